@@ -44,6 +44,9 @@ int test_gpu = 0;
 static int skip_cpu=0;
 module_param(skip_cpu, int, 0444);
 MODULE_PARM_DESC(skip_cpu, "do not test CPU cipher, default 0 (No)");
+static char *cipher = "gaes_ecb(aes)";
+module_param(cipher, charp, 0444);
+MODULE_PARM_DESC(cipher, "cipher to test, e.g. gaes_ctr(aes) or gaes_xts(aes)");
 
 #if 0
 
@@ -131,7 +134,8 @@ static int test_skcipher(void)
     struct crypto_skcipher *skcipher = NULL;
     struct skcipher_request *req = NULL;   
     char *ivdata = NULL;
-    unsigned char key[16];
+    unsigned char key[32];
+    int keylen = strstr(CIPHER, "xts")? 32: 16;   /* xts: data and tweak key */
     int ret = -EFAULT;
 
     struct scatterlist *src;
@@ -191,8 +195,8 @@ static int test_skcipher(void)
                       NULL);
 
     /* AES 128 with random key */
-    get_random_bytes(&key, 16);
-    if (crypto_skcipher_setkey(skcipher, key, 16)) {
+    get_random_bytes(&key, keylen);
+    if (crypto_skcipher_setkey(skcipher, key, keylen)) {
         printk("key could not be set\n");
         ret = -EAGAIN;
         goto out;
@@ -287,7 +291,7 @@ static int __init taes_init(void)
 {
 	printk("test skcipher loaded\n");	
     test_gpu = 1;
-    CIPHER ="gaes_ecb(aes)" ;
+    CIPHER = cipher;
     test_skcipher(); 
     
    // test_gpu = 0;
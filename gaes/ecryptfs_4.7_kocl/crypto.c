@@ -35,6 +35,7 @@
 #include <linux/file.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <asm/unaligned.h>
 #include "ecryptfs_kernel.h"
 
@@ -319,7 +320,6 @@ static void extent_crypt_complete(struct crypto_async_request *req, int rc)
 
 	ecr->rc = rc;
 	complete(&ecr->completion);
-	printk("encrypt ok\n");
 }
 
 /**
@@ -462,83 +462,76 @@ out:
 	return rc;
 }
 
+/*
+ * ecryptfs_encrypt_pages2
+ *
+ * Encrypt multiple pages at once. The plaintext is copied into one
+ * virtually contiguous bounce buffer and encrypted there in place, so
+ * gaes_ecb gives the buffer's own pages to the helper (kocl_map_sg())
+ * rather than copying them into the pool and back. Each run of
+ * consecutive pages is then written to the lower file in one write.
+ */
 int ecryptfs_encrypt_pages2(struct page **pgs, unsigned int nr_pages)
 {
 	struct ecryptfs_crypt_stat *cst;
 	struct inode *ind;
-	struct scatterlist *sgs = NULL, *sgd = NULL;
+	struct scatterlist *sgd = NULL;
+	char *buf = NULL;
 	int rc = 0;
-	unsigned int i=0;
-	u32 sz = 0;
-	struct page *p=NULL;
+	unsigned int i=0, run;
 	loff_t offset;
-		 struct timeval t0, t1;
-		 long int enc ;
 
 	if (!nr_pages || !pgs || !pgs[0]) {
 		goto out;
 	}
 
-	sgs = (struct scatterlist *)kmalloc(
-		nr_pages*sizeof(struct scatterlist), GFP_KERNEL);
-	if (!sgs) {
-		printk(KERN_ERR "allocate sgs failed\n");
-		rc = -ENOMEM;
-		goto out;
-    	}
-    	
-    	sgd = (struct scatterlist *)kmalloc(
+	sgd = (struct scatterlist *)kmalloc(
 		nr_pages*sizeof(struct scatterlist), GFP_KERNEL);
-	if (!sgd) {
-		printk(KERN_ERR "allocate sgr failed\n");
+	buf = vmalloc((unsigned long)nr_pages << PAGE_SHIFT);
+	if (!sgd || !buf) {
+		printk("[g-ecryptfs] Error: cannot allocate bounce buffer\n");
 		rc = -ENOMEM;
-		kfree(sgs);
-		goto out;
-    	}
-    	
-    	sg_init_table(sgs, nr_pages);
-    	sg_init_table(sgd, nr_pages);
+		goto higher_out;
+	}
+	sg_init_table(sgd, nr_pages);
 
 	ind = pgs[0]->mapping->host;
 	cst = &(ecryptfs_inode_to_private(ind)->crypt_stat);
-	
+
 	for (i = 0; i<nr_pages; i++) {
-		p = alloc_page(GFP_USER);
-		if (!p) {
-			rc = -ENOMEM;
-			printk("[g-ecryptfs] Error: cannot allocate page\n");
-			for (sz = 0; sz < i; sz++) {
-				p = sg_page(sgd+sz);
-				__free_page(p);
-			}
-			goto higher_out;
-		}
-			
-		sg_set_page(sgs+i, pgs[i], PAGE_SIZE, 0);
-		sg_set_page(sgd+i, p, PAGE_SIZE, 0);
+		char *bp = buf + ((unsigned long)i << PAGE_SHIFT);
+		char *virt = kmap(pgs[i]);
+
+		memcpy(bp, virt, PAGE_SIZE);
+		kunmap(pgs[i]);
+		sg_set_page(sgd+i, vmalloc_to_page(bp), PAGE_SIZE, 0);
+	}
+	rc = crypt_scatterlist(cst, sgd, sgd, PAGE_SIZE*nr_pages, fake_iv, ENCRYPT);
+	if (rc < 0) {
+		printk(KERN_ERR "[g-ecryptfs] Error encrypting pages; rc = [%d]\n",
+		       rc);
+		goto higher_out;
 	}
-	//do_gettimeofday(&t0);
-	rc = crypt_scatterlist(cst, sgd, sgs, PAGE_SIZE*nr_pages, fake_iv, ENCRYPT);
 	rc = 0;
-	// do_gettimeofday(&t1);
-	//  	enc = 1000000*(t1.tv_sec-t0.tv_sec) + 
-	//  		((int)(t1.tv_usec) - (int)(t0.tv_usec));
-    //  printk(" Size %10lu: enc time: %6ld us \n", PAGE_SIZE*nr_pages, enc);	
 
-	for (i=0; i<nr_pages; i++) {
-	    char *virt;
-		p = sg_page(sgd+i);
-		virt = kmap(p);
+	for (i=0; i<nr_pages; i+=run) {
+		for (run = 1; i+run < nr_pages
+			     && pgs[i+run]->index == pgs[i]->index + run; run++)
+			;
 		offset = ecryptfs_lower_header_size(cst) +
 		    (((loff_t)pgs[i]->index)<< PAGE_SHIFT);
-		ecryptfs_write_lower(ind, virt, offset, PAGE_SIZE);
-		/* ecryptfs_write_lower_page_segment(ind, p, 0, PAGE_SIZE); */
-		kunmap(p);
-		__free_page(p);			
+		rc = ecryptfs_write_lower(ind, buf + ((unsigned long)i << PAGE_SHIFT),
+					  offset, (size_t)run << PAGE_SHIFT);
+		if (rc < 0) {
+			printk(KERN_ERR "[g-ecryptfs] Error writing lower pages; "
+			       "rc = [%d]\n", rc);
+			goto higher_out;
+		}
+		rc = 0;
 	}
-	
+
 higher_out:
-	kfree(sgs);
+	vfree(buf);
 	kfree(sgd);
 out:
 	return rc;
@@ -613,6 +606,152 @@ out:
 	return rc;
 }
 
+/*
+ * read_lower_pages
+ *
+ * Read the lower data of @pgs into them, a read per run of consecutive
+ * pages, and point @sgs at them.
+ * Returns the first error of a lower read, 0 if none failed.
+ */
+static int read_lower_pages(struct inode *ind, struct ecryptfs_crypt_stat *cst,
+			    struct page **pgs, struct scatterlist *sgs,
+			    unsigned int nr_pages)
+{
+    unsigned int i, j, run;
+    int rc, err = 0;
+
+    for (i=0; i<nr_pages; i+=run) {
+    	loff_t offset;
+	for (run = 1; i+run < nr_pages
+		 && pgs[i+run]->index == pgs[i]->index + run; run++)
+	    ;
+    	offset = ecryptfs_lower_header_size(cst)
+    		+ ((loff_t)(pgs[i]->index)<<PAGE_SHIFT);
+    	rc = ecryptfs_read_lower_pages(pgs+i, run, offset, ind);//把disk資料讀到pgs[i..]
+
+	if (rc < 0) {
+	    printk(KERN_ERR "Error attempting to read lower pages; rc "
+			    "= [%d] \n", rc);
+	    if (!err)
+		err = rc;
+	}
+	for (j=i; j<i+run; j++) {
+	    flush_dcache_page(pgs[j]);
+	    sg_set_page(sgs+j, pgs[j], PAGE_SIZE, 0);//把scatterlist 指標指向page cache 的page
+	}
+    }
+    return err;
+}
+
+/*
+ * A batch of readahead pages in flight, see ecryptfs_decrypt_pages_async().
+ * sgs points past pgs[].
+ */
+struct ecryptfs_ra_batch {
+    struct skcipher_request *req;
+    struct scatterlist *sgs;
+    char iv[ECRYPTFS_MAX_IV_BYTES];
+    unsigned int nr_pages;
+    struct page *pgs[0];
+};
+
+static void ecryptfs_ra_finish(struct ecryptfs_ra_batch *b, int rc)
+{
+    unsigned int i;
+
+    for (i=0; i<b->nr_pages; i++) {
+	if (rc)
+	    ClearPageUptodate(b->pgs[i]);
+	else
+	    SetPageUptodate(b->pgs[i]);
+	unlock_page(b->pgs[i]);
+	put_page(b->pgs[i]);
+    }
+    if (b->req)
+	skcipher_request_free(b->req);
+    kfree(b);
+}
+
+static void ecryptfs_ra_complete(struct crypto_async_request *req, int rc)
+{
+    if (rc == -EINPROGRESS)
+	return;
+    ecryptfs_ra_finish(req->data, rc);
+}
+
+/*
+ * ecryptfs_decrypt_pages_async
+ *
+ * Read the lower data of locked readahead pages and start decrypting them,
+ * without waiting for the cipher: the pages are marked uptodate (or not),
+ * unlocked and put when it completes, from its callback if it is async.
+ * The caller's references to the pages are taken over in any case.
+ */
+int ecryptfs_decrypt_pages_async(struct page **pgs, unsigned int nr_pages)
+{
+    struct ecryptfs_ra_batch *b;
+    struct inode *ind;
+    struct ecryptfs_crypt_stat *cst;
+    unsigned int i;
+    int rc;
+
+    if (!nr_pages)
+	return 0;
+
+    b = kzalloc(sizeof(*b) + nr_pages*(sizeof(struct page*)
+				       + sizeof(struct scatterlist)), GFP_KERNEL);
+    if (!b) {
+	for (i=0; i<nr_pages; i++) {
+	    ClearPageUptodate(pgs[i]);
+	    unlock_page(pgs[i]);
+	    put_page(pgs[i]);
+	}
+	return -ENOMEM;
+    }
+    b->nr_pages = nr_pages;
+    memcpy(b->pgs, pgs, nr_pages*sizeof(struct page*));
+    b->sgs = (struct scatterlist *)(b->pgs + nr_pages);
+    sg_init_table(b->sgs, nr_pages);
+
+    ind = pgs[0]->mapping->host;
+    cst = &(ecryptfs_inode_to_private(ind)->crypt_stat);
+    rc = read_lower_pages(ind, cst, b->pgs, b->sgs, nr_pages);
+    if (rc < 0)
+	goto fail;
+
+    mutex_lock(&cst->cs_tfm_mutex);
+    b->req = skcipher_request_alloc(cst->tfm, GFP_NOFS);
+    if (!b->req) {
+	mutex_unlock(&cst->cs_tfm_mutex);
+	rc = -ENOMEM;
+	goto fail;
+    }
+    if (!(cst->flags & ECRYPTFS_KEY_SET)) {
+	rc = crypto_skcipher_setkey(cst->tfm, cst->key, cst->key_size);
+	if (rc) {
+	    ecryptfs_printk(KERN_ERR, "Error setting key; rc = [%d]\n", rc);
+	    mutex_unlock(&cst->cs_tfm_mutex);
+	    rc = -EINVAL;
+	    goto fail;
+	}
+	cst->flags |= ECRYPTFS_KEY_SET;
+    }
+    mutex_unlock(&cst->cs_tfm_mutex);
+
+    skcipher_request_set_callback(b->req,
+		CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+		ecryptfs_ra_complete, b);
+    /* no IV for our implementation */
+    skcipher_request_set_crypt(b->req, b->sgs, b->sgs,
+			       nr_pages*PAGE_SIZE, b->iv);
+    rc = crypto_skcipher_decrypt(b->req);
+    if (rc == -EINPROGRESS || rc == -EBUSY)
+	return 0;
+fail:
+    ecryptfs_ra_finish(b, rc);
+    return rc;
+}
+
 /*
  * ecryptfs_decrypt_pages
  *
@@ -625,7 +764,6 @@ int ecryptfs_decrypt_pages(struct page **pgs, unsigned int nr_pages)
     char iv[ECRYPTFS_MAX_IV_BYTES];
     struct scatterlist *sgs = NULL;
     int rc = 0;
-    unsigned int i=0;
     /* u32 sz = 0; */
 
     if (!nr_pages || !pgs || !pgs[0]) {
@@ -648,23 +786,7 @@ int ecryptfs_decrypt_pages(struct page **pgs, unsigned int nr_pages)
 
     ind = pgs[0]->mapping->host;
     cst = &(ecryptfs_inode_to_private(ind)->crypt_stat);
-    for (i=0; i<nr_pages; i++) {
-    	char *virt;
-    	loff_t offset;
-    	offset = ecryptfs_lower_header_size(cst)
-    		+ ((loff_t)(pgs[i]->index)<<PAGE_SHIFT);
-    	virt = kmap(pgs[i]);
-    	rc = ecryptfs_read_lower(virt, offset, PAGE_SIZE, ind);//把disk資料讀到pgs[i]
-
-	if (rc < 0) {
-	    printk(KERN_ERR "Error attempting to read lower page; rc "
-			    "= [%d] \n", rc);
-	}
-	kunmap(pgs[i]);
-	flush_dcache_page(pgs[i]);
-
-	sg_set_page(sgs+i, pgs[i], PAGE_SIZE, 0);//把scatterlist 指標指向page cache 的page
-    }
+    read_lower_pages(ind, cst, pgs, sgs, nr_pages);
 
     /* no IV for our implementation */
     rc = crypt_scatterlist(cst, sgs, sgs, nr_pages*PAGE_SIZE, iv, DECRYPT);//開始做解密
@@ -764,7 +886,8 @@ int ecryptfs_init_crypt_ctx(struct ecryptfs_crypt_stat *crypt_stat)
 	 					    crypt_stat->cipher, "gaes_ecb");						
 	if (rc)
 		goto out_unlock;
-	crypt_stat->tfm = crypto_alloc_skcipher(full_alg_name, 0, CRYPTO_ALG_ASYNC);
+	/* the async gaes_ecb, crypt_scatterlist() waits for it */
+	crypt_stat->tfm = crypto_alloc_skcipher(full_alg_name, 0, 0);
 	if (IS_ERR(crypt_stat->tfm)) {
 		rc = PTR_ERR(crypt_stat->tfm);
 		crypt_stat->tfm = NULL;
@@ -254,6 +254,11 @@ struct ecryptfs_inode_info {
 	atomic_t lower_file_count;
 	struct file *lower_file;
 	struct ecryptfs_crypt_stat crypt_stat;
+	/* write-behind: pages dirtied since the last kick, see read_write.c */
+	atomic_t wb_dirty;
+	struct work_struct wb_work;
+	/* the size grew by staged writes, the metadata doesn't have it yet */
+	atomic_t wb_size_stale;
 };
 
 /* dentry private data. Each dentry must keep track of a lower
@@ -543,6 +548,9 @@ extern int ecryptfs_verbosity;
 extern unsigned int ecryptfs_message_buf_len;
 extern signed long ecryptfs_message_wait_timeout;
 extern unsigned int ecryptfs_number_of_users;
+extern int ecryptfs_write_behind;
+extern unsigned int ecryptfs_wb_batch;
+extern unsigned int ecryptfs_read_batch;
 
 extern struct kmem_cache *ecryptfs_auth_tok_list_item_cache;
 extern struct kmem_cache *ecryptfs_file_info_cache;
@@ -587,6 +595,7 @@ int ecryptfs_encrypt_page(struct page *page);
 int ecryptfs_encrypt_pages2(struct page **pgs, unsigned int nr_pages);
 int ecryptfs_decrypt_page(struct page *page);
 int ecryptfs_decrypt_pages(struct page **pgs, unsigned int nr_pages);
+int ecryptfs_decrypt_pages_async(struct page **pgs, unsigned int nr_pages);
 int ecryptfs_write_metadata(struct dentry *ecryptfs_dentry,
 			    struct inode *ecryptfs_inode);
 int ecryptfs_read_metadata(struct dentry *ecryptfs_dentry);
@@ -673,7 +682,11 @@ int ecryptfs_write_lower_page_segment(struct inode *ecryptfs_inode,
 				      size_t offset_in_page, size_t size);
 int ecryptfs_write(struct inode *inode, char *data, loff_t offset, size_t size);
 int ecryptfs_write2(struct file *file, struct inode *inode, char *data, loff_t offset, size_t size);
+int ecryptfs_write_staged(struct file *file, struct inode *inode, char *data, loff_t offset, size_t size);
+void ecryptfs_wb_work(struct work_struct *work);
 int ecryptfs_read2(struct file *file, char *data, loff_t offset, size_t size);
+int ecryptfs_read_lower_pages(struct page **pgs, unsigned int nr_pages,
+			      loff_t offset, struct inode *ecryptfs_inode);
 int ecryptfs_read_lower(char *data, loff_t offset, size_t size,
 			struct inode *ecryptfs_inode);
 int ecryptfs_read_lower_page_segment(struct page *page_for_ecryptfs,
@@ -52,9 +52,10 @@ static ssize_t ecryptfs_read_update_atime(struct kiocb *iocb,
 	//struct file_ra_state *ra = &iocb->ki_filp->f_ra;
     
 	//ra->ra_pages=1024;
-	printk("[g-ecryptfs] pos: %lld ,count: %lu \n",iocb->ki_pos, to->count);
+	ecryptfs_printk(KERN_DEBUG, "pos: %lld, count: %zu\n",
+			iocb->ki_pos, iov_iter_count(to));
 	rc = generic_file_read_iter(iocb, to);
-	printk("[g-ecryptfs] rc: %lu \n", rc);
+	ecryptfs_printk(KERN_DEBUG, "rc: %zd\n", rc);
 	if (rc >= 0) {
 		path = ecryptfs_dentry_to_lower_path(file->f_path.dentry);
 		touch_atime(path);
@@ -416,7 +417,13 @@ static ssize_t ecryptfs_file_write(struct file *filp, const char __user *buf,
 				   size_t sz, loff_t *poffset)
 {
     // printk("[g-ecryptfs] Info: write2 %lu at %lld \n", sz, *poffset); 	
-    ecryptfs_write2( filp ,filp->f_path.dentry->d_inode, (char*)buf, *poffset, sz);
+    if (ecryptfs_write_behind) {
+	int rc = ecryptfs_write_staged(filp, filp->f_path.dentry->d_inode,
+				       (char*)buf, *poffset, sz);
+	if (rc)
+	    return rc;
+    } else
+	ecryptfs_write2( filp ,filp->f_path.dentry->d_inode, (char*)buf, *poffset, sz);
     *poffset += sz;
     return sz;
 }
@@ -82,6 +82,38 @@ module_param(ecryptfs_number_of_users, uint, 0);
 MODULE_PARM_DESC(ecryptfs_number_of_users, "An estimate of the number of "
 		 "concurrent users of eCryptfs");
 
+/**
+ * Module parameters for write-behind: writes only fill the page cache,
+ * dirty pages are encrypted ecryptfs_wb_batch at a time as they are
+ * written back, see ecryptfs_writepages().
+ */
+int ecryptfs_write_behind = 0;
+
+module_param_named(write_behind, ecryptfs_write_behind, int, 0644);
+MODULE_PARM_DESC(write_behind,
+		 "Stage writes in the page cache and encrypt them in the "
+		 "background (0 or 1; defaults to 0)");
+
+unsigned int ecryptfs_wb_batch = 512;
+
+module_param_named(write_behind_batch, ecryptfs_wb_batch, uint, 0644);
+MODULE_PARM_DESC(write_behind_batch,
+		 "Pages per encryption request of write-behind, and dirty "
+		 "pages of a file that start one (defaults to 512)");
+
+/**
+ * Module parameter for readahead: the pages of a readahead window are
+ * read from the lower file and decrypted ecryptfs_read_batch at a time,
+ * each batch decrypting while the next one is read, see
+ * ecryptfs_readpages().
+ */
+unsigned int ecryptfs_read_batch = 64;
+
+module_param_named(read_batch, ecryptfs_read_batch, uint, 0644);
+MODULE_PARM_DESC(read_batch,
+		 "Pages per decryption request of readahead (0 for the "
+		 "whole window at once; defaults to 64)");
+
 void __ecryptfs_printk(const char *fmt, ...)
 {
 	va_list args;
@@ -161,6 +193,15 @@ void ecryptfs_put_lower_file(struct inode *inode)
 	if (atomic_dec_and_mutex_lock(&inode_info->lower_file_count,
 				      &inode_info->lower_file_mutex)) {
 		filemap_write_and_wait(inode->i_mapping);
+		/*
+		 * ecryptfs_writepages() doesn't take the lower file once its
+		 * count is 0, the size of staged writes goes to the metadata
+		 * here, before the lower file is dropped.
+		 */
+		if (atomic_xchg(&inode_info->wb_size_stale, 0)
+		    && ecryptfs_write_inode_size_to_metadata(inode))
+			ecryptfs_printk(KERN_ERR, "Problem with "
+					"ecryptfs_write_inode_size_to_metadata\n");
 		fput(inode_info->lower_file);
 		inode_info->lower_file = NULL;
 		mutex_unlock(&inode_info->lower_file_mutex);
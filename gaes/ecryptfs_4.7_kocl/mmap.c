@@ -26,6 +26,7 @@
  */
 
 #include <linux/pagemap.h>
+#include <linux/pagevec.h>
 #include <linux/writeback.h>
 #include <linux/page-flags.h>
 #include <linux/mount.h>
@@ -79,6 +80,131 @@ out:
 	return rc;
 }
 
+/* encrypt and write a batch of ecryptfs_writepages(), then let the pages go */
+static int ecryptfs_wb_flush(struct address_space *mapping,
+			     struct page **pgs, unsigned int n)
+{
+	unsigned int i;
+	int rc;
+
+	rc = ecryptfs_encrypt_pages2(pgs, n);
+	for (i = 0; i < n; i++) {
+		if (rc) {
+			SetPageError(pgs[i]);
+			mapping_set_error(mapping, rc);
+		}
+		end_page_writeback(pgs[i]);
+		put_page(pgs[i]);
+	}
+	return rc;
+}
+
+/**
+ * ecryptfs_writepages
+ * @mapping: The address space of the eCryptfs inode
+ * @wbc: Which pages, and how many
+ *
+ * With write-behind, dirty pages are encrypted ecryptfs_wb_batch at a
+ * time through ecryptfs_encrypt_pages2(), one GPU request per batch,
+ * rather than a page at a time by ecryptfs_writepage(). The file size
+ * goes to the metadata once at the end, if staged writes grew it.
+ *
+ * Returns zero on success; non-zero otherwise
+ */
+static int ecryptfs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct ecryptfs_inode_info *inode_info = ecryptfs_inode_to_private(inode);
+	unsigned int batch = max(ecryptfs_wb_batch, 1U);
+	struct page **pgs;
+	struct pagevec pvec;
+	pgoff_t index, end;
+	unsigned int n = 0, i, nr;
+	int written = 0;
+	int rc = 0;
+
+	if (!ecryptfs_write_behind
+	    || !(inode_info->crypt_stat.flags & ECRYPTFS_ENCRYPTED))
+		return generic_writepages(mapping, wbc);
+	/* the lower file stays open until we are done */
+	if (!atomic_inc_not_zero(&inode_info->lower_file_count))
+		return generic_writepages(mapping, wbc);
+
+	pgs = kmalloc_array(batch, sizeof(struct page *), GFP_NOFS);
+	if (!pgs) {
+		ecryptfs_put_lower_file(inode);
+		return generic_writepages(mapping, wbc);
+	}
+
+	if (wbc->range_cyclic) {
+		index = mapping->writeback_index;
+		end = -1;
+	} else {
+		index = wbc->range_start >> PAGE_SHIFT;
+		end = wbc->range_end >> PAGE_SHIFT;
+	}
+
+	pagevec_init(&pvec, 0);
+	while (!rc && index <= end && (nr = pagevec_lookup_tag(&pvec, mapping,
+			&index, PAGECACHE_TAG_DIRTY, PAGEVEC_SIZE))) {
+		for (i = 0; i < nr; i++) {
+			struct page *page = pvec.pages[i];
+
+			if (page->index > end)
+				break;
+			lock_page(page);
+			if (page->mapping != mapping || !PageDirty(page)) {
+				unlock_page(page);
+				continue;
+			}
+			if (PageWriteback(page)) {
+				if (wbc->sync_mode == WB_SYNC_NONE) {
+					unlock_page(page);
+					continue;
+				}
+				wait_on_page_writeback(page);
+			}
+			if (!clear_page_dirty_for_io(page)) {
+				unlock_page(page);
+				continue;
+			}
+			set_page_writeback(page);
+			unlock_page(page);
+			get_page(page);
+			pgs[n++] = page;
+			if (n == batch) {
+				rc = ecryptfs_wb_flush(mapping, pgs, n);
+				written += n;
+				n = 0;
+				if (rc)
+					break;
+			}
+		}
+		pagevec_release(&pvec);
+		if (wbc->sync_mode == WB_SYNC_NONE
+		    && written + n >= wbc->nr_to_write)
+			break;
+		cond_resched();
+	}
+	if (n) {
+		int rc2 = ecryptfs_wb_flush(mapping, pgs, n);
+
+		if (!rc)
+			rc = rc2;
+		written += n;
+	}
+	kfree(pgs);
+
+	wbc->nr_to_write -= written;
+	if (wbc->range_cyclic)
+		mapping->writeback_index = index;
+	if (!rc && atomic_xchg(&inode_info->wb_size_stale, 0))
+		rc = ecryptfs_write_inode_size_to_metadata(inode);
+	ecryptfs_put_lower_file(inode);
+	return rc;
+}
+
 static void strip_xattr_flag(char *page_virt,
 			     struct ecryptfs_crypt_stat *crypt_stat)
 {
@@ -198,13 +324,13 @@ static int ecryptfs_readpage(struct file *file, struct page *page)
 	int rc = 0;
   //  printk("[ecryptfs_readpage]:crypt_state->flag:%u \n",crypt_stat->flags);
 	if (!crypt_stat || !(crypt_stat->flags & ECRYPTFS_ENCRYPTED)) {
-		printk("[ecryptfs_readpage]:read_lower \n");
+		ecryptfs_printk(KERN_DEBUG, "read_lower\n");
 		rc = ecryptfs_read_lower_page_segment(page, page->index, 0,
 						      PAGE_SIZE,
 						      page->mapping->host);
 	} else if (crypt_stat->flags & ECRYPTFS_VIEW_AS_ENCRYPTED) {
 		if (crypt_stat->flags & ECRYPTFS_METADATA_IN_XATTR) {
-			printk("[ecryptfs_readpage]:copy_up \n");
+			ecryptfs_printk(KERN_DEBUG, "copy_up\n");
 			rc = ecryptfs_copy_up_encrypted_with_header(page,
 								    crypt_stat);
 			if (rc) {
@@ -217,7 +343,7 @@ static int ecryptfs_readpage(struct file *file, struct page *page)
 			}
 
 		} else {
-			printk("[ecryptfs_readpage]:read_lower2 \n");
+			ecryptfs_printk(KERN_DEBUG, "read_lower2\n");
 			rc = ecryptfs_read_lower_page_segment(
 				page, page->index, 0, PAGE_SIZE,
 				page->mapping->host);
@@ -247,6 +373,27 @@ out:
 	return rc;
 }
 
+/*
+ * ecryptfs_lower_readahead
+ * Start reading the lower pages behind @pgs, without waiting for them.
+ */
+static void ecryptfs_lower_readahead(struct inode *inode, struct page **pgs,
+				     unsigned int nr_pages)
+{
+	struct ecryptfs_inode_info *inode_info = ecryptfs_inode_to_private(inode);
+	struct file *lower_file = inode_info->lower_file;
+	size_t hdr = ecryptfs_lower_header_size(&inode_info->crypt_stat);
+	pgoff_t start, end;
+
+	if (!lower_file || !nr_pages)
+		return;
+	start = (hdr + ((loff_t)pgs[0]->index << PAGE_SHIFT)) >> PAGE_SHIFT;
+	end = (hdr + ((loff_t)(pgs[nr_pages - 1]->index + 1) << PAGE_SHIFT) - 1)
+	      >> PAGE_SHIFT;
+	page_cache_sync_readahead(lower_file->f_mapping, &lower_file->f_ra,
+				  lower_file, start, end - start + 1);
+}
+
 /*
  * ecryptfs_readpages
  * Read in multiple pages and decrypt them if necessary.
@@ -260,6 +407,7 @@ static int ecryptfs_readpages(struct file *filp, struct address_space *mapping,
 	unsigned int page_idx = 0;
 	int rc = 0;
 	int nodec = 0;	//no decryption needed flag
+	unsigned int nr = 0, batch;
 	/* u32 sz = 0;  */
 
 	if (!crypt_stat
@@ -278,7 +426,7 @@ static int ecryptfs_readpages(struct file *filp, struct address_space *mapping,
 	    }
 	}
 
-	  printk("[g-ecryptfs] Info: in read_pages read %d pages ,nodec:%d \n", nr_pages, nodec); 
+	  ecryptfs_printk(KERN_DEBUG, "read %d pages, nodec:%d\n", nr_pages, nodec); 
 	/* dump_stack(); */
 
 	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
@@ -287,28 +435,32 @@ static int ecryptfs_readpages(struct file *filp, struct address_space *mapping,
 	    if (add_to_page_cache_lru(page, mapping, page->index, GFP_KERNEL)) {
 			printk("[g-eCryptfs] INFO: cannot add page %lu to cache lru\n",
 			       (unsigned long)(page->index));
-	    } else {
-		   if (nodec)
-		       rc |= ecryptfs_readpage(filp, page);//這邊會去判斷如果不需要decrypt就直接從lower read
+			put_page(page);
+			continue;
 	    }
+	    if (nodec)
+		   rc |= ecryptfs_readpage(filp, page);//這邊會去判斷如果不需要decrypt就直接從lower read
 
 	    if (nodec)
 			put_page(page);
 	    else
-			pgs[page_idx] = page;
+			pgs[nr++] = page;
 	}
 
 	if (!nodec) {
-	    rc = ecryptfs_decrypt_pages(pgs, nr_pages);
-
-	    for (page_idx = 0; page_idx < nr_pages; page_idx++) {
-		     if (rc)
-		          ClearPageUptodate(pgs[page_idx]);
-		     else
-		          SetPageUptodate(pgs[page_idx]);
-
-		   unlock_page(pgs[page_idx]);
-		   put_page(pgs[page_idx]);
+	    /*
+	     * Pipelined: start the lower readahead of the next batch, read
+	     * this one and hand it to the cipher, which unlocks its pages
+	     * when done, while we go on with the next one.
+	     */
+	    batch = ecryptfs_read_batch ? ecryptfs_read_batch : nr;
+	    for (page_idx = 0; page_idx < nr; page_idx += batch) {
+		   unsigned int n = min(batch, nr - page_idx);
+
+		   if (page_idx + n < nr)
+		       ecryptfs_lower_readahead(mapping->host, pgs + page_idx + n,
+						min(batch, nr - page_idx - n));
+		   ecryptfs_decrypt_pages_async(pgs + page_idx, n);
 	    }
 
 	    kfree(pgs);
@@ -361,7 +513,7 @@ static int ecryptfs_write_begin(struct file *file,
 	loff_t prev_page_end_size;
 	int rc = 0;
    
-	printk("write begin: \n");
+	ecryptfs_printk(KERN_DEBUG, "write begin\n");
 	page = grab_cache_page_write_begin(mapping, index, flags);
 	if (!page)
 		return -ENOMEM;
@@ -373,7 +525,7 @@ static int ecryptfs_write_begin(struct file *file,
 			&ecryptfs_inode_to_private(mapping->host)->crypt_stat;
 
 		if (!(crypt_stat->flags & ECRYPTFS_ENCRYPTED)) {
-			 printk("read_lower_page_segment  \n");
+			 ecryptfs_printk(KERN_DEBUG, "read_lower_page_segment\n");
 			rc = ecryptfs_read_lower_page_segment(
 				page, index, 0, PAGE_SIZE, mapping->host);
 			if (rc) {
@@ -386,7 +538,7 @@ static int ecryptfs_write_begin(struct file *file,
 				SetPageUptodate(page);
 		} else if (crypt_stat->flags & ECRYPTFS_VIEW_AS_ENCRYPTED) {
 			if (crypt_stat->flags & ECRYPTFS_METADATA_IN_XATTR) {
-				printk("copy_up_encrypted  \n");
+				ecryptfs_printk(KERN_DEBUG, "copy_up_encrypted\n");
 				rc = ecryptfs_copy_up_encrypted_with_header(
 					page, crypt_stat);
 				if (rc) {
@@ -401,7 +553,7 @@ static int ecryptfs_write_begin(struct file *file,
 				}
 				SetPageUptodate(page);
 			} else {
-				printk("read_lower_page_segment2  \n");
+				ecryptfs_printk(KERN_DEBUG, "read_lower_page_segment2\n");
 				rc = ecryptfs_read_lower_page_segment(
 					page, index, 0, PAGE_SIZE,
 					mapping->host);
@@ -420,7 +572,7 @@ static int ecryptfs_write_begin(struct file *file,
 				zero_user(page, 0, PAGE_SIZE);
 				SetPageUptodate(page);
 			} else if (len < PAGE_SIZE) {
-				printk("write begin:decrypt page \n");
+				ecryptfs_printk(KERN_DEBUG, "decrypt page\n");
 				rc = ecryptfs_decrypt_page(page);
 				if (rc) {
 					printk(KERN_ERR "%s: Error decrypting "
@@ -438,7 +590,7 @@ static int ecryptfs_write_begin(struct file *file,
 	 * Note, this will increase i_size. */
 	if (index != 0) {
 		if (prev_page_end_size > i_size_read(page->mapping->host)) {	
-			printk("truncate \n");		
+			ecryptfs_printk(KERN_DEBUG, "truncate\n");		
 			rc = ecryptfs_truncate(file->f_path.dentry,
 					       prev_page_end_size);
 			if (rc) {
@@ -599,7 +751,7 @@ static int ecryptfs_write_end(struct file *file,
 			"zeros in page with index = [0x%.16lx]\n", index);
 		goto out;
 	}
-	printk("write end:encrypt page \n");
+	ecryptfs_printk(KERN_DEBUG, "encrypt page\n");
 	rc = ecryptfs_encrypt_page(page);
 	if (rc) {
 		ecryptfs_printk(KERN_WARNING, "Error encrypting page (upper "
@@ -640,6 +792,7 @@ static sector_t ecryptfs_bmap(struct address_space *mapping, sector_t block)
 
 const struct address_space_operations ecryptfs_aops = {
 	.writepage = ecryptfs_writepage,
+	.writepages = ecryptfs_writepages,
 	.readpage = ecryptfs_readpage,
 	.readpages = ecryptfs_readpages,
 	.write_begin = ecryptfs_write_begin,
@@ -23,6 +23,7 @@
 #include <linux/fs.h>
 #include <linux/pagemap.h>
 #include <linux/slab.h>
+#include <linux/writeback.h>
 #include "ecryptfs_kernel.h"
 
 /**
@@ -350,6 +351,133 @@ out:
 }
 
 
+/**
+ * ecryptfs_wb_work
+ * @work: The wb_work of an eCryptfs inode
+ *
+ * Start writing back the dirty pages of the inode, if it still has its
+ * lower file open; ecryptfs_put_lower_file() writes them otherwise.
+ */
+void ecryptfs_wb_work(struct work_struct *work)
+{
+	struct ecryptfs_inode_info *inode_info =
+		container_of(work, struct ecryptfs_inode_info, wb_work);
+	struct inode *inode = &inode_info->vfs_inode;
+
+	atomic_set(&inode_info->wb_dirty, 0);
+	if (!atomic_inc_not_zero(&inode_info->lower_file_count))
+		return;
+	filemap_flush(inode->i_mapping);
+	ecryptfs_put_lower_file(inode);
+}
+
+/**
+ * ecryptfs_write_staged
+ *
+ * Write-behind version of ecryptfs_write2(): the data only goes to the
+ * page cache, as dirty pages. ecryptfs_writepages() encrypts them in
+ * large requests when they are written back, which the inode kicks off
+ * itself once it has ecryptfs_wb_batch new dirty pages.
+ *
+ * Returns zero on success; non-zero otherwise
+ */
+int ecryptfs_write_staged(struct file *file, struct inode *ecryptfs_inode,
+			  char *data, loff_t offset, size_t size)
+{
+	struct ecryptfs_inode_info *inode_info =
+		ecryptfs_inode_to_private(ecryptfs_inode);
+	struct address_space *mapping = file->f_mapping;
+	struct page *ecryptfs_page;
+	char *ecryptfs_page_virt;
+	loff_t ecryptfs_file_size = i_size_read(ecryptfs_inode);
+	loff_t data_offset = 0;
+	loff_t pos;
+	int npages = 0;
+	int rc = 0;
+
+	if (!(inode_info->crypt_stat.flags & ECRYPTFS_ENCRYPTED))
+		return ecryptfs_write2(file, ecryptfs_inode, data, offset, size);
+
+	pos = offset > ecryptfs_file_size? ecryptfs_file_size: offset;
+	while (pos < (offset + size)) {
+		pgoff_t ecryptfs_page_idx = (pos >> PAGE_SHIFT);
+		size_t start_offset_in_page = (pos & ~PAGE_MASK);
+		size_t num_bytes = (PAGE_SIZE - start_offset_in_page);
+		size_t total_remaining_bytes = ((offset + size) - pos);
+		int fresh = ((loff_t)ecryptfs_page_idx << PAGE_SHIFT)
+			>= ecryptfs_file_size;
+
+		if (num_bytes > total_remaining_bytes)
+			num_bytes = total_remaining_bytes;
+		if (pos < offset) {
+			size_t total_remaining_zeros = (offset - pos);
+
+			if (num_bytes > total_remaining_zeros)
+				num_bytes = total_remaining_zeros;
+		}
+		/*
+		 * A page with file data that the write doesn't cover whole
+		 * is read in, and decrypted, before it is written into.
+		 */
+		if (!fresh && num_bytes < PAGE_SIZE) {
+			ecryptfs_page = ecryptfs_get_locked_page(ecryptfs_inode,
+								 ecryptfs_page_idx);
+			if (IS_ERR(ecryptfs_page)) {
+				rc = PTR_ERR(ecryptfs_page);
+				printk(KERN_ERR "%s: Error getting page at "
+				       "index [%ld] from eCryptfs inode "
+				       "mapping; rc = [%d]\n", __func__,
+				       ecryptfs_page_idx, rc);
+				goto out;
+			}
+		} else {
+			ecryptfs_page = grab_cache_page_write_begin(mapping,
+							ecryptfs_page_idx, 0);
+			if (!ecryptfs_page) {
+				rc = -ENOMEM;
+				goto out;
+			}
+		}
+		ecryptfs_page_virt = kmap(ecryptfs_page);
+		/* zeros only past the end of the file */
+		if (pos < offset || (fresh && !start_offset_in_page))
+			memset(((char *)ecryptfs_page_virt
+				+ start_offset_in_page), 0,
+			       PAGE_SIZE - start_offset_in_page);
+		if (pos >= offset) {
+			if (copy_from_user(((char *)ecryptfs_page_virt
+					    + start_offset_in_page),
+					   (data + data_offset), num_bytes))
+				rc = -EFAULT;
+			data_offset += num_bytes;
+		}
+		kunmap(ecryptfs_page);
+		flush_dcache_page(ecryptfs_page);
+		SetPageUptodate(ecryptfs_page);
+		__set_page_dirty_nobuffers(ecryptfs_page);
+		unlock_page(ecryptfs_page);
+		put_page(ecryptfs_page);
+		if (rc)
+			goto out;
+		npages++;
+		pos += num_bytes;
+	}
+
+	/* the size goes to the metadata when the pages are written back */
+	if ((offset + size) > ecryptfs_file_size) {
+		i_size_write(ecryptfs_inode, (offset + size));
+		atomic_set(&inode_info->wb_size_stale, 1);
+	}
+out:
+	if (npages) {
+		balance_dirty_pages_ratelimited(mapping);
+		if (atomic_add_return(npages, &inode_info->wb_dirty)
+		    >= ecryptfs_wb_batch)
+			queue_work(system_unbound_wq, &inode_info->wb_work);
+	}
+	return rc;
+}
+
 /**
  * ecryptfs_read_lower
  * @data: The read data is stored here by this function
@@ -373,6 +501,81 @@ int ecryptfs_read_lower(char *data, loff_t offset, size_t size,
 	return kernel_read(lower_file, offset, data, size);
 }
 
+/**
+ * ecryptfs_read_lower_pages
+ * @pgs: Pages to read into, whole, for consecutive lower pages
+ * @nr_pages: Number of pages
+ * @offset: Byte offset in the lower file of the first
+ * @ecryptfs_inode: The eCryptfs inode
+ *
+ * Reads the run as one vectored read of the lower file, rather than a
+ * kernel_read() per page; a lower file without read_iter gets those.
+ * Short reads are retried until the run is read or the lower file
+ * ends, and only what is past its end is zeroed.
+ *
+ * Returns zero on success; negative on error
+ */
+int ecryptfs_read_lower_pages(struct page **pgs, unsigned int nr_pages,
+			      loff_t offset, struct inode *ecryptfs_inode)
+{
+	struct file *lower_file;
+	struct bio_vec *bv;
+	struct iov_iter iter;
+	size_t size = (size_t)nr_pages << PAGE_SHIFT, done = 0;
+	unsigned int i;
+	ssize_t rc = 0;
+
+	lower_file = ecryptfs_inode_to_private(ecryptfs_inode)->lower_file;
+	if (!lower_file)
+		return -EIO;
+	if (!lower_file->f_op->read_iter)
+		goto per_page;
+	bv = kmalloc_array(nr_pages, sizeof(*bv), GFP_KERNEL);
+	if (!bv)
+		goto per_page;
+	for (i = 0; i < nr_pages; i++) {
+		bv[i].bv_page = pgs[i];
+		bv[i].bv_len = PAGE_SIZE;
+		bv[i].bv_offset = 0;
+	}
+	iov_iter_bvec(&iter, ITER_BVEC | READ, bv, nr_pages, size);
+	/* vfs_iter_read() advances iter and offset */
+	while (done < size) {
+		rc = vfs_iter_read(lower_file, &iter, &offset);
+		if (rc <= 0)
+			break;
+		done += rc;
+	}
+	kfree(bv);
+	if (rc < 0)
+		return rc;
+	for (i = done >> PAGE_SHIFT; i < nr_pages; i++)
+		zero_user_segment(pgs[i], i == (done >> PAGE_SHIFT) ?
+				  done & ~PAGE_MASK : 0, PAGE_SIZE);
+	return 0;
+
+per_page:
+	for (i = 0; i < nr_pages; i++) {
+		char *virt = kmap(pgs[i]);
+		size_t got = 0;
+
+		while (got < PAGE_SIZE) {
+			rc = kernel_read(lower_file,
+					 offset + ((loff_t)i << PAGE_SHIFT) + got,
+					 virt + got, PAGE_SIZE - got);
+			if (rc <= 0)
+				break;
+			got += rc;
+		}
+		if (rc >= 0 && got < PAGE_SIZE)
+			memset(virt + got, 0, PAGE_SIZE - got);
+		kunmap(pgs[i]);
+		if (rc < 0)
+			return rc;
+	}
+	return 0;
+}
+
 /**
  * ecryptfs_read_lower_page_segment
  * @page_for_ecryptfs: The page into which data for eCryptfs will be
@@ -62,6 +62,9 @@ static struct inode *ecryptfs_alloc_inode(struct super_block *sb)
 	mutex_init(&inode_info->lower_file_mutex);
 	atomic_set(&inode_info->lower_file_count, 0);
 	inode_info->lower_file = NULL;
+	atomic_set(&inode_info->wb_dirty, 0);
+	atomic_set(&inode_info->wb_size_stale, 0);
+	INIT_WORK(&inode_info->wb_work, ecryptfs_wb_work);
 	inode = &inode_info->vfs_inode;
 out:
 	return inode;
@@ -134,6 +137,7 @@ static int ecryptfs_statfs(struct dentry *dentry, struct kstatfs *buf)
  */
 static void ecryptfs_evict_inode(struct inode *inode)
 {
+	cancel_work_sync(&ecryptfs_inode_to_private(inode)->wb_work);
 	truncate_inode_pages_final(&inode->i_data);
 	clear_inode(inode);
 	iput(ecryptfs_inode_to_lower(inode));
@@ -24,6 +24,18 @@ struct crypto_gaes_ctr_info {
     u8  ctrblk[AES_BLOCK_SIZE];	
 };
 
+/*
+ * udata of the gaes_ctr and gaes_xts services: the key as for gaes_ecb,
+ * in the same layout as crypto_aes_ctx, and the counter block of the
+ * first block, or its tweak already encrypted with the tweak key.
+ */
+struct crypto_gaes_iv_info {
+    u32 key_enc[AES_MAX_KEYLENGTH_U32];
+    u32 key_dec[AES_MAX_KEYLENGTH_U32];
+    u32 key_length;
+    u8  iv[AES_BLOCK_SIZE];
+};
+
 #ifndef __KERNEL__
 typedef struct {
     u64 a, b;
@@ -0,0 +1,329 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * GPU accelerated AES-CTR cipher
+ *
+ * The counter mode of crypto/ctr.c: the counter block is the iv, a
+ * 128-bit big-endian number incremented per block, and is left at the
+ * next block's when done. Every work-item of the gaes_ctr service works
+ * out its own counter block from the first one, see gaes.cl.
+ */
+#include <crypto/algapi.h>
+#include <crypto/scatterwalk.h>
+#include <linux/err.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <crypto/aes.h>
+#include <linux/string.h>
+#include <linux/moduleparam.h>
+#include "../../kocl/kocl.h"
+#include "../gaesk.h"
+
+/* customized log function */
+#define g_log(level, ...) kocl_do_log(level, "gaes_ctr", ##__VA_ARGS__)
+#define dbg(...) g_log(KOCL_LOG_DEBUG, ##__VA_ARGS__)
+
+struct crypto_gaes_ctr_ctx {
+    struct crypto_cipher *child;
+    struct crypto_aes_ctx aes_ctx;
+};
+
+/* KOCL_CHANNEL_AUTO (-1) lets kocl place each request */
+static int channel=1;
+module_param(channel, int , 0);
+
+/* in place requests on their own pages, not on copies in the pool */
+static int sg=1;
+module_param(sg, int , 0644);
+
+static int gaes_ctr_sid;
+
+static int
+crypto_gaes_ctr_setkey(
+    struct crypto_tfm *parent, const u8 *key,
+    unsigned int keylen)
+{
+    struct crypto_gaes_ctr_ctx *ctx = crypto_tfm_ctx(parent);
+    struct crypto_cipher *child = ctx->child;
+    int err;
+
+    crypto_cipher_clear_flags(child, CRYPTO_TFM_REQ_MASK);
+    crypto_cipher_set_flags(child, crypto_tfm_get_flags(parent) &
+			    CRYPTO_TFM_REQ_MASK);
+
+    err = crypto_aes_expand_key(&ctx->aes_ctx, key, keylen);
+    if (!err)
+	err = crypto_cipher_setkey(child, key, keylen);
+
+    cvt_endian_u32(ctx->aes_ctx.key_enc, AES_MAX_KEYLENGTH_U32);
+    cvt_endian_u32(ctx->aes_ctx.key_dec, AES_MAX_KEYLENGTH_U32);
+
+    crypto_tfm_set_flags(parent, crypto_cipher_get_flags(child) &
+			 CRYPTO_TFM_RES_MASK);
+    return err;
+}
+
+/* ctr += n, big-endian */
+static void gaes_ctr_add(u8 *ctr, u64 n)
+{
+    int i;
+
+    for (i=AES_BLOCK_SIZE-1; i>=0 && n; i--) {
+	n += ctr[i];
+	ctr[i] = (u8)n;
+	n >>= 8;
+    }
+}
+
+static int
+crypto_gaes_ctr_gpu_crypt(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int sz)
+{
+    struct crypto_gaes_ctr_ctx *ctx = crypto_blkcipher_ctx(desc->tfm);
+    struct crypto_gaes_iv_info *info;
+    struct kocl_request *req;
+    size_t rsz = roundup(sz, PAGE_SIZE);
+    int ch = channel == KOCL_CHANNEL_AUTO? kocl_pick_channel(sz): channel;
+    int mapped, err = 0;
+    char *buf;
+
+    if (ch < 0 || ch >= KOCL_NR_CHANNELS)
+	ch = 0;
+
+    req = kocl_alloc_request();
+    if (!req) {
+	g_log(KOCL_LOG_ERROR, "can't allocate request\n");
+	return -EFAULT;
+    }
+    req->channel = ch;
+
+    /* the helper works on the pages themselves if kocl can map them */
+    mapped = sg && src == dst && (desc->flags & CRYPTO_TFM_REQ_MAY_SLEEP)
+	&& !kocl_map_sg(req, src, 0, sz, KOCL_SG_INOUT);
+    if (mapped)
+	rsz = 0;
+
+    if (desc->flags & CRYPTO_TFM_REQ_MAY_SLEEP)
+	buf = kocl_malloc_wait(rsz+sizeof(*info), ch, NULL);
+    else
+	buf = kocl_malloc(rsz+sizeof(*info), ch);
+    if (!buf) {
+	g_log(KOCL_LOG_ERROR, "GPU buffer is null.\n");
+	kocl_free_request(req);
+	return -EFAULT;
+    }
+
+    req->in = buf;
+    req->out = buf;
+    req->insize = mapped? sz: rsz+sizeof(*info);
+    req->outsize = sz;
+    req->udatasize = sizeof(*info);
+    req->udata = buf+rsz;
+    if (!mapped)
+	sg_copy_to_buffer(src, sg_nents(src), buf, sz);
+
+    info = (struct crypto_gaes_iv_info*)req->udata;
+    memcpy(info->key_enc, ctx->aes_ctx.key_enc, sizeof(info->key_enc));
+    memcpy(info->key_dec, ctx->aes_ctx.key_dec, sizeof(info->key_dec));
+    info->key_length = ctx->aes_ctx.key_length;
+    memcpy(info->iv, desc->info, AES_BLOCK_SIZE);
+    strcpy(req->service_name, "gaes_ctr");
+    req->sid = gaes_ctr_sid;
+
+    if (kocl_offload_sync(req)) {
+	err = -EFAULT;
+	g_log(KOCL_LOG_ERROR, "callgpu error\n");
+    } else {
+	if (!mapped)
+	    sg_copy_from_buffer(dst, sg_nents(dst), req->out, sz);
+	gaes_ctr_add(desc->info, sz/AES_BLOCK_SIZE);
+    }
+    kocl_free_quota(req->in, req->channel, NULL);
+    kocl_free_request(req);
+    return err;
+}
+
+/* as crypto/ctr.c does it, for small requests and a partial last block */
+static int
+crypto_gaes_ctr_cpu_crypt(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int nbytes)
+{
+    struct crypto_gaes_ctr_ctx *ctx = crypto_blkcipher_ctx(desc->tfm);
+    struct crypto_cipher *child = ctx->child;
+    u8 *ctr = desc->info;
+    u8 ks[AES_BLOCK_SIZE];
+    struct blkcipher_walk walk;
+    int err;
+
+    blkcipher_walk_init(&walk, dst, src, nbytes);
+    err = blkcipher_walk_virt_block(desc, &walk, AES_BLOCK_SIZE);
+
+    while (walk.nbytes >= AES_BLOCK_SIZE) {
+	u8 *wsrc = walk.src.virt.addr;
+	u8 *wdst = walk.dst.virt.addr;
+
+	nbytes = walk.nbytes;
+	do {
+	    crypto_cipher_encrypt_one(child, ks, ctr);
+	    if (wdst != wsrc)
+		memcpy(wdst, wsrc, AES_BLOCK_SIZE);
+	    crypto_xor(wdst, ks, AES_BLOCK_SIZE);
+	    crypto_inc(ctr, AES_BLOCK_SIZE);
+
+	    wsrc += AES_BLOCK_SIZE;
+	    wdst += AES_BLOCK_SIZE;
+	} while ((nbytes -= AES_BLOCK_SIZE) >= AES_BLOCK_SIZE);
+
+	err = blkcipher_walk_done(desc, &walk, nbytes);
+    }
+
+    if (walk.nbytes) {
+	crypto_cipher_encrypt_one(child, ks, ctr);
+	if (walk.dst.virt.addr != walk.src.virt.addr)
+	    memcpy(walk.dst.virt.addr, walk.src.virt.addr, walk.nbytes);
+	crypto_xor(walk.dst.virt.addr, ks, walk.nbytes);
+	crypto_inc(ctr, AES_BLOCK_SIZE);
+	err = blkcipher_walk_done(desc, &walk, 0);
+    }
+
+    return err;
+}
+
+/* encryption and decryption are the same */
+static int
+crypto_gaes_ctr_crypt(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int nbytes)
+{
+    unsigned int gsz = nbytes & ~(AES_BLOCK_SIZE-1);
+    int err;
+
+    if (gsz <= GAES_CTR_SIZE_THRESHOLD)
+	return crypto_gaes_ctr_cpu_crypt(desc, dst, src, nbytes);
+
+    err = crypto_gaes_ctr_gpu_crypt(desc, dst, src, gsz);
+    if (err || gsz == nbytes)
+	return err;
+
+    /* the partial block at the end */
+    {
+	struct scatterlist s[2], d[2], *ps, *pd;
+
+	ps = scatterwalk_ffwd(s, src, gsz);
+	pd = src == dst? ps: scatterwalk_ffwd(d, dst, gsz);
+	return crypto_gaes_ctr_cpu_crypt(desc, pd, ps, nbytes-gsz);
+    }
+}
+
+static int crypto_gaes_ctr_init_tfm(struct crypto_tfm *tfm)
+{
+    struct crypto_instance *inst = (void *)tfm->__crt_alg;
+    struct crypto_spawn *spawn = crypto_instance_ctx(inst);
+    struct crypto_gaes_ctr_ctx *ctx = crypto_tfm_ctx(tfm);
+    struct crypto_cipher *cipher;
+
+    cipher = crypto_spawn_cipher(spawn);
+    if (IS_ERR(cipher))
+	return PTR_ERR(cipher);
+
+    ctx->child = cipher;
+    return 0;
+}
+
+static void crypto_gaes_ctr_exit_tfm(struct crypto_tfm *tfm)
+{
+    struct crypto_gaes_ctr_ctx *ctx = crypto_tfm_ctx(tfm);
+    crypto_free_cipher(ctx->child);
+}
+
+static struct crypto_instance *crypto_gaes_ctr_alloc(struct rtattr **tb)
+{
+    struct crypto_instance *inst;
+    struct crypto_alg *alg;
+    int err;
+
+    err = crypto_check_attr_type(tb, CRYPTO_ALG_TYPE_BLKCIPHER);
+    if (err)
+	return ERR_PTR(err);
+
+    alg = crypto_get_attr_alg(tb, CRYPTO_ALG_TYPE_CIPHER,
+			      CRYPTO_ALG_TYPE_MASK);
+    if (IS_ERR(alg))
+	return ERR_CAST(alg);
+
+    /* the kernels are AES's */
+    inst = ERR_PTR(-EINVAL);
+    if (alg->cra_blocksize != AES_BLOCK_SIZE)
+	goto out_put_alg;
+
+    inst = crypto_alloc_instance("gaes_ctr", alg);
+    if (IS_ERR(inst)) {
+	g_log(KOCL_LOG_ERROR, "cannot alloc crypto instance\n");
+	goto out_put_alg;
+    }
+
+    inst->alg.cra_flags = CRYPTO_ALG_TYPE_BLKCIPHER;
+    inst->alg.cra_priority = alg->cra_priority;
+    inst->alg.cra_blocksize = 1;
+    inst->alg.cra_alignmask = alg->cra_alignmask;
+    inst->alg.cra_type = &crypto_blkcipher_type;
+
+    inst->alg.cra_blkcipher.ivsize = AES_BLOCK_SIZE;
+    inst->alg.cra_blkcipher.min_keysize = alg->cra_cipher.cia_min_keysize;
+    inst->alg.cra_blkcipher.max_keysize = alg->cra_cipher.cia_max_keysize;
+
+    inst->alg.cra_ctxsize = sizeof(struct crypto_gaes_ctr_ctx);
+
+    inst->alg.cra_init = crypto_gaes_ctr_init_tfm;
+    inst->alg.cra_exit = crypto_gaes_ctr_exit_tfm;
+
+    inst->alg.cra_blkcipher.setkey = crypto_gaes_ctr_setkey;
+    inst->alg.cra_blkcipher.encrypt = crypto_gaes_ctr_crypt;
+    inst->alg.cra_blkcipher.decrypt = crypto_gaes_ctr_crypt;
+
+out_put_alg:
+    crypto_mod_put(alg);
+    return inst;
+}
+
+static void crypto_gaes_ctr_free(struct crypto_instance *inst)
+{
+    crypto_drop_spawn(crypto_instance_ctx(inst));
+    kfree(inst);
+}
+
+static struct crypto_template crypto_gaes_ctr_tmpl = {
+    .name = "gaes_ctr",
+    .alloc = crypto_gaes_ctr_alloc,
+    .free = crypto_gaes_ctr_free,
+    .module = THIS_MODULE,
+};
+
+static int __init crypto_gaes_ctr_module_init(void)
+{
+    gaes_ctr_sid = kocl_service_id("gaes_ctr");
+    return crypto_register_template(&crypto_gaes_ctr_tmpl);
+}
+
+static void __exit crypto_gaes_ctr_module_exit(void)
+{
+    g_log(KOCL_LOG_PRINT, "module unload\n");
+    crypto_unregister_template(&crypto_gaes_ctr_tmpl);
+}
+
+module_init(crypto_gaes_ctr_module_init);
+module_exit(crypto_gaes_ctr_module_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("gaes_ctr block cipher algorithm");
@@ -12,7 +12,10 @@
  *
  * This cipher is mostly derived from the crypto/ecb.c in Linux kernel tree.
  *
- * 
+ * Users that take async algorithms get an ablkcipher instance: a GPU
+ * request returns -EINPROGRESS at once and completes through the
+ * request's callback, so they can have many of them in flight. Those
+ * asking for a sync one get the blkcipher, which waits for the GPU.
  */
 #include <crypto/algapi.h>
 #include <linux/err.h>
@@ -24,6 +27,10 @@
 #include <crypto/aes.h>
 #include <linux/string.h>
 #include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <crypto/scatterwalk.h>
 #include "../../kocl/kocl.h"
 #include "../gaesk.h"
 
@@ -35,8 +42,16 @@ struct crypto_gaes_ecb_ctx {
     struct crypto_cipher *child;
     struct crypto_aes_ctx aes_ctx;    
     u8 key[32];
+    int kctx;                         /* aes_ctx as a kocl context, 0 if not */
 };
 
+/* bytes of aes_ctx a request carries itself, none with a kocl context */
+static inline size_t gaes_udsize(struct crypto_gaes_ecb_ctx *ctx)
+{
+    return ctx->kctx? 0: sizeof(struct crypto_aes_ctx);
+}
+
+
 struct gaes_ecb_async_data {
     struct completion *c;             /* async-call completion */
     struct scatterlist *dst, *src;    /* crypt destination and source */
@@ -44,11 +59,45 @@ struct gaes_ecb_async_data {
     unsigned int sz;                  /* data size */
     void *expage;                     /* extra page allocated before calling KOCL, if any */
     unsigned int offset;              /* offset within scatterlists */
+    int mapped;                       /* kocl_map_sg()-ed, nothing to copy back */
 };
 
+/* an async request on the GPU, see gaes_ecb_async_crypt() */
+struct gaes_ecb_areq_data {
+    struct ablkcipher_request *areq;
+    int ch;
+    int mapped;                       /* kocl_map_sg()-ed, nothing to copy back */
+    u64 t0;                           /* submitted, for gaes_gpu_ns */
+};
+
+/* KOCL_CHANNEL_AUTO (-1) lets kocl place each request */
 static int channel=1;
 module_param(channel, int , 0);
 
+/* run large requests on all devices at once, see kocl_offload_split() */
+static int split=0;
+module_param(split, int , 0);
+
+/* pool memory in flight for all gaes_ecb requests, MB, 0 for no limit */
+static int quota=0;
+module_param(quota, int , 0);
+
+static struct kocl_quota gaes_quota = KOCL_QUOTA_INIT(0);
+
+/* pool buffer of a request, or none if it's mapped and has a context */
+static void gaes_free_buf(struct kocl_request *req)
+{
+    if (req->in)
+	kocl_free_quota(req->in, req->channel, &gaes_quota);
+}
+
+/* in place requests on their own pages, not on copies in the pool */
+static int sg=1;
+module_param(sg, int , 0644);
+
+/* kocl_service_id() of the two services */
+static int gaes_enc_sid, gaes_dec_sid;
+
 static int
 crypto_gaes_ecb_setkey(
     struct crypto_tfm *parent, const u8 *key,
@@ -71,6 +120,11 @@ crypto_gaes_ecb_setkey(
     cvt_endian_u32(ctx->aes_ctx.key_dec, AES_MAX_KEYLENGTH_U32);
     
     memcpy(ctx->key, key, keylen);
+
+    /* the helper keeps it from now on, requests just name it */
+    if (ctx->kctx)
+	kocl_ctx_unregister(ctx->kctx);
+    ctx->kctx = kocl_ctx_register(&ctx->aes_ctx, sizeof(struct crypto_aes_ctx));
     
     crypto_tfm_set_flags(parent, crypto_cipher_get_flags(child) &
 			 CRYPTO_TFM_RES_MASK);
@@ -111,14 +165,14 @@ static int async_gpu_callback(struct kocl_request *req)
     struct gaes_ecb_async_data *data = (struct gaes_ecb_async_data*)
 	req->kdata;
 
-    
+    if (!data->mapped)
 	__done_cryption(data->desc, data->dst, data->src, data->sz,
 			(char*)req->out, data->offset);
 
     complete(data->c);
    // g_log(KOCL_LOG_PRINT, "REQ Comp: %lu \n",data->c); 
 
-    kocl_free(req->in,req->channel);
+    gaes_free_buf(req);
     
     if (data->expage)
 	free_page(TO_UL(data->expage));
@@ -133,12 +187,13 @@ crypto_gaes_ecb_crypt(
     struct blkcipher_desc *desc,
     struct scatterlist *dst, struct scatterlist *src,
     unsigned int sz,
-    int enc, struct completion *c, unsigned int offset)
+    int enc, struct completion *c, unsigned int offset, int ch)
 {
     int err=0;
     size_t rsz = roundup(sz, PAGE_SIZE);
     size_t nbytes;
     unsigned int cur;
+    int mapped;
 
     struct kocl_request *req;
     char *buf;
@@ -152,26 +207,41 @@ crypto_gaes_ecb_crypt(
 	    g_log(KOCL_LOG_ERROR, "can't allocate request\n");
 	    return -EFAULT;
     }
-    req->channel=channel;
-
-    buf = kocl_malloc(rsz+sizeof(struct crypto_aes_ctx), req->channel);
-    if (!buf) {
+    req->channel = ch;
+
+    /* the helper works on the pages themselves if kocl can map them */
+    mapped = sg && src == dst && (desc->flags & CRYPTO_TFM_REQ_MAY_SLEEP)
+	&& !kocl_map_sg(req, src, offset, sz, KOCL_SG_INOUT);
+    if (mapped)
+	rsz = 0;
+
+    /* throttle on a full pool when we may sleep instead of failing */
+    if (!(rsz+gaes_udsize(ctx)))
+	buf = NULL;
+    else if (desc->flags & CRYPTO_TFM_REQ_MAY_SLEEP)
+	buf = kocl_malloc_wait(rsz+gaes_udsize(ctx), req->channel,
+			       &gaes_quota);
+    else
+	buf = kocl_malloc(rsz+gaes_udsize(ctx), req->channel);
+    if (!buf && rsz+gaes_udsize(ctx)) {
 	    g_log(KOCL_LOG_ERROR, "GPU buffer is null.\n");
+	    kocl_free_request(req);
 	    return -EFAULT;
     }   
 
     req->in = buf;
     req->out = buf;
-    req->insize = rsz+sizeof(struct crypto_aes_ctx);
+    req->insize = mapped? sz: rsz+gaes_udsize(ctx);
     req->outsize = sz;
-    req->udatasize = sizeof(struct crypto_aes_ctx);
-    req->udata = buf+rsz;
+    req->ctx = ctx->kctx;
+    req->udatasize = gaes_udsize(ctx);
+    req->udata = req->udatasize? buf+rsz: NULL;
 
     blkcipher_walk_init(&walk, dst, src, sz+offset);//如果是async 則要加上offset
-    err = blkcipher_walk_virt(desc, &walk);
+    err = mapped? 0: blkcipher_walk_virt(desc, &walk);
     cur = 0;
 
-    while ((nbytes = walk.nbytes)) {
+    while (!mapped && (nbytes = walk.nbytes)) {
 	if (cur >= offset) {
 	    u8 *wsrc = walk.src.virt.addr;
 	    
@@ -185,8 +255,10 @@ crypto_gaes_ecb_crypt(
 	    break;
     }
 
-    memcpy(req->udata, &(ctx->aes_ctx), sizeof(struct crypto_aes_ctx));   
+    if (req->udata)
+	memcpy(req->udata, &(ctx->aes_ctx), sizeof(struct crypto_aes_ctx));
     strcpy(req->service_name, enc?"gaes_ecb-enc":"gaes_ecb-dec");
+    req->sid = enc? gaes_enc_sid: gaes_dec_sid;
 
     if (c) {
 	struct gaes_ecb_async_data *adata =
@@ -205,74 +277,87 @@ crypto_gaes_ecb_crypt(
 	    adata->sz = sz;
 	    adata->expage = NULL;
 	    adata->offset = offset;
-	    kocl_offload_async(req);
+	    adata->mapped = mapped;
+	    if (split)
+		kocl_offload_split(req, AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+	    else
+		kocl_offload_async(req);
 	    return 0;
 	}
     } else {
-        if (kocl_offload_sync(req)) {
+        if (split? kocl_offload_split_sync(req, AES_BLOCK_SIZE, AES_BLOCK_SIZE):
+	    kocl_offload_sync(req)) {
 	        err = -EFAULT;
 	        g_log(KOCL_LOG_ERROR, "callgpu error\n");
-	    } else {
+	    } else if (!mapped) {
 	        __done_cryption(desc, dst, src, sz, (char*)req->out, offset);
 	    }
-	kocl_free(req->in, req->channel);
+	gaes_free_buf(req);
 	kocl_free_request(req); 
     }
     
     return err;
 }
 
+/*
+ * Large requests go as parts: as many as the channels they may use
+ * have free slots, of part_min KB or more, in whole pool units. With
+ * channel=-1 each part goes where kocl_pick_channel() puts it, so the
+ * parts of one request fan out over the devices. split=1 leaves the
+ * cutting to kocl_offload_split() instead.
+ */
+static int part_min=64;
+module_param(part_min, int , 0644);
+
+#define GAES_MAX_PARTS 16
+
+static int gaes_nparts(unsigned int nbytes, int ch, unsigned long min)
+{
+    int c, slots = 0;
+
+    if (channel == KOCL_CHANNEL_AUTO)
+	for (c=0; c<KOCL_NR_CHANNELS; c++)
+	    slots += kocl_channel_free_slots(c);
+    else
+	slots = kocl_channel_free_slots(ch);
+
+    return min_t(unsigned long, min_t(int, slots, GAES_MAX_PARTS), nbytes/min);
+}
+
 static int crypto_ecb_gpu_crypt(
     struct blkcipher_desc *desc,
     struct scatterlist *dst, struct scatterlist *src,
-    unsigned int nbytes, int enc)
+    unsigned int nbytes, int enc, int ch)
 {
-    
-    //如果nbyte右移4KB且>=128+64(192個page) 的時後表示原本nbytes大於192*4KB 也就是nbytes大於768KB時會split //在x86 PAGE_SHIFT 12
-    if ((nbytes>>PAGE_SHIFT)>= 512 ) { //512 等於2MB , 4096 等於16MB
-	
-    unsigned int remainings = nbytes;
-
+    unsigned long unit = kocl_pool_unit(ch);
+    unsigned long min = max_t(unsigned long, (unsigned long)part_min<<10, unit);
     struct completion *cs;
-	int i;
-	int ret = 0;
-	unsigned int partsz ;
-    int nparts;
-   
-	  if((nbytes>>PAGE_SHIFT) == 512){ //32K~512K 切4份
-          nparts = 4 ;
-	      partsz = nbytes/nparts;
-      }else {
-           nparts = 8 ;
-	       partsz = nbytes/nparts;//1MB~32MB 切8份
-     }  
-  //  printk(" nparts: %u \n",nparts);    
-	cs = (struct completion*)kmalloc(sizeof(struct completion)*nparts,
-					 GFP_KERNEL);
-                     
-	if (cs) {
-	    for(i=0; i<nparts && remainings > 0; i++) {
-		init_completion(cs+i);
-		
-        ret = crypto_gaes_ecb_crypt(desc, dst, src,
-						(i==nparts-1)?remainings:
-						partsz,
-						enc, cs+i, i*partsz);//每次丟512KB給gpu算,最後一次丟remainings
-
-		if (ret < 0)
-		    break;
-		
-		remainings -= partsz;
-	    }
+    unsigned int partsz, off, sz;
+    int i, c, nparts, ret = 0;
+
+    nparts = split? 1: gaes_nparts(nbytes, ch, min);
+    if (nparts < 2)
+	return crypto_gaes_ecb_crypt(desc, dst, src, nbytes, enc, NULL, 0, ch);
+
+    partsz = roundup(DIV_ROUND_UP(nbytes, nparts), unit);
+    nparts = DIV_ROUND_UP(nbytes, partsz);
+    cs = kmalloc(sizeof(struct completion)*nparts, GFP_KERNEL);
+    if (!cs)
+	return crypto_gaes_ecb_crypt(desc, dst, src, nbytes, enc, NULL, 0, ch);
+
+    for (i=0, off=0; i<nparts; i++, off+=sz) {
+	sz = min(partsz, nbytes-off);
+	c = channel == KOCL_CHANNEL_AUTO && i? kocl_pick_channel(sz): ch;
+	init_completion(cs+i);
+	ret = crypto_gaes_ecb_crypt(desc, dst, src, sz, enc, cs+i, off, c);
+	if (ret < 0)
+	    break;
+    }
 
-	    for (i--; i>=0; i--)
-		wait_for_completion_interruptible(cs+i);
-	    kfree(cs);
-	    return ret;
-	   }
-    } 
-    
-    return crypto_gaes_ecb_crypt(desc, dst, src, nbytes, enc, NULL, 0);
+    for (i--; i>=0; i--)
+	wait_for_completion_interruptible(cs+i);
+    kfree(cs);
+    return ret;
 }
 
 
@@ -338,15 +423,130 @@ crypto_ecb_decrypt(
 			    crypto_cipher_alg(child)->cia_decrypt);
 }
 
+/*
+ * CPU or GPU. Both paths are timed per power-of-two size class and
+ * channel, as ns per KB, from the requests themselves, and each request
+ * takes the faster one. Every GAES_PROBE_EVERY-th request of a class
+ * takes the other path to keep its time current, a class without a time
+ * for a path tries it first. cpu_max fixes the crossover instead.
+ */
+#define GAES_NR_CLASSES 21        /* 16 bytes .. 16MB and more */
+#define GAES_PROBE_EVERY 64
+
+static u64 gaes_cpu_ns[GAES_NR_CLASSES];
+static u64 gaes_gpu_ns[KOCL_NR_CHANNELS][GAES_NR_CLASSES];
+static atomic_t gaes_nreqs[KOCL_NR_CHANNELS][GAES_NR_CLASSES];
+
+/* requests up to cpu_max bytes run on the CPU, -1 for the calibrated choice */
+static int cpu_max=-1;
+module_param(cpu_max, int , 0644);
+
+static inline int gaes_class(unsigned int nbytes)
+{
+    int c = nbytes? ilog2(nbytes): 0;
+
+    return clamp(c, 4, 4+GAES_NR_CLASSES-1) - 4;
+}
+
+static void gaes_time(u64 *t, u64 ns, unsigned int nbytes)
+{
+    u64 v = div_u64(ns << 10, nbytes? nbytes: 1), o = READ_ONCE(*t);
+
+    WRITE_ONCE(*t, o? o - (o>>3) + (v>>3): v);
+}
+
+static int gaes_use_cpu(int ch, unsigned int nbytes)
+{
+    int c = gaes_class(nbytes), cpu;
+    u64 ct, gt;
+
+    if (cpu_max >= 0)
+	return nbytes <= cpu_max;
+
+    ct = READ_ONCE(gaes_cpu_ns[c]);
+    gt = READ_ONCE(gaes_gpu_ns[ch][c]);
+    if (!gt)
+	return 0;
+    if (!ct)
+	return 1;
+    cpu = ct < gt;
+    if (!(atomic_inc_return(&gaes_nreqs[ch][c]) % GAES_PROBE_EVERY))
+	cpu = !cpu;
+    return cpu;
+}
+
+static int
+gaes_ecb_route(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int nbytes, int enc)
+{
+    int ch = channel == KOCL_CHANNEL_AUTO? kocl_pick_channel(nbytes): channel;
+    int cpu, err;
+    u64 t0;
+
+    if (ch < 0 || ch >= KOCL_NR_CHANNELS)
+	ch = 0;
+    cpu = gaes_use_cpu(ch, nbytes);
+
+    t0 = ktime_get_ns();
+    if (cpu)
+	err = enc? crypto_ecb_encrypt(desc, dst, src, nbytes):
+	    crypto_ecb_decrypt(desc, dst, src, nbytes);
+    else
+	err = crypto_ecb_gpu_crypt(desc, dst, src, nbytes, enc, ch);
+    if (!err)
+	gaes_time(cpu? &gaes_cpu_ns[gaes_class(nbytes)]:
+		  &gaes_gpu_ns[ch][gaes_class(nbytes)],
+		  ktime_get_ns() - t0, nbytes);
+    return err;
+}
+
+/*
+ * crossover: per channel, the smallest size class from which on the
+ * GPU was measured faster, "-" if it never was.
+ */
+static int gaes_crossover_get(char *buf, const struct kernel_param *kp)
+{
+    int ch, c, n = 0, from;
+    u64 ct, gt;
+
+    for (ch=0; ch<KOCL_NR_CHANNELS; ch++) {
+	from = -1;
+	for (c=GAES_NR_CLASSES-1; c>=0; c--) {
+	    ct = READ_ONCE(gaes_cpu_ns[c]);
+	    gt = READ_ONCE(gaes_gpu_ns[ch][c]);
+	    if (!ct || !gt || gt >= ct)
+		break;
+	    from = c;
+	}
+	if (from < 0)
+	    n += scnprintf(buf+n, PAGE_SIZE-n, "%d:- ", ch);
+	else
+	    n += scnprintf(buf+n, PAGE_SIZE-n, "%d:%lu ", ch, 16UL<<from);
+    }
+    n += scnprintf(buf+n, PAGE_SIZE-n, "\n");
+    return n;
+}
+
+static int gaes_crossover_set(const char *val, const struct kernel_param *kp)
+{
+    return -EPERM;
+}
+
+static const struct kernel_param_ops gaes_crossover_ops = {
+    .set = gaes_crossover_set,
+    .get = gaes_crossover_get,
+};
+module_param_cb(crossover, &gaes_crossover_ops, NULL, 0444);
+
 static int
 crypto_gaes_ecb_encrypt(
     struct blkcipher_desc *desc,
     struct scatterlist *dst, struct scatterlist *src,
     unsigned int nbytes)
-{    
-   // if (/*nbytes%PAGE_SIZE != 0 ||*/ nbytes <= GAES_ECB_SIZE_THRESHOLD)
-   // 	return crypto_ecb_encrypt(desc, dst, src, nbytes);
-    return crypto_ecb_gpu_crypt(desc, dst, src, nbytes, 1);
+{
+    return gaes_ecb_route(desc, dst, src, nbytes, 1);
 }
 
 static int
@@ -355,9 +555,160 @@ crypto_gaes_ecb_decrypt(
     struct scatterlist *dst, struct scatterlist *src,
     unsigned int nbytes)
 {
-    //if (/*nbytes%PAGE_SIZE != 0 ||*/ nbytes <= GAES_ECB_SIZE_THRESHOLD)
-    //	return crypto_ecb_decrypt(desc, dst, src, nbytes);
-    return crypto_ecb_gpu_crypt(desc, dst, src, nbytes, 0);
+    return gaes_ecb_route(desc, dst, src, nbytes, 0);
+}
+
+static int
+crypto_gaes_ecb_async_setkey(
+    struct crypto_ablkcipher *tfm, const u8 *key,
+    unsigned int keylen)
+{
+    return crypto_gaes_ecb_setkey(crypto_ablkcipher_tfm(tfm), key, keylen);
+}
+
+static int gaes_ecb_async_done(struct kocl_request *req)
+{
+    struct gaes_ecb_areq_data *data = (struct gaes_ecb_areq_data*)req->kdata;
+    struct ablkcipher_request *areq = data->areq;
+    int err = req->errcode? -EIO: 0;
+
+    if (!err) {
+	if (!data->mapped)
+	    sg_copy_from_buffer(areq->dst, sg_nents(areq->dst), req->out,
+				areq->nbytes);
+	gaes_time(&gaes_gpu_ns[data->ch][gaes_class(areq->nbytes)],
+		  ktime_get_ns() - data->t0, areq->nbytes);
+    }
+
+    gaes_free_buf(req);
+    kocl_free_request(req);
+    kfree(data);
+
+    areq->base.complete(&areq->base, err);
+    return 0;
+}
+
+/* the child cipher a page at a time, done when it returns */
+static int gaes_ecb_async_cpu(struct ablkcipher_request *areq, int enc)
+{
+    struct crypto_gaes_ecb_ctx *ctx =
+	crypto_ablkcipher_ctx(crypto_ablkcipher_reqtfm(areq));
+    struct crypto_cipher *child = ctx->child;
+    void (*fn)(struct crypto_tfm *, u8 *, const u8 *) = enc?
+	crypto_cipher_alg(child)->cia_encrypt: crypto_cipher_alg(child)->cia_decrypt;
+    unsigned int off, n, i;
+    u64 t0 = ktime_get_ns();
+    u8 *buf;
+
+    buf = (u8*)__get_free_page(areq->base.flags & CRYPTO_TFM_REQ_MAY_SLEEP?
+			       GFP_KERNEL: GFP_ATOMIC);
+    if (!buf)
+	return -ENOMEM;
+
+    for (off=0; off<areq->nbytes; off+=n) {
+	n = min_t(unsigned int, areq->nbytes-off, PAGE_SIZE);
+	scatterwalk_map_and_copy(buf, areq->src, off, n, 0);
+	for (i=0; i<n; i+=AES_BLOCK_SIZE)
+	    fn(crypto_cipher_tfm(child), buf+i, buf+i);
+	scatterwalk_map_and_copy(buf, areq->dst, off, n, 1);
+    }
+    free_page(TO_UL(buf));
+
+    gaes_time(&gaes_cpu_ns[gaes_class(areq->nbytes)], ktime_get_ns() - t0,
+	      areq->nbytes);
+    return 0;
+}
+
+/*
+ * One kocl request for all of it, or the parts of kocl_offload_split().
+ * kocl allocates with GFP_KERNEL, so only requests that may sleep go to
+ * the GPU, and they wait for room in the pool as the sync ones do.
+ */
+static int gaes_ecb_async_crypt(struct ablkcipher_request *areq, int enc)
+{
+    struct crypto_gaes_ecb_ctx *ctx =
+	crypto_ablkcipher_ctx(crypto_ablkcipher_reqtfm(areq));
+    struct gaes_ecb_areq_data *data;
+    struct kocl_request *req;
+    unsigned int sz = areq->nbytes;
+    size_t rsz = roundup(sz, PAGE_SIZE);
+    int ch = channel == KOCL_CHANNEL_AUTO? kocl_pick_channel(sz): channel;
+    int mapped, err;
+    char *buf;
+
+    if (sz % AES_BLOCK_SIZE)
+	return -EINVAL;
+    if (!sz)
+	return 0;
+    if (ch < 0 || ch >= KOCL_NR_CHANNELS)
+	ch = 0;
+    if (!(areq->base.flags & CRYPTO_TFM_REQ_MAY_SLEEP) || gaes_use_cpu(ch, sz))
+	return gaes_ecb_async_cpu(areq, enc);
+
+    data = kmalloc(sizeof(*data), GFP_KERNEL);
+    req = kocl_alloc_request();
+    if (!data || !req) {
+	kfree(data);
+	if (req)
+	    kocl_free_request(req);
+	return gaes_ecb_async_cpu(areq, enc);
+    }
+    req->channel = ch;
+
+    mapped = sg && areq->src == areq->dst
+	&& !kocl_map_sg(req, areq->src, 0, sz, KOCL_SG_INOUT);
+    if (mapped)
+	rsz = 0;
+
+    buf = rsz+gaes_udsize(ctx)?
+	kocl_malloc_wait(rsz+gaes_udsize(ctx), ch, &gaes_quota): NULL;
+    if (!buf && rsz+gaes_udsize(ctx)) {
+	kocl_free_request(req);
+	kfree(data);
+	return gaes_ecb_async_cpu(areq, enc);
+    }
+
+    req->in = buf;
+    req->out = buf;
+    req->insize = mapped? sz: rsz+gaes_udsize(ctx);
+    req->outsize = sz;
+    req->ctx = ctx->kctx;
+    req->udatasize = gaes_udsize(ctx);
+    req->udata = req->udatasize? buf+rsz: NULL;
+    if (!mapped)
+	sg_copy_to_buffer(areq->src, sg_nents(areq->src), buf, sz);
+    if (req->udata)
+	memcpy(req->udata, &ctx->aes_ctx, sizeof(struct crypto_aes_ctx));
+    strcpy(req->service_name, enc?"gaes_ecb-enc":"gaes_ecb-dec");
+    req->sid = enc? gaes_enc_sid: gaes_dec_sid;
+
+    data->areq = areq;
+    data->ch = ch;
+    data->mapped = mapped;
+    data->t0 = ktime_get_ns();
+    req->callback = gaes_ecb_async_done;
+    req->kdata = data;
+
+    err = split? kocl_offload_split(req, AES_BLOCK_SIZE, AES_BLOCK_SIZE):
+	kocl_offload_async(req);
+    if (err) {
+	g_log(KOCL_LOG_ERROR, "callgpu error\n");
+	gaes_free_buf(req);
+	kocl_free_request(req);
+	kfree(data);
+	return -EFAULT;
+    }
+    return -EINPROGRESS;
+}
+
+static int crypto_gaes_ecb_async_encrypt(struct ablkcipher_request *areq)
+{
+    return gaes_ecb_async_crypt(areq, 1);
+}
+
+static int crypto_gaes_ecb_async_decrypt(struct ablkcipher_request *areq)
+{
+    return gaes_ecb_async_crypt(areq, 0);
 }
 
 static int crypto_gaes_ecb_init_tfm(struct crypto_tfm *tfm)
@@ -378,18 +729,30 @@ static int crypto_gaes_ecb_init_tfm(struct crypto_tfm *tfm)
 static void crypto_gaes_ecb_exit_tfm(struct crypto_tfm *tfm)
 {
     struct crypto_gaes_ecb_ctx *ctx = crypto_tfm_ctx(tfm);
+
+    if (ctx->kctx)
+	kocl_ctx_unregister(ctx->kctx);
     crypto_free_cipher(ctx->child);
 }
 
 static struct crypto_instance *crypto_gaes_ecb_alloc(struct rtattr **tb)
 {
     struct crypto_instance *inst;
+    struct crypto_attr_type *algt;
     struct crypto_alg *alg;
+    int async;
     int err;
 
     err = crypto_check_attr_type(tb, CRYPTO_ALG_TYPE_BLKCIPHER);
     if (err)
 	return ERR_PTR(err);
+    algt = crypto_get_attr_type(tb);
+    if (IS_ERR(algt))
+	return ERR_CAST(algt);
+    /* crypto_alloc_blkcipher() users can't take an ablkcipher either */
+    async = !crypto_requires_sync(algt->type, algt->mask)
+	&& !((algt->type ^ CRYPTO_ALG_TYPE_ABLKCIPHER) & algt->mask
+	     & CRYPTO_ALG_TYPE_MASK);
 
     alg = crypto_get_attr_alg(tb, CRYPTO_ALG_TYPE_CIPHER,
 			      CRYPTO_ALG_TYPE_MASK);
@@ -402,20 +765,34 @@ static struct crypto_instance *crypto_gaes_ecb_alloc(struct rtattr **tb)
 	goto out_put_alg;
     }
 
-    inst->alg.cra_flags = CRYPTO_ALG_TYPE_BLKCIPHER;
     inst->alg.cra_priority = alg->cra_priority;
     inst->alg.cra_blocksize = alg->cra_blocksize;
     inst->alg.cra_alignmask = alg->cra_alignmask;
+    inst->alg.cra_ctxsize = sizeof(struct crypto_gaes_ecb_ctx);
+    inst->alg.cra_init = crypto_gaes_ecb_init_tfm;
+    inst->alg.cra_exit = crypto_gaes_ecb_exit_tfm;
+
+    /* both may be there at once, the async one is preferred */
+    if (async) {
+	snprintf(inst->alg.cra_driver_name, CRYPTO_MAX_ALG_NAME,
+		 "gaes_ecb-async(%s)", alg->cra_driver_name);
+	inst->alg.cra_flags = CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC;
+	inst->alg.cra_priority++;
+	inst->alg.cra_type = &crypto_ablkcipher_type;
+	inst->alg.cra_ablkcipher.min_keysize = alg->cra_cipher.cia_min_keysize;
+	inst->alg.cra_ablkcipher.max_keysize = alg->cra_cipher.cia_max_keysize;
+	inst->alg.cra_ablkcipher.setkey = crypto_gaes_ecb_async_setkey;
+	inst->alg.cra_ablkcipher.encrypt = crypto_gaes_ecb_async_encrypt;
+	inst->alg.cra_ablkcipher.decrypt = crypto_gaes_ecb_async_decrypt;
+	goto out_put_alg;
+    }
+
+    inst->alg.cra_flags = CRYPTO_ALG_TYPE_BLKCIPHER;
     inst->alg.cra_type = &crypto_blkcipher_type;
 
     inst->alg.cra_blkcipher.min_keysize = alg->cra_cipher.cia_min_keysize;
     inst->alg.cra_blkcipher.max_keysize = alg->cra_cipher.cia_max_keysize;
 
-    inst->alg.cra_ctxsize = sizeof(struct crypto_gaes_ecb_ctx);
-
-    inst->alg.cra_init = crypto_gaes_ecb_init_tfm;
-    inst->alg.cra_exit = crypto_gaes_ecb_exit_tfm;
-
     inst->alg.cra_blkcipher.setkey = crypto_gaes_ecb_setkey;
     inst->alg.cra_blkcipher.encrypt = crypto_gaes_ecb_encrypt;
     inst->alg.cra_blkcipher.decrypt = crypto_gaes_ecb_decrypt;
@@ -440,6 +817,9 @@ static struct crypto_template crypto_gaes_ecb_tmpl = {
 
 static int __init crypto_gaes_ecb_module_init(void)
 {
+    gaes_quota.limit = (unsigned long)quota<<20;
+    gaes_enc_sid = kocl_service_id("gaes_ecb-enc");
+    gaes_dec_sid = kocl_service_id("gaes_ecb-dec");
   
     return crypto_register_template(&crypto_gaes_ecb_tmpl);
 }
@@ -0,0 +1,352 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * GPU accelerated AES-XTS cipher
+ *
+ * XTS of IEEE P1619 as crypto/xts.c has it: the key is a data key and
+ * a tweak key of the same size, the iv (the sector number for dm-crypt's
+ * plain64) is encrypted with the latter into the tweak of the first
+ * block, which is multiplied by x in GF(2^128) for each next one. A
+ * request is one data unit, its length a multiple of the block size.
+ *
+ * The client encrypts the iv, the one CPU block of a request, and the
+ * gaes_xts services derive all other tweaks on the device, see gaes.cl.
+ */
+#include <crypto/algapi.h>
+#include <linux/err.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <crypto/aes.h>
+#include <linux/string.h>
+#include <linux/moduleparam.h>
+#include "../../kocl/kocl.h"
+#include "../gaesk.h"
+
+/* customized log function */
+#define g_log(level, ...) kocl_do_log(level, "gaes_xts", ##__VA_ARGS__)
+#define dbg(...) g_log(KOCL_LOG_DEBUG, ##__VA_ARGS__)
+
+struct crypto_gaes_xts_ctx {
+    struct crypto_cipher *child;      /* data key */
+    struct crypto_cipher *tweak;      /* tweak key */
+    struct crypto_aes_ctx aes_ctx;    /* data key, for the device */
+};
+
+/* KOCL_CHANNEL_AUTO (-1) lets kocl place each request */
+static int channel=1;
+module_param(channel, int , 0);
+
+/* in place requests on their own pages, not on copies in the pool */
+static int sg=1;
+module_param(sg, int , 0644);
+
+/* kocl_service_id() of the two services */
+static int gaes_xts_enc_sid, gaes_xts_dec_sid;
+
+static int
+crypto_gaes_xts_setkey(
+    struct crypto_tfm *parent, const u8 *key,
+    unsigned int keylen)
+{
+    struct crypto_gaes_xts_ctx *ctx = crypto_tfm_ctx(parent);
+    u32 *flags = &parent->crt_flags;
+    int err;
+
+    /* the data key, then the tweak key */
+    if (keylen % 2) {
+	*flags |= CRYPTO_TFM_RES_BAD_KEY_LEN;
+	return -EINVAL;
+    }
+    keylen /= 2;
+
+    crypto_cipher_clear_flags(ctx->tweak, CRYPTO_TFM_REQ_MASK);
+    crypto_cipher_set_flags(ctx->tweak, crypto_tfm_get_flags(parent) &
+			    CRYPTO_TFM_REQ_MASK);
+    err = crypto_cipher_setkey(ctx->tweak, key+keylen, keylen);
+    crypto_tfm_set_flags(parent, crypto_cipher_get_flags(ctx->tweak) &
+			 CRYPTO_TFM_RES_MASK);
+    if (err)
+	return err;
+
+    crypto_cipher_clear_flags(ctx->child, CRYPTO_TFM_REQ_MASK);
+    crypto_cipher_set_flags(ctx->child, crypto_tfm_get_flags(parent) &
+			    CRYPTO_TFM_REQ_MASK);
+    err = crypto_aes_expand_key(&ctx->aes_ctx, key, keylen);
+    if (!err)
+	err = crypto_cipher_setkey(ctx->child, key, keylen);
+
+    cvt_endian_u32(ctx->aes_ctx.key_enc, AES_MAX_KEYLENGTH_U32);
+    cvt_endian_u32(ctx->aes_ctx.key_dec, AES_MAX_KEYLENGTH_U32);
+
+    crypto_tfm_set_flags(parent, crypto_cipher_get_flags(ctx->child) &
+			 CRYPTO_TFM_RES_MASK);
+    return err;
+}
+
+/* t *= x: little-endian, the reduction is x^128 = x^7+x^2+x+1 */
+static void gaes_xts_mul_x(u8 *t)
+{
+    u8 c = t[AES_BLOCK_SIZE-1] >> 7;
+    int i;
+
+    for (i=AES_BLOCK_SIZE-1; i>0; i--)
+	t[i] = (t[i] << 1) | (t[i-1] >> 7);
+    t[0] = (t[0] << 1) ^ (c? 0x87: 0);
+}
+
+static int
+crypto_gaes_xts_gpu_crypt(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int sz, int enc)
+{
+    struct crypto_gaes_xts_ctx *ctx = crypto_blkcipher_ctx(desc->tfm);
+    struct crypto_gaes_iv_info *info;
+    struct kocl_request *req;
+    size_t rsz = roundup(sz, PAGE_SIZE);
+    int ch = channel == KOCL_CHANNEL_AUTO? kocl_pick_channel(sz): channel;
+    int mapped, err = 0;
+    char *buf;
+
+    if (ch < 0 || ch >= KOCL_NR_CHANNELS)
+	ch = 0;
+
+    req = kocl_alloc_request();
+    if (!req) {
+	g_log(KOCL_LOG_ERROR, "can't allocate request\n");
+	return -EFAULT;
+    }
+    req->channel = ch;
+
+    /* the helper works on the pages themselves if kocl can map them */
+    mapped = sg && src == dst && (desc->flags & CRYPTO_TFM_REQ_MAY_SLEEP)
+	&& !kocl_map_sg(req, src, 0, sz, KOCL_SG_INOUT);
+    if (mapped)
+	rsz = 0;
+
+    if (desc->flags & CRYPTO_TFM_REQ_MAY_SLEEP)
+	buf = kocl_malloc_wait(rsz+sizeof(*info), ch, NULL);
+    else
+	buf = kocl_malloc(rsz+sizeof(*info), ch);
+    if (!buf) {
+	g_log(KOCL_LOG_ERROR, "GPU buffer is null.\n");
+	kocl_free_request(req);
+	return -EFAULT;
+    }
+
+    req->in = buf;
+    req->out = buf;
+    req->insize = mapped? sz: rsz+sizeof(*info);
+    req->outsize = sz;
+    req->udatasize = sizeof(*info);
+    req->udata = buf+rsz;
+    if (!mapped)
+	sg_copy_to_buffer(src, sg_nents(src), buf, sz);
+
+    info = (struct crypto_gaes_iv_info*)req->udata;
+    memcpy(info->key_enc, ctx->aes_ctx.key_enc, sizeof(info->key_enc));
+    memcpy(info->key_dec, ctx->aes_ctx.key_dec, sizeof(info->key_dec));
+    info->key_length = ctx->aes_ctx.key_length;
+    crypto_cipher_encrypt_one(ctx->tweak, info->iv, desc->info);
+    strcpy(req->service_name, enc? "gaes_xts-enc": "gaes_xts-dec");
+    req->sid = enc? gaes_xts_enc_sid: gaes_xts_dec_sid;
+
+    if (kocl_offload_sync(req)) {
+	err = -EFAULT;
+	g_log(KOCL_LOG_ERROR, "callgpu error\n");
+    } else if (!mapped) {
+	sg_copy_from_buffer(dst, sg_nents(dst), req->out, sz);
+    }
+    kocl_free_quota(req->in, req->channel, NULL);
+    kocl_free_request(req);
+    return err;
+}
+
+static int
+crypto_gaes_xts_cpu_crypt(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int nbytes, int enc)
+{
+    struct crypto_gaes_xts_ctx *ctx = crypto_blkcipher_ctx(desc->tfm);
+    struct crypto_cipher *child = ctx->child;
+    u8 t[AES_BLOCK_SIZE];
+    struct blkcipher_walk walk;
+    int err;
+
+    crypto_cipher_encrypt_one(ctx->tweak, t, desc->info);
+
+    blkcipher_walk_init(&walk, dst, src, nbytes);
+    err = blkcipher_walk_virt(desc, &walk);
+
+    while ((nbytes = walk.nbytes)) {
+	u8 *wsrc = walk.src.virt.addr;
+	u8 *wdst = walk.dst.virt.addr;
+
+	do {
+	    if (wdst != wsrc)
+		memcpy(wdst, wsrc, AES_BLOCK_SIZE);
+	    crypto_xor(wdst, t, AES_BLOCK_SIZE);
+	    if (enc)
+		crypto_cipher_encrypt_one(child, wdst, wdst);
+	    else
+		crypto_cipher_decrypt_one(child, wdst, wdst);
+	    crypto_xor(wdst, t, AES_BLOCK_SIZE);
+	    gaes_xts_mul_x(t);
+
+	    wsrc += AES_BLOCK_SIZE;
+	    wdst += AES_BLOCK_SIZE;
+	} while ((nbytes -= AES_BLOCK_SIZE) >= AES_BLOCK_SIZE);
+
+	err = blkcipher_walk_done(desc, &walk, nbytes);
+    }
+
+    return err;
+}
+
+static int
+gaes_xts_route(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int nbytes, int enc)
+{
+    if (nbytes % AES_BLOCK_SIZE)
+	return -EINVAL;
+    if (nbytes <= GAES_XTS_SIZE_THRESHOLD)
+	return crypto_gaes_xts_cpu_crypt(desc, dst, src, nbytes, enc);
+    return crypto_gaes_xts_gpu_crypt(desc, dst, src, nbytes, enc);
+}
+
+static int
+crypto_gaes_xts_encrypt(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int nbytes)
+{
+    return gaes_xts_route(desc, dst, src, nbytes, 1);
+}
+
+static int
+crypto_gaes_xts_decrypt(
+    struct blkcipher_desc *desc,
+    struct scatterlist *dst, struct scatterlist *src,
+    unsigned int nbytes)
+{
+    return gaes_xts_route(desc, dst, src, nbytes, 0);
+}
+
+static int crypto_gaes_xts_init_tfm(struct crypto_tfm *tfm)
+{
+    struct crypto_instance *inst = (void *)tfm->__crt_alg;
+    struct crypto_spawn *spawn = crypto_instance_ctx(inst);
+    struct crypto_gaes_xts_ctx *ctx = crypto_tfm_ctx(tfm);
+    struct crypto_cipher *cipher;
+
+    cipher = crypto_spawn_cipher(spawn);
+    if (IS_ERR(cipher))
+	return PTR_ERR(cipher);
+    ctx->child = cipher;
+
+    cipher = crypto_spawn_cipher(spawn);
+    if (IS_ERR(cipher)) {
+	crypto_free_cipher(ctx->child);
+	return PTR_ERR(cipher);
+    }
+    ctx->tweak = cipher;
+    return 0;
+}
+
+static void crypto_gaes_xts_exit_tfm(struct crypto_tfm *tfm)
+{
+    struct crypto_gaes_xts_ctx *ctx = crypto_tfm_ctx(tfm);
+    crypto_free_cipher(ctx->child);
+    crypto_free_cipher(ctx->tweak);
+}
+
+static struct crypto_instance *crypto_gaes_xts_alloc(struct rtattr **tb)
+{
+    struct crypto_instance *inst;
+    struct crypto_alg *alg;
+    int err;
+
+    err = crypto_check_attr_type(tb, CRYPTO_ALG_TYPE_BLKCIPHER);
+    if (err)
+	return ERR_PTR(err);
+
+    alg = crypto_get_attr_alg(tb, CRYPTO_ALG_TYPE_CIPHER,
+			      CRYPTO_ALG_TYPE_MASK);
+    if (IS_ERR(alg))
+	return ERR_CAST(alg);
+
+    /* the kernels are AES's */
+    inst = ERR_PTR(-EINVAL);
+    if (alg->cra_blocksize != AES_BLOCK_SIZE)
+	goto out_put_alg;
+
+    inst = crypto_alloc_instance("gaes_xts", alg);
+    if (IS_ERR(inst)) {
+	g_log(KOCL_LOG_ERROR, "cannot alloc crypto instance\n");
+	goto out_put_alg;
+    }
+
+    inst->alg.cra_flags = CRYPTO_ALG_TYPE_BLKCIPHER;
+    inst->alg.cra_priority = alg->cra_priority;
+    inst->alg.cra_blocksize = AES_BLOCK_SIZE;
+    inst->alg.cra_alignmask = alg->cra_alignmask;
+    inst->alg.cra_type = &crypto_blkcipher_type;
+
+    inst->alg.cra_blkcipher.ivsize = AES_BLOCK_SIZE;
+    inst->alg.cra_blkcipher.min_keysize = 2*alg->cra_cipher.cia_min_keysize;
+    inst->alg.cra_blkcipher.max_keysize = 2*alg->cra_cipher.cia_max_keysize;
+
+    inst->alg.cra_ctxsize = sizeof(struct crypto_gaes_xts_ctx);
+
+    inst->alg.cra_init = crypto_gaes_xts_init_tfm;
+    inst->alg.cra_exit = crypto_gaes_xts_exit_tfm;
+
+    inst->alg.cra_blkcipher.setkey = crypto_gaes_xts_setkey;
+    inst->alg.cra_blkcipher.encrypt = crypto_gaes_xts_encrypt;
+    inst->alg.cra_blkcipher.decrypt = crypto_gaes_xts_decrypt;
+
+out_put_alg:
+    crypto_mod_put(alg);
+    return inst;
+}
+
+static void crypto_gaes_xts_free(struct crypto_instance *inst)
+{
+    crypto_drop_spawn(crypto_instance_ctx(inst));
+    kfree(inst);
+}
+
+static struct crypto_template crypto_gaes_xts_tmpl = {
+    .name = "gaes_xts",
+    .alloc = crypto_gaes_xts_alloc,
+    .free = crypto_gaes_xts_free,
+    .module = THIS_MODULE,
+};
+
+static int __init crypto_gaes_xts_module_init(void)
+{
+    gaes_xts_enc_sid = kocl_service_id("gaes_xts-enc");
+    gaes_xts_dec_sid = kocl_service_id("gaes_xts-dec");
+    return crypto_register_template(&crypto_gaes_xts_tmpl);
+}
+
+static void __exit crypto_gaes_xts_module_exit(void)
+{
+    g_log(KOCL_LOG_PRINT, "module unload\n");
+    crypto_unregister_template(&crypto_gaes_xts_tmpl);
+}
+
+module_init(crypto_gaes_xts_module_init);
+module_exit(crypto_gaes_xts_module_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("gaes_xts block cipher algorithm");
@@ -709,18 +709,15 @@ __constant  u32 rcon[] =
                          (ciphertext)[3] = (u8)(st); }
 
 
-__kernel void aes_encrypt_bpt(__global u32 *rk, int nrounds, __global u8* text)
+/* on a block of the private memory, as big-endian words */
+void aes_encrypt_state(__global u32 *rk, int nrounds, u32 *st)
 {
     u32 s0, s1, s2, s3, t0, t1, t2, t3;
-    int idx=get_global_id(0);
-
-   // u8 *txt = text+(16*(blockIdx.x*blockDim.x+threadIdx.x));
-   __global u8 *txt =(__global u8*)(text+(16*(idx)));
 
-    s0 = GETU32(txt     ) ^ rk[0];
-    s1 = GETU32(txt +  4) ^ rk[1];
-    s2 = GETU32(txt +  8) ^ rk[2];
-    s3 = GETU32(txt + 12) ^ rk[3];
+    s0 = st[0] ^ rk[0];
+    s1 = st[1] ^ rk[1];
+    s2 = st[2] ^ rk[2];
+    s3 = st[3] ^ rk[3];
 
     /* round 1: */
     t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xff] ^ Te2[(s2 >>  8) & 0xff] ^ Te3[s3 & 0xff] ^ rk[ 4];
@@ -801,46 +798,42 @@ __kernel void aes_encrypt_bpt(__global u32 *rk, int nrounds, __global u8* text)
 	(Te4[(t2 >>  8) & 0xff] & 0x0000ff00) ^
 	(Te4[(t3      ) & 0xff] & 0x000000ff) ^
 	rk[0];
-    PUTU32(txt     , s0);
+    st[0] = s0;
     s1 =
 	(Te4[(t1 >> 24)       ] & 0xff000000) ^
 	(Te4[(t2 >> 16) & 0xff] & 0x00ff0000) ^
 	(Te4[(t3 >>  8) & 0xff] & 0x0000ff00) ^
 	(Te4[(t0      ) & 0xff] & 0x000000ff) ^
 	rk[1];
-    PUTU32(txt +  4, s1);
+    st[1] = s1;
     s2 =
 	(Te4[(t2 >> 24)       ] & 0xff000000) ^
 	(Te4[(t3 >> 16) & 0xff] & 0x00ff0000) ^
 	(Te4[(t0 >>  8) & 0xff] & 0x0000ff00) ^
 	(Te4[(t1      ) & 0xff] & 0x000000ff) ^
 	rk[2];
-    PUTU32(txt +  8, s2);
+    st[2] = s2;
     s3 =
 	(Te4[(t3 >> 24)       ] & 0xff000000) ^
 	(Te4[(t0 >> 16) & 0xff] & 0x00ff0000) ^
 	(Te4[(t1 >>  8) & 0xff] & 0x0000ff00) ^
 	(Te4[(t2      ) & 0xff] & 0x000000ff) ^
 	rk[3];
-    PUTU32(txt + 12, s3);
+    st[3] = s3;
 }
 
-__kernel void aes_decrypt_bpt(__global u32 *rk, int nrounds,__global u8* text)
+void aes_decrypt_state(__global u32 *rk, int nrounds, u32 *st)
 {
     u32 s0, s1, s2, s3, t0, t1, t2, t3;
-    int idx=get_global_id(0);
-
-    //u8 *txt = text+(16*(blockIdx.x*blockDim.x+threadIdx.x));
-    __global u8 *txt =(__global u8*)(text+(16*(idx)));
 
     /*
      * map byte array block to cipher state
      * and add initial round key:
      */
-    s0 = GETU32(txt     ) ^ rk[0];
-    s1 = GETU32(txt +  4) ^ rk[1];
-    s2 = GETU32(txt +  8) ^ rk[2];
-    s3 = GETU32(txt + 12) ^ rk[3];
+    s0 = st[0] ^ rk[0];
+    s1 = st[1] ^ rk[1];
+    s2 = st[2] ^ rk[2];
+    s3 = st[3] ^ rk[3];
   
     /* round 1: */
     t0 = Td0[s0 >> 24] ^ Td1[(s3 >> 16) & 0xff] ^ Td2[(s2 >>  8) & 0xff] ^ Td3[s1 & 0xff] ^ rk[ 4];
@@ -921,28 +914,400 @@ __kernel void aes_decrypt_bpt(__global u32 *rk, int nrounds,__global u8* text)
 	(Td4[(t2 >>  8) & 0xff] & 0x0000ff00) ^
 	(Td4[(t1      ) & 0xff] & 0x000000ff) ^
 	rk[0];
-    PUTU32(txt     , s0);
+    st[0] = s0;
     s1 =
 	(Td4[(t1 >> 24)       ] & 0xff000000) ^
 	(Td4[(t0 >> 16) & 0xff] & 0x00ff0000) ^
 	(Td4[(t3 >>  8) & 0xff] & 0x0000ff00) ^
 	(Td4[(t2      ) & 0xff] & 0x000000ff) ^
 	rk[1];
-    PUTU32(txt +  4, s1);
+    st[1] = s1;
     s2 =
 	(Td4[(t2 >> 24)       ] & 0xff000000) ^
 	(Td4[(t1 >> 16) & 0xff] & 0x00ff0000) ^
 	(Td4[(t0 >>  8) & 0xff] & 0x0000ff00) ^
 	(Td4[(t3      ) & 0xff] & 0x000000ff) ^
 	rk[2];
-    PUTU32(txt +  8, s2);
+    st[2] = s2;
     s3 =
 	(Td4[(t3 >> 24)       ] & 0xff000000) ^
 	(Td4[(t2 >> 16) & 0xff] & 0x00ff0000) ^
 	(Td4[(t1 >>  8) & 0xff] & 0x0000ff00) ^
 	(Td4[(t0      ) & 0xff] & 0x000000ff) ^
 	rk[3];
-    PUTU32(txt + 12, s3);
+    st[3] = s3;
+}
+
+void aes_encrypt_block(__global u32 *rk, int nrounds, __global u8 *txt)
+{
+    u32 st[4];
+
+    st[0] = GETU32(txt     );
+    st[1] = GETU32(txt +  4);
+    st[2] = GETU32(txt +  8);
+    st[3] = GETU32(txt + 12);
+    aes_encrypt_state(rk, nrounds, st);
+    PUTU32(txt     , st[0]);
+    PUTU32(txt +  4, st[1]);
+    PUTU32(txt +  8, st[2]);
+    PUTU32(txt + 12, st[3]);
+}
+
+void aes_decrypt_block(__global u32 *rk, int nrounds, __global u8 *txt)
+{
+    u32 st[4];
+
+    st[0] = GETU32(txt     );
+    st[1] = GETU32(txt +  4);
+    st[2] = GETU32(txt +  8);
+    st[3] = GETU32(txt + 12);
+    aes_decrypt_state(rk, nrounds, st);
+    PUTU32(txt     , st[0]);
+    PUTU32(txt +  4, st[1]);
+    PUTU32(txt +  8, st[2]);
+    PUTU32(txt + 12, st[3]);
+}
+
+/*
+ * The ECB kernels take the number of blocks n, they are variants of
+ * each other, see kocl_variant_pick(), and may be launched rounded up.
+ */
+__kernel void aes_encrypt_bpt(__global u32 *rk, int nrounds, __global u8* text, uint n)
+{
+    int idx=get_global_id(0);
+
+    if (idx >= n)
+	return;
+
+   // u8 *txt = text+(16*(blockIdx.x*blockDim.x+threadIdx.x));
+    aes_encrypt_block(rk, nrounds, text+(16*(idx)));
+}
+
+__kernel void aes_decrypt_bpt(__global u32 *rk, int nrounds,__global u8* text, uint n)
+{
+    int idx=get_global_id(0);
+
+    if (idx >= n)
+	return;
+
+    aes_decrypt_block(rk, nrounds, text+(16*(idx)));
+}
+
+/*
+ * AES_PER_ITEM blocks per work-item, loaded as uint4s. The _lt4 ones
+ * use a copy of the tables in local memory the work-group makes first,
+ * for devices whose constant memory is slow on the scattered lookups.
+ */
+#define AES_PER_ITEM 4
+
+#ifdef __ENDIAN_LITTLE__
+#define BE32(w) as_uint(as_uchar4(w).s3210)
+#else
+#define BE32(w) (w)
+#endif
+
+#define AES_LOAD4(st, v) { (st)[0] = BE32((v).x); (st)[1] = BE32((v).y); \
+			   (st)[2] = BE32((v).z); (st)[3] = BE32((v).w); }
+#define AES_STORE4(st) ((uint4)(BE32((st)[0]), BE32((st)[1]), \
+				BE32((st)[2]), BE32((st)[3])))
+
+__kernel void aes_encrypt_bpt4(__global u32 *rk, int nrounds, __global u8 *text, uint n)
+{
+    __global uint4 *blk = (__global uint4*)text;
+    size_t idx = AES_PER_ITEM*get_global_id(0);
+    u32 st[4];
+    int i;
+
+    for (i = 0; i < AES_PER_ITEM && idx+i < n; i++) {
+	AES_LOAD4(st, blk[idx+i]);
+	aes_encrypt_state(rk, nrounds, st);
+	blk[idx+i] = AES_STORE4(st);
+    }
+}
+
+__kernel void aes_decrypt_bpt4(__global u32 *rk, int nrounds, __global u8 *text, uint n)
+{
+    __global uint4 *blk = (__global uint4*)text;
+    size_t idx = AES_PER_ITEM*get_global_id(0);
+    u32 st[4];
+    int i;
+
+    for (i = 0; i < AES_PER_ITEM && idx+i < n; i++) {
+	AES_LOAD4(st, blk[idx+i]);
+	aes_decrypt_state(rk, nrounds, st);
+	blk[idx+i] = AES_STORE4(st);
+    }
+}
+
+/* T0..T4 at 256 words each: Te0..Te4 or Td0..Td4 */
+void aes_local_tables(__local u32 *T, int dec)
+{
+    int i;
+
+    for (i = get_local_id(0); i < 256; i += get_local_size(0)) {
+	T[i      ] = dec? Td0[i]: Te0[i];
+	T[i+ 256] = dec? Td1[i]: Te1[i];
+	T[i+ 512] = dec? Td2[i]: Te2[i];
+	T[i+ 768] = dec? Td3[i]: Te3[i];
+	T[i+1024] = dec? Td4[i]: Te4[i];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+void aes_encrypt_state_lt(__global u32 *rk, int nrounds, u32 *st, __local const u32 *T)
+{
+    u32 s0, s1, s2, s3, t0, t1, t2, t3;
+    int r;
+
+    s0 = st[0] ^ rk[0];
+    s1 = st[1] ^ rk[1];
+    s2 = st[2] ^ rk[2];
+    s3 = st[3] ^ rk[3];
+    for (r = 1; r < nrounds; r++) {
+	rk += 4;
+	t0 = T[s0 >> 24] ^ T[256+((s1 >> 16) & 0xff)] ^ T[512+((s2 >> 8) & 0xff)] ^ T[768+(s3 & 0xff)] ^ rk[0];
+	t1 = T[s1 >> 24] ^ T[256+((s2 >> 16) & 0xff)] ^ T[512+((s3 >> 8) & 0xff)] ^ T[768+(s0 & 0xff)] ^ rk[1];
+	t2 = T[s2 >> 24] ^ T[256+((s3 >> 16) & 0xff)] ^ T[512+((s0 >> 8) & 0xff)] ^ T[768+(s1 & 0xff)] ^ rk[2];
+	t3 = T[s3 >> 24] ^ T[256+((s0 >> 16) & 0xff)] ^ T[512+((s1 >> 8) & 0xff)] ^ T[768+(s2 & 0xff)] ^ rk[3];
+	s0 = t0;
+	s1 = t1;
+	s2 = t2;
+	s3 = t3;
+    }
+    rk += 4;
+    T += 1024;
+    st[0] = (T[s0 >> 24] & 0xff000000) ^ (T[(s1 >> 16) & 0xff] & 0x00ff0000) ^
+	(T[(s2 >> 8) & 0xff] & 0x0000ff00) ^ (T[s3 & 0xff] & 0x000000ff) ^ rk[0];
+    st[1] = (T[s1 >> 24] & 0xff000000) ^ (T[(s2 >> 16) & 0xff] & 0x00ff0000) ^
+	(T[(s3 >> 8) & 0xff] & 0x0000ff00) ^ (T[s0 & 0xff] & 0x000000ff) ^ rk[1];
+    st[2] = (T[s2 >> 24] & 0xff000000) ^ (T[(s3 >> 16) & 0xff] & 0x00ff0000) ^
+	(T[(s0 >> 8) & 0xff] & 0x0000ff00) ^ (T[s1 & 0xff] & 0x000000ff) ^ rk[2];
+    st[3] = (T[s3 >> 24] & 0xff000000) ^ (T[(s0 >> 16) & 0xff] & 0x00ff0000) ^
+	(T[(s1 >> 8) & 0xff] & 0x0000ff00) ^ (T[s2 & 0xff] & 0x000000ff) ^ rk[3];
+}
+
+void aes_decrypt_state_lt(__global u32 *rk, int nrounds, u32 *st, __local const u32 *T)
+{
+    u32 s0, s1, s2, s3, t0, t1, t2, t3;
+    int r;
+
+    s0 = st[0] ^ rk[0];
+    s1 = st[1] ^ rk[1];
+    s2 = st[2] ^ rk[2];
+    s3 = st[3] ^ rk[3];
+    for (r = 1; r < nrounds; r++) {
+	rk += 4;
+	t0 = T[s0 >> 24] ^ T[256+((s3 >> 16) & 0xff)] ^ T[512+((s2 >> 8) & 0xff)] ^ T[768+(s1 & 0xff)] ^ rk[0];
+	t1 = T[s1 >> 24] ^ T[256+((s0 >> 16) & 0xff)] ^ T[512+((s3 >> 8) & 0xff)] ^ T[768+(s2 & 0xff)] ^ rk[1];
+	t2 = T[s2 >> 24] ^ T[256+((s1 >> 16) & 0xff)] ^ T[512+((s0 >> 8) & 0xff)] ^ T[768+(s3 & 0xff)] ^ rk[2];
+	t3 = T[s3 >> 24] ^ T[256+((s2 >> 16) & 0xff)] ^ T[512+((s1 >> 8) & 0xff)] ^ T[768+(s0 & 0xff)] ^ rk[3];
+	s0 = t0;
+	s1 = t1;
+	s2 = t2;
+	s3 = t3;
+    }
+    rk += 4;
+    T += 1024;
+    st[0] = (T[s0 >> 24] & 0xff000000) ^ (T[(s3 >> 16) & 0xff] & 0x00ff0000) ^
+	(T[(s2 >> 8) & 0xff] & 0x0000ff00) ^ (T[s1 & 0xff] & 0x000000ff) ^ rk[0];
+    st[1] = (T[s1 >> 24] & 0xff000000) ^ (T[(s0 >> 16) & 0xff] & 0x00ff0000) ^
+	(T[(s3 >> 8) & 0xff] & 0x0000ff00) ^ (T[s2 & 0xff] & 0x000000ff) ^ rk[1];
+    st[2] = (T[s2 >> 24] & 0xff000000) ^ (T[(s1 >> 16) & 0xff] & 0x00ff0000) ^
+	(T[(s0 >> 8) & 0xff] & 0x0000ff00) ^ (T[s3 & 0xff] & 0x000000ff) ^ rk[2];
+    st[3] = (T[s3 >> 24] & 0xff000000) ^ (T[(s2 >> 16) & 0xff] & 0x00ff0000) ^
+	(T[(s1 >> 8) & 0xff] & 0x0000ff00) ^ (T[s0 & 0xff] & 0x000000ff) ^ rk[3];
+}
+
+__kernel void aes_encrypt_lt4(__global u32 *rk, int nrounds, __global u8 *text, uint n)
+{
+    __local u32 T[5*256];
+    __global uint4 *blk = (__global uint4*)text;
+    size_t idx = AES_PER_ITEM*get_global_id(0);
+    u32 st[4];
+    int i;
+
+    aes_local_tables(T, 0);
+    for (i = 0; i < AES_PER_ITEM && idx+i < n; i++) {
+	AES_LOAD4(st, blk[idx+i]);
+	aes_encrypt_state_lt(rk, nrounds, st, T);
+	blk[idx+i] = AES_STORE4(st);
+    }
+}
+
+__kernel void aes_decrypt_lt4(__global u32 *rk, int nrounds, __global u8 *text, uint n)
+{
+    __local u32 T[5*256];
+    __global uint4 *blk = (__global uint4*)text;
+    size_t idx = AES_PER_ITEM*get_global_id(0);
+    u32 st[4];
+    int i;
+
+    aes_local_tables(T, 1);
+    for (i = 0; i < AES_PER_ITEM && idx+i < n; i++) {
+	AES_LOAD4(st, blk[idx+i]);
+	aes_decrypt_state_lt(rk, nrounds, st, T);
+	blk[idx+i] = AES_STORE4(st);
+    }
+}
+
+/*
+ * Merged requests, see kocl_service_request.nbatch. tbl has a
+ * {first work-item, input offset, output offset} in base per request,
+ * the text is in the output.
+ */
+int batch_member(__global const u32 *tbl, int n, u32 idx)
+{
+    int i = n-1;
+
+    while (i > 0 && tbl[3*i] > idx)
+	i--;
+    return i;
+}
+
+__kernel void aes_encrypt_bpt_tbl(__global u32 *rk, int nrounds, __global u8 *base,
+				  __global const u32 *tbl, int n)
+{
+    u32 idx=get_global_id(0);
+    int i = batch_member(tbl, n, idx);
+
+    aes_encrypt_block(rk, nrounds, base+tbl[3*i+2]+16*(idx-tbl[3*i]));
+}
+
+__kernel void aes_decrypt_bpt_tbl(__global u32 *rk, int nrounds, __global u8 *base,
+				  __global const u32 *tbl, int n)
+{
+    u32 idx=get_global_id(0);
+    int i = batch_member(tbl, n, idx);
+
+    aes_decrypt_block(rk, nrounds, base+tbl[3*i+2]+16*(idx-tbl[3*i]));
+}
+
+/*
+ * CTR: the counter block of block idx is ctr+idx, a 128-bit
+ * big-endian number, as crypto/ctr.c counts. ctr is in words.
+ */
+__kernel void aes_ctr_bpt(__global u32 *rk, int nrounds, __global u8 *text, uint4 ctr)
+{
+    ulong idx = get_global_id(0);
+    __global u8 *txt = text+16*idx;
+    u32 st[4];
+    ulong s;
+
+    s = (ulong)ctr.w + (idx & 0xffffffff);
+    st[3] = (u32)s;
+    s = (ulong)ctr.z + (idx >> 32) + (s >> 32);
+    st[2] = (u32)s;
+    s = (ulong)ctr.y + (s >> 32);
+    st[1] = (u32)s;
+    st[0] = ctr.x + (u32)(s >> 32);
+
+    aes_encrypt_state(rk, nrounds, st);
+    st[0] ^= GETU32(txt     );
+    st[1] ^= GETU32(txt +  4);
+    st[2] ^= GETU32(txt +  8);
+    st[3] ^= GETU32(txt + 12);
+    PUTU32(txt     , st[0]);
+    PUTU32(txt +  4, st[1]);
+    PUTU32(txt +  8, st[2]);
+    PUTU32(txt + 12, st[3]);
+}
+
+/*
+ * XTS. Tweaks are elements of GF(2^128) as IEEE P1619 has them, x is
+ * the little-endian bytes 0..7, y 8..15. The tweak of block i is
+ * t0*x^i: aes_xts_tweaks() works out the one of every XTS_STRIPE-th
+ * block from the powers pw[b] = x^(XTS_STRIPE*2^b), and each block
+ * doubles its stripe's up to XTS_STRIPE-1 times.
+ */
+#define XTS_STRIPE 64
+
+ulong2 xts_mul_x(ulong2 t)
+{
+    ulong c = t.y >> 63;
+
+    t.y = (t.y << 1) | (t.x >> 63);
+    t.x = (t.x << 1) ^ (c * 0x87);
+    return t;
+}
+
+ulong2 xts_mul(ulong2 a, ulong2 b)
+{
+    ulong2 r = (ulong2)(0, 0);
+    int k;
+
+    for (k = 127; k >= 0; k--) {
+	r = xts_mul_x(r);
+	if (((k < 64? b.x >> k: b.y >> (k-64)) & 1))
+	    r ^= a;
+    }
+    return r;
+}
+
+__kernel void aes_xts_tweaks(ulong2 t0, __global const ulong2 *pw, __global ulong2 *tw)
+{
+    ulong q = get_global_id(0);
+    ulong2 t = t0;
+    int b;
+
+    for (b = 0; b < 32 && (q >> b); b++)
+	if ((q >> b) & 1)
+	    t = xts_mul(t, pw[b]);
+    tw[q] = t;
+}
+
+/* the tweak of block idx, as the words the AES state is in */
+void xts_tweak(__global const ulong2 *tw, ulong idx, u32 *w)
+{
+    ulong2 t = tw[idx / XTS_STRIPE];
+    u8 b[16];
+    int i;
+
+    for (i = idx % XTS_STRIPE; i > 0; i--)
+	t = xts_mul_x(t);
+    for (i = 0; i < 8; i++) {
+	b[i] = (u8)(t.x >> (8*i));
+	b[i+8] = (u8)(t.y >> (8*i));
+    }
+    for (i = 0; i < 4; i++)
+	w[i] = GETU32(b + 4*i);
+}
+
+__kernel void aes_xts_encrypt_bpt(__global u32 *rk, int nrounds, __global u8 *text,
+				  __global const ulong2 *tw)
+{
+    ulong idx = get_global_id(0);
+    __global u8 *txt = text+16*idx;
+    u32 st[4], w[4];
+
+    xts_tweak(tw, idx, w);
+    st[0] = GETU32(txt     ) ^ w[0];
+    st[1] = GETU32(txt +  4) ^ w[1];
+    st[2] = GETU32(txt +  8) ^ w[2];
+    st[3] = GETU32(txt + 12) ^ w[3];
+    aes_encrypt_state(rk, nrounds, st);
+    PUTU32(txt     , st[0] ^ w[0]);
+    PUTU32(txt +  4, st[1] ^ w[1]);
+    PUTU32(txt +  8, st[2] ^ w[2]);
+    PUTU32(txt + 12, st[3] ^ w[3]);
+}
+
+__kernel void aes_xts_decrypt_bpt(__global u32 *rk, int nrounds, __global u8 *text,
+				  __global const ulong2 *tw)
+{
+    ulong idx = get_global_id(0);
+    __global u8 *txt = text+16*idx;
+    u32 st[4], w[4];
+
+    xts_tweak(tw, idx, w);
+    st[0] = GETU32(txt     ) ^ w[0];
+    st[1] = GETU32(txt +  4) ^ w[1];
+    st[2] = GETU32(txt +  8) ^ w[2];
+    st[3] = GETU32(txt + 12) ^ w[3];
+    aes_decrypt_state(rk, nrounds, st);
+    PUTU32(txt     , st[0] ^ w[0]);
+    PUTU32(txt +  4, st[1] ^ w[1]);
+    PUTU32(txt +  8, st[2] ^ w[2]);
+    PUTU32(txt + 12, st[3] ^ w[3]);
 }
 
 /*
@@ -0,0 +1,88 @@
+/* This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ */
+
+#ifndef __GAES_KEYS_H__
+#define __GAES_KEYS_H__
+
+/*
+ * Device-resident key schedules. The users of a service encrypt a lot
+ * of blocks with a few keys, so expanded keys are kept in device
+ * buffers, looked up by their contents, an LRU of GAES_KEY_CACHE_NR
+ * per channel and direction. A channel is served by one helper thread,
+ * so the caches need no locking.
+ *
+ * gaes_get_key() returns a buffer the caller owns a reference of, the
+ * service releases it in post as it did with per-request buffers. An
+ * evicted buffer lives until the requests using it drop theirs.
+ *
+ * Requests of a client context (sr->ctx) are compared too: a handle's
+ * slot and generation come round again, a schedule cached for it may
+ * be another context's.
+ */
+#define GAES_KEY_CACHE_NR 16
+#define GAES_KEY_SIZE (sizeof(u32)*AES_MAX_KEYLENGTH_U32)
+
+struct gaes_key {
+    cl_mem buf;
+    cl_context ctx;
+    u32 key_length;
+    u32 key[AES_MAX_KEYLENGTH_U32];
+    unsigned long stamp;       /* last use */
+};
+
+struct gaes_key_cache {
+    unsigned long clock;
+    struct gaes_key keys[GAES_KEY_CACHE_NR];
+};
+
+/* [channel][0: encrypt, 1: decrypt] */
+static struct gaes_key_cache gaes_keys[KOCL_NR_CHANNELS][2];
+
+static cl_mem gaes_get_key(struct kocl_service_request *sr, int dec,
+			   const u32 *key, u32 key_length, cl_int *ret)
+{
+    struct gaes_key_cache *kc;
+    struct gaes_key *k, *victim;
+    cl_mem buf;
+    int i;
+
+    if (sr->channel < 0 || sr->channel >= KOCL_NR_CHANNELS)
+	return clCreateBuffer(sr->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			      GAES_KEY_SIZE, (void*)key, ret);
+
+    kc = &gaes_keys[sr->channel][dec];
+    victim = &kc->keys[0];
+    for (i=0; i<GAES_KEY_CACHE_NR; i++) {
+	k = &kc->keys[i];
+	if (k->buf && k->ctx == sr->context && k->key_length == key_length
+	    && !memcmp(k->key, key, GAES_KEY_SIZE)) {
+	    k->stamp = ++kc->clock;
+	    *ret = clRetainMemObject(k->buf);
+	    return k->buf;
+	}
+	if (victim->buf && (!k->buf || k->stamp < victim->stamp))
+	    victim = k;
+    }
+
+    buf = clCreateBuffer(sr->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			 GAES_KEY_SIZE, (void*)key, ret);
+    if (*ret != CL_SUCCESS)
+	return NULL;
+
+    if (victim->buf)
+	clReleaseMemObject(victim->buf);
+    victim->buf = buf;
+    victim->ctx = sr->context;
+    victim->key_length = key_length;
+    memcpy(victim->key, key, GAES_KEY_SIZE);
+    victim->stamp = ++kc->clock;
+
+    /* one reference for the cache, one for the request */
+    *ret = clRetainMemObject(buf);
+    return buf;
+}
+
+#endif
@@ -12,8 +12,13 @@
 #include <CL/cl.h>
 #include "../../kocl/kocl.h"
 #include "../../kocl/gputils.h"
+#include "../../kocl/progcache.h"
+#include "../../kocl/wgtune.h"
 #include "../gaesu.h"
 #include <string.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#include "gaes_keys.h"
 
 #define BYTES_PER_BLOCK  1024
 #define BYTES_PER_THREAD 4
@@ -26,6 +31,9 @@
 
 struct kocl_service gaes_ecb_enc_srv;
 struct kocl_service gaes_ecb_dec_srv;
+struct kocl_service gaes_ctr_srv;
+struct kocl_service gaes_xts_enc_srv;
+struct kocl_service gaes_xts_dec_srv;
 
 struct gaes_ecb_data {
     u32 *d_key;
@@ -34,9 +42,28 @@ struct gaes_ecb_data {
     int nr_dblks_per_tblk;
 };
 
-cl_program program, program2;
-cl_kernel decrypt_kernel, encrypt_kernel ;
-cl_kernel decrypt_kernel2, encrypt_kernel2 ;
+/* one per platform, see struct plat_set */
+cl_program programs[KOCL_MAX_PLATFORMS];
+/* a kernel object per queue, see kocl_get_kernel() */
+/* [variant], see gaes_enc_variants */
+static struct kocl_kernel_pool decrypt_kernels[] = {
+    KOCL_KERNEL_POOL("aes_decrypt_bpt"),
+    KOCL_KERNEL_POOL("aes_decrypt_bpt4"),
+    KOCL_KERNEL_POOL("aes_decrypt_lt4"),
+};
+static struct kocl_kernel_pool encrypt_kernels[] = {
+    KOCL_KERNEL_POOL("aes_encrypt_bpt"),
+    KOCL_KERNEL_POOL("aes_encrypt_bpt4"),
+    KOCL_KERNEL_POOL("aes_encrypt_lt4"),
+};
+/* for merged requests */
+static struct kocl_kernel_pool decrypt_tbl_kernels = KOCL_KERNEL_POOL("aes_decrypt_bpt_tbl");
+static struct kocl_kernel_pool encrypt_tbl_kernels = KOCL_KERNEL_POOL("aes_encrypt_bpt_tbl");
+/* CTR and XTS, see gaes_iv_prepare() */
+static struct kocl_kernel_pool ctr_kernels = KOCL_KERNEL_POOL("aes_ctr_bpt");
+static struct kocl_kernel_pool xts_enc_kernels = KOCL_KERNEL_POOL("aes_xts_encrypt_bpt");
+static struct kocl_kernel_pool xts_dec_kernels = KOCL_KERNEL_POOL("aes_xts_decrypt_bpt");
+static struct kocl_kernel_pool xts_tweak_kernels = KOCL_KERNEL_POOL("aes_xts_tweaks");
 cl_mem  key_dec_buf, key_enc_buf,OutputBuf;
 char *cl_filename = "gaes.cl";
 char *source_str;
@@ -58,32 +85,157 @@ static int LoadKernel(char *cl_filename, char **source_str, size_t *source_size)
     return 0;
 }
 
-int service_CLsetup(struct plat_set *plat){
+/*
+ * XTS tweaks in GF(2^128), little-endian as in gaes.cl: [0] holds the
+ * bytes 0..7. xts_pow[] has x^(XTS_STRIPE*2^b) for b = 0..31 per
+ * platform, aes_xts_tweaks() takes a stripe's tweak from them.
+ */
+#define XTS_STRIPE 64
+#define XTS_NR_POWS 32
+
+static cl_mem xts_pow[KOCL_MAX_PLATFORMS];
+
+static void xts_mul_x(cl_ulong *t)
+{
+    cl_ulong c = t[1] >> 63;
+
+    t[1] = (t[1] << 1) | (t[0] >> 63);
+    t[0] = (t[0] << 1) ^ (c * 0x87);
+}
+
+static void xts_mul(cl_ulong *r, const cl_ulong *a, const cl_ulong *b)
+{
+    cl_ulong t[2] = {0, 0};
+    int k;
+
+    for (k=127; k>=0; k--) {
+        xts_mul_x(t);
+        if ((b[k/64] >> (k%64)) & 1) {
+            t[0] ^= a[0];
+            t[1] ^= a[1];
+        }
+    }
+    r[0] = t[0];
+    r[1] = t[1];
+}
+
+static void xts_powers(cl_ulong *pw)
+{
+    int i;
+
+    pw[0] = 1;
+    pw[1] = 0;
+    for (i=0; i<XTS_STRIPE; i++)
+        xts_mul_x(pw);
+    for (i=1; i<XTS_NR_POWS; i++)
+        xts_mul(pw+2*i, pw+2*(i-1), pw+2*(i-1));
+}
+
+/* the program and XTS powers of platform i, built on its first request */
+int service_CLsetup_plat(struct plat_set *plat, int i){
 
+    cl_ulong pw[2*XTS_NR_POWS];
     cl_int ret;
-    LoadKernel( cl_filename, &source_str, &source_size);    
-   //Build OpenCL kernel for platform1 devices   
-    program = clCreateProgramWithSource(plat->platform1.context , 1 ,(const char**)&source_str,(const size_t *)&source_size , &ret);
-    cl_err(ret);
-    ret = clBuildProgram(program, plat->platform1.numDevices, plat->platform1.devices, NULL,  NULL,  NULL);
-    cl_err(ret);   
-    decrypt_kernel = clCreateKernel(program, "aes_decrypt_bpt", &ret);
-    cl_err(ret);   
-    encrypt_kernel = clCreateKernel(program, "aes_encrypt_bpt", &ret);
-    cl_err(ret);
-    //printf("gaes service_CLsetup 1 ok \n"); 
+    if (!source_str)
+        LoadKernel( cl_filename, &source_str, &source_size);    
+    programs[i] = kocl_build_program(plat->platforms[i].context,
+                                     plat->platforms[i].numDevices,
+                                     plat->platforms[i].devices,
+                                     source_str, source_size, &ret);
+    /* the helper fails the platform's requests, see kh_service_ready() */
+    if (cl_warn(ret) != CL_SUCCESS)
+        goto err;
 
-    //Build OpenCL kernel for platform2 devices 
-    program2 = clCreateProgramWithSource(plat->platform2.context , 1 ,(const char**)&source_str,(const size_t *)&source_size , &ret);
-    cl_err(ret);
-    ret = clBuildProgram(program2, plat->platform2.numDevices, plat->platform2.devices, NULL,  NULL,  NULL);
-    decrypt_kernel2 = clCreateKernel(program2, "aes_decrypt_bpt", &ret);
-    cl_err(ret);   
-    encrypt_kernel2 = clCreateKernel(program2, "aes_encrypt_bpt", &ret);
-    cl_err(ret);
-   // printf("gaes service_CLsetup 2 ok \n"); 
+    xts_powers(pw);
+    xts_pow[i] = clCreateBuffer(plat->platforms[i].context,
+                                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                sizeof(pw), pw, &ret);
+    if (cl_warn(ret) != CL_SUCCESS) {
+        xts_pow[i] = NULL;
+        goto err;
+    }
+    return 0;
+
+err:
+    if (programs[i]) {
+        clReleaseProgram(programs[i]);
+        programs[i] = NULL;
+    }
+    return 1;
+}
+
+int service_CLsetup(struct plat_set *plat){
+
+    int i, err = 0;
+    //Build OpenCL kernel for the devices of every platform
+    for (i=0; i<plat->nplatforms; i++)
+        err |= service_CLsetup_plat(plat, i);
 
-   return 0;
+   return err;
+}
+
+/* one shape for both directions, see wgtune.h */
+static int gaes_tune_args(cl_kernel k, cl_mem scratch, size_t size)
+{
+    cl_int nrounds = 10;
+    cl_uint n = size/16;
+
+    return clSetKernelArg(k,0,sizeof(cl_mem), &scratch)
+        || clSetKernelArg(k,1,sizeof(cl_int), &nrounds)
+        || clSetKernelArg(k,2,sizeof(cl_mem), &scratch)
+        || clSetKernelArg(k,3,sizeof(cl_uint), &n);
+}
+
+static struct kocl_wg_tuner gaes_tuner =
+    KOCL_WG_TUNER("aes_encrypt_bpt", 65536, 16, gaes_tune_args);
+
+/*
+ * The ECB kernels in the shapes of gaes.cl, the same order as the
+ * kernel pools; each channel runs the one its device is fastest at.
+ */
+static struct kocl_variant_tuner gaes_enc_variants = {
+    .name = "aes_encrypt", .work = 65536, .item_size = 16, .setargs = gaes_tune_args,
+    .v = { KOCL_VARIANT("aes_encrypt_bpt", 1), KOCL_VARIANT("aes_encrypt_bpt4", 4),
+           KOCL_VARIANT("aes_encrypt_lt4", 4) },
+};
+static struct kocl_variant_tuner gaes_dec_variants = {
+    .name = "aes_decrypt", .work = 65536, .item_size = 16, .setargs = gaes_tune_args,
+    .v = { KOCL_VARIANT("aes_decrypt_bpt", 1), KOCL_VARIANT("aes_decrypt_bpt4", 4),
+           KOCL_VARIANT("aes_decrypt_lt4", 4) },
+};
+
+static struct kocl_variant_tuner *gaes_variants(struct kocl_service_request *sr)
+{
+    if (sr->nbatch)
+        return NULL;
+    if (sr->s == &gaes_ecb_enc_srv)
+        return &gaes_enc_variants;
+    if (sr->s == &gaes_ecb_dec_srv)
+        return &gaes_dec_variants;
+    return NULL;
+}
+
+/* blocks a work-item does: 1 but for the ECB variants */
+static size_t gaes_per_item(struct kocl_service_request *sr)
+{
+    struct kocl_variant_tuner *t = gaes_variants(sr);
+
+    return t? kocl_variant_pick(t, programs[sr->platform], sr)->per_item: 1;
+}
+
+/* blocks first..first+n-1 */
+static int gaes_enqueue(struct kocl_service_request *sr,
+                        unsigned long first, unsigned long n)
+{
+    size_t per = gaes_per_item(sr);
+    size_t offset[2] = {first/per, 0};
+    size_t globalWorkSize[2] = {(n+per-1)/per, 1};
+    size_t workGroupSize[2] = {sr->local_x, 1};
+
+    cl_err(kocl_enqueue_kernel(sr, sr->kernel, 2, offset, globalWorkSize,
+                                  (sr->local_x && !(globalWorkSize[0] % sr->local_x))?
+                                  workGroupSize: NULL));
+    return 0;
 }
 
 int gaes_ecb_compute_size_bpt(struct kocl_service_request *sr)
@@ -120,10 +272,7 @@ int gaes_ecb_compute_size_bpt(struct kocl_service_request *sr)
 
 int gaes_ecb_launch_bpt(struct kocl_service_request *sr)
 {
-    size_t globalWorkSize[2]={sr->global_x,1};//global work-items
-    size_t  workGroupSize[2]={sr->local_x, 1};//work-items per Group 
-
-cl_err(clEnqueueNDRangeKernel( sr->queue, sr->kernel , 2 , NULL , globalWorkSize, NULL, 0 , NULL , NULL));  
+    gaes_enqueue(sr, 0, sr->global_x);
    
 #if DEBUG
     printf("clEnqueueNDRangeKernel ok \n");   
@@ -131,43 +280,70 @@ cl_err(clEnqueueNDRangeKernel( sr->queue, sr->kernel , 2 , NULL , globalWorkSize
     return 0;
 }
 
+/* blocks first..first+n-1, streamed by the helper on copying devices */
+static int gaes_ecb_launch_chunk(struct kocl_service_request *sr,
+                                 unsigned long first, unsigned long n)
+{
+    return gaes_enqueue(sr, first, n);
+}
+
 int gaes_ecb_prepare(struct kocl_service_request *sr)
 {
     cl_int ret;
       
     struct crypto_aes_ctx *hctx = (struct crypto_aes_ctx*)sr->hdata;
     u32 key_length=hctx->key_length/4+6; 
+    struct kocl_variant_tuner *vt = gaes_variants(sr);
+    int v = 0;
+    cl_uint nblocks = sr->global_x;
    
+     if (vt) {
+         v = kocl_variant_pick(vt, programs[sr->platform], sr) - vt->v;
+         sr->local_x = vt->local[sr->channel];
+     } else
+         sr->local_x = kocl_wg_local(&gaes_tuner,
+             programs[sr->platform], sr);
+
      if (!strcmp(sr->s->name,"gaes_ecb-dec")){
-           sr->key_dec_buf = clCreateBuffer( sr->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, 
-                                  sizeof(u32)*AES_MAX_KEYLENGTH_U32 , (u32*)&hctx->key_dec , &ret); 
+           sr->key_dec_buf = gaes_get_key(sr, 1, hctx->key_dec, hctx->key_length, &ret);
         cl_err(ret); 
 
-         if(sr->channel==2 || sr->channel==3 ){
-                sr->kernel=decrypt_kernel2;
-         }else{
-                sr->kernel=decrypt_kernel;
-         }    
+         sr->kernel = kocl_get_kernel(sr->nbatch? &decrypt_tbl_kernels: &decrypt_kernels[v],
+             programs[sr->platform], sr);
+         if (!sr->kernel)
+             return KOCL_NO_RESPONSE;
         cl_err(clSetKernelArg(sr->kernel,0,sizeof(cl_mem), (void*)&sr->key_dec_buf));          
        // printf("decrypt: \n"); 
      }else{
-           sr->key_enc_buf = clCreateBuffer( sr->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, 
-                                  sizeof(u32)*AES_MAX_KEYLENGTH_U32 , (u32*)&hctx->key_enc , &ret);            
+           sr->key_enc_buf = gaes_get_key(sr, 0, hctx->key_enc, hctx->key_length, &ret);
            cl_err(ret);
 
-           if(sr->channel==2 || sr->channel==3 ){
-                sr->kernel=encrypt_kernel2;
-            }else{
-                sr->kernel=encrypt_kernel;
-            }  
+           sr->kernel = kocl_get_kernel(sr->nbatch? &encrypt_tbl_kernels: &encrypt_kernels[v],
+               programs[sr->platform], sr);
+           if (!sr->kernel)
+               return KOCL_NO_RESPONSE;
            cl_err(clSetKernelArg(sr->kernel,0,sizeof(cl_mem), (void*)&sr->key_enc_buf));     
         // printf("encrypt: \n");       
      }      
 
-        sr->OutputBuf = clCreateBuffer( sr->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sr->outsize , sr->hout , &ret); 
+        /* the members are all in batchbuf, at the table's offsets */
+        if (sr->nbatch) {
+            sr->InputBuf = kocl_batch_table(sr, &ret);
+            cl_err(ret);
+            cl_err(clSetKernelArg(sr->kernel,1,sizeof(cl_int),  (void*)&key_length));
+            cl_err(kocl_set_arg_buffer(sr, sr->kernel, 2, &sr->batchbuf, sr->batchbase));
+            cl_err(clSetKernelArg(sr->kernel,3,sizeof(cl_mem), (void*)&sr->InputBuf));
+            cl_err(clSetKernelArg(sr->kernel,4,sizeof(cl_int), (void*)&sr->nbatch));
+            return 0;
+        }
+
+        /* in place or copied, as suits the device, see kocl_get_buffer() */
+        sr->OutputBuf = kocl_get_buffer(sr, sr->outview, sr->hout, sr->outsize,
+                                        !sr->chunked, &ret);
         cl_err(ret);
         cl_err(clSetKernelArg(sr->kernel,1,sizeof(cl_int),  (void*)&key_length)); 
-        cl_err(clSetKernelArg(sr->kernel,2,sizeof(cl_mem), (void*)&sr->OutputBuf));  
+        cl_err(kocl_set_arg_buffer(sr, sr->kernel, 2, &sr->OutputBuf, sr->hout));  
+        cl_err(clSetKernelArg(sr->kernel,3,sizeof(cl_uint), (void*)&nblocks));
 
        // printf("sr->outsize: %lu \n",sr->outsize);  
     
@@ -176,11 +352,13 @@ int gaes_ecb_prepare(struct kocl_service_request *sr)
 
 int gaes_ecb_post(struct kocl_service_request *sr)
 {  
-    /*Only for nvidia GPU zerocopy case  */
-    int ret; 
-    sr->hout=clEnqueueMapBuffer( sr->queue , sr->OutputBuf , CL_TRUE , CL_MAP_READ, 0 ,
-                                    sr->outsize , 0 , 0 , NULL, &ret);
-    cl_err(ret);                               
+    if (sr->nbatch) {
+        clReleaseMemObject(sr->InputBuf);
+        clReleaseMemObject(!strcmp(sr->s->name,"gaes_ecb-dec")?
+                           sr->key_dec_buf: sr->key_enc_buf);
+        return 0;
+    }
+    cl_err(kocl_put_buffer(sr, sr->OutputBuf, sr->outview, sr->hout, sr->outsize, !sr->chunked));
     
     if (!strcmp(sr->s->name,"gaes_ecb-dec")){
        clReleaseMemObject(sr->key_dec_buf);
@@ -188,12 +366,192 @@ int gaes_ecb_post(struct kocl_service_request *sr)
        clReleaseMemObject(sr->key_enc_buf);
     }
   
-    //clReleaseKernel(sr->kernel);    
-    clReleaseMemObject(sr->OutputBuf);      
-    
+    return 0;
+}
+
+/* one key, one launch */
+static int gaes_ecb_can_merge(struct kocl_service_request *a,
+                              struct kocl_service_request *b)
+{
+    return !memcmp(a->hdata, b->hdata, sizeof(struct crypto_aes_ctx));
+}
+
+/*
+ * AES-NI, for the helper's native lanes: the blocks of the request,
+ * in place in hout, without OpenCL. The round keys are the equivalent
+ * inverse cipher ones the kernels use, only in big-endian words, see
+ * cvt_endian_u32().
+ */
+#define GAES_NI_LANES 4
+
+__attribute__((target("aes,ssse3")))
+static inline __m128i gaes_ni_key(const u32 *k)
+{
+    const __m128i sw = _mm_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)k), sw);
+}
+
+__attribute__((target("aes,ssse3")))
+static int gaes_ecb_native(struct kocl_service_request *sr,
+                           unsigned long first, unsigned long n)
+{
+    struct crypto_aes_ctx *hctx = (struct crypto_aes_ctx*)sr->hdata;
+    int dec = sr->s == &gaes_ecb_dec_srv;
+    const u32 *rk = dec? hctx->key_dec: hctx->key_enc;
+    int nr = hctx->key_length/4+6, i, j;
+    __m128i k[15], x[GAES_NI_LANES];
+    __m128i *p = (__m128i*)sr->hout + first;
+    unsigned long b = 0;
+
+    if (nr > 14)
+        return KOCL_NO_RESPONSE;
+    for (i=0; i<=nr; i++)
+        k[i] = gaes_ni_key(rk + 4*i);
+
+    /* a few blocks at a time, to cover the latency of aesenc */
+    for (; b+GAES_NI_LANES <= n; b += GAES_NI_LANES) {
+        for (j=0; j<GAES_NI_LANES; j++)
+            x[j] = _mm_xor_si128(_mm_loadu_si128(p+b+j), k[0]);
+        for (i=1; i<nr; i++)
+            for (j=0; j<GAES_NI_LANES; j++)
+                x[j] = dec? _mm_aesdec_si128(x[j], k[i]): _mm_aesenc_si128(x[j], k[i]);
+        for (j=0; j<GAES_NI_LANES; j++)
+            _mm_storeu_si128(p+b+j, dec? _mm_aesdeclast_si128(x[j], k[nr]):
+                             _mm_aesenclast_si128(x[j], k[nr]));
+    }
+    for (; b<n; b++) {
+        x[0] = _mm_xor_si128(_mm_loadu_si128(p+b), k[0]);
+        for (i=1; i<nr; i++)
+            x[0] = dec? _mm_aesdec_si128(x[0], k[i]): _mm_aesenc_si128(x[0], k[i]);
+        _mm_storeu_si128(p+b, dec? _mm_aesdeclast_si128(x[0], k[nr]):
+                         _mm_aesenclast_si128(x[0], k[nr]));
+    }
     return 0;
 }
 
+/*
+ * CTR and XTS. hdata is a crypto_gaes_iv_info, with the counter block
+ * of the first block or its tweak, the latter already encrypted with
+ * the tweak key by the client. The kernels derive those of the other
+ * blocks from it, so both modes are as wide as ECB and are streamed
+ * the same way. Requests differ by their ivs, they aren't merged.
+ */
+static int gaes_is_xts(struct kocl_service_request *sr)
+{
+    return sr->s == &gaes_xts_enc_srv || sr->s == &gaes_xts_dec_srv;
+}
+
+int gaes_iv_prepare(struct kocl_service_request *sr)
+{
+    struct crypto_gaes_iv_info *info = (struct crypto_gaes_iv_info*)sr->hdata;
+    int dec = sr->s == &gaes_xts_dec_srv;
+    cl_int nrounds = info->key_length/4+6;
+    cl_mem *key = dec? &sr->key_dec_buf: &sr->key_enc_buf;
+    cl_uint ctr[4];
+    cl_int ret;
+    int i;
+
+    sr->local_x = kocl_wg_local(&gaes_tuner, programs[sr->platform], sr);
+    *key = gaes_get_key(sr, dec, dec? info->key_dec: info->key_enc,
+                        info->key_length, &ret);
+    cl_err(ret);
+    sr->kernel = kocl_get_kernel(!gaes_is_xts(sr)? &ctr_kernels:
+                                 dec? &xts_dec_kernels: &xts_enc_kernels,
+                                 programs[sr->platform], sr);
+    if (!sr->kernel)
+        return KOCL_NO_RESPONSE;
+
+    sr->OutputBuf = kocl_get_buffer(sr, sr->outview, sr->hout, sr->outsize,
+                                    !sr->chunked, &ret);
+    cl_err(ret);
+    cl_err(clSetKernelArg(sr->kernel,0,sizeof(cl_mem), (void*)key));
+    cl_err(clSetKernelArg(sr->kernel,1,sizeof(cl_int), (void*)&nrounds));
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 2, &sr->OutputBuf, sr->hout));
+
+    if (!gaes_is_xts(sr)) {
+        /* a uint4 of big-endian words, as the AES state */
+        for (i=0; i<4; i++)
+            ctr[i] = (cl_uint)info->iv[4*i] << 24 | (cl_uint)info->iv[4*i+1] << 16
+                | (cl_uint)info->iv[4*i+2] << 8 | info->iv[4*i+3];
+        cl_err(clSetKernelArg(sr->kernel,3,sizeof(ctr), (void*)ctr));
+        return 0;
+    }
+
+    /* the tweaks of the stripes, see gaes_xts_tweaks() */
+    sr->InputBuf = clCreateBuffer(sr->context, CL_MEM_READ_WRITE,
+                                  2*sizeof(cl_ulong)*((sr->global_x+XTS_STRIPE-1)/XTS_STRIPE),
+                                  NULL, &ret);
+    cl_err(ret);
+    cl_err(clSetKernelArg(sr->kernel,3,sizeof(cl_mem), (void*)&sr->InputBuf));
+    return 0;
+}
+
+/* the stripes of blocks first..first+n-1, ahead of their kernel */
+static int gaes_xts_tweaks(struct kocl_service_request *sr,
+                           unsigned long first, unsigned long n)
+{
+    struct crypto_gaes_iv_info *info = (struct crypto_gaes_iv_info*)sr->hdata;
+    cl_kernel k = kocl_get_kernel(&xts_tweak_kernels, programs[sr->platform], sr);
+    size_t offset = first/XTS_STRIPE;
+    size_t global = (first+n+XTS_STRIPE-1)/XTS_STRIPE - offset;
+    cl_ulong t0[2] = {0, 0};
+    int i;
+
+    if (!k)
+        return KOCL_NO_RESPONSE;
+    for (i=0; i<AES_BLOCK_SIZE; i++)
+        t0[i/8] |= (cl_ulong)info->iv[i] << 8*(i%8);
+
+    cl_err(clSetKernelArg(k,0,sizeof(t0), (void*)t0));
+    cl_err(clSetKernelArg(k,1,sizeof(cl_mem), (void*)&xts_pow[sr->platform]));
+    cl_err(clSetKernelArg(k,2,sizeof(cl_mem), (void*)&sr->InputBuf));
+    cl_err(kocl_enqueue_kernel(sr, k, 1, &offset, &global, NULL));
+    return 0;
+}
+
+int gaes_iv_launch(struct kocl_service_request *sr)
+{
+    int err;
+
+    if (gaes_is_xts(sr) && (err = gaes_xts_tweaks(sr, 0, sr->global_x)))
+        return err;
+    return gaes_enqueue(sr, 0, sr->global_x);
+}
+
+static int gaes_iv_launch_chunk(struct kocl_service_request *sr,
+                                unsigned long first, unsigned long n)
+{
+    int err;
+
+    if (gaes_is_xts(sr) && (err = gaes_xts_tweaks(sr, first, n)))
+        return err;
+    return gaes_enqueue(sr, first, n);
+}
+
+int gaes_iv_post(struct kocl_service_request *sr)
+{
+    cl_err(kocl_put_buffer(sr, sr->OutputBuf, sr->outview, sr->hout, sr->outsize, !sr->chunked));
+    if (sr->InputBuf)
+        clReleaseMemObject(sr->InputBuf);
+    clReleaseMemObject(sr->s == &gaes_xts_dec_srv? sr->key_dec_buf: sr->key_enc_buf);
+    return 0;
+}
+
+static void gaes_iv_service(struct kocl_service *s, const char *name)
+{
+    sprintf(s->name, "%s", name);
+    s->sid = 0;
+    s->compute_size = gaes_ecb_compute_size_bpt;
+    s->launch = gaes_iv_launch;
+    s->prepare = gaes_iv_prepare;
+    s->post = gaes_iv_post;
+    s->can_merge = NULL;
+    s->chunk_in = 0;                         /* in place */
+    s->chunk_out = 16;
+    s->launch_chunk = gaes_iv_launch_chunk;
+}
+
 /*
  * Naming convention of ciphers:
  * g{algorithm}_{mode}[-({enc}|{dev})]
@@ -205,7 +563,7 @@ int gaes_ecb_post(struct kocl_service_request *sr)
 int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
 {
     int err;
-    printf("[libsrv_gaes] Info: init gaes zerocopy services\n");
+    printf("[libsrv_gaes] Info: init gaes services\n");
    
     
     sprintf(gaes_ecb_enc_srv.name, "gaes_ecb-enc");
@@ -214,6 +572,10 @@ int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
     gaes_ecb_enc_srv.launch = gaes_ecb_launch_bpt;
     gaes_ecb_enc_srv.prepare = gaes_ecb_prepare;
     gaes_ecb_enc_srv.post = gaes_ecb_post;
+    gaes_ecb_enc_srv.can_merge = gaes_ecb_can_merge;
+    gaes_ecb_enc_srv.chunk_in = 0;           /* in place */
+    gaes_ecb_enc_srv.chunk_out = 16;
+    gaes_ecb_enc_srv.launch_chunk = gaes_ecb_launch_chunk;
     
     sprintf(gaes_ecb_dec_srv.name, "gaes_ecb-dec");
     gaes_ecb_dec_srv.sid = 0;
@@ -221,10 +583,27 @@ int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
     gaes_ecb_dec_srv.launch = gaes_ecb_launch_bpt;
     gaes_ecb_dec_srv.prepare = gaes_ecb_prepare;
     gaes_ecb_dec_srv.post = gaes_ecb_post;
+    gaes_ecb_dec_srv.can_merge = gaes_ecb_can_merge;
+    gaes_ecb_dec_srv.chunk_in = 0;           /* in place */
+    gaes_ecb_dec_srv.chunk_out = 16;
+    gaes_ecb_dec_srv.launch_chunk = gaes_ecb_launch_chunk;
+
+    /* the CPU channel skips OpenCL where the CPU can */
+    if (__builtin_cpu_supports("aes")) {
+        gaes_ecb_enc_srv.native = gaes_ecb_native;
+        gaes_ecb_dec_srv.native = gaes_ecb_native;
+    }
 
+    /* CTR decrypts as it encrypts */
+    gaes_iv_service(&gaes_ctr_srv, "gaes_ctr");
+    gaes_iv_service(&gaes_xts_enc_srv, "gaes_xts-enc");
+    gaes_iv_service(&gaes_xts_dec_srv, "gaes_xts-dec");
     
     err = reg_srv(&gaes_ecb_enc_srv, lh);
     err |= reg_srv(&gaes_ecb_dec_srv, lh);
+    err |= reg_srv(&gaes_ctr_srv, lh);
+    err |= reg_srv(&gaes_xts_enc_srv, lh);
+    err |= reg_srv(&gaes_xts_dec_srv, lh);
    
     if (err) {
     	fprintf(stderr,
@@ -236,16 +615,36 @@ int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
 
 int finit_service(void *lh, int (*unreg_srv)(const char*))
 {
-    int err;
+    int err, i;
     printf("[libsrv_gaes] Info: finit gaes services\n");
     
     err = unreg_srv(gaes_ecb_enc_srv.name);
     err |= unreg_srv(gaes_ecb_dec_srv.name);
+    err |= unreg_srv(gaes_ctr_srv.name);
+    err |= unreg_srv(gaes_xts_enc_srv.name);
+    err |= unreg_srv(gaes_xts_dec_srv.name);
     
     if (err) {
     	fprintf(stderr,
 		"[libsrv_gaes] Error: failed to unregister gaes services\n");
     }
+
+    for (i=0; i<sizeof(encrypt_kernels)/sizeof(encrypt_kernels[0]); i++) {
+        kocl_release_kernels(&decrypt_kernels[i]);
+        kocl_release_kernels(&encrypt_kernels[i]);
+    }
+    kocl_release_kernels(&decrypt_tbl_kernels);
+    kocl_release_kernels(&encrypt_tbl_kernels);
+    kocl_release_kernels(&ctr_kernels);
+    kocl_release_kernels(&xts_enc_kernels);
+    kocl_release_kernels(&xts_dec_kernels);
+    kocl_release_kernels(&xts_tweak_kernels);
+    for (i=0; i<KOCL_MAX_PLATFORMS; i++)
+        if (xts_pow[i]) {
+            clReleaseMemObject(xts_pow[i]);
+            xts_pow[i] = NULL;
+        }
+    kocl_release_programs(programs, KOCL_MAX_PLATFORMS);
     
     return err;
 }
@@ -0,0 +1,393 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * GPU checksums, on the gcrc services.
+ *
+ * "gcrc32c" is crc32c as a shash, as crypto/crc32c_generic.c has it.
+ * An update of gpu_min bytes or more that may sleep is cut in requests
+ * of up to gpu_max bytes, and those in blocks whose crcs the GPU
+ * computes at once, combined here with
+ * __crc32c_le_shift(), the others, and those kocl has no room for right
+ * now, run on the CPU. Its priority is below
+ * the other crc32c ones, users ask for it by name.
+ *
+ * gcrc_crc32c_bufs() and gcrc_xxh32_bufs() checksum many buffers in one
+ * request, for filesystems verifying many extents at once.
+ */
+#include <crypto/internal/hash.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/scatterlist.h>
+#include <linux/string.h>
+#include <linux/crc32.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <asm/unaligned.h>
+#include "../../kocl/kocl.h"
+#include "../gcrc_common.h"
+
+/* customized log function */
+#define g_log(level, ...) kocl_do_log(level, "gcrc32c", ##__VA_ARGS__)
+#define dbg(...) g_log(KOCL_LOG_DEBUG, ##__VA_ARGS__)
+
+/* KOCL_CHANNEL_AUTO (-1) lets kocl place each request */
+static int channel=KOCL_CHANNEL_AUTO;
+module_param(channel, int , 0644);
+
+/* smallest update the shash sends to the GPU, and its block, bytes */
+static int gpu_min=256*1024;
+module_param(gpu_min, int , 0644);
+
+static int block=4096;
+module_param(block, int , 0644);
+
+/* largest piece of an update one request takes, bytes */
+static int gpu_max=4*1024*1024;
+module_param(gpu_max, int , 0644);
+
+/* compare GPU and CPU crc32c of this many KB at load */
+static int test=0;
+module_param(test, int , 0);
+
+/* kocl_service_id() of the two services */
+static int gcrc_crc32c_sid, gcrc_xxh32_sid;
+
+static struct kocl_request *gcrc_alloc_request(unsigned long nbytes, int crc)
+{
+    struct kocl_request *req = kocl_alloc_request();
+
+    if (!req)
+	return NULL;
+    req->channel = channel == KOCL_CHANNEL_AUTO? kocl_pick_channel(nbytes): channel;
+    strcpy(req->service_name, crc? "gcrc-crc32c": "gcrc-xxh32");
+    req->sid = crc? gcrc_crc32c_sid: gcrc_xxh32_sid;
+    return req;
+}
+
+static int gcrc_offload(struct kocl_request *req)
+{
+    int err = kocl_offload_sync(req);
+
+    if (!err)
+	err = req->errcode;
+    if (err)
+	g_log(KOCL_LOG_ERROR, "%s failed: %d\n", req->service_name, err);
+    return err? -EIO: 0;
+}
+
+/*
+ * A scatterlist of the pages under len bytes of kernel memory at p,
+ * vmalloc-ed or whole pages from the page allocator, NULL if it's
+ * neither: kmalloc-ed memory shares its pages with other objects the
+ * helper mustn't see, so that is copied.
+ */
+static struct scatterlist *gcrc_sg(const u8 *p, unsigned long len)
+{
+    unsigned long off = offset_in_page(p);
+    unsigned int n = DIV_ROUND_UP(off + len, PAGE_SIZE), i;
+    struct scatterlist *sg;
+
+    if (!is_vmalloc_addr(p)) {
+	if (!virt_addr_valid(p) || !virt_addr_valid(p + len - 1))
+	    return NULL;
+	for (i=0; i<n; i++)
+	    if (PageSlab(virt_to_head_page(p - off + (unsigned long)i*PAGE_SIZE)))
+		return NULL;
+    }
+    sg = kmalloc_array(n, sizeof(*sg), GFP_KERNEL);
+    if (!sg)
+	return NULL;
+    sg_init_table(sg, n);
+    for (i=0; i<n; i++) {
+	const u8 *a = p - off + (unsigned long)i*PAGE_SIZE;
+	unsigned int o = i? 0: off;
+	unsigned int l = min_t(unsigned long, PAGE_SIZE - o, len);
+
+	sg_set_page(sg+i, is_vmalloc_addr(a)? vmalloc_to_page(a): virt_to_page(a), l, o);
+	len -= l;
+    }
+    return sg;
+}
+
+/*
+ * The raw crc32c of len bytes at p from crc, in blocks on the GPU. The
+ * helper reads them in place if kocl can map them, else from a copy.
+ * -ENOMEM if the pool has no room now, it doesn't wait for it.
+ */
+static int gcrc_crc32c_gpu(u32 *crc, const u8 *p, unsigned long len)
+{
+    unsigned int n = DIV_ROUND_UP(len, block), i;
+    unsigned long osz = round_up(n*sizeof(u32), sizeof(long));
+    struct kocl_request *req = gcrc_alloc_request(len, 1);
+    struct scatterlist *sg = NULL;
+    struct gcrc_info *info;
+    char *in = NULL, *out = NULL;
+    u32 c = *crc, *r;
+    int err = -ENOMEM;
+
+    if (!req)
+	return -ENOMEM;
+    out = kocl_malloc(osz + sizeof(*info), req->channel);
+    if (!out)
+	goto out;
+    sg = gcrc_sg(p, len);
+    if (!sg || kocl_map_sg(req, sg, 0, len, KOCL_SG_IN)) {
+	in = kocl_malloc(len, req->channel);
+	if (!in)
+	    goto out;
+	memcpy(in, p, len);
+    }
+
+    info = (struct gcrc_info*)(out + osz);
+    info->nbufs = n;
+    info->seed = 0;
+    info->block = block;
+    req->in = in;
+    req->insize = len;
+    req->out = out;
+    req->outsize = n*sizeof(u32);
+    req->udata = info;
+    req->udatasize = sizeof(*info);
+
+    err = gcrc_offload(req);
+    if (err)
+	goto out;
+    /* crc(c, A|B) = shift(crc(c, A), |B|) ^ crc(0, B) */
+    r = (u32*)out;
+    for (i=0; i<n; i++) {
+	unsigned long l = min_t(unsigned long, block, len - (unsigned long)i*block);
+
+	c = __crc32c_le_shift(c, l) ^ r[i];
+    }
+    *crc = c;
+
+out:
+    if (in)
+	kocl_free(in, req->channel);
+    if (out)
+	kocl_free(out, req->channel);
+    kfree(sg);
+    kocl_free_request(req);
+    return err;
+}
+
+/* n buffers copied after their table, one request */
+static int gcrc_bufs(int crc, const void * const *bufs, const u32 *lens,
+		     unsigned int n, u32 seed, u32 *sums)
+{
+    unsigned long tsz = (unsigned long)n*sizeof(struct gcrc_buf), isz = tsz;
+    unsigned long osz = round_up(n*sizeof(u32), sizeof(long));
+    struct kocl_request *req;
+    struct gcrc_buf *tbl;
+    struct gcrc_info *info;
+    char *in = NULL, *out = NULL;
+    unsigned int i;
+    int err = -ENOMEM;
+
+    if (!n)
+	return 0;
+    if (tsz > 0xffffffffUL)
+	return -EINVAL;
+    /* offsets are u32, and round_up() of one may wrap */
+    for (i=0; i<n; i++) {
+	if ((u64)isz + lens[i] + 3 > 0xffffffffULL)
+	    return -EINVAL;
+	isz += round_up(lens[i], 4);
+    }
+    req = gcrc_alloc_request(isz, crc);
+    if (!req)
+	return -ENOMEM;
+    in = kocl_malloc(isz, req->channel);
+    out = kocl_malloc(osz + sizeof(*info), req->channel);
+    if (!in || !out)
+	goto out;
+
+    tbl = (struct gcrc_buf*)in;
+    for (i=0, isz=tsz; i<n; i++) {
+	tbl[i].offset = isz;
+	tbl[i].length = lens[i];
+	memcpy(in + isz, bufs[i], lens[i]);
+	isz += round_up(lens[i], 4);
+    }
+    info = (struct gcrc_info*)(out + osz);
+    info->nbufs = n;
+    info->seed = seed;
+    info->block = 0;
+    req->in = in;
+    req->insize = isz;
+    req->out = out;
+    req->outsize = n*sizeof(u32);
+    req->udata = info;
+    req->udatasize = sizeof(*info);
+
+    err = gcrc_offload(req);
+    if (!err)
+	memcpy(sums, out, n*sizeof(u32));
+out:
+    if (in)
+	kocl_free(in, req->channel);
+    if (out)
+	kocl_free(out, req->channel);
+    kocl_free_request(req);
+    return err;
+}
+
+/*
+ * the raw __crc32c_le(seed, bufs[i], lens[i]) of each buffer, on the CPU
+ * if the GPU can't. May sleep.
+ */
+int gcrc_crc32c_bufs(const void * const *bufs, const u32 *lens, unsigned int n,
+		     u32 seed, u32 *crcs)
+{
+    unsigned int i;
+
+    if (!gcrc_bufs(1, bufs, lens, n, seed, crcs))
+	return 0;
+    for (i=0; i<n; i++)
+	crcs[i] = __crc32c_le(seed, bufs[i], lens[i]);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(gcrc_crc32c_bufs);
+
+/* XXH32(bufs[i], lens[i], seed) of each buffer, an error if the GPU can't. May sleep. */
+int gcrc_xxh32_bufs(const void * const *bufs, const u32 *lens, unsigned int n,
+		    u32 seed, u32 *hashes)
+{
+    return gcrc_bufs(0, bufs, lens, n, seed, hashes);
+}
+EXPORT_SYMBOL_GPL(gcrc_xxh32_bufs);
+
+/* the shash, as crypto/crc32c_generic.c */
+struct gcrc32c_ctx {
+    u32 key;
+};
+
+struct gcrc32c_desc_ctx {
+    u32 crc;
+};
+
+static int gcrc32c_cra_init(struct crypto_tfm *tfm)
+{
+    struct gcrc32c_ctx *mctx = crypto_tfm_ctx(tfm);
+
+    mctx->key = ~0;
+    return 0;
+}
+
+static int gcrc32c_setkey(struct crypto_shash *hash, const u8 *key,
+			  unsigned int keylen)
+{
+    struct gcrc32c_ctx *mctx = crypto_shash_ctx(hash);
+
+    if (keylen != sizeof(mctx->key)) {
+	crypto_shash_set_flags(hash, CRYPTO_TFM_RES_BAD_KEY_LEN);
+	return -EINVAL;
+    }
+    mctx->key = le32_to_cpu(*(__le32 *)key);
+    return 0;
+}
+
+static int gcrc32c_init(struct shash_desc *desc)
+{
+    struct gcrc32c_ctx *mctx = crypto_shash_ctx(desc->tfm);
+    struct gcrc32c_desc_ctx *ctx = shash_desc_ctx(desc);
+
+    ctx->crc = mctx->key;
+    return 0;
+}
+
+static int gcrc32c_update(struct shash_desc *desc, const u8 *data,
+			  unsigned int length)
+{
+    struct gcrc32c_desc_ctx *ctx = shash_desc_ctx(desc);
+    unsigned int l;
+
+    /* the rest on the CPU once a piece can't go to the GPU */
+    while (length >= gpu_min && block > 0
+	   && (desc->flags & CRYPTO_TFM_REQ_MAY_SLEEP)) {
+	l = min_t(unsigned int, length, max(gpu_max, block));
+	if (gcrc_crc32c_gpu(&ctx->crc, data, l))
+	    break;
+	data += l;
+	length -= l;
+    }
+    ctx->crc = __crc32c_le(ctx->crc, data, length);
+    return 0;
+}
+
+static int gcrc32c_final(struct shash_desc *desc, u8 *out)
+{
+    struct gcrc32c_desc_ctx *ctx = shash_desc_ctx(desc);
+
+    put_unaligned_le32(~ctx->crc, out);
+    return 0;
+}
+
+static struct shash_alg gcrc32c_alg = {
+    .digestsize		= 4,
+    .setkey		= gcrc32c_setkey,
+    .init		= gcrc32c_init,
+    .update		= gcrc32c_update,
+    .final		= gcrc32c_final,
+    .descsize		= sizeof(struct gcrc32c_desc_ctx),
+    .base		= {
+	.cra_name		= "crc32c",
+	.cra_driver_name	= "gcrc32c",
+	.cra_priority		= 50,
+	.cra_blocksize		= 1,
+	.cra_ctxsize		= sizeof(struct gcrc32c_ctx),
+	.cra_module		= THIS_MODULE,
+	.cra_init		= gcrc32c_cra_init,
+    }
+};
+
+static void gcrc_test(int kb)
+{
+    unsigned long len = (unsigned long)kb*1024, i;
+    u8 *p = vmalloc(len);
+    u32 cpu, gpu = ~0;
+    ktime_t t0, t1, t2;
+
+    if (!p)
+	return;
+    for (i=0; i<len; i++)
+	p[i] = i*2654435761UL >> 24;
+    t0 = ktime_get();
+    cpu = __crc32c_le(~0, p, len);
+    t1 = ktime_get();
+    if (gcrc_crc32c_gpu(&gpu, p, len))
+	gpu = ~cpu;
+    t2 = ktime_get();
+    g_log(KOCL_LOG_PRINT, "%d KB: cpu %lld us, gpu %lld us, %s\n", kb,
+	  ktime_us_delta(t1, t0), ktime_us_delta(t2, t1),
+	  cpu == gpu? "ok": "MISMATCH");
+    vfree(p);
+}
+
+static int __init gcrc32c_mod_init(void)
+{
+    gcrc_crc32c_sid = kocl_service_id("gcrc-crc32c");
+    gcrc_xxh32_sid = kocl_service_id("gcrc-xxh32");
+    if (test > 0)
+	gcrc_test(test);
+    return crypto_register_shash(&gcrc32c_alg);
+}
+
+static void __exit gcrc32c_mod_exit(void)
+{
+    crypto_unregister_shash(&gcrc32c_alg);
+}
+
+module_init(gcrc32c_mod_init);
+module_exit(gcrc32c_mod_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("GPU crc32c and xxh32 checksums");
+MODULE_ALIAS_CRYPTO("gcrc32c");
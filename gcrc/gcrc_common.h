@@ -0,0 +1,36 @@
+/* This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * KOCL gcrc common header
+ */
+
+#ifndef __GCRC_COMMON_H__
+#define __GCRC_COMMON_H__
+
+/*
+ * gcrc-crc32c and gcrc-xxh32: a checksum of each of nbufs buffers, a
+ * u32 each in out, a work-item per buffer. crc32c is the raw register
+ * update of __crc32c_le(seed, buf, len), without the inversions, xxh32
+ * is XXH32(buf, len, seed).
+ *
+ * in starts with a gcrc_buf per buffer, byte offsets into in and
+ * lengths, the buffers follow anywhere after. With block set there is
+ * no table, in is just the buffers back to back, block bytes each but
+ * the last, which has what's left of insize. The info is the udata.
+ */
+struct gcrc_buf {
+    unsigned int offset;
+    unsigned int length;
+};
+
+struct gcrc_info {
+    unsigned int nbufs;
+    unsigned int seed;
+    unsigned int block;
+};
+
+#define GCRC_GROUP 64
+
+#endif
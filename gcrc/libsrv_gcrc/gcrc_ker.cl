@@ -0,0 +1,126 @@
+/* This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ */
+
+/*
+ * Checksums of many buffers, a work-item each, see gcrc_common.h.
+ */
+#define GCRC_GROUP 64
+#define CRC32C_POLY 0x82f63b78
+
+/* buffer i of a request, its offset in in and length */
+static inline uint2 gcrc_buf(__global const uchar *in, unsigned int i,
+                             unsigned int block, unsigned int insize)
+{
+	if (!block)
+	    return ((__global const uint2 *)in)[i];
+	return (uint2)(i*block, min(block, insize - i*block));
+}
+
+/*
+ * crc32c sliced by 4, on aligned 32-bit loads. The work-group builds
+ * the tables in local memory first.
+ */
+__kernel __attribute__((reqd_work_group_size(GCRC_GROUP, 1, 1)))
+void gcrc_crc32c(__global const uchar *in, __global unsigned int *out,
+                 unsigned int seed, unsigned int nbufs, unsigned int block,
+                 unsigned int insize)
+{
+     __local unsigned int t[4][256];
+     unsigned int gid = get_global_id(0), lid = get_local_id(0);
+     unsigned int i, j, c, off, len, crc = seed;
+     __global const uchar *p;
+     uint2 b;
+
+	for (i = lid; i < 256; i += GCRC_GROUP) {
+	    for (c = i, j = 0; j < 8; j++)
+		c = (c & 1)? (c >> 1) ^ CRC32C_POLY: c >> 1;
+	    t[0][i] = c;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (i = lid; i < 256; i += GCRC_GROUP) {
+	    c = t[0][i];
+	    for (j = 1; j < 4; j++) {
+		c = t[0][c & 255] ^ (c >> 8);
+		t[j][i] = c;
+	    }
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (gid >= nbufs)
+	    return;
+
+	b = gcrc_buf(in, gid, block, insize);
+	off = b.x;
+	len = b.y;
+	p = in + off;
+	for (; len && (off & 3); len--, off++)
+	    crc = t[0][(crc ^ *p++) & 255] ^ (crc >> 8);
+	for (; len >= 4; len -= 4, p += 4) {
+	    crc ^= *(__global const unsigned int *)p;
+	    crc = t[3][crc & 255] ^ t[2][(crc >> 8) & 255]
+		^ t[1][(crc >> 16) & 255] ^ t[0][crc >> 24];
+	}
+	for (; len; len--)
+	    crc = t[0][(crc ^ *p++) & 255] ^ (crc >> 8);
+	out[gid] = crc;
+}
+
+#define XXH_P1 2654435761U
+#define XXH_P2 2246822519U
+#define XXH_P3 3266489917U
+#define XXH_P4 668265263U
+#define XXH_P5 374761393U
+
+static inline unsigned int xxh_read32(__global const uchar *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline unsigned int xxh_round(unsigned int acc, unsigned int v)
+{
+	return rotate(acc + v*XXH_P2, 13U) * XXH_P1;
+}
+
+__kernel void gcrc_xxh32(__global const uchar *in, __global unsigned int *out,
+                         unsigned int seed, unsigned int nbufs, unsigned int block,
+                         unsigned int insize)
+{
+     unsigned int gid = get_global_id(0), len, h;
+     __global const uchar *p, *end;
+     uint2 b;
+
+	if (gid >= nbufs)
+	    return;
+	b = gcrc_buf(in, gid, block, insize);
+	p = in + b.x;
+	len = b.y;
+	end = p + len;
+
+	if (len >= 16) {
+	    unsigned int v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2;
+	    unsigned int v3 = seed, v4 = seed - XXH_P1;
+
+	    for (; p + 16 <= end; p += 16) {
+		v1 = xxh_round(v1, xxh_read32(p));
+		v2 = xxh_round(v2, xxh_read32(p+4));
+		v3 = xxh_round(v3, xxh_read32(p+8));
+		v4 = xxh_round(v4, xxh_read32(p+12));
+	    }
+	    h = rotate(v1, 1U) + rotate(v2, 7U) + rotate(v3, 12U) + rotate(v4, 18U);
+	} else {
+	    h = seed + XXH_P5;
+	}
+	h += len;
+	for (; p + 4 <= end; p += 4)
+	    h = rotate(h + xxh_read32(p)*XXH_P3, 17U) * XXH_P4;
+	for (; p < end; p++)
+	    h = rotate(h + (*p)*XXH_P5, 11U) * XXH_P1;
+	h ^= h >> 15;
+	h *= XXH_P2;
+	h ^= h >> 13;
+	h *= XXH_P3;
+	h ^= h >> 16;
+	out[gid] = h;
+}
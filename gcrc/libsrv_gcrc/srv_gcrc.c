@@ -0,0 +1,191 @@
+/* This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * gcrc-crc32c and gcrc-xxh32, checksums of many buffers, see
+ * gcrc_common.h.
+ */
+ 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+#include "../../kocl/kocl.h"
+#include "../../kocl/gputils.h"
+#include "../../kocl/progcache.h"
+#include "../gcrc_common.h"
+
+#define MAX_SOURCE_SIZE 1024000
+
+/* one per platform, see struct plat_set */
+cl_program programs[KOCL_MAX_PLATFORMS];
+/* a kernel object per queue, see kocl_get_kernel() */
+static struct kocl_kernel_pool crc32c_kernels = KOCL_KERNEL_POOL("gcrc_crc32c");
+static struct kocl_kernel_pool xxh32_kernels = KOCL_KERNEL_POOL("gcrc_xxh32");
+
+char *cl_filename = "gcrc_ker.cl";
+char *source_str;
+size_t source_size;
+
+/*Load the Kernel*/
+static int LoadKernel(char *cl_filename, char **source_str, size_t *source_size)
+{
+    FILE *fp;
+    fp = fopen(cl_filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to load kernel.\n");
+        exit(1);
+    }
+
+    *source_str = (char*)malloc(MAX_SOURCE_SIZE);
+    *source_size = fread(*source_str, 1, MAX_SOURCE_SIZE, fp);
+    fclose(fp);
+    return 0;
+}
+
+/* the program of platform i, the helper builds each on its first request */
+int service_CLsetup_plat(struct plat_set *plat, int i){
+
+    cl_int ret;
+    if (!source_str)
+        LoadKernel( cl_filename, &source_str, &source_size); 
+    programs[i] = kocl_build_program(plat->platforms[i].context,
+                                     plat->platforms[i].numDevices,
+                                     plat->platforms[i].devices,
+                                     source_str, source_size, &ret);
+    /* the helper fails the platform's requests, see kh_service_ready() */
+    if (cl_warn(ret) != CL_SUCCESS && programs[i]) {
+        clReleaseProgram(programs[i]);
+        programs[i] = NULL;
+    }
+    return ret != CL_SUCCESS;
+}
+
+int service_CLsetup(struct plat_set *plat){
+
+    int i, err = 0;
+    //Build OpenCL kernel for the devices of every platform
+    for (i=0; i<plat->nplatforms; i++)
+        err |= service_CLsetup_plat(plat, i);
+
+   return err;
+}
+
+static struct kocl_service gcrc_crc32c_srv, gcrc_xxh32_srv;
+
+/* the table and the buffers are checked against insize, the kernels don't */
+static struct gcrc_info *gcrc_check(struct kocl_service_request *sr)
+{
+    struct gcrc_info *info = (struct gcrc_info*)sr->hdata;
+    struct gcrc_buf *tbl = (struct gcrc_buf*)sr->hin;
+    unsigned int i;
+
+    if (!info || sr->datasize < sizeof(*info) || !info->nbufs
+	|| sr->insize > 0xffffffffUL
+	|| info->nbufs > sr->outsize/sizeof(unsigned int))
+	return NULL;
+    if (info->block)
+	return (unsigned long)(info->nbufs-1)*info->block < sr->insize
+	    && (unsigned long)info->nbufs*info->block >= sr->insize? info: NULL;
+    if (info->nbufs > sr->insize/sizeof(*tbl))
+	return NULL;
+    for (i=0; i<info->nbufs; i++)
+	if (tbl[i].offset > sr->insize || tbl[i].length > sr->insize - tbl[i].offset)
+	    return NULL;
+    return info;
+}
+
+static int gcrc_cs(struct kocl_service_request *sr)
+{
+    struct gcrc_info *info = (struct gcrc_info*)sr->hdata;
+    unsigned int n = (info && sr->datasize >= sizeof(*info))? info->nbufs: 0;
+
+    /* whole groups, the kernels skip the work-items past nbufs */
+    sr->global_x = (n + GCRC_GROUP-1)/GCRC_GROUP*GCRC_GROUP;
+    sr->local_x = GCRC_GROUP;
+    sr->global_y = 1;
+    sr->local_y = 1;
+    return 0;
+}
+
+static int gcrc_launch(struct kocl_service_request *sr)
+{
+    size_t global = sr->global_x, local = sr->local_x;
+
+    cl_err(kocl_enqueue_kernel(sr, sr->kernel, 1, NULL, &global, &local));
+    return 0;
+}
+
+static int gcrc_prepare(struct kocl_service_request *sr)
+{
+    struct gcrc_info *info = gcrc_check(sr);
+    cl_uint insize = sr->insize;
+    cl_int ret;
+
+    if (!info || !sr->global_x)
+	return KOCL_NO_RESPONSE;
+
+    sr->InputBuf = kocl_get_buffer(sr, sr->inview, sr->hin, sr->insize, 1, &ret);
+    cl_err(ret);
+    sr->OutputBuf = kocl_get_buffer(sr, sr->outview, sr->hout, sr->outsize, 0, &ret);
+    cl_err(ret);
+
+    sr->kernel = kocl_get_kernel(sr->s == &gcrc_crc32c_srv? &crc32c_kernels: &xxh32_kernels,
+				 programs[sr->platform], sr);
+    if (!sr->kernel)
+	return KOCL_NO_RESPONSE;
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 0, &sr->InputBuf, sr->hin));
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 1, &sr->OutputBuf, sr->hout));
+    cl_err(clSetKernelArg(sr->kernel,2,sizeof(cl_uint), &info->seed));
+    cl_err(clSetKernelArg(sr->kernel,3,sizeof(cl_uint), &info->nbufs));
+    cl_err(clSetKernelArg(sr->kernel,4,sizeof(cl_uint), &info->block));
+    cl_err(clSetKernelArg(sr->kernel,5,sizeof(cl_uint), &insize));
+    return 0;
+}
+
+static int gcrc_post(struct kocl_service_request *sr)
+{
+    cl_err(kocl_put_buffer(sr, sr->InputBuf, sr->inview, sr->hin, sr->insize, 0));
+    cl_err(kocl_put_buffer(sr, sr->OutputBuf, sr->outview, sr->hout, sr->outsize, 1));
+    return 0;
+}
+
+static void gcrc_service(struct kocl_service *s, const char *name)
+{
+    sprintf(s->name, "%s", name);
+    s->sid = 0;
+    s->compute_size = gcrc_cs;
+    s->launch = gcrc_launch;
+    s->prepare = gcrc_prepare;
+    s->post = gcrc_post;
+}
+
+int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
+{
+    int err;
+    printf("[libsrv_gcrc] Info: init gcrc services\n");
+
+    gcrc_service(&gcrc_crc32c_srv, "gcrc-crc32c");
+    gcrc_service(&gcrc_xxh32_srv, "gcrc-xxh32");
+
+    err = reg_srv(&gcrc_crc32c_srv, lh);
+    err |= reg_srv(&gcrc_xxh32_srv, lh);
+    if (err)
+	fprintf(stderr, "[libsrv_gcrc] Error: failed to register gcrc services\n");
+    return err;
+}
+
+int finit_service(void *lh, int (*unreg_srv)(const char*))
+{
+    int err;
+
+    printf("[libsrv_gcrc] Info: finit gcrc services\n");
+    unreg_srv(gcrc_xxh32_srv.name);
+    err = unreg_srv(gcrc_crc32c_srv.name);
+
+    kocl_release_kernels(&crc32c_kernels);
+    kocl_release_kernels(&xxh32_kernels);
+    kocl_release_programs(programs, KOCL_MAX_PLATFORMS);
+    return err;
+}
@@ -0,0 +1,321 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * GPU LZ4 page compression, for zram or zswap style users that have
+ * many pages to do at once: glz4_compress_pages() and
+ * glz4_decompress_pages() send up to GLZ4_MAX_BATCH pages per request
+ * to the glz4 services. The output is the LZ4 block format of lib/lz4.
+ * The pages themselves go to the helper through kocl_map_sg(), copies
+ * of them in the pool only if they can't. Both may sleep.
+ */
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/scatterlist.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include "../../kocl/kocl.h"
+#include "../glz4_common.h"
+
+/* customized log function */
+#define g_log(level, ...) kocl_do_log(level, "glz4", ##__VA_ARGS__)
+#define dbg(...) g_log(KOCL_LOG_DEBUG, ##__VA_ARGS__)
+
+/* KOCL_CHANNEL_AUTO (-1) lets kocl place each request */
+static int channel=KOCL_CHANNEL_AUTO;
+module_param(channel, int , 0644);
+
+/* round trip this many pages at load and print the time */
+static int test=0;
+module_param(test, int , 0);
+
+/* kocl_service_id() of the two services */
+static int glz4_comp_sid, glz4_decomp_sid;
+
+static struct kocl_request *glz4_alloc_request(unsigned int n, int comp)
+{
+    struct kocl_request *req = kocl_alloc_request();
+
+    if (!req)
+	return NULL;
+    req->channel = channel == KOCL_CHANNEL_AUTO?
+	kocl_pick_channel((unsigned long)n*GLZ4_PAGE): channel;
+    strcpy(req->service_name, comp? "glz4-comp": "glz4-decomp");
+    req->sid = comp? glz4_comp_sid: glz4_decomp_sid;
+    return req;
+}
+
+/* a scatterlist of n pages, and of extra after them if not NULL */
+static struct scatterlist *glz4_sg(struct page **pages, unsigned int n,
+				   struct page *extra)
+{
+    struct scatterlist *sg = kmalloc_array(n+1, sizeof(*sg), GFP_KERNEL);
+    unsigned int i;
+
+    if (!sg)
+	return NULL;
+    sg_init_table(sg, extra? n+1: n);
+    for (i=0; i<n; i++)
+	sg_set_page(sg+i, pages[i], PAGE_SIZE, 0);
+    if (extra)
+	sg_set_page(sg+n, extra, PAGE_SIZE, 0);
+    return sg;
+}
+
+static int glz4_offload(struct kocl_request *req)
+{
+    int err = kocl_offload_sync(req);
+
+    if (!err)
+	err = req->errcode;
+    if (err)
+	g_log(KOCL_LOG_ERROR, "%s failed: %d\n", req->service_name, err);
+    return err? -EIO: 0;
+}
+
+static int glz4_compress_batch(struct page **src, unsigned int n,
+			       u8 **dst, u32 *dlen)
+{
+    unsigned long osz = (unsigned long)n*(GLZ4_PAGE+sizeof(u32));
+    struct kocl_request *req = glz4_alloc_request(n, 1);
+    struct scatterlist *sg = NULL;
+    struct glz4_info *info;
+    char *in = NULL, *out = NULL;
+    u32 *lens;
+    unsigned int i;
+    int err = -ENOMEM;
+
+    if (!req)
+	return -ENOMEM;
+    sg = glz4_sg(src, n, NULL);
+    out = kocl_malloc_wait(osz + sizeof(*info), req->channel, NULL);
+    if (!sg || !out)
+	goto out;
+    if (kocl_map_sg(req, sg, 0, (unsigned long)n*PAGE_SIZE, KOCL_SG_IN)) {
+	in = kocl_malloc_wait((unsigned long)n*GLZ4_PAGE, req->channel, NULL);
+	if (!in)
+	    goto out;
+	for (i=0; i<n; i++) {
+	    void *p = kmap_atomic(src[i]);
+
+	    memcpy(in + (unsigned long)i*GLZ4_PAGE, p, GLZ4_PAGE);
+	    kunmap_atomic(p);
+	}
+    }
+
+    info = (struct glz4_info*)(out + osz);
+    info->npages = n;
+    req->in = in;
+    req->insize = (unsigned long)n*GLZ4_PAGE;
+    req->out = out;
+    req->outsize = osz;
+    req->udata = info;
+    req->udatasize = sizeof(*info);
+
+    err = glz4_offload(req);
+    if (err)
+	goto out;
+    lens = (u32*)(out + (unsigned long)n*GLZ4_PAGE);
+    for (i=0; i<n; i++) {
+	dlen[i] = lens[i] < GLZ4_PAGE? lens[i]: 0;
+	memcpy(dst[i], out + (unsigned long)i*GLZ4_PAGE, dlen[i]);
+    }
+
+out:
+    if (in)
+	kocl_free(in, req->channel);
+    if (out)
+	kocl_free(out, req->channel);
+    kfree(sg);
+    kocl_free_request(req);
+    return err;
+}
+
+static int glz4_decompress_batch(const u8 * const *src, const u32 *slen,
+				 unsigned int n, struct page **dst)
+{
+    unsigned long isz = (unsigned long)n*(GLZ4_PAGE+sizeof(u32));
+    struct kocl_request *req = glz4_alloc_request(n, 0);
+    struct scatterlist *sg = NULL;
+    struct page *okpg = alloc_page(GFP_KERNEL);
+    struct glz4_info *info;
+    char *in = NULL, *out = NULL;
+    u32 *lens, *ok;
+    unsigned int i;
+    int err = -ENOMEM;
+
+    if (!req || !okpg)
+	goto out;
+    sg = glz4_sg(dst, n, okpg);
+    in = kocl_malloc_wait(isz + sizeof(*info), req->channel, NULL);
+    if (!sg || !in)
+	goto out;
+
+    lens = (u32*)(in + (unsigned long)n*GLZ4_PAGE);
+    for (i=0; i<n; i++) {
+	lens[i] = slen[i] < GLZ4_PAGE? slen[i]: 0;
+	memcpy(in + (unsigned long)i*GLZ4_PAGE, src[i], lens[i]);
+    }
+    info = (struct glz4_info*)(in + isz);
+    info->npages = n;
+
+    /* decompressed right into the pages, the results into okpg */
+    if (kocl_map_sg(req, sg, 0, (unsigned long)(n+1)*PAGE_SIZE, KOCL_SG_OUT)) {
+	out = kocl_malloc_wait(isz, req->channel, NULL);
+	if (!out)
+	    goto out;
+    }
+    req->in = in;
+    req->insize = isz;
+    req->out = out;
+    req->outsize = isz;
+    req->udata = info;
+    req->udatasize = sizeof(*info);
+
+    err = glz4_offload(req);
+    if (err)
+	goto out;
+    if (out) {
+	for (i=0; i<n; i++) {
+	    void *p = kmap_atomic(dst[i]);
+
+	    memcpy(p, out + (unsigned long)i*GLZ4_PAGE, GLZ4_PAGE);
+	    kunmap_atomic(p);
+	}
+	ok = (u32*)(out + (unsigned long)n*GLZ4_PAGE);
+    } else {
+	ok = page_address(okpg);
+    }
+    for (i=0; i<n; i++)
+	if (ok[i] != GLZ4_PAGE)
+	    err = -EIO;
+
+out:
+    if (req) {
+	if (in)
+	    kocl_free(in, req->channel);
+	if (out)
+	    kocl_free(out, req->channel);
+	kocl_free_request(req);
+    }
+    kfree(sg);
+    if (okpg)
+	__free_page(okpg);
+    return err;
+}
+
+/*
+ * Compress n pages into dst[i], buffers of PAGE_SIZE each, dlen[i] the
+ * length, 0 for a page that didn't compress (to less than PAGE_SIZE
+ * less GLZ4_SLACK). 0 or a negative errno.
+ */
+int glz4_compress_pages(struct page **src, unsigned int n, u8 **dst, u32 *dlen)
+{
+    unsigned int i, k;
+    int err = 0;
+
+    for (i=0; i<n && !err; i+=k) {
+	k = min_t(unsigned int, n-i, GLZ4_MAX_BATCH);
+	err = glz4_compress_batch(src+i, k, dst+i, dlen+i);
+    }
+    return err;
+}
+EXPORT_SYMBOL_GPL(glz4_compress_pages);
+
+/*
+ * Decompress n pages of slen[i] bytes at src[i] into dst[i]. -EIO if
+ * any of them isn't a whole page of LZ4.
+ */
+int glz4_decompress_pages(const u8 * const *src, const u32 *slen,
+			  unsigned int n, struct page **dst)
+{
+    unsigned int i, k;
+    int err = 0;
+
+    for (i=0; i<n && !err; i+=k) {
+	k = min_t(unsigned int, n-i, GLZ4_MAX_BATCH);
+	err = glz4_decompress_batch(src+i, slen+i, k, dst+i);
+    }
+    return err;
+}
+EXPORT_SYMBOL_GPL(glz4_decompress_pages);
+
+/* pages of text like data, compressed, decompressed and compared */
+static void glz4_test(int n)
+{
+    struct page **pg = kcalloc(2*n, sizeof(*pg), GFP_KERNEL);
+    u8 **buf = kcalloc(n, sizeof(*buf), GFP_KERNEL);
+    u32 *len = kcalloc(n, sizeof(*len), GFP_KERNEL);
+    unsigned long total = 0;
+    ktime_t t0, t1, t2;
+    int i, j, bad = 0;
+
+    if (!pg || !buf || !len)
+	goto out;
+    for (i=0; i<n; i++) {
+	char *p;
+
+	pg[i] = alloc_page(GFP_KERNEL);
+	pg[n+i] = alloc_page(GFP_KERNEL);
+	buf[i] = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!pg[i] || !pg[n+i] || !buf[i])
+	    goto out;
+	p = page_address(pg[i]);
+	for (j=0; j<PAGE_SIZE; j++)
+	    p[j] = "kocl glz4 "[(j/7 + i) % 10];
+    }
+
+    t0 = ktime_get();
+    if (glz4_compress_pages(pg, n, buf, len))
+	goto out;
+    t1 = ktime_get();
+    for (i=0; i<n; i++)
+	total += len[i]? len[i]: PAGE_SIZE;
+    if (glz4_decompress_pages((const u8 * const *)buf, len, n, pg+n))
+	bad = -1;
+    t2 = ktime_get();
+    for (i=0; i<n && !bad; i++)
+	if (len[i] && memcmp(page_address(pg[i]), page_address(pg[n+i]), PAGE_SIZE))
+	    bad = i+1;
+
+    g_log(KOCL_LOG_PRINT, "%d pages to %lu bytes, comp %lld us, decomp %lld us, %s\n",
+	  n, total, ktime_us_delta(t1, t0), ktime_us_delta(t2, t1),
+	  bad? "MISMATCH": "ok");
+out:
+    for (i=0; pg && buf && i<n; i++) {
+	if (pg[i])
+	    __free_page(pg[i]);
+	if (pg[n+i])
+	    __free_page(pg[n+i]);
+	kfree(buf[i]);
+    }
+    kfree(pg);
+    kfree(buf);
+    kfree(len);
+}
+
+static int __init glz4_init(void)
+{
+    BUILD_BUG_ON(PAGE_SIZE != GLZ4_PAGE);
+    glz4_comp_sid = kocl_service_id("glz4-comp");
+    glz4_decomp_sid = kocl_service_id("glz4-decomp");
+    if (test > 0)
+	glz4_test(test);
+    return 0;
+}
+
+static void __exit glz4_exit(void)
+{
+}
+
+module_init(glz4_init);
+module_exit(glz4_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("GPU LZ4 page compression");
@@ -0,0 +1,35 @@
+/* This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * KOCL glz4 common header
+ */
+
+#ifndef __GLZ4_COMMON_H__
+#define __GLZ4_COMMON_H__
+
+/*
+ * glz4-comp and glz4-decomp: LZ4 block format (that of lib/lz4) of
+ * npages pages, a work-item each. A page is GLZ4_PAGE bytes, and so is
+ * the slot of its compressed data, which is why a page that doesn't
+ * compress to less than GLZ4_PAGE - GLZ4_SLACK is incompressible, of
+ * length 0. The info is the udata.
+ *
+ *  glz4-comp:   in  npages pages
+ *               out npages slots, then a u32 length per page
+ *  glz4-decomp: in  npages slots, then a u32 length per page
+ *               out npages pages, then a u32 per page: GLZ4_PAGE if it
+ *                   decompressed to a whole page, 0 if not
+ */
+#define GLZ4_PAGE 4096
+#define GLZ4_SLACK 64
+
+/* pages per request, the lengths of a request fit in a page */
+#define GLZ4_MAX_BATCH (GLZ4_PAGE/4)
+
+struct glz4_info {
+    unsigned int npages;
+};
+
+#endif
@@ -0,0 +1,164 @@
+/* This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ */
+
+/*
+ * LZ4 block format, the same as lib/lz4 reads and writes, of a page per
+ * work-item, see glz4_common.h. The compressor is the greedy one with a
+ * hash table of the last position of each 4-byte sequence, in global
+ * scratch, a table per page.
+ */
+#define GLZ4_PAGE 4096
+#define GLZ4_SLACK 64
+
+#define GLZ4_HASH_LOG 12
+#define MINMATCH 4
+#define LASTLITERALS 5
+#define MFLIMIT 12
+#define RUN_MASK 15
+
+static inline unsigned int glz4_read32(__global const uchar *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline unsigned int glz4_hash(unsigned int seq)
+{
+	return (seq * 2654435761U) >> (32 - GLZ4_HASH_LOG);
+}
+
+/* a length of 15 or more in the token and the bytes after it */
+static inline int glz4_put_len(__global uchar *dst, int op, unsigned int l)
+{
+	for (l -= RUN_MASK; l >= 255; l -= 255)
+	    dst[op++] = 255;
+	dst[op++] = l;
+	return op;
+}
+
+/* the sequence of the literals src[anchor..ip) and a match, 0 if none */
+static inline int glz4_put_seq(__global const uchar *src, __global uchar *dst,
+                               int op, int cap, int anchor, int ip,
+                               unsigned int off, unsigned int mlen)
+{
+	unsigned int lit = ip - anchor, ml = mlen? mlen - MINMATCH: 0;
+	int i, tok = op;
+
+	if (op + 1 + lit/255 + 1 + lit + (mlen? 2 + ml/255 + 1: 0) > cap)
+	    return -1;
+	op++;
+	dst[tok] = (lit >= RUN_MASK? RUN_MASK: lit) << 4;
+	if (lit >= RUN_MASK)
+	    op = glz4_put_len(dst, op, lit);
+	for (i = 0; i < lit; i++)
+	    dst[op++] = src[anchor+i];
+	if (!mlen)
+	    return op;
+	dst[op++] = off & 255;
+	dst[op++] = off >> 8;
+	dst[tok] |= ml >= RUN_MASK? RUN_MASK: ml;
+	if (ml >= RUN_MASK)
+	    op = glz4_put_len(dst, op, ml);
+	return op;
+}
+
+__kernel void glz4_comp(__global const uchar *in, __global uchar *out,
+                        __global ushort *scratch, unsigned int npages)
+{
+     unsigned int pg = get_global_id(0);
+     __global const uchar *src = in + (size_t)pg*GLZ4_PAGE;
+     __global uchar *dst = out + (size_t)pg*GLZ4_PAGE;
+     __global ushort *ht = scratch + ((size_t)pg << GLZ4_HASH_LOG);
+     __global unsigned int *lens = (__global unsigned int *)(out + (size_t)npages*GLZ4_PAGE);
+     int cap = GLZ4_PAGE - GLZ4_SLACK;
+     int ip = 0, anchor = 0, op = 0, i;
+
+	if (pg >= npages)
+	    return;
+	/* positions + 1, 0 is none */
+	for (i = 0; i < (1 << GLZ4_HASH_LOG); i++)
+	    ht[i] = 0;
+
+	while (ip < GLZ4_PAGE - MFLIMIT) {
+	    unsigned int seq = glz4_read32(src + ip), h = glz4_hash(seq);
+	    int ref = (int)ht[h] - 1;
+	    unsigned int mlen;
+
+	    ht[h] = ip + 1;
+	    if (ref < 0 || glz4_read32(src + ref) != seq) {
+		ip++;
+		continue;
+	    }
+	    for (mlen = MINMATCH; ip + mlen < GLZ4_PAGE - LASTLITERALS
+		     && src[ref+mlen] == src[ip+mlen]; mlen++)
+		;
+	    op = glz4_put_seq(src, dst, op, cap, anchor, ip, ip - ref, mlen);
+	    if (op < 0)
+		break;
+	    ip += mlen;
+	    anchor = ip;
+	}
+	if (op >= 0)
+	    op = glz4_put_seq(src, dst, op, cap, anchor, GLZ4_PAGE, 0, 0);
+	lens[pg] = op < 0? 0: op;
+}
+
+__kernel void glz4_decomp(__global const uchar *in, __global uchar *out,
+                          unsigned int npages)
+{
+     unsigned int pg = get_global_id(0);
+     __global const uchar *src = in + (size_t)pg*GLZ4_PAGE;
+     __global uchar *dst = out + (size_t)pg*GLZ4_PAGE;
+     __global const unsigned int *lens =
+	 (__global const unsigned int *)(in + (size_t)npages*GLZ4_PAGE);
+     __global unsigned int *ok = (__global unsigned int *)(out + (size_t)npages*GLZ4_PAGE);
+     unsigned int slen, ip = 0, op = 0, l, b, off, i;
+
+	if (pg >= npages)
+	    return;
+	slen = lens[pg];
+	if (slen > GLZ4_PAGE)
+	    slen = 0;
+
+	while (ip < slen) {
+	    unsigned int tok = src[ip++];
+
+	    l = tok >> 4;
+	    if (l == RUN_MASK)
+		do {
+		    b = ip < slen? src[ip++]: 0;
+		    l += b;
+		} while (b == 255);
+	    if (ip + l > slen || op + l > GLZ4_PAGE)
+		goto bad;
+	    for (i = 0; i < l; i++)
+		dst[op++] = src[ip++];
+	    if (ip >= slen)
+		break;
+
+	    if (ip + 2 > slen)
+		goto bad;
+	    off = src[ip] | (src[ip+1] << 8);
+	    ip += 2;
+	    if (!off || off > op)
+		goto bad;
+	    l = tok & RUN_MASK;
+	    if (l == RUN_MASK)
+		do {
+		    b = ip < slen? src[ip++]: 0;
+		    l += b;
+		} while (b == 255);
+	    l += MINMATCH;
+	    if (op + l > GLZ4_PAGE)
+		goto bad;
+	    /* byte by byte, matches may overlap their own output */
+	    for (i = 0; i < l; i++, op++)
+		dst[op] = dst[op - off];
+	}
+	ok[pg] = op == GLZ4_PAGE? GLZ4_PAGE: 0;
+	return;
+bad:
+	ok[pg] = 0;
+}
@@ -0,0 +1,191 @@
+/* This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * glz4-comp and glz4-decomp, LZ4 pages, see glz4_common.h.
+ */
+ 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+#include "../../kocl/kocl.h"
+#include "../../kocl/gputils.h"
+#include "../../kocl/progcache.h"
+#include "../glz4_common.h"
+
+#define MAX_SOURCE_SIZE 1024000
+#define GLZ4_HASH_LOG 12
+
+/* one per platform, see struct plat_set */
+cl_program programs[KOCL_MAX_PLATFORMS];
+/* a kernel object per queue, see kocl_get_kernel() */
+static struct kocl_kernel_pool comp_kernels = KOCL_KERNEL_POOL("glz4_comp");
+static struct kocl_kernel_pool decomp_kernels = KOCL_KERNEL_POOL("glz4_decomp");
+
+char *cl_filename = "glz4_ker.cl";
+char *source_str;
+size_t source_size;
+
+/*Load the Kernel*/
+static int LoadKernel(char *cl_filename, char **source_str, size_t *source_size)
+{
+    FILE *fp;
+    fp = fopen(cl_filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to load kernel.\n");
+        exit(1);
+    }
+
+    *source_str = (char*)malloc(MAX_SOURCE_SIZE);
+    *source_size = fread(*source_str, 1, MAX_SOURCE_SIZE, fp);
+    fclose(fp);
+    return 0;
+}
+
+/* the program of platform i, the helper builds each on its first request */
+int service_CLsetup_plat(struct plat_set *plat, int i){
+
+    cl_int ret;
+    if (!source_str)
+        LoadKernel( cl_filename, &source_str, &source_size); 
+    programs[i] = kocl_build_program(plat->platforms[i].context,
+                                     plat->platforms[i].numDevices,
+                                     plat->platforms[i].devices,
+                                     source_str, source_size, &ret);
+    /* the helper fails the platform's requests, see kh_service_ready() */
+    if (cl_warn(ret) != CL_SUCCESS && programs[i]) {
+        clReleaseProgram(programs[i]);
+        programs[i] = NULL;
+    }
+    return ret != CL_SUCCESS;
+}
+
+int service_CLsetup(struct plat_set *plat){
+
+    int i, err = 0;
+    //Build OpenCL kernel for the devices of every platform
+    for (i=0; i<plat->nplatforms; i++)
+        err |= service_CLsetup_plat(plat, i);
+
+   return err;
+}
+
+static struct kocl_service glz4_comp_srv, glz4_decomp_srv;
+
+/* the pages of a request, 0 if in and out don't hold them */
+static unsigned int glz4_npages(struct kocl_service_request *sr)
+{
+    struct glz4_info *info = (struct glz4_info*)sr->hdata;
+    unsigned long need;
+
+    if (!info || sr->datasize < sizeof(*info) || info->npages > GLZ4_MAX_BATCH)
+	return 0;
+    need = (unsigned long)info->npages*(GLZ4_PAGE+sizeof(unsigned int));
+    if (sr->s == &glz4_comp_srv?
+	sr->insize < (unsigned long)info->npages*GLZ4_PAGE || sr->outsize < need:
+	sr->insize < need || sr->outsize < need)
+	return 0;
+    return info->npages;
+}
+
+static int glz4_cs(struct kocl_service_request *sr)
+{
+    sr->global_x = glz4_npages(sr);
+    sr->local_x = 0;
+    sr->global_y = 1;
+    sr->local_y = 1;
+    return 0;
+}
+
+static int glz4_launch(struct kocl_service_request *sr)
+{
+    size_t global = sr->global_x;
+
+    cl_err(kocl_enqueue_kernel(sr, sr->kernel, 1, NULL, &global, NULL));
+    return 0;
+}
+
+/* the compressor's hash tables are in key_enc_buf from prepare to post */
+static int glz4_prepare(struct kocl_service_request *sr)
+{
+    int comp = sr->s == &glz4_comp_srv;
+    cl_uint n = glz4_npages(sr);
+    cl_int ret;
+
+    if (!n)
+	return KOCL_NO_RESPONSE;
+
+    sr->InputBuf = kocl_get_buffer(sr, sr->inview, sr->hin, sr->insize, 1, &ret);
+    cl_err(ret);
+    sr->OutputBuf = kocl_get_buffer(sr, sr->outview, sr->hout, sr->outsize, 0, &ret);
+    cl_err(ret);
+
+    sr->kernel = kocl_get_kernel(comp? &comp_kernels: &decomp_kernels,
+				 programs[sr->platform], sr);
+    if (!sr->kernel)
+	return KOCL_NO_RESPONSE;
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 0, &sr->InputBuf, sr->hin));
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 1, &sr->OutputBuf, sr->hout));
+    if (comp) {
+	sr->key_enc_buf = clCreateBuffer(sr->context, CL_MEM_READ_WRITE,
+					 ((size_t)n << GLZ4_HASH_LOG)*sizeof(unsigned short),
+					 NULL, &ret);
+	cl_err(ret);
+	cl_err(clSetKernelArg(sr->kernel,2,sizeof(cl_mem), &sr->key_enc_buf));
+	cl_err(clSetKernelArg(sr->kernel,3,sizeof(cl_uint), &n));
+    } else {
+	cl_err(clSetKernelArg(sr->kernel,2,sizeof(cl_uint), &n));
+    }
+    return 0;
+}
+
+static int glz4_post(struct kocl_service_request *sr)
+{
+    if (sr->s == &glz4_comp_srv)
+	clReleaseMemObject(sr->key_enc_buf);
+    cl_err(kocl_put_buffer(sr, sr->InputBuf, sr->inview, sr->hin, sr->insize, 0));
+    cl_err(kocl_put_buffer(sr, sr->OutputBuf, sr->outview, sr->hout, sr->outsize, 1));
+    return 0;
+}
+
+int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
+{
+    int err;
+    printf("[libsrv_glz4] Info: init glz4 services\n");
+
+    sprintf(glz4_comp_srv.name, "glz4-comp");
+    glz4_comp_srv.sid = 0;
+    glz4_comp_srv.compute_size = glz4_cs;
+    glz4_comp_srv.launch = glz4_launch;
+    glz4_comp_srv.prepare = glz4_prepare;
+    glz4_comp_srv.post = glz4_post;
+
+    sprintf(glz4_decomp_srv.name, "glz4-decomp");
+    glz4_decomp_srv.sid = 0;
+    glz4_decomp_srv.compute_size = glz4_cs;
+    glz4_decomp_srv.launch = glz4_launch;
+    glz4_decomp_srv.prepare = glz4_prepare;
+    glz4_decomp_srv.post = glz4_post;
+
+    err = reg_srv(&glz4_comp_srv, lh);
+    err |= reg_srv(&glz4_decomp_srv, lh);
+    if (err)
+	fprintf(stderr, "[libsrv_glz4] Error: failed to register glz4 services\n");
+    return err;
+}
+
+int finit_service(void *lh, int (*unreg_srv)(const char*))
+{
+    int err;
+
+    printf("[libsrv_glz4] Info: finit glz4 services\n");
+    unreg_srv(glz4_decomp_srv.name);
+    err = unreg_srv(glz4_comp_srv.name);
+
+    kocl_release_kernels(&comp_kernels);
+    kocl_release_kernels(&decomp_kernels);
+    kocl_release_programs(programs, KOCL_MAX_PLATFORMS);
+    return err;
+}
@@ -38,10 +38,13 @@
 #define TEST_TIMES 10
 
 static int loop= 20 ;
-static int channel=0;
+static int channel=0;     /* KOCL_CHANNEL_AUTO (-1): kocl picks */
 module_param(loop, int , 0);
 module_param(channel, int , 0);
 
+/* kocl_service_id("jhash_service"), looked up once at load */
+static int jhash_sid;
+
 int mycb(struct kocl_request *req)
 {    
      complete(req->c); 
@@ -72,7 +75,8 @@ static int jhash_test(int kb, struct completion *c){
 	                g_log(KOCL_LOG_ERROR, "request null\n");
 	                return 0;
                  }     
-            req->channel=channel;
+            req->channel = channel == KOCL_CHANNEL_AUTO?
+                kocl_pick_channel(1024*kb + sizeof(unsigned int)*kb): channel;
 
             in = kocl_malloc(1024*kb, req->channel);
   
@@ -101,6 +105,7 @@ static int jhash_test(int kb, struct completion *c){
                    req->out = out;
                    req->outsize = (sizeof(unsigned int)*kb);
                    strcpy(req->service_name, "jhash_service");
+                   req->sid = jhash_sid;
                    req->callback = mycb;
                    kocl_offload_async(req);
                     
@@ -112,6 +117,7 @@ static int jhash_test(int kb, struct completion *c){
                    req->out = out;
                    req->outsize = (sizeof(unsigned int)*kb);
                    strcpy(req->service_name, "jhash_service");
+                   req->sid = jhash_sid;
                    req->callback = mycb2;
                    kocl_offload_sync(req);
                   /*for(k=0;k<10;k++){
@@ -134,6 +140,8 @@ static int __init minit(void)
     unsigned int i,kb;
     long tt;
     struct completion *cs=NULL;
+
+    jhash_sid = kocl_service_id("jhash_service");
     
   //  cs = (struct completion*)kmalloc(sizeof(struct completion)*loop,GFP_KERNEL);
     tt=0;
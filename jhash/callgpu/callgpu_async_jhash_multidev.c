@@ -39,9 +39,13 @@
 static int loop= 10 ;
 module_param(loop, int , 0);
 
-static int channel=0;
+/* -1 (KOCL_CHANNEL_AUTO) spreads the requests over the devices */
+static int channel=KOCL_CHANNEL_AUTO;
 module_param(channel, int , 0);
 
+/* kocl_service_id("jhash_service"), looked up once at load */
+static int jhash_sid;
+
 int mycb(struct kocl_request *req)
 {    
      complete(req->c); 
@@ -67,22 +71,13 @@ static int jhash_test(int kb, struct completion *c){
     char *in;
     unsigned int *out;   
    
-            if(channel==0){
-                channel=1;
-                goto run;
-            } 
-            if(channel==1){
-                channel=0;
-                goto run;
-            } 
-            
-run:            
             req = kocl_alloc_request();
                  if (!req) {
 	                g_log(KOCL_LOG_ERROR, "request null\n");
 	                return 0;
                  }     
-            req->channel=channel;
+            req->channel = channel == KOCL_CHANNEL_AUTO?
+                kocl_pick_channel(1024*kb + sizeof(unsigned int)*kb): channel;
 
             in = kocl_malloc(1024*kb, req->channel);
   
@@ -111,6 +106,7 @@ run:
                    req->out = out;
                    req->outsize = (sizeof(unsigned int)*kb);
                    strcpy(req->service_name, "jhash_service");
+                   req->sid = jhash_sid;
                    req->callback = mycb;
                    kocl_offload_async(req);
                     
@@ -122,6 +118,7 @@ run:
                    req->out = out;
                    req->outsize = (sizeof(unsigned int)*kb);
                    strcpy(req->service_name, "jhash_service");
+                   req->sid = jhash_sid;
                    req->callback = mycb2;
                    kocl_offload_sync(req);
                    /*for(k=0;k<10;k++){
@@ -144,6 +141,8 @@ static int __init minit(void)
     unsigned int i,kb;
     long tt;
     struct completion *cs=NULL;
+
+    jhash_sid = kocl_service_id("jhash_service");
     
     cs = (struct completion*)kmalloc(sizeof(struct completion)*loop,GFP_KERNEL);
     tt=0;
@@ -0,0 +1,43 @@
+/* This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * KOCL jhash common header
+ */
+
+#ifndef __JHASH_COMMON_H__
+#define __JHASH_COMMON_H__
+
+/*
+ * jhash2_service: the kernel's jhash2() of nkeys keys of 32-bit words,
+ * each with its own length, and a hash each in out. in starts with a
+ * jhash2_key per key, byte offsets into in (4-byte aligned) and lengths
+ * in words; the keys follow anywhere after. With length set there is
+ * no table, in is just the keys back to back, length words each, such
+ * as pages for KSM. The info is the udata.
+ */
+struct jhash2_key {
+    unsigned int offset;
+    unsigned int length;
+};
+
+struct jhash2_info {
+    unsigned int seed;
+    unsigned int nkeys;
+    unsigned int length;
+};
+
+/*
+ * dedup_service: the same info, with length set, and out a key index
+ * per key: that of the first key with the same 64-bit fingerprint, its
+ * own if there is none. Equal prints are only candidates, the client
+ * compares the keys to be sure.
+ */
+
+/* the keys of a work-group are loaded together, in tiles of JHASH2_TILE words */
+#define JHASH2_GROUP 32
+#define JHASH2_TILE 96
+#define DEDUP_LANES 64
+
+#endif
@@ -39,10 +39,8 @@ static inline unsigned int rol32(unsigned int word, unsigned int shift)
         return (word << shift) | (word >> (32 - shift));
 }
 
-__kernel void jhash(__global char *k , __global unsigned int *out )
+unsigned int jhash_1k(__global char *k)
 { 
-     int idx=get_global_id(0);
-
         unsigned int j=0;
 	unsigned int a, b, c;
 	unsigned int length=1024,initval=17;
@@ -51,25 +49,233 @@ __kernel void jhash(__global char *k , __global unsigned int *out )
 
         /* Handle most of the key */
         while (length > 3) {
-                a += k[idx*1024+0+j];
-                b += k[idx*1024+1+j];
-                c += k[idx*1024+2+j];
+                a += k[0+j];
+                b += k[1+j];
+                c += k[2+j];
                 __jhash_mix(a, b, c);
                 length -= 3;
-                //k = k+3+tid*1024;
 		j+=3;
         }
         
         /* Handle the last 3 u32's: all the case statements fall through */
         switch (length) {
-        case 3: c += k[idx*1024+2+j];
-        case 2: b += k[idx*1024+1+j];
-        case 1: a += k[idx*1024+0+j];
+        case 3: c += k[2+j];
+        case 2: b += k[1+j];
+        case 1: a += k[0+j];
                 __jhash_final(a, b, c);
         case 0: /* Nothing left to add */
                 break;
         }
-	out[idx] = c ; 
+	return c;
+}
+
+__kernel void jhash(__global char *k , __global unsigned int *out )
+{ 
+     int idx=get_global_id(0);
+
+	out[idx] = jhash_1k(k+idx*1024); 
 	barrier(CLK_GLOBAL_MEM_FENCE);
 }
 
+/*
+ * Merged requests, see kocl_service_request.nbatch. tbl has a
+ * {first work-item, input offset, output offset} in base per request.
+ */
+__kernel void jhash_tbl(__global char *base, __global const unsigned int *tbl, int n)
+{
+     unsigned int idx=get_global_id(0);
+     int i = n-1;
+
+	while (i > 0 && tbl[3*i] > idx)
+	    i--;
+	idx -= tbl[3*i];
+	((__global unsigned int *)(base+tbl[3*i+2]))[idx] =
+	    jhash_1k(base+tbl[3*i+1]+idx*1024);
+}
+
+/*
+ * jhash2_service, see jhash_common.h: the kernel's jhash2() of a key of
+ * 32-bit words per work-item, JHASH2_GROUP of them per work-group. The
+ * group loads its keys a tile at a time into local memory, consecutive
+ * work-items reading consecutive words of one key, and each work-item
+ * then hashes its own key's words out of there. JHASH2_TILE is a
+ * multiple of 3, so a tile holds whole jhash2 rounds.
+ */
+#define JHASH2_GROUP 32
+#define JHASH2_TILE 96
+
+__kernel __attribute__((reqd_work_group_size(JHASH2_GROUP, 1, 1)))
+void jhash2(__global const char *in, __global unsigned int *out,
+            unsigned int seed, unsigned int nkeys, unsigned int length)
+{
+     __local unsigned int tile[JHASH2_GROUP][JHASH2_TILE+1];
+     __local unsigned int keyoff[JHASH2_GROUP], keylen[JHASH2_GROUP];
+     __local int maxlen;
+     __global const uint2 *tbl = (__global const uint2 *)in;
+     unsigned int gid = get_global_id(0), lid = get_local_id(0);
+     unsigned int len = 0, a, b, c, s, w, i, k;
+
+	if (lid == 0)
+	    maxlen = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (gid < nkeys && length) {
+	    keyoff[lid] = gid*length*4;
+	    keylen[lid] = len = length;
+	    if (lid == 0)
+		maxlen = (int)length;
+	} else if (gid < nkeys) {
+	    uint2 e = tbl[gid];
+	    keyoff[lid] = e.x;
+	    keylen[lid] = len = e.y;
+	    atomic_max(&maxlen, (int)len);
+	} else {
+	    keyoff[lid] = keylen[lid] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	a = b = c = JHASH_INITVAL + (len<<2) + seed;
+	w = 0;
+	for (s = 0; s < (unsigned int)maxlen; s += JHASH2_TILE) {
+	    /* coalesced: work-item lid loads words lid, lid+32, lid+64 of each key */
+	    for (k = 0; k < JHASH2_GROUP; k++) {
+		__global const unsigned int *kw =
+		    (__global const unsigned int *)(in + keyoff[k]);
+		for (i = lid; i < JHASH2_TILE; i += JHASH2_GROUP)
+		    if (s + i < keylen[k])
+			tile[k][i] = kw[s + i];
+	    }
+	    barrier(CLK_LOCAL_MEM_FENCE);
+
+	    for (; w < len && w < s + JHASH2_TILE; w += 3) {
+		__local unsigned int *t = &tile[lid][w - s];
+		if (len - w > 3) {
+		    a += t[0];
+		    b += t[1];
+		    c += t[2];
+		    __jhash_mix(a, b, c);
+		} else {
+		    /* the last 3 u32's: all the case statements fall through */
+		    switch (len - w) {
+		    case 3: c += t[2];
+		    case 2: b += t[1];
+		    case 1: a += t[0];
+			    __jhash_final(a, b, c);
+		    }
+		}
+	    }
+	    barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (gid < nkeys)
+	    out[gid] = c;
+}
+
+/*
+ * dedup_service, see jhash_common.h: groups of identical keys. Each key
+ * gets a 64-bit fingerprint from a work-group of DEDUP_LANES, lane l
+ * mixing words l, l+DEDUP_LANES, ... (coalesced) and the lanes folded
+ * pairwise. The (fingerprint, key) pairs are bitonic sorted, each run
+ * of equal fingerprints finds its head by pointer jumping and every
+ * key is told the first key of its run. s is the scratch of npow2 of
+ * each: fingerprints, keys and heads.
+ */
+#define DEDUP_LANES 64
+
+#define DEDUP_FP(s)		((__global ulong *)(s))
+#define DEDUP_ID(s, np)		((__global unsigned int *)((s) + (np)*8))
+#define DEDUP_LEAD(s, np)	((__global unsigned int *)((s) + (np)*12))
+
+__kernel __attribute__((reqd_work_group_size(DEDUP_LANES, 1, 1)))
+void dedup_fp(__global const unsigned int *in, __global char *s,
+              unsigned int seed, unsigned int nkeys, unsigned int length,
+              unsigned int npow2)
+{
+     __local unsigned int lb[DEDUP_LANES], lc[DEDUP_LANES];
+     unsigned int g = get_group_id(0), l = get_local_id(0);
+     __global const unsigned int *k = in + (ulong)g*length;
+     unsigned int a, b, c, w, j = 0, h;
+
+	a = b = c = JHASH_INITVAL + (length<<2) + seed + l;
+	for (w = l; g < nkeys && w < length; w += DEDUP_LANES) {
+	    unsigned int x = k[w];
+	    if (j == 0)
+		a += x;
+	    else if (j == 1)
+		b += x;
+	    else {
+		c += x;
+		__jhash_mix(a, b, c);
+	    }
+	    j = j == 2? 0: j+1;
+	}
+	__jhash_final(a, b, c);
+	lb[l] = b;
+	lc[l] = c;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (h = DEDUP_LANES/2; h > 0; h >>= 1) {
+	    if (l < h) {
+		a = lb[l];
+		b = lc[l];
+		c = lb[l+h];
+		__jhash_mix(a, b, c);
+		a += lc[l+h];
+		__jhash_final(a, b, c);
+		lb[l] = b;
+		lc[l] = c;
+	    }
+	    barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (l == 0) {
+	    /* the padding sorts last, after any real key of the same print */
+	    DEDUP_FP(s)[g] = g < nkeys? ((ulong)lb[0] << 32) | lc[0]: (ulong)-1;
+	    DEDUP_ID(s, npow2)[g] = g;
+	}
+}
+
+/* one bitonic step, j and k as in the usual loops */
+__kernel void dedup_sort(__global char *s, unsigned int npow2,
+                         unsigned int j, unsigned int k)
+{
+     __global ulong *fp = DEDUP_FP(s);
+     __global unsigned int *id = DEDUP_ID(s, npow2);
+     unsigned int i = get_global_id(0), p = i ^ j;
+
+	if (p > i) {
+	    ulong fi = fp[i], fpp = fp[p];
+	    unsigned int ii = id[i], ip = id[p];
+	    int gt = fi > fpp || (fi == fpp && ii > ip);
+	    if (((i & k) == 0) == gt) {
+		fp[i] = fpp; fp[p] = fi;
+		id[i] = ip; id[p] = ii;
+	    }
+	}
+}
+
+__kernel void dedup_lead(__global char *s, unsigned int npow2)
+{
+     __global ulong *fp = DEDUP_FP(s);
+     unsigned int p = get_global_id(0);
+
+	DEDUP_LEAD(s, npow2)[p] = (p == 0 || fp[p] != fp[p-1])? p: p-1;
+}
+
+/* heads only get nearer, so jumping in place is safe */
+__kernel void dedup_jump(__global char *s, unsigned int npow2)
+{
+     __global unsigned int *lead = DEDUP_LEAD(s, npow2);
+     unsigned int p = get_global_id(0);
+
+	lead[p] = lead[lead[p]];
+}
+
+__kernel void dedup_group(__global char *s, unsigned int npow2,
+                          __global unsigned int *out, unsigned int nkeys)
+{
+     __global unsigned int *id = DEDUP_ID(s, npow2);
+     unsigned int p = get_global_id(0);
+
+	if (id[p] < nkeys)
+	    out[id[p]] = id[DEDUP_LEAD(s, npow2)[p]];
+}
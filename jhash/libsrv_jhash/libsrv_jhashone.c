@@ -13,11 +13,15 @@
 #include <CL/cl.h>
 #include "../../kocl/kocl.h"
 #include "../../kocl/gputils.h"
+#include "../../kocl/progcache.h"
+#include "../../kocl/wgtune.h"
 
 #define MAX_SOURCE_SIZE 1024000
 
-cl_program program, program2;
-cl_kernel kernel, kernel2 ;
+/* one per platform, see struct plat_set */
+cl_program programs[KOCL_MAX_PLATFORMS];
+/* a kernel object per queue, see kocl_get_kernel() */
+static struct kocl_kernel_pool jhash_kernels = KOCL_KERNEL_POOL("jhash");
 
 char *cl_filename = "jhash_ker.cl";
 char *source_str;
@@ -43,28 +47,35 @@ static int LoadKernel(char *cl_filename, char **source_str, size_t *source_size)
 int service_CLsetup(struct plat_set *plat){
 
     cl_int ret;
+    int i, err = 0;
     LoadKernel( cl_filename, &source_str, &source_size); 
-    //Build OpenCL kernel for platform1 devices   
-    program = clCreateProgramWithSource(plat->platform1.context , 1 ,(const char**)&source_str,(const size_t *)&source_size , &ret);
-    cl_err(ret);
-    ret = clBuildProgram(program, plat->platform1.numDevices, plat->platform1.devices, NULL,  NULL,  NULL);
-    cl_err(ret);   
-    kernel = clCreateKernel(program, "jhash", &ret);
-    cl_err(ret);  
-
-    //printf("jhash service_CLsetup 1 ok \n"); 
-    //Build OpenCL kernel for platform2 devices 
-    program2 = clCreateProgramWithSource(plat->platform2.context , 1 ,(const char**)&source_str,(const size_t *)&source_size , &ret);
-    cl_err(ret);
-    ret = clBuildProgram(program2, plat->platform2.numDevices, plat->platform2.devices, NULL,  NULL,  NULL);
-    cl_err(ret);   
-    kernel2 = clCreateKernel(program2, "jhash", &ret);
-    cl_err(ret);   
+    //Build OpenCL kernel for the devices of every platform
+    for (i=0; i<plat->nplatforms; i++) {
+        programs[i] = kocl_build_program(plat->platforms[i].context,
+                                         plat->platforms[i].numDevices,
+                                         plat->platforms[i].devices,
+                                         source_str, source_size, &ret);
+        if (cl_warn(ret) != CL_SUCCESS) {
+            if (programs[i])
+                clReleaseProgram(programs[i]);
+            programs[i] = NULL;
+            err = 1;
+        }
+    }
 
-   //printf("jhash service_CLsetup 2 ok \n"); 
-   return 0;
+   return err;
 }
 
+/* see wgtune.h */
+static int jhash_tune_args(cl_kernel k, cl_mem scratch, size_t size)
+{
+    return clSetKernelArg(k,0,sizeof(cl_mem), &scratch)
+	|| clSetKernelArg(k,1,sizeof(cl_mem), &scratch);
+}
+
+static struct kocl_wg_tuner jhash_tuner =
+    KOCL_WG_TUNER("jhash", 4096, 1024, jhash_tune_args);
+
 static int jhash_cs(struct kocl_service_request *sr)
 {
     sr->global_x = sr->insize/1024 ; //3072*1024   
@@ -90,7 +101,8 @@ static int jhash_launch(struct kocl_service_request *sr)
     size_t  workGroupSize[2]={sr->local_x, 1};//work-items per Group
     
    // cl_event kernel_event;   
-    cl_err(clEnqueueNDRangeKernel( sr->queue, sr->kernel , 2 , NULL , globalWorkSize, NULL, 0 , NULL, NULL/*&kernel_event*/));
+    cl_err(clEnqueueNDRangeKernel( sr->queue, sr->kernel , 2 , NULL , globalWorkSize,
+	(sr->local_x && !(sr->global_x % sr->local_x))? workGroupSize: NULL, 0 , NULL, NULL/*&kernel_event*/));
   //  clWaitForEvents(1, &kernel_event); 
 
 #if DEBUG
@@ -102,16 +114,17 @@ static int jhash_launch(struct kocl_service_request *sr)
 static int jhash_prepare(struct kocl_service_request *sr)
 {
     cl_int ret;       
+    sr->local_x = kocl_wg_local(&jhash_tuner,
+	programs[sr->platform], sr);
     sr->InputBuf = clCreateBuffer( sr->context, CL_MEM_READ_WRITE , sr->insize , NULL , &ret); 
     cl_err(ret);
     sr->OutputBuf = clCreateBuffer( sr->context, CL_MEM_READ_WRITE , sr->outsize , NULL , &ret); 
     cl_err(ret);
     
-    if(sr->channel==2 || sr->channel==3 ){
-            sr->kernel=kernel2;
-        }else{
-            sr->kernel=kernel;
-        }   
+    sr->kernel = kocl_get_kernel(&jhash_kernels,
+	programs[sr->platform], sr);
+    if (!sr->kernel)
+	return KOCL_NO_RESPONSE;
 
     cl_err(clSetKernelArg(sr->kernel,0,sizeof(cl_mem), &sr->InputBuf));   
     cl_err(clSetKernelArg(sr->kernel,1,sizeof(cl_mem), &sr->OutputBuf)); 
@@ -156,6 +169,12 @@ int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
 
 int finit_service(void *lh, int (*unreg_srv)(const char*))
 {
+    int err;
+
     printf("[libsrv_jhash] Info: finit test service\n");
-    return unreg_srv(jhash_srv.name);
+    err = unreg_srv(jhash_srv.name);
+
+    kocl_release_kernels(&jhash_kernels);
+    kocl_release_programs(programs, KOCL_MAX_PLATFORMS);
+    return err;
 }
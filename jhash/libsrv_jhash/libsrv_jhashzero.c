@@ -13,11 +13,23 @@
 #include <CL/cl.h>
 #include "../../kocl/kocl.h"
 #include "../../kocl/gputils.h"
+#include "../../kocl/progcache.h"
+#include "../../kocl/wgtune.h"
+#include "../jhash_common.h"
 
 #define MAX_SOURCE_SIZE 1024000
 
-cl_program program, program2;
-cl_kernel kernel, kernel2 ;
+/* one per platform, see struct plat_set */
+cl_program programs[KOCL_MAX_PLATFORMS];
+/* a kernel object per queue, see kocl_get_kernel() */
+static struct kocl_kernel_pool jhash_kernels = KOCL_KERNEL_POOL("jhash");
+static struct kocl_kernel_pool jhash_tbl_kernels = KOCL_KERNEL_POOL("jhash_tbl");
+static struct kocl_kernel_pool jhash2_kernels = KOCL_KERNEL_POOL("jhash2");
+static struct kocl_kernel_pool dedup_fp_kernels = KOCL_KERNEL_POOL("dedup_fp");
+static struct kocl_kernel_pool dedup_sort_kernels = KOCL_KERNEL_POOL("dedup_sort");
+static struct kocl_kernel_pool dedup_lead_kernels = KOCL_KERNEL_POOL("dedup_lead");
+static struct kocl_kernel_pool dedup_jump_kernels = KOCL_KERNEL_POOL("dedup_jump");
+static struct kocl_kernel_pool dedup_group_kernels = KOCL_KERNEL_POOL("dedup_group");
 
 char *cl_filename = "jhash_ker.cl";
 char *source_str;
@@ -40,31 +52,44 @@ static int LoadKernel(char *cl_filename, char **source_str, size_t *source_size)
     return 0;
 }
 
-int service_CLsetup(struct plat_set *plat){
+/* the program of platform i, the helper builds each on its first request */
+int service_CLsetup_plat(struct plat_set *plat, int i){
 
     cl_int ret;
-    LoadKernel( cl_filename, &source_str, &source_size); 
-    //Build OpenCL kernel for platform1 devices   
-    program = clCreateProgramWithSource(plat->platform1.context , 1 ,(const char**)&source_str,(const size_t *)&source_size , &ret);
-    cl_err(ret);
-    ret = clBuildProgram(program, plat->platform1.numDevices, plat->platform1.devices, NULL,  NULL,  NULL);
-    cl_err(ret);   
-    kernel = clCreateKernel(program, "jhash", &ret);
-    cl_err(ret);  
-
-    //printf("jhash service_CLsetup 1 ok \n"); 
-    //Build OpenCL kernel for platform2 devices 
-    program2 = clCreateProgramWithSource(plat->platform2.context , 1 ,(const char**)&source_str,(const size_t *)&source_size , &ret);
-    cl_err(ret);
-    ret = clBuildProgram(program2, plat->platform2.numDevices, plat->platform2.devices, NULL,  NULL,  NULL);
-    cl_err(ret);   
-    kernel2 = clCreateKernel(program2, "jhash", &ret);
-    cl_err(ret);   
+    if (!source_str)
+        LoadKernel( cl_filename, &source_str, &source_size); 
+    programs[i] = kocl_build_program(plat->platforms[i].context,
+                                     plat->platforms[i].numDevices,
+                                     plat->platforms[i].devices,
+                                     source_str, source_size, &ret);
+    /* the helper fails the platform's requests, see kh_service_ready() */
+    if (cl_warn(ret) != CL_SUCCESS && programs[i]) {
+        clReleaseProgram(programs[i]);
+        programs[i] = NULL;
+    }
+    return ret != CL_SUCCESS;
+}
+
+int service_CLsetup(struct plat_set *plat){
+
+    int i, err = 0;
+    //Build OpenCL kernel for the devices of every platform
+    for (i=0; i<plat->nplatforms; i++)
+        err |= service_CLsetup_plat(plat, i);
 
-   printf("jhash service_CLsetup 2 ok \n"); 
-   return 0;
+   return err;
 }
 
+/* see wgtune.h */
+static int jhash_tune_args(cl_kernel k, cl_mem scratch, size_t size)
+{
+    return clSetKernelArg(k,0,sizeof(cl_mem), &scratch)
+	|| clSetKernelArg(k,1,sizeof(cl_mem), &scratch);
+}
+
+static struct kocl_wg_tuner jhash_tuner =
+    KOCL_WG_TUNER("jhash", 4096, 1024, jhash_tune_args);
+
 static int jhash_cs(struct kocl_service_request *sr)
 {
     sr->global_x = sr->insize/1024 ; //3072*1024   
@@ -90,7 +115,8 @@ static int jhash_launch(struct kocl_service_request *sr)
     size_t  workGroupSize[2]={sr->local_x, 1};//work-items per Group
     
    // cl_event kernel_event;   
-    cl_err(clEnqueueNDRangeKernel( sr->queue, sr->kernel , 2 , NULL , globalWorkSize, NULL/*workGroupSize*/, 0 , NULL, NULL/*&kernel_event*/));
+    cl_err(kocl_enqueue_kernel(sr, sr->kernel, 2, NULL, globalWorkSize,
+	(sr->local_x && !(sr->global_x % sr->local_x))? workGroupSize: NULL));
   //  clWaitForEvents(1, &kernel_event); 
 
 #if DEBUG
@@ -99,21 +125,51 @@ static int jhash_launch(struct kocl_service_request *sr)
     return 0;
 }
 
+/* keys first..first+n-1, streamed by the helper on copying devices */
+static int jhash_launch_chunk(struct kocl_service_request *sr,
+			      unsigned long first, unsigned long n)
+{
+    size_t offset[2] = {first, 0};
+    size_t globalWorkSize[2] = {n, 1};
+    size_t workGroupSize[2] = {sr->local_x, 1};
+
+    cl_err(kocl_enqueue_kernel(sr, sr->kernel, 2, offset, globalWorkSize,
+	(sr->local_x && !(n % sr->local_x))? workGroupSize: NULL));
+    return 0;
+}
+
 static int jhash_prepare(struct kocl_service_request *sr)
 {
     cl_int ret;       
-    sr->InputBuf = clCreateBuffer( sr->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sr->insize , sr->hin , &ret); 
+    sr->local_x = kocl_wg_local(&jhash_tuner,
+	programs[sr->platform], sr);
+
+    /* merged requests, all in batchbuf at the table's offsets */
+    if (sr->nbatch) {
+	sr->kernel = kocl_get_kernel(&jhash_tbl_kernels,
+	    programs[sr->platform], sr);
+	if (!sr->kernel)
+	    return KOCL_NO_RESPONSE;
+	sr->InputBuf = kocl_batch_table(sr, &ret);
+	cl_err(ret);
+	cl_err(kocl_set_arg_buffer(sr, sr->kernel, 0, &sr->batchbuf, sr->batchbase));
+	cl_err(clSetKernelArg(sr->kernel,1,sizeof(cl_mem), &sr->InputBuf));
+	cl_err(clSetKernelArg(sr->kernel,2,sizeof(cl_int), &sr->nbatch));
+	return 0;
+    }
+
+    /* in place or copied, as suits the device, see kocl_get_buffer() */
+    sr->InputBuf = kocl_get_buffer(sr, sr->inview, sr->hin, sr->insize, !sr->chunked, &ret);
     cl_err(ret);
-    sr->OutputBuf = clCreateBuffer( sr->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sr->outsize , sr->hout , &ret); 
+    sr->OutputBuf = kocl_get_buffer(sr, sr->outview, sr->hout, sr->outsize, 0, &ret);
     cl_err(ret);
     
-     if(sr->channel==2 || sr->channel==3 ){
-            sr->kernel=kernel2;
-        }else{
-            sr->kernel=kernel;
-        }  
-    cl_err(clSetKernelArg(sr->kernel,0,sizeof(cl_mem), &sr->InputBuf));   
-    cl_err(clSetKernelArg(sr->kernel,1,sizeof(cl_mem), &sr->OutputBuf)); 
+    sr->kernel = kocl_get_kernel(&jhash_kernels,
+	programs[sr->platform], sr);
+    if (!sr->kernel)
+	return KOCL_NO_RESPONSE;
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 0, &sr->InputBuf, sr->hin));   
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 1, &sr->OutputBuf, sr->hout)); 
 
     return 0;
 }
@@ -125,14 +181,345 @@ static int jhash_post(struct kocl_service_request *sr)
     sr->hout=clEnqueueMapBuffer( sr->queue , sr->OutputBuf , CL_TRUE , CL_MAP_READ, 0 ,
                                     sr->outsize , 0 , 0 , NULL, &ret);
     cl_err(ret); */
-    clReleaseMemObject(sr->InputBuf);
-    clReleaseMemObject(sr->OutputBuf);
+    if (sr->nbatch) {
+	clReleaseMemObject(sr->InputBuf);
+	return 0;
+    }
+    cl_err(kocl_put_buffer(sr, sr->InputBuf, sr->inview, sr->hin, sr->insize, 0));
+    cl_err(kocl_put_buffer(sr, sr->OutputBuf, sr->outview, sr->hout, sr->outsize, !sr->chunked));
+
+    return 0;
+}
+
+
+/* 1 KB keys and a hash each, the table kernel's layout */
+static int jhash_can_merge(struct kocl_service_request *a,
+			   struct kocl_service_request *b)
+{
+    return !(a->insize % 1024) && !(b->insize % 1024)
+	&& a->outsize >= a->global_x*sizeof(unsigned int)
+	&& b->outsize >= b->global_x*sizeof(unsigned int);
+}
+
+/*
+ * jhash2_service, see jhash_common.h. The table and the keys are
+ * checked against insize here, the kernel doesn't.
+ */
+static struct jhash2_info *jhash2_check(struct kocl_service_request *sr)
+{
+    struct jhash2_info *info = (struct jhash2_info*)sr->hdata;
+    struct jhash2_key *tbl = (struct jhash2_key*)sr->hin;
+    unsigned int i;
+
+    if (!info || sr->datasize < sizeof(*info)
+	|| info->nkeys > sr->outsize/sizeof(unsigned int))
+	return NULL;
+    if (info->length)
+	return (unsigned long)info->nkeys*info->length*sizeof(unsigned int)
+	    <= sr->insize? info: NULL;
+    if (info->nkeys > sr->insize/sizeof(*tbl))
+	return NULL;
+    for (i=0; i<info->nkeys; i++)
+	if ((tbl[i].offset & 3) || tbl[i].offset > sr->insize
+	    || tbl[i].length > (sr->insize - tbl[i].offset)/sizeof(unsigned int))
+	    return NULL;
+    return info;
+}
+
+static int jhash2_cs(struct kocl_service_request *sr)
+{
+    struct jhash2_info *info = (struct jhash2_info*)sr->hdata;
+    unsigned int n = (info && sr->datasize >= sizeof(*info))? info->nkeys: 0;
+
+    /* whole groups, the kernel skips the work-items past nkeys */
+    sr->global_x = (n + JHASH2_GROUP-1)/JHASH2_GROUP*JHASH2_GROUP;
+    sr->local_x = JHASH2_GROUP;
+    sr->global_y = 1;
+    sr->local_y = 1;
+    return 0;
+}
+
+static int jhash2_prepare(struct kocl_service_request *sr)
+{
+    struct jhash2_info *info = jhash2_check(sr);
+    cl_int ret;
+
+    if (!info || !sr->global_x)
+	return KOCL_NO_RESPONSE;
+
+    sr->InputBuf = kocl_get_buffer(sr, sr->inview, sr->hin, sr->insize, 1, &ret);
+    cl_err(ret);
+    sr->OutputBuf = kocl_get_buffer(sr, sr->outview, sr->hout, sr->outsize, 0, &ret);
+    cl_err(ret);
+
+    sr->kernel = kocl_get_kernel(&jhash2_kernels, programs[sr->platform], sr);
+    if (!sr->kernel)
+	return KOCL_NO_RESPONSE;
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 0, &sr->InputBuf, sr->hin));
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 1, &sr->OutputBuf, sr->hout));
+    cl_err(clSetKernelArg(sr->kernel,2,sizeof(cl_uint), &info->seed));
+    cl_err(clSetKernelArg(sr->kernel,3,sizeof(cl_uint), &info->nkeys));
+    cl_err(clSetKernelArg(sr->kernel,4,sizeof(cl_uint), &info->length));
+    return 0;
+}
+
+static int jhash2_post(struct kocl_service_request *sr)
+{
+    cl_err(kocl_put_buffer(sr, sr->InputBuf, sr->inview, sr->hin, sr->insize, 0));
+    cl_err(kocl_put_buffer(sr, sr->OutputBuf, sr->outview, sr->hout, sr->outsize, 1));
+    return 0;
+}
+
+#define rol32(w, s) (((w) << (s)) | ((w) >> (32 - (s))))
+
+#define __jhash_mix(a, b, c) {			\
+    a -= c;  a ^= rol32(c, 4);  c += b;		\
+    b -= a;  b ^= rol32(a, 6);  a += c;		\
+    c -= b;  c ^= rol32(b, 8);  b += a;		\
+    a -= c;  a ^= rol32(c, 16); c += b;		\
+    b -= a;  b ^= rol32(a, 19); a += c;		\
+    c -= b;  c ^= rol32(b, 4);  b += a;		\
+}
+
+#define __jhash_final(a, b, c) {		\
+    c ^= b; c -= rol32(b, 14);			\
+    a ^= c; a -= rol32(c, 11);			\
+    b ^= a; b -= rol32(a, 25);			\
+    c ^= b; c -= rol32(b, 16);			\
+    a ^= c; a -= rol32(c, 4);			\
+    b ^= a; b -= rol32(a, 14);			\
+    c ^= b; c -= rol32(b, 24);			\
+}
+
+/* the kernel's jhash2(), for the helper's native lanes */
+static int jhash2_native(struct kocl_service_request *sr,
+			 unsigned long first, unsigned long n)
+{
+    struct jhash2_info *info = jhash2_check(sr);
+    struct jhash2_key *tbl = (struct jhash2_key*)sr->hin;
+    unsigned int *out = (unsigned int*)sr->hout;
+    unsigned int i;
+
+    if (!info)
+	return KOCL_NO_RESPONSE;
+    for (i=0; i<info->nkeys; i++) {
+	const unsigned int *k = info->length?
+	    (const unsigned int*)sr->hin + (unsigned long)i*info->length:
+	    (const unsigned int*)((char*)sr->hin + tbl[i].offset);
+	unsigned int len = info->length? info->length: tbl[i].length, a, b, c;
+
+	a = b = c = 0xdeadbeef + (len<<2) + info->seed;
+	while (len > 3) {
+	    a += k[0]; b += k[1]; c += k[2];
+	    __jhash_mix(a, b, c);
+	    len -= 3;
+	    k += 3;
+	}
+	if (len) {
+	    switch (len) {
+	    case 3: c += k[2];
+	    case 2: b += k[1];
+	    case 1: a += k[0];
+	    }
+	    __jhash_final(a, b, c);
+	}
+	out[i] = c;
+    }
+    return 0;
+}
+
+/*
+ * dedup_service, see jhash_common.h and the dedup_ kernels. Its scratch
+ * on the device, npow2 fingerprints, keys and heads, is kept in
+ * ScratchBuf from prepare to post.
+ */
+static unsigned int dedup_npow2(unsigned int n)
+{
+    unsigned int np = 1;
+
+    while (np < n)
+	np <<= 1;
+    return np;
+}
+
+static int dedup_cs(struct kocl_service_request *sr)
+{
+    struct jhash2_info *info = (struct jhash2_info*)sr->hdata;
+    unsigned int n = (info && sr->datasize >= sizeof(*info))? info->nkeys: 0;
+
+    /* a group per key, padded to a power of two for the sort */
+    sr->global_x = n? dedup_npow2(n)*DEDUP_LANES: 0;
+    sr->local_x = DEDUP_LANES;
+    sr->global_y = 1;
+    sr->local_y = 1;
+    return 0;
+}
+
+static int dedup_prepare(struct kocl_service_request *sr)
+{
+    struct jhash2_info *info = jhash2_check(sr);
+    unsigned int np;
+    cl_int ret;
+
+    if (!info || !info->length || !sr->global_x)
+	return KOCL_NO_RESPONSE;
+    np = sr->global_x/DEDUP_LANES;
+
+    sr->InputBuf = kocl_get_buffer(sr, sr->inview, sr->hin, sr->insize, 1, &ret);
+    cl_err(ret);
+    sr->OutputBuf = kocl_get_buffer(sr, sr->outview, sr->hout, sr->outsize, 0, &ret);
+    cl_err(ret);
+    sr->ScratchBuf = clCreateBuffer(sr->context, CL_MEM_READ_WRITE,
+				    (size_t)np*16, NULL, &ret);
+    cl_err(ret);
+
+    sr->kernel = kocl_get_kernel(&dedup_fp_kernels, programs[sr->platform], sr);
+    if (!sr->kernel)
+	return KOCL_NO_RESPONSE;
+    cl_err(kocl_set_arg_buffer(sr, sr->kernel, 0, &sr->InputBuf, sr->hin));
+    cl_err(clSetKernelArg(sr->kernel,1,sizeof(cl_mem), &sr->ScratchBuf));
+    cl_err(clSetKernelArg(sr->kernel,2,sizeof(cl_uint), &info->seed));
+    cl_err(clSetKernelArg(sr->kernel,3,sizeof(cl_uint), &info->nkeys));
+    cl_err(clSetKernelArg(sr->kernel,4,sizeof(cl_uint), &info->length));
+    cl_err(clSetKernelArg(sr->kernel,5,sizeof(cl_uint), &np));
+    return 0;
+}
+
+/* the fingerprints, then the sort and the grouping, all on sr->queue */
+static int dedup_launch(struct kocl_service_request *sr)
+{
+    struct jhash2_info *info = (struct jhash2_info*)sr->hdata;
+    cl_program prog = programs[sr->platform];
+    size_t global = sr->global_x, local = DEDUP_LANES, np = global/DEDUP_LANES;
+    cl_uint npow2 = np, j, k;
+    cl_kernel ks, kl, kj, kg;
+
+    ks = kocl_get_kernel(&dedup_sort_kernels, prog, sr);
+    kl = kocl_get_kernel(&dedup_lead_kernels, prog, sr);
+    kj = kocl_get_kernel(&dedup_jump_kernels, prog, sr);
+    kg = kocl_get_kernel(&dedup_group_kernels, prog, sr);
+    if (!ks || !kl || !kj || !kg)
+	return KOCL_NO_RESPONSE;
+
+    cl_err(kocl_enqueue_kernel(sr, sr->kernel, 1, NULL, &global, &local));
+
+    cl_err(clSetKernelArg(ks,0,sizeof(cl_mem), &sr->ScratchBuf));
+    cl_err(clSetKernelArg(ks,1,sizeof(cl_uint), &npow2));
+    for (k = 2; k <= npow2; k <<= 1)
+	for (j = k>>1; j > 0; j >>= 1) {
+	    cl_err(clSetKernelArg(ks,2,sizeof(cl_uint), &j));
+	    cl_err(clSetKernelArg(ks,3,sizeof(cl_uint), &k));
+	    cl_err(kocl_enqueue_kernel(sr, ks, 1, NULL, &np, NULL));
+	}
 
+    cl_err(clSetKernelArg(kl,0,sizeof(cl_mem), &sr->ScratchBuf));
+    cl_err(clSetKernelArg(kl,1,sizeof(cl_uint), &npow2));
+    cl_err(kocl_enqueue_kernel(sr, kl, 1, NULL, &np, NULL));
+
+    cl_err(clSetKernelArg(kj,0,sizeof(cl_mem), &sr->ScratchBuf));
+    cl_err(clSetKernelArg(kj,1,sizeof(cl_uint), &npow2));
+    for (k = 1; k < npow2; k <<= 1)
+	cl_err(kocl_enqueue_kernel(sr, kj, 1, NULL, &np, NULL));
+
+    cl_err(clSetKernelArg(kg,0,sizeof(cl_mem), &sr->ScratchBuf));
+    cl_err(clSetKernelArg(kg,1,sizeof(cl_uint), &npow2));
+    cl_err(kocl_set_arg_buffer(sr, kg, 2, &sr->OutputBuf, sr->hout));
+    cl_err(clSetKernelArg(kg,3,sizeof(cl_uint), &info->nkeys));
+    cl_err(kocl_enqueue_kernel(sr, kg, 1, NULL, &np, NULL));
     return 0;
 }
 
+static int dedup_post(struct kocl_service_request *sr)
+{
+    clReleaseMemObject(sr->ScratchBuf);
+    cl_err(kocl_put_buffer(sr, sr->InputBuf, sr->inview, sr->hin, sr->insize, 0));
+    cl_err(kocl_put_buffer(sr, sr->OutputBuf, sr->outview, sr->hout, sr->outsize, 1));
+    return 0;
+}
+
+/* the dedup_fp kernel's print of a key, lane by lane */
+static unsigned long long dedup_fp(const unsigned int *k, unsigned int length,
+				   unsigned int seed)
+{
+    unsigned int lb[DEDUP_LANES], lc[DEDUP_LANES];
+    unsigned int a, b, c, w, j, l, h;
+
+    for (l=0; l<DEDUP_LANES; l++) {
+	a = b = c = 0xdeadbeef + (length<<2) + seed + l;
+	for (w = l, j = 0; w < length; w += DEDUP_LANES) {
+	    if (j == 0)
+		a += k[w];
+	    else if (j == 1)
+		b += k[w];
+	    else {
+		c += k[w];
+		__jhash_mix(a, b, c);
+	    }
+	    j = j == 2? 0: j+1;
+	}
+	__jhash_final(a, b, c);
+	lb[l] = b;
+	lc[l] = c;
+    }
+    for (h = DEDUP_LANES/2; h > 0; h >>= 1)
+	for (l=0; l<h; l++) {
+	    a = lb[l];
+	    b = lc[l];
+	    c = lb[l+h];
+	    __jhash_mix(a, b, c);
+	    a += lc[l+h];
+	    __jhash_final(a, b, c);
+	    lb[l] = b;
+	    lc[l] = c;
+	}
+    return (unsigned long long)lb[0] << 32 | lc[0];
+}
+
+struct dedup_ent {
+    unsigned long long fp;
+    unsigned int id;
+};
+
+static int dedup_cmp(const void *x, const void *y)
+{
+    const struct dedup_ent *a = x, *b = y;
+
+    if (a->fp != b->fp)
+	return a->fp < b->fp? -1: 1;
+    return a->id < b->id? -1: a->id > b->id;
+}
+
+static int dedup_native(struct kocl_service_request *sr,
+			unsigned long first, unsigned long n)
+{
+    struct jhash2_info *info = jhash2_check(sr);
+    unsigned int *out = (unsigned int*)sr->hout;
+    struct dedup_ent *e;
+    unsigned int i, head = 0;
+
+    if (!info || !info->length)
+	return KOCL_NO_RESPONSE;
+    e = malloc((info->nkeys+1)*sizeof(*e));
+    if (!e)
+	return KOCL_NO_RESPONSE;
+    for (i=0; i<info->nkeys; i++) {
+	e[i].fp = dedup_fp((const unsigned int*)sr->hin + (unsigned long)i*info->length,
+			   info->length, info->seed);
+	e[i].id = i;
+    }
+    qsort(e, info->nkeys, sizeof(*e), dedup_cmp);
+    for (i=0; i<info->nkeys; i++) {
+	if (i == 0 || e[i].fp != e[i-1].fp)
+	    head = e[i].id;
+	out[e[i].id] = head;
+    }
+    free(e);
+    return 0;
+}
 
 static struct kocl_service jhash_srv;
+static struct kocl_service jhash2_srv;
+static struct kocl_service dedup_srv;
 
 int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
 {
@@ -144,12 +531,50 @@ int init_service(void *lh, int (*reg_srv)(struct kocl_service*, void*))
     jhash_srv.launch = jhash_launch;
     jhash_srv.prepare = jhash_prepare;
     jhash_srv.post = jhash_post;
+    jhash_srv.can_merge = jhash_can_merge;
+    jhash_srv.chunk_in = 1024;
+    jhash_srv.chunk_out = sizeof(unsigned int);
+    jhash_srv.launch_chunk = jhash_launch_chunk;
+
+    sprintf(jhash2_srv.name, "jhash2_service");
+    jhash2_srv.sid = 1;
+    jhash2_srv.compute_size = jhash2_cs;
+    jhash2_srv.launch = jhash_launch;
+    jhash2_srv.prepare = jhash2_prepare;
+    jhash2_srv.post = jhash2_post;
+    jhash2_srv.native = jhash2_native;
 
-    return reg_srv(&jhash_srv, lh);
+    sprintf(dedup_srv.name, "dedup_service");
+    dedup_srv.sid = 1;
+    dedup_srv.compute_size = dedup_cs;
+    dedup_srv.launch = dedup_launch;
+    dedup_srv.prepare = dedup_prepare;
+    dedup_srv.post = dedup_post;
+    dedup_srv.native = dedup_native;
+
+    int err = reg_srv(&jhash_srv, lh);
+    err |= reg_srv(&jhash2_srv, lh);
+    err |= reg_srv(&dedup_srv, lh);
+    return err;
 }
 
 int finit_service(void *lh, int (*unreg_srv)(const char*))
 {
+    int err;
+
     printf("[libsrv_jhash] Info: finit test service\n");
-    return unreg_srv(jhash_srv.name);
+    unreg_srv(dedup_srv.name);
+    unreg_srv(jhash2_srv.name);
+    err = unreg_srv(jhash_srv.name);
+
+    kocl_release_kernels(&jhash_kernels);
+    kocl_release_kernels(&jhash_tbl_kernels);
+    kocl_release_kernels(&jhash2_kernels);
+    kocl_release_kernels(&dedup_fp_kernels);
+    kocl_release_kernels(&dedup_sort_kernels);
+    kocl_release_kernels(&dedup_lead_kernels);
+    kocl_release_kernels(&dedup_jump_kernels);
+    kocl_release_kernels(&dedup_group_kernels);
+    kocl_release_programs(programs, KOCL_MAX_PLATFORMS);
+    return err;
 }
@@ -0,0 +1,534 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * kbench, the offload benchmark: requests of a kocl service, or of an
+ * skcipher such as gaes_ecb(aes), over a sweep of sizes, depth of them
+ * in flight, on a set of channels. A line per size, key=value:
+ *
+ *   kbench target=jhash_service mode=async depth=4 channels=0,2 size=65536
+ *	n=100 errs=0 us=... MBps=... iops=... mean_us=... p50_us=...
+ *	p90_us=... p99_us=... max_us=...
+ *
+ * e.g. insmod kbench.ko service=gcrc-crc32c min_kb=64 max_kb=16384 depth=8
+ *	insmod kbench.ko cipher="gaes_xts(aes)" async=0 depth=4
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/semaphore.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+#include <linux/moduleparam.h>
+#include <crypto/skcipher.h>
+
+#include "../kocl/kocl.h"
+#include "../gcrc/gcrc_common.h"
+
+/* customized log function */
+#define g_log(level, ...) kocl_do_log(level, "kbench", ##__VA_ARGS__)
+#define dbg(...) g_log(KOCL_LOG_DEBUG, ##__VA_ARGS__)
+
+#define KB_MAX_DEPTH 64
+#define KB_MAX_SIZES 32
+
+/* a kocl service, unless cipher is set */
+static char *service = "jhash_service";
+module_param(service, charp, 0);
+MODULE_PARM_DESC(service, "kocl service to time, default jhash_service");
+
+static char *cipher = "";
+module_param(cipher, charp, 0);
+MODULE_PARM_DESC(cipher, "skcipher to time instead, e.g. gaes_ecb(aes)");
+
+static int decrypt = 0;
+module_param(decrypt, int, 0);
+MODULE_PARM_DESC(decrypt, "time the cipher's decryption, default 0 (encryption)");
+
+/* sizes in KB: min_kb, doubling up to max_kb, or the list in sizes */
+static int min_kb = 4;
+module_param(min_kb, int, 0);
+static int max_kb = 32*1024;
+module_param(max_kb, int, 0);
+static int sizes[KB_MAX_SIZES];
+static int nsizes;
+module_param_array(sizes, int, &nsizes, 0);
+MODULE_PARM_DESC(sizes, "request sizes in KB, in place of min_kb..max_kb");
+
+static int loop = 20;
+module_param(loop, int, 0);
+MODULE_PARM_DESC(loop, "requests per size, default 20");
+
+static int warmup = 2;
+module_param(warmup, int, 0);
+MODULE_PARM_DESC(warmup, "requests per size before timing, default 2");
+
+static int depth = 1;
+module_param(depth, int, 0);
+MODULE_PARM_DESC(depth, "requests in flight, default 1");
+
+static int async = 1;
+module_param(async, int, 0);
+MODULE_PARM_DESC(async, "1: one thread submits async requests, 0: depth threads of sync ones");
+
+/* KOCL_CHANNEL_AUTO (-1): kocl picks; in flight slot i uses channels[i%n] */
+static int channels[KOCL_NR_CHANNELS] = { KOCL_CHANNEL_AUTO };
+static int nchannels = 1;
+module_param_array(channels, int, &nchannels, 0);
+MODULE_PARM_DESC(channels, "channels to spread requests over, default -1 (auto)");
+
+/* output bytes of a service kbench doesn't know, per 100 bytes in */
+static int out_pct = 100;
+module_param(out_pct, int, 0);
+
+/* a request in flight, with its buffers */
+struct kb_slot {
+    int channel;
+    char *in, *out;
+    struct gcrc_info *info;
+    unsigned long insize, outsize;
+    /* skcipher */
+    struct skcipher_request *creq;
+    struct scatterlist *src, *dst;
+    struct page **pages;
+    unsigned int npages;
+    u8 iv[16];
+    struct completion done;
+    int cerr;
+    u64 t0;
+    struct list_head list;
+};
+
+static struct kb_slot slots[KB_MAX_DEPTH];
+static int kocl_sid;
+static struct crypto_skcipher *tfm;
+
+/* the run in progress */
+static DEFINE_SPINLOCK(kb_lock);
+static LIST_HEAD(kb_free);
+static struct semaphore kb_sem;
+static struct completion kb_all;
+static atomic_t kb_left, kb_nlat, kb_errs, kb_threads;
+static u64 *kb_lat;      /* ns, kb_nlat of them, NULL for a warm up */
+
+static void kb_record(struct kb_slot *s, int err)
+{
+    int i;
+
+    if (err)
+	atomic_inc(&kb_errs);
+    if (kb_lat && (i = atomic_inc_return(&kb_nlat)-1) < loop)
+	kb_lat[i] = ktime_get_ns() - s->t0;
+}
+
+/* an async request is done, its slot goes back */
+static void kb_done(struct kb_slot *s, int err)
+{
+    unsigned long flags;
+
+    kb_record(s, err);
+    spin_lock_irqsave(&kb_lock, flags);
+    list_add(&s->list, &kb_free);
+    spin_unlock_irqrestore(&kb_lock, flags);
+    up(&kb_sem);
+    if (atomic_dec_and_test(&kb_left))
+	complete(&kb_all);
+}
+
+/* kocl service requests */
+
+static int kb_service_cb(struct kocl_request *req)
+{
+    struct kb_slot *s = req->kdata;
+    int err = req->errcode;
+
+    kocl_free_request(req);
+    kb_done(s, err);
+    return 0;
+}
+
+static int kb_service_setup(struct kb_slot *s, unsigned long size)
+{
+    unsigned long osz;
+
+    if (!strcmp(service, "jhash_service"))
+	osz = size/1024*sizeof(u32);
+    else if (!strncmp(service, "gcrc-", 5))
+	osz = DIV_ROUND_UP(size, 4096)*sizeof(u32);
+    else
+	osz = size/100*out_pct;
+    osz = max_t(unsigned long, round_up(osz, sizeof(long)), sizeof(long));
+
+    s->in = kocl_malloc(size, s->channel);
+    s->out = kocl_malloc(osz + sizeof(*s->info), s->channel);
+    if (!s->in || !s->out)
+	return -ENOMEM;
+    memset(s->in, 'k', size);
+    s->insize = size;
+    s->outsize = osz;
+    s->info = (struct gcrc_info*)(s->out + osz);
+    s->info->nbufs = DIV_ROUND_UP(size, 4096);
+    s->info->seed = 0;
+    s->info->block = 4096;
+    return 0;
+}
+
+static void kb_service_free(struct kb_slot *s)
+{
+    if (s->in)
+	kocl_free(s->in, s->channel);
+    if (s->out)
+	kocl_free(s->out, s->channel);
+    s->in = s->out = NULL;
+}
+
+static struct kocl_request *kb_service_req(struct kb_slot *s)
+{
+    struct kocl_request *req = kocl_alloc_request();
+
+    if (!req)
+	return NULL;
+    req->channel = s->channel;
+    req->in = s->in;
+    req->insize = s->insize;
+    req->out = s->out;
+    req->outsize = !strncmp(service, "gcrc-", 5)?
+	s->info->nbufs*sizeof(u32): s->outsize;
+    if (!strncmp(service, "gcrc-", 5)) {
+	req->udata = s->info;
+	req->udatasize = sizeof(*s->info);
+    }
+    strcpy(req->service_name, service);
+    req->sid = kocl_sid;
+    req->kdata = s;
+    return req;
+}
+
+/* skcipher requests */
+
+static void kb_cipher_cb(struct crypto_async_request *areq, int err)
+{
+    struct kb_slot *s = areq->data;
+
+    if (err == -EINPROGRESS)
+	return;
+    if (async)
+	kb_done(s, err);
+    else {
+	s->cerr = err;
+	complete(&s->done);
+    }
+}
+
+static int kb_cipher_setup(struct kb_slot *s, unsigned long size)
+{
+    unsigned int i;
+
+    s->npages = DIV_ROUND_UP(size, PAGE_SIZE);
+    s->pages = kcalloc(2*s->npages, sizeof(*s->pages), GFP_KERNEL);
+    s->src = kmalloc_array(2*s->npages, sizeof(*s->src), GFP_KERNEL);
+    s->creq = skcipher_request_alloc(tfm, GFP_KERNEL);
+    if (!s->pages || !s->src || !s->creq)
+	return -ENOMEM;
+    s->dst = s->src + s->npages;
+    sg_init_table(s->src, s->npages);
+    sg_init_table(s->dst, s->npages);
+    for (i=0; i<2*s->npages; i++) {
+	s->pages[i] = alloc_page(GFP_KERNEL);
+	if (!s->pages[i])
+	    return -ENOMEM;
+	sg_set_page((i < s->npages? s->src: s->dst) + i%s->npages, s->pages[i],
+		    PAGE_SIZE, 0);
+    }
+    get_random_bytes(s->iv, sizeof(s->iv));
+    s->insize = size;
+    skcipher_request_set_callback(s->creq, CRYPTO_TFM_REQ_MAY_BACKLOG,
+				  kb_cipher_cb, s);
+    return 0;
+}
+
+static void kb_cipher_free(struct kb_slot *s)
+{
+    unsigned int i;
+
+    if (s->pages)
+	for (i=0; i<2*s->npages; i++)
+	    if (s->pages[i])
+		__free_page(s->pages[i]);
+    kfree(s->pages);
+    kfree(s->src);
+    if (s->creq)
+	skcipher_request_free(s->creq);
+    s->pages = NULL;
+    s->src = s->dst = NULL;
+    s->creq = NULL;
+}
+
+static int kb_cipher_start(struct kb_slot *s)
+{
+    skcipher_request_set_crypt(s->creq, s->src, s->dst, s->insize, s->iv);
+    return decrypt? crypto_skcipher_decrypt(s->creq): crypto_skcipher_encrypt(s->creq);
+}
+
+/* one request in flight on s, 0 if it was submitted */
+static int kb_submit(struct kb_slot *s)
+{
+    struct kocl_request *req;
+    int err;
+
+    s->t0 = ktime_get_ns();
+    if (tfm) {
+	err = kb_cipher_start(s);
+	if (err == -EINPROGRESS || err == -EBUSY)
+	    return 0;
+	kb_done(s, err);
+	return 0;
+    }
+    req = kb_service_req(s);
+    if (!req)
+	return -ENOMEM;
+    req->callback = kb_service_cb;
+    err = kocl_offload_async(req);
+    if (err)
+	kocl_free_request(req);
+    return err;
+}
+
+/* one sync request on s, its error */
+static int kb_call(struct kb_slot *s)
+{
+    struct kocl_request *req;
+    int err;
+
+    s->t0 = ktime_get_ns();
+    if (tfm) {
+	reinit_completion(&s->done);
+	err = kb_cipher_start(s);
+	if (err == -EINPROGRESS || err == -EBUSY) {
+	    wait_for_completion(&s->done);
+	    err = s->cerr;
+	}
+	return err;
+    }
+    req = kb_service_req(s);
+    if (!req)
+	return -ENOMEM;
+    err = kocl_offload_sync(req);
+    if (!err)
+	err = req->errcode;
+    kocl_free_request(req);
+    return err;
+}
+
+static int kb_sync_thread(void *arg)
+{
+    struct kb_slot *s = arg;
+
+    while (atomic_dec_return(&kb_left) >= 0)
+	kb_record(s, kb_call(s));
+    if (atomic_dec_and_test(&kb_threads))
+	complete(&kb_all);
+    return 0;
+}
+
+/* n requests, ns they took */
+static u64 kb_run(int n, u64 *lat)
+{
+    struct kb_slot *s;
+    u64 t0;
+    int i;
+
+    kb_lat = lat;
+    atomic_set(&kb_nlat, 0);
+    atomic_set(&kb_errs, 0);
+    atomic_set(&kb_left, n);
+    init_completion(&kb_all);
+    t0 = ktime_get_ns();
+
+    if (!async) {
+	atomic_set(&kb_threads, depth);
+	for (i=0; i<depth; i++)
+	    if (IS_ERR(kthread_run(kb_sync_thread, &slots[i], "kbench/%d", i))) {
+		g_log(KOCL_LOG_ERROR, "no thread %d\n", i);
+		if (atomic_dec_and_test(&kb_threads))
+		    complete(&kb_all);
+	    }
+	wait_for_completion(&kb_all);
+	return ktime_get_ns() - t0;
+    }
+
+    sema_init(&kb_sem, depth);
+    INIT_LIST_HEAD(&kb_free);
+    for (i=0; i<depth; i++)
+	list_add_tail(&slots[i].list, &kb_free);
+    for (i=0; i<n; i++) {
+	down(&kb_sem);
+	spin_lock_irq(&kb_lock);
+	s = list_first_entry(&kb_free, struct kb_slot, list);
+	list_del(&s->list);
+	spin_unlock_irq(&kb_lock);
+	if (kb_submit(s)) {
+	    atomic_inc(&kb_errs);
+	    /* as if it was done, without a latency */
+	    spin_lock_irq(&kb_lock);
+	    list_add(&s->list, &kb_free);
+	    spin_unlock_irq(&kb_lock);
+	    up(&kb_sem);
+	    if (atomic_dec_and_test(&kb_left))
+		complete(&kb_all);
+	}
+    }
+    wait_for_completion(&kb_all);
+    return ktime_get_ns() - t0;
+}
+
+static int kb_cmp(const void *a, const void *b)
+{
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+
+    return x < y? -1: x > y;
+}
+
+static u64 kb_pct(u64 *lat, int n, int p)
+{
+    return lat[min(n-1, DIV_ROUND_UP(n*p, 100)-1)];
+}
+
+static void kb_report(const char *chans, unsigned long size, u64 ns, u64 *lat)
+{
+    int n = min(atomic_read(&kb_nlat), loop), i;
+    u64 sum = 0;
+
+    sort(lat, n, sizeof(*lat), kb_cmp, NULL);
+    for (i=0; i<n; i++)
+	sum += lat[i];
+    ns = max_t(u64, ns, 1);
+    printk(KERN_INFO "kbench target=%s mode=%s depth=%d channels=%s size=%lu"
+	   " n=%d errs=%d us=%llu MBps=%llu iops=%llu"
+	   " mean_us=%llu p50_us=%llu p90_us=%llu p99_us=%llu max_us=%llu\n",
+	   tfm? cipher: service, async? "async": "sync", depth, chans, size,
+	   n, atomic_read(&kb_errs), div_u64(ns, 1000),
+	   div64_u64((u64)n*size*1000, ns), div64_u64((u64)n*NSEC_PER_SEC, ns),
+	   n? div_u64(sum, n*1000): 0,
+	   n? div_u64(kb_pct(lat, n, 50), 1000): 0,
+	   n? div_u64(kb_pct(lat, n, 90), 1000): 0,
+	   n? div_u64(kb_pct(lat, n, 99), 1000): 0,
+	   n? div_u64(lat[n-1], 1000): 0);
+}
+
+static void kb_free_slots(void)
+{
+    int i;
+
+    for (i=0; i<depth; i++) {
+	if (tfm)
+	    kb_cipher_free(&slots[i]);
+	else
+	    kb_service_free(&slots[i]);
+    }
+}
+
+static int kb_size(const char *chans, unsigned long size, u64 *lat)
+{
+    int i, err = 0;
+    u64 ns;
+
+    for (i=0; i<depth && !err; i++) {
+	struct kb_slot *s = &slots[i];
+
+	s->channel = channels[i % nchannels];
+	if (s->channel == KOCL_CHANNEL_AUTO && !tfm)
+	    s->channel = kocl_pick_channel(size);
+	init_completion(&s->done);
+	err = tfm? kb_cipher_setup(s, size): kb_service_setup(s, size);
+    }
+    if (err) {
+	g_log(KOCL_LOG_ERROR, "no buffers for %d x %lu bytes\n", depth, size);
+	goto out;
+    }
+    if (warmup)
+	kb_run(warmup, NULL);
+    ns = kb_run(loop, lat);
+    kb_report(chans, size, ns, lat);
+out:
+    kb_free_slots();
+    return err;
+}
+
+static int __init kb_init(void)
+{
+    char chans[KOCL_NR_CHANNELS*4];
+    unsigned char key[64];
+    u64 *lat;
+    int i, p = 0, kb;
+
+    if (depth < 1 || depth > KB_MAX_DEPTH || loop < 1 || nchannels < 1) {
+	g_log(KOCL_LOG_ERROR, "depth 1..%d, loop and channels at least 1\n",
+	      KB_MAX_DEPTH);
+	return -EINVAL;
+    }
+    for (i=0; i<nchannels; i++)
+	p += scnprintf(chans+p, sizeof(chans)-p, "%s%d", i? ",": "", channels[i]);
+
+    if (*cipher) {
+	int keylen = strstr(cipher, "xts")? 32: 16;   /* xts: data and tweak key */
+
+	tfm = crypto_alloc_skcipher(cipher, 0, async? 0: CRYPTO_ALG_ASYNC);
+	if (IS_ERR(tfm)) {
+	    g_log(KOCL_LOG_ERROR, "no skcipher %s\n", cipher);
+	    return PTR_ERR(tfm);
+	}
+	get_random_bytes(key, keylen);
+	if (crypto_skcipher_setkey(tfm, key, keylen)) {
+	    crypto_free_skcipher(tfm);
+	    return -EINVAL;
+	}
+    } else
+	kocl_sid = kocl_service_id(service);
+
+    lat = vmalloc(loop*sizeof(*lat));
+    if (!lat) {
+	if (tfm)
+	    crypto_free_skcipher(tfm);
+	return -ENOMEM;
+    }
+
+    if (nsizes) {
+	for (i=0; i<nsizes; i++)
+	    if (sizes[i] > 0 && kb_size(chans, (unsigned long)sizes[i]<<10, lat))
+		break;
+    } else {
+	for (kb = min_kb; kb > 0 && kb <= max_kb; kb <<= 1)
+	    if (kb_size(chans, (unsigned long)kb<<10, lat))
+		break;
+    }
+
+    vfree(lat);
+    if (tfm)
+	crypto_free_skcipher(tfm);
+    tfm = NULL;
+    return 0;
+}
+
+static void __exit kb_exit(void)
+{
+    g_log(KOCL_LOG_PRINT, "unload\n");
+}
+
+module_init(kb_init);
+module_exit(kb_exit);
+
+MODULE_DESCRIPTION("kocl offload benchmark");
+MODULE_LICENSE("GPL");
@@ -7,5 +7,9 @@ struct fordedup {
         int (*kkocl_next_request_id)(void);
         void (*kkocl_free_request)(struct kocl_request* req);    
         void (*kkocl_free)(void *p,int channel);
+        /* calc_checksum() of n pages, see kocl_page_checksums() */
+        int (*kkocl_page_checksums)(struct page **pages, unsigned int n, u32 *sums);
+        /* candidate duplicates among n pages, see kocl_page_dups() */
+        int (*kkocl_page_dups)(struct page **pages, unsigned int n, u32 *group);
 };
 
@@ -13,6 +13,13 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
 #include "helper.h"
 #include "gputils.h"
 #include "gpuops.h"
@@ -20,199 +27,688 @@
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #include <CL/cl.h>
+#include <CL/cl_ext.h>
 
-#define MAX_QUEUE_NR 8
-cl_int ret;
-cl_uint numPlatforms = 0;
-cl_platform_id *platforms = NULL;
-cl_uint numDevices = 0, numDevices2 = 0;
-cl_device_id *devices = NULL,*devices2 = NULL;
-cl_context context = NULL, context2 = NULL;
+#define MAX_SLOTS KOCL_MAX_SLOTS
+#define GPU_MAX_DEVICES 16
+#define GPU_MAX_QUEUES 16
+#define GPU_DEF_QUEUES 8
+#define GPU_DEF_DEPTH 2
 
-cl_command_queue  cmdQueue[MAX_QUEUE_NR], cmdQueue2[MAX_QUEUE_NR], cmdQueue3[MAX_QUEUE_NR];
-cl_command_queue  mapQueue, mapQueue2, mapQueue3;
-static int Queueuses[MAX_QUEUE_NR], Queueuses2[MAX_QUEUE_NR], Queueuses3[MAX_QUEUE_NR];
+/*
+ * All OpenCL platforms and their devices, a context per platform over
+ * all of its devices, as the services build their programs per
+ * platform, see service_CLset().
+ */
+struct gpu_platform {
+    cl_platform_id id;
+    cl_uint ndevs;
+    cl_device_id *devs;
+    cl_context ctx;
+};
+
+struct gpu_device {
+    int plat;
+    cl_device_id id;
+    cl_device_type type;
+    cl_bool unified;            /* CL_DEVICE_HOST_UNIFIED_MEMORY */
+    int zerocopy;               /* work on host memory in place */
+    int svm;                    /* fine-grained SVM buffers, OpenCL 2.0 */
+    int pool;                   /* -1 if no channel uses it */
+    int node;                   /* NUMA node, -1 if not known */
+};
+
+static struct gpu_platform plats[KOCL_MAX_PLATFORMS];
+static int nPlats;
+static struct gpu_device gdevs[GPU_MAX_DEVICES];
+static int nDevs;
+
+/*
+ * Channels go to devices by kind, as the kernel clients expect: 0 and
+ * 1 to a discrete GPU, 2 to an integrated GPU and 3 to a CPU, or the
+ * first device there is without one of the kind. A pool per device a
+ * channel uses. A helper may serve only some of the channels, others
+ * run the rest, see gpu_set_channels(): the others have no pool (-1)
+ * and no queues here.
+ */
+static unsigned long servedChans = (1UL<<KOCL_NR_CHANNELS)-1;
+static int chanDev[KOCL_NR_CHANNELS];
+static int chanPool[KOCL_NR_CHANNELS];
+static int poolDev[KOCL_MAX_POOLS];
+static int nPools;
+static cl_command_queue mapQueue[KOCL_MAX_POOLS];  /* to map pool segments */
+/*
+ * A pool of a device with fine-grained SVM is clSVMAlloc()ed: kernels
+ * take pointers into it, clSetKernelArgSVMPointer(), and a request needs
+ * no buffers, views or maps of its own. KOCL_SVM=0 turns it off.
+ */
+static int poolSvm[KOCL_MAX_POOLS];
+
+/*
+ * A set of queues per channel, channel 0 and 1 both on the NVIDIA GPU
+ * have their own, so that a helper thread per channel shares nothing.
+ *
+ * A request takes a slot and runs on the least loaded queue, up to
+ * queueDepth requests share an in-order queue: their commands, and
+ * the stage markers after them, are ordered by the queue. Overlap
+ * comes from the queues, nQueues of them, see gpu_set_queues().
+ */
+cl_command_queue  cmdQueue[KOCL_NR_CHANNELS][GPU_MAX_QUEUES];
+static int nQueues[KOCL_NR_CHANNELS];
+static int queueDepth[KOCL_NR_CHANNELS];
+static int queueLoad[KOCL_NR_CHANNELS][GPU_MAX_QUEUES];
+static int Queueuses[KOCL_NR_CHANNELS][MAX_SLOTS]; /* queue+1, 0: free */
+
+/*
+ * Streaming: a queue each way per channel for the copies of chunked
+ * requests, on devices that work on copies, see gpu_launch_chunked().
+ */
+#define GPU_DEF_CHUNK (1UL<<20)
+static cl_command_queue upQueue[KOCL_NR_CHANNELS], downQueue[KOCL_NR_CHANNELS];
+static unsigned long chunkSize = GPU_DEF_CHUNK;
+
+/* pinned pool segments of each device, see gpu_alloc_pinned_mem() */
+static cl_mem pinBufs[KOCL_MAX_POOLS][KOCL_POOL_MAX_SEGS];
+static void *pinPtrs[KOCL_MAX_POOLS][KOCL_POOL_MAX_SEGS];
+static void *pinMaps[KOCL_MAX_POOLS][KOCL_POOL_MAX_SEGS];   /* huge pages */
+static unsigned long pinMapSizes[KOCL_MAX_POOLS][KOCL_POOL_MAX_SEGS];
+static int nPinBufs[KOCL_MAX_POOLS];
+
+/*
+ * Sub-buffer views over the pinned pools, so that a request's buffers
+ * need no clCreateBuffer(CL_MEM_USE_HOST_PTR) and no pinning of their
+ * own. Views are cached by address and size, a view in use is never
+ * evicted. Without a free slot, or at an offset the device can't start
+ * a sub-buffer at, a request gets no view and the service creates its
+ * buffers as before.
+ */
+#define GPU_VIEW_SLOTS 256
+#define GPU_VIEW_WAYS 4
+
+struct gpu_view {
+    cl_mem mem;
+    void *p;
+    unsigned long size;
+    int users;
+};
 
-char   plat_name[10240];
-char device_name[10240];
+static struct gpu_view views[KOCL_MAX_POOLS][GPU_VIEW_SLOTS];
+static unsigned long viewAlign[KOCL_MAX_POOLS];  /* bytes */
+/* views and the segments, the growing thread adds segments */
+static pthread_mutex_t viewLock = PTHREAD_MUTEX_INITIALIZER;
 
-cl_mem  hostPinBuf, hostPinBuf2, hostPinBuf3;
+/*
+ * Profiling, helper -P: the request queues are created with
+ * CL_QUEUE_PROFILING_ENABLE and the events services give their
+ * commands, kocl_prof_event(), are read when a request is done, see
+ * gpu_prof_collect(). Per device: bytes and time of the transfers each
+ * way, kernel time, how long commands waited to be submitted and to
+ * start, and the time the device was busy with any of them, the rest
+ * of the time between the first and the last command is idle.
+ */
+struct gpu_prof {
+    unsigned long long h2d_bytes, h2d_n, h2d_ns;
+    unsigned long long d2h_bytes, d2h_n, d2h_ns;
+    unsigned long long kern_n, kern_ns;
+    unsigned long long queued_ns;   /* queued to submitted */
+    unsigned long long submit_ns;   /* submitted to started */
+    unsigned long long busy_ns, idle_ns, first, last_end;
+    unsigned long long nreqs;
+    unsigned long long lost;        /* events not profiled, out of memory */
+};
 
-void * buff_arr[3]={0};  
+static int gpuProf;
+static int profInterval;            /* s between dumps, 0: at exit only */
+static struct gpu_prof profs[GPU_MAX_DEVICES];
+static pthread_mutex_t profLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t profThread;
+static int profThreadOn, profStop;
+static pthread_cond_t profCond = PTHREAD_COND_INITIALIZER;
+
+
+
+#ifndef CL_DEVICE_PCI_BUS_ID_NV
+#define CL_DEVICE_PCI_BUS_ID_NV 0x4008
+#endif
+#ifndef CL_DEVICE_PCI_SLOT_ID_NV
+#define CL_DEVICE_PCI_SLOT_ID_NV 0x4009
+#endif
+
+/*
+ * The NUMA node of a PCI device from sysfs, by the KHR or the NVIDIA
+ * PCI address query. -1 for devices without one, like CPUs, or with a
+ * driver that doesn't tell.
+ */
+static int gpu_device_node(cl_device_id id)
+{
+    unsigned int dom = 0, bus, slot, fn = 0;
+    char path[64];
+    FILE *f;
+    int node = -1;
+#ifdef CL_DEVICE_PCI_BUS_INFO_KHR
+    cl_device_pci_bus_info_khr pci;
 
+    if (clGetDeviceInfo(id, CL_DEVICE_PCI_BUS_INFO_KHR, sizeof(pci), &pci, NULL)
+	== CL_SUCCESS) {
+	dom = pci.pci_domain;
+	bus = pci.pci_bus;
+	slot = pci.pci_device;
+	fn = pci.pci_function;
+    } else
+#endif
+    if (clGetDeviceInfo(id, CL_DEVICE_PCI_BUS_ID_NV, sizeof(bus), &bus, NULL)
+	!= CL_SUCCESS
+	|| clGetDeviceInfo(id, CL_DEVICE_PCI_SLOT_ID_NV, sizeof(slot), &slot, NULL)
+	!= CL_SUCCESS)
+	return -1;
 
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node",
+	     dom, bus, slot, fn);
+    f = fopen(path, "r");
+    if (!f)
+	return -1;
+    if (fscanf(f, "%d", &node) != 1)
+	node = -1;
+    fclose(f);
+    return node;
+}
 
 /*Get the OpenCL platforms and devices */
-int GetHw(){    
+int GetHw(){
+    char name[256];
+    cl_platform_id ids[KOCL_MAX_PLATFORMS];
+    cl_uint n = 0;
+    struct gpu_device *d;
+    int i, j;
+
+    const char *only = getenv("KOCL_PLATFORM");
+
+    if (clGetPlatformIDs(KOCL_MAX_PLATFORMS, ids, &n) != CL_SUCCESS)
+	n = 0;
+    if (n > KOCL_MAX_PLATFORMS)
+	n = KOCL_MAX_PLATFORMS;
+
+    for (i=0; i<n; ++i) {
+	struct gpu_platform *pl = &plats[nPlats];
+	cl_uint nd = 0;
 
-    
-    cl_err(clGetPlatformIDs(0, NULL, &numPlatforms));
-    platforms =(cl_platform_id*)malloc(numPlatforms*sizeof(cl_platform_id));
+	if (clGetPlatformInfo(ids[i], CL_PLATFORM_NAME, sizeof(name), name, NULL)
+	    != CL_SUCCESS)
+	    strcpy(name, "?");
+	printf("Platform %d = %s\n", i, name);
+	/* KOCL_PLATFORM=name: only the platforms with that in their name */
+	if (only && *only && !strstr(name, only))
+	    continue;
 
-    cl_err(clGetPlatformIDs(numPlatforms, platforms , NULL));   
-    
-    for(int i=0;i<numPlatforms;++i){        
-      cl_err(clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, 10240, plat_name, NULL));
-       printf("Platform %d = %s\n", i ,plat_name );
+	if (clGetDeviceIDs(ids[i], CL_DEVICE_TYPE_ALL, 0, NULL, &nd) != CL_SUCCESS
+	    || !nd)
+	    continue;
+	if (nd > GPU_MAX_DEVICES - nDevs)
+	    nd = GPU_MAX_DEVICES - nDevs;
+	if (!nd)
+	    break;
+	pl->id = ids[i];
+	pl->ndevs = nd;
+	pl->devs = (cl_device_id*)malloc(nd*sizeof(cl_device_id));
+	cl_err(clGetDeviceIDs(ids[i], CL_DEVICE_TYPE_ALL, nd, pl->devs, NULL));
+
+	for (j=0; j<nd; ++j) {
+	    d = &gdevs[nDevs++];
+	    d->plat = nPlats;
+	    d->id = pl->devs[j];
+	    d->pool = -1;
+	    d->node = gpu_device_node(d->id);
+	    cl_err(clGetDeviceInfo(d->id, CL_DEVICE_TYPE, sizeof(d->type), &d->type, NULL));
+	    if (clGetDeviceInfo(d->id, CL_DEVICE_HOST_UNIFIED_MEMORY,
+				sizeof(d->unified), &d->unified, NULL) != CL_SUCCESS)
+		d->unified = CL_FALSE;
+	    d->zerocopy = d->unified || (d->type & CL_DEVICE_TYPE_CPU);
+	    d->svm = 0;
+#ifdef CL_VERSION_2_0
+	    {
+		cl_device_svm_capabilities svm;
+
+		if (clGetDeviceInfo(d->id, CL_DEVICE_SVM_CAPABILITIES, sizeof(svm),
+				    &svm, NULL) == CL_SUCCESS)
+		    d->svm = (svm & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+	    }
+#endif
+	    cl_err(clGetDeviceInfo(d->id, CL_DEVICE_NAME, sizeof(name), name, NULL));
+	    printf("Device %d = %s, %s memory%s\n", nDevs-1, name,
+		   d->unified? "host": "own", d->svm? ", SVM": "");
+	}
+	nPlats++;
     }
 
-    cl_err(clGetDeviceIDs(platforms[0],CL_DEVICE_TYPE_ALL,0,NULL, &numDevices));
-    devices =(cl_device_id*)malloc(numDevices*sizeof(cl_device_id));
-    cl_err(clGetDeviceIDs(platforms[0],CL_DEVICE_TYPE_ALL, numDevices , devices ,NULL));	
-    for(int i=0;i<numDevices;++i){        
-	    cl_err(clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(device_name), device_name, NULL)); 
-        printf("Device %d = %s\n", i, device_name );	 
+    return nDevs? 0: -1;
+}
+
+/* the first device of the kind, unified -1 for any */
+static int gpu_find_device(cl_device_type type, int unified)
+{
+    int i;
+
+    for (i=0; i<nDevs; i++)
+	if ((gdevs[i].type & type)
+	    && (unified < 0 || !gdevs[i].unified == !unified))
+	    return i;
+    return -1;
+}
+
+static void gpu_map_channels(void)
+{
+    static const struct { cl_device_type type; int unified; } kind[KOCL_NR_CHANNELS] = {
+	{ CL_DEVICE_TYPE_GPU, 0 }, { CL_DEVICE_TYPE_GPU, 0 },
+	{ CL_DEVICE_TYPE_GPU, 1 }, { CL_DEVICE_TYPE_CPU, -1 },
+    };
+    const char *zc = getenv("KOCL_ZEROCOPY");
+    const char *svm = getenv("KOCL_SVM");
+    int c, d;
+
+    for (c=0; c<KOCL_NR_CHANNELS; c++) {
+	d = gpu_find_device(kind[c].type, kind[c].unified);
+	if (d < 0)
+	    d = gpu_find_device(kind[c].type, -1);
+	if (d < 0)
+	    d = gpu_find_device(CL_DEVICE_TYPE_GPU, -1);
+	if (d < 0)
+	    d = 0;
+	chanDev[c] = d;
+	if (!(servedChans & (1UL<<c))) {
+	    chanPool[c] = -1;
+	    continue;
+	}
+	if (gdevs[d].pool < 0 && nPools < KOCL_MAX_POOLS) {
+	    gdevs[d].pool = nPools;
+	    poolDev[nPools++] = d;
+	}
+	chanPool[c] = gdevs[d].pool < 0? 0: gdevs[d].pool;
     }
 
-    cl_err(clGetDeviceIDs(platforms[1],CL_DEVICE_TYPE_ALL,0,NULL, &numDevices2));
-    devices2 =(cl_device_id*)malloc(numDevices2*sizeof(cl_device_id));
-    cl_err(clGetDeviceIDs(platforms[1],CL_DEVICE_TYPE_ALL, numDevices2 , devices2 ,NULL));   	
-    for(int i=0;i<numDevices2;++i){        
-	    cl_err(clGetDeviceInfo(devices2[i], CL_DEVICE_NAME, sizeof(device_name), device_name, NULL)); 
-         printf("Device %d = %s\n", i, device_name ); 
+    /* KOCL_ZEROCOPY=0 or 1 overrides what the devices tell */
+    if (zc && *zc)
+	for (d=0; d<nDevs; d++)
+	    gdevs[d].zerocopy = atoi(zc) != 0;
+
+    /* SVM only where the device works on host memory anyway */
+    for (c=0; c<nPools; c++) {
+	d = poolDev[c];
+	poolSvm[c] = gdevs[d].svm && gdevs[d].zerocopy && !(svm && !atoi(svm));
     }
-    
-  
-   return 0;
 }
 
+static void gpu_channel_device(int channel, cl_context *ctx, cl_device_id *dev)
+{
+    struct gpu_device *d = &gdevs[chanDev[channel]];
+
+    *ctx = plats[d->plat].ctx;
+    *dev = d->id;
+}
+
+static inline int gpu_channel(struct kocl_service_request *sreq)
+{
+    return (sreq->channel < 0 || sreq->channel >= KOCL_NR_CHANNELS)?
+	0: sreq->channel;
+}
 
+static void gpu_prof_dump(void);
+static void *gpu_prof_thread(void *arg);
 
 void gpu_init()
-{      
-    int i;
+{
+    int i, c;
+    cl_context ctx;
+    cl_device_id dev;
+    cl_uint align;
+    cl_int ret;
 
-    GetHw();
-    context = clCreateContext(NULL, numDevices ,devices , NULL, NULL, &ret);//Nvidia Platform1
-    cl_err(ret);
-    context2 = clCreateContext(NULL, numDevices2 ,devices2 , NULL, NULL, &ret);//Intel Platform2
-    cl_err(ret);
-
-    /*Using mapQueue to map the cl_mem buffer to host */
-    mapQueue = clCreateCommandQueue( context, devices[0], CL_QUEUE_PROFILING_ENABLE , &ret);//Nvidia GPU
-    cl_err(ret);
-    mapQueue2 = clCreateCommandQueue( context2, devices2[0], CL_QUEUE_PROFILING_ENABLE , &ret);//HD 530
-    cl_err(ret);
-    mapQueue3 = clCreateCommandQueue( context2, devices2[1], CL_QUEUE_PROFILING_ENABLE , &ret);//i7 CPU
-    cl_err(ret);       
-    
-    for (i=0; i<MAX_QUEUE_NR; i++) {                            /*CL_QUEUE_PROFILING_ENABLE,CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE*/
-        cmdQueue[i]= clCreateCommandQueue( context, devices[0], CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &ret);//Nvidia GPU-> channel 1
-        cl_err(ret);
-	    Queueuses[i] = 0;
-    }  
-     for (i=0; i<MAX_QUEUE_NR; i++) {                            /*CL_QUEUE_PROFILING_ENABLE,CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE*/
-        cmdQueue2[i]= clCreateCommandQueue( context2, devices2[0], CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &ret);//HD 530-> channel 2
-        cl_err(ret);
-	    Queueuses2[i] = 0;
-    }  
-    for (i=0; i<MAX_QUEUE_NR; i++) {                            /*CL_QUEUE_PROFILING_ENABLE,CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE*/
-        cmdQueue3[i]= clCreateCommandQueue( context2, devices2[1], CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &ret);//i7 CPU-> channel 3
+    if (GetHw()) {
+	fprintf(stderr, "no OpenCL device\n");
+	exit(1);
+    }
+    for (i=0; i<nPlats; i++) {
+	plats[i].ctx = clCreateContext(NULL, plats[i].ndevs, plats[i].devs,
+				       NULL, NULL, &ret);
+	cl_err(ret);
+    }
+    gpu_map_channels();
+
+    /* a queue per pool to map its segments to the host */
+    for (i=0; i<nPools; i++) {
+	struct gpu_device *d = &gdevs[poolDev[i]];
+
+	mapQueue[i] = clCreateCommandQueue(plats[d->plat].ctx, d->id,
+					   CL_QUEUE_PROFILING_ENABLE, &ret);
+	cl_err(ret);
+    }
+
+ for (c=0; c<KOCL_NR_CHANNELS; c++) {
+    if (chanPool[c] < 0) {
+	nQueues[c] = 0;
+	printf("channel %d: not served here\n", c);
+	continue;
+    }
+    gpu_channel_device(c, &ctx, &dev);
+    if (clGetDeviceInfo(dev, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(align),
+			&align, NULL) == CL_SUCCESS
+	&& align/8 > viewAlign[chanPool[c]])
+	viewAlign[chanPool[c]] = align/8;
+    if (!nQueues[c])
+	nQueues[c] = GPU_DEF_QUEUES;
+    if (!queueDepth[c])
+	queueDepth[c] = GPU_DEF_DEPTH;
+    if (nQueues[c]*queueDepth[c] > MAX_SLOTS)
+	queueDepth[c] = MAX_SLOTS/nQueues[c];
+    for (i=0; i<nQueues[c]; i++) {                            /*CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE*/
+        cmdQueue[c][i]= clCreateCommandQueue( ctx, dev,
+					      gpuProf? CL_QUEUE_PROFILING_ENABLE: 0, &ret);
         cl_err(ret);
-	    Queueuses3[i] = 0;
-    }  
-    printf("clCreateCommandQueue ok ~\n");     
+	    queueLoad[c][i] = 0;
+    }
+    for (i=0; i<MAX_SLOTS; i++)
+	Queueuses[c][i] = 0;
+    if (chunkSize && !gdevs[chanDev[c]].zerocopy) {
+	upQueue[c] = clCreateCommandQueue(ctx, dev,
+					  gpuProf? CL_QUEUE_PROFILING_ENABLE: 0, &ret);
+	cl_err(ret);
+	downQueue[c] = clCreateCommandQueue(ctx, dev,
+					    gpuProf? CL_QUEUE_PROFILING_ENABLE: 0, &ret);
+	cl_err(ret);
+    }
+    printf("channel %d: device %d, pool %d, %s, %d queues, %d requests each\n",
+	   c, chanDev[c], chanPool[c],
+	   poolSvm[chanPool[c]]? "SVM":
+	   gdevs[chanDev[c]].zerocopy? "zero-copy": "copies",
+	   nQueues[c], queueDepth[c]);
+ }
+    printf("clCreateCommandQueue ok ~\n");
+
+    if (gpuProf && profInterval > 0) {
+	if (pthread_create(&profThread, NULL, gpu_prof_thread, NULL))
+	    fprintf(stderr, "no profile thread, profiles at exit only\n");
+	else
+	    profThreadOn = 1;
+    }
+}
+
+/* before gpu_init(), 0 keeps the default */
+int gpu_set_queues(int channel, int queues, int depth)
+{
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS
+	|| queues < 0 || queues > GPU_MAX_QUEUES
+	|| depth < 0 || depth > MAX_SLOTS)
+	return -1;
+    nQueues[channel] = queues;
+    queueDepth[channel] = depth;
+    return 0;
+}
+
+/* the channels to serve, a bit each; before gpu_init() */
+void gpu_set_channels(unsigned long mask)
+{
+    servedChans = mask & ((1UL<<KOCL_NR_CHANNELS)-1);
+}
+
+/* bytes per chunk of a streamed request, 0 to not stream; before gpu_init() */
+void gpu_set_chunk(unsigned long size)
+{
+    chunkSize = size;
+}
+
+/* profile the requests' commands, dump every secs s, 0 at exit only; before gpu_init() */
+void gpu_set_profiling(int secs)
+{
+    gpuProf = 1;
+    profInterval = secs;
+}
+
+/* the platforms as services see them, see struct plat_set */
+void gpu_plat_set(struct plat_set *plat)
+{
+    int i;
+
+    memset(plat, 0, sizeof(*plat));
+    plat->nplatforms = nPlats;
+    for (i=0; i<nPlats; i++) {
+	plat->platforms[i].numDevices = plats[i].ndevs;
+	plat->platforms[i].devices = plats[i].devs;
+	plat->platforms[i].context = plats[i].ctx;
+    }
+    plat->platform1 = plat->platforms[0];
+    plat->platform2 = plat->platforms[nPlats > 1? 1: 0];
+}
+
+/* the platform of a channel's device, sr->platform before gpu_alloc_device_mem() */
+int gpu_channel_platform(int channel)
+{
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS)
+	channel = 0;
+    return gdevs[chanDev[channel]].plat;
 }
 
 void service_CLset(int (*CLsetup)(struct plat_set *plat)){
-    
-    struct plat_set plat;
 
-    plat.platform1.numDevices = numDevices;
-    plat.platform1.devices = devices;
-    plat.platform1.context = context;
+    struct plat_set plat;
 
-    plat.platform2.numDevices = numDevices2;
-    plat.platform2.devices = devices2;
-    plat.platform2.context = context2;
-   
+    gpu_plat_set(&plat);
     CLsetup(&plat);
-    printf("service_CLset ok ~\n");  
+    printf("service_CLset ok ~\n");
 }
 
 
 void gpu_finit()
 {
-    int i;
-   
-    for (i=0; i<MAX_QUEUE_NR; i++) {
-	cl_err( clReleaseCommandQueue(cmdQueue[i]));
-    }
-    for (i=0; i<MAX_QUEUE_NR; i++) {
-	cl_err( clReleaseCommandQueue(cmdQueue2[i]));
-    }
-    for (i=0; i<MAX_QUEUE_NR; i++) {
-	cl_err( clReleaseCommandQueue(cmdQueue3[i]));
+    int i, c;
+
+    if (profThreadOn) {
+	pthread_mutex_lock(&profLock);
+	profStop = 1;
+	pthread_cond_signal(&profCond);
+	pthread_mutex_unlock(&profLock);
+	pthread_join(profThread, NULL);
+	profThreadOn = 0;
     }
+    if (gpuProf)
+	gpu_prof_dump();
+
+    for (c=0; c<KOCL_NR_CHANNELS; c++)
+	for (i=0; i<nQueues[c]; i++) {
+	    cl_err( clReleaseCommandQueue(cmdQueue[c][i]));
+	}
+    for (c=0; c<KOCL_NR_CHANNELS; c++)
+	if (upQueue[c]) {
+	    clReleaseCommandQueue(upQueue[c]);
+	    clReleaseCommandQueue(downQueue[c]);
+	}
+    for (i=0; i<nPools; i++)
+	clReleaseCommandQueue(mapQueue[i]);
 
-    clReleaseContext(context);
-    clReleaseContext(context2);
-    free(devices);
-    free(devices2);
-    free(platforms);    
+    for (i=0; i<nPlats; i++) {
+	clReleaseContext(plats[i].ctx);
+	free(plats[i].devs);
+    }
 }
 
 cl_command_queue gpu_get_cmdQueue(struct kocl_service_request *sreq)
 {
-    if (sreq->queue_id < 0 || sreq->queue_id >= MAX_QUEUE_NR){
+    if (sreq->queue_id < 0 || sreq->queue_id >= MAX_SLOTS){
 	    return 0;
     }else{
-	    if(sreq->channel==2){
-            return (cl_command_queue)cmdQueue2[sreq->queue_id];
-        }else if(sreq->channel==3){
-            return (cl_command_queue)cmdQueue3[sreq->queue_id];
-        }else{
-            return (cl_command_queue)cmdQueue[sreq->queue_id];
-        }
+            return sreq->queue;
     }
 }
 
-/*Allocate Hoast Pinned memory */
-void **gpu_alloc_pinned_mem(unsigned long size) {
+int gpu_nr_pools(void)
+{
+    return nPools;
+}
+
+int gpu_pool_node(int pool)
+{
+    if (pool < 0 || pool >= nPools)
+	return -1;
+    return gdevs[poolDev[pool]].node;
+}
+
+/* -1 for a channel of another helper */
+int gpu_channel_pool(int channel)
+{
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS)
+	return 0;
+    return chanPool[channel];
+}
+
+/* requests the channel runs at once, its queues times their depth */
+int gpu_channel_slots(int channel)
+{
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS)
+	return 0;
+    return nQueues[channel]*queueDepth[channel];
+}
+
+/* 1 if the channel's device is the host CPU */
+int gpu_channel_cpu(int channel)
+{
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS)
+	return 0;
+    return (gdevs[chanDev[channel]].type & CL_DEVICE_TYPE_CPU) != 0;
+}
+
+static void gpu_pool_device(int pool, cl_context *ctx, cl_command_queue *q)
+{
+    if (pool < 0 || pool >= nPools)
+	pool = 0;
+    *ctx = plats[gdevs[poolDev[pool]].plat].ctx;
+    *q = mapQueue[pool];
+}
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+/* populated anonymous huge pages of hugesz bytes, size is a multiple */
+static void *gpu_map_huge(unsigned long size, unsigned long hugesz)
+{
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+	     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE
+	     |((__builtin_ctzl(hugesz)) << MAP_HUGE_SHIFT), -1, 0);
+    return p == MAP_FAILED? NULL: p;
+}
 
-    void *h, *h2, *h3;    
+/*
+ * Allocate Hoast Pinned memory, one more segment of a device's pool.
+ * With *hugesz the segment is backed by huge pages of that size that
+ * the device uses in place, *hugesz is cleared if it falls back to
+ * driver allocated memory.
+ * May be called from the pool growing thread.
+ */
+void *gpu_alloc_pinned_mem(int pool, unsigned long size, unsigned long *hugesz) {
+
+    cl_context ctx;
+    cl_command_queue q;
     cl_event map_event;
+    cl_mem buf;
+    cl_int e;
+    void *h, *m = NULL;
+    int n = nPinBufs[pool];
 
-    hostPinBuf = clCreateBuffer( context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR , size , NULL , &ret);
-    cl_err(ret);
-    h = clEnqueueMapBuffer( mapQueue, hostPinBuf, CL_TRUE , CL_MAP_WRITE, 0 , size , 0 , NULL, &map_event, &ret);
-    cl_err(ret);
-    clWaitForEvents(1, &map_event);
+    if (n >= KOCL_POOL_MAX_SEGS)
+	return NULL;
+    gpu_pool_device(pool, &ctx, &q);
 
-    hostPinBuf2 = clCreateBuffer( context2, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR , size , NULL , &ret);
-    cl_err(ret);
-    h2 =clEnqueueMapBuffer( mapQueue2, hostPinBuf2, CL_TRUE , CL_MAP_WRITE, 0 , size , 0 , NULL, &map_event, &ret);
-    cl_err(ret);
-    clWaitForEvents(1, &map_event);
+#ifdef CL_VERSION_2_0
+    if (poolSvm[pool]) {
+	/* the driver's memory, there are no huge pages for it */
+	*hugesz = 0;
+	h = clSVMAlloc(ctx, CL_MEM_READ_WRITE | CL_MEM_SVM_FINE_GRAIN_BUFFER, size, 0);
+	if (!h) {
+	    fprintf(stderr, "pool %d: can't allocate %lu bytes of SVM\n",
+		    pool, size);
+	    return NULL;
+	}
+	buf = NULL;
+	goto added;
+    }
+#endif
+
+    if (*hugesz) {
+	m = gpu_map_huge(size, *hugesz);
+	if (!m) {
+	    fprintf(stderr, "pool %d: no %lu KB huge pages, use normal pages\n",
+		    pool, *hugesz>>10);
+	    *hugesz = 0;
+	}
+    }
 
-    hostPinBuf3 = clCreateBuffer( context2, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR , size , NULL , &ret);
-    cl_err(ret);
-    h3 =clEnqueueMapBuffer( mapQueue3, hostPinBuf3, CL_TRUE , CL_MAP_WRITE, 0 , size , 0 , NULL, &map_event, &ret);
-    cl_err(ret);
+    if (m)
+	buf = clCreateBuffer( ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR , size , m , &e);
+    else
+	buf = clCreateBuffer( ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR , size , NULL , &e);
+    if (e != CL_SUCCESS) {
+	fprintf(stderr, "pool %d: can't create %lu bytes pinned buffer: %s\n",
+		pool, size, getErrorString(e));
+	if (m)
+	    munmap(m, size);
+	return NULL;
+    }
+    h = clEnqueueMapBuffer( q, buf, CL_TRUE , CL_MAP_WRITE, 0 , size , 0 , NULL, &map_event, &e);
+    if (e != CL_SUCCESS) {
+	fprintf(stderr, "pool %d: can't map pinned buffer: %s\n",
+		pool, getErrorString(e));
+	clReleaseMemObject(buf);
+	if (m)
+	    munmap(m, size);
+	return NULL;
+    }
     clWaitForEvents(1, &map_event);
-   
-    buff_arr[0]=h;  //Nvidia GPU
-    buff_arr[1]=h2; //HD 530
-    buff_arr[2]=h3; //i7 cpu
 
-    return buff_arr;
+#ifdef CL_VERSION_2_0
+added:
+#endif
+    pthread_mutex_lock(&viewLock);
+    pinBufs[pool][n] = buf;
+    pinPtrs[pool][n] = h;
+    pinMaps[pool][n] = m;
+    pinMapSizes[pool][n] = size;
+    nPinBufs[pool] = n+1;
+    pthread_mutex_unlock(&viewLock);
+
+    return h;
 }
 
 
-void gpu_free_pinned_mem(struct kocl_gpu_mem_info *p) {
+void gpu_free_pinned_mem(void) {
 
+    cl_context ctx;
+    cl_command_queue q;
     cl_event map_event; 
-    clEnqueueUnmapMemObject(mapQueue, hostPinBuf , p->uva , 0 , NULL , &map_event); 
-    clWaitForEvents(1, &map_event);
-    clReleaseMemObject(hostPinBuf);
-    
-    clEnqueueUnmapMemObject(mapQueue2, hostPinBuf2 , p->uva2 , 0 , NULL , &map_event); 
-    clWaitForEvents(1, &map_event);
-    clReleaseMemObject(hostPinBuf2);
+    int i, j;
 
-    clEnqueueUnmapMemObject(mapQueue3, hostPinBuf3 , p->uva3 , 0 , NULL , &map_event); 
-    clWaitForEvents(1, &map_event);
-    clReleaseMemObject(hostPinBuf3);
+    for (i=0; i<KOCL_MAX_POOLS; i++) {
+	for (j=0; j<GPU_VIEW_SLOTS; j++)
+	    if (views[i][j].mem) {
+		clReleaseMemObject(views[i][j].mem);
+		views[i][j].mem = NULL;
+	    }
+	gpu_pool_device(i, &ctx, &q);
+	for (j=0; j<nPinBufs[i]; j++) {
+#ifdef CL_VERSION_2_0
+	    if (!pinBufs[i][j]) {
+		clSVMFree(ctx, pinPtrs[i][j]);
+		continue;
+	    }
+#endif
+	    clEnqueueUnmapMemObject(q, pinBufs[i][j] , pinPtrs[i][j] , 0 , NULL , &map_event); 
+	    clWaitForEvents(1, &map_event);
+	    clReleaseMemObject(pinBufs[i][j]);
+	    if (pinMaps[i][j])
+		munmap(pinMaps[i][j], pinMapSizes[i][j]);
+	    pinMaps[i][j] = NULL;
+	}
+	nPinBufs[i] = 0;
+    }
 }
 
 static int __check_cmdQueue_done(cl_command_queue Q)
@@ -226,76 +722,456 @@ static int __check_cmdQueue_done(cl_command_queue Q)
     return 0;
 }
 
-int gpu_execution_finished(struct kocl_service_request *sreq)
+/* units of a streamable request, 0 if its sizes don't fit the service's */
+unsigned long gpu_chunk_units(struct kocl_service_request *sreq)
+{
+    struct kocl_service *s = sreq->s;
+    unsigned long n;
+
+    if (!s->chunk_out)
+	return 0;
+    n = s->chunk_in? sreq->insize/s->chunk_in: sreq->outsize/s->chunk_out;
+    if ((s->chunk_in? n*s->chunk_in != sreq->insize: n*s->chunk_out != sreq->outsize)
+	|| n*s->chunk_out > sreq->outsize)
+	return 0;
+    return n;
+}
+
+/* 1 if the request is worth streaming, before prepare */
+int gpu_can_chunk(struct kocl_service_request *sreq)
+{
+    struct kocl_service *s = sreq->s;
+    int c = gpu_channel(sreq);
+    unsigned long unit;
+
+    if (!s->launch_chunk || sreq->zerocopy || sreq->nbatch || sreq->nchain
+	|| !chunkSize || !upQueue[c])
+	return 0;
+    unit = s->chunk_in > s->chunk_out? s->chunk_in: s->chunk_out;
+    return gpu_chunk_units(sreq)*unit >= 2*chunkSize;
+}
+
+/*
+ * Launch a streamed request: chunk by chunk, its upload on the
+ * channel's up queue, a barrier on the request's queue for it, the
+ * service's kernels and the download on the down queue behind them.
+ * Chunk i+1 is uploaded while chunk i runs and chunk i-1 is read back,
+ * and the request's queue waits for the last download at the end, so
+ * the stage marker covers the whole request.
+ */
+int gpu_launch_chunked(struct kocl_service_request *sreq)
+{
+    struct kocl_service *s = sreq->s;
+    int c = gpu_channel(sreq), r = 0;
+    unsigned long nunits = gpu_chunk_units(sreq), per, first, n;
+    unsigned long iu = s->chunk_in? s->chunk_in: s->chunk_out, ou = s->chunk_out;
+    cl_mem in = s->chunk_in? sreq->InputBuf: sreq->OutputBuf;
+    char *hin = (char*)(s->chunk_in? sreq->hin: sreq->hout);
+    char *hout = (char*)sreq->hout;
+    cl_event w, k, d = NULL, *pe;
+
+    per = chunkSize/(iu > ou? iu: ou);
+    if (!per)
+	per = 1;
+    for (first=0; first<nunits; first+=n) {
+	n = nunits-first < per? nunits-first: per;
+	cl_err(clEnqueueWriteBuffer(upQueue[c], in, CL_FALSE, first*iu, n*iu,
+				    hin+first*iu, 0, NULL, &w));
+	if ((pe = kocl_prof_event(sreq, KOCL_PROF_WRITE, n*iu)))
+	    clRetainEvent(*pe = w);
+	cl_err(clEnqueueBarrierWithWaitList(sreq->queue, 1, &w, NULL));
+	clReleaseEvent(w);
+	if ((r = s->launch_chunk(sreq, first, n)))
+	    break;
+	cl_err(clEnqueueMarkerWithWaitList(sreq->queue, 0, NULL, &k));
+	if (d)
+	    clReleaseEvent(d);
+	cl_err(clEnqueueReadBuffer(downQueue[c], sreq->OutputBuf, CL_FALSE,
+				   first*ou, n*ou, hout+first*ou, 1, &k, &d));
+	if ((pe = kocl_prof_event(sreq, KOCL_PROF_READ, n*ou)))
+	    clRetainEvent(*pe = d);
+	clReleaseEvent(k);
+    }
+    clFlush(upQueue[c]);
+    clFlush(sreq->queue);
+    clFlush(downQueue[c]);
+    if (d) {
+	cl_err(clEnqueueMarkerWithWaitList(sreq->queue, 1, &d, NULL));
+	clReleaseEvent(d);
+    }
+    return r;
+}
+
+static void CL_CALLBACK gpu_stage_notify(cl_event e, cl_int st, void *arg)
+{
+    uint64_t one = 1;
+
+    if (write((int)(long)arg, &one, sizeof(one)) < 0)
+	;   /* it's full, so it'll wake up anyway */
+}
+
+/*
+ * Mark the end of what a service has enqueued for a stage. Queues are
+ * in order, so a marker without a wait list completes with all of the
+ * request's commands, and those of the requests before it there. A
+ * helper waiting on sreq->evfd is woken up when it does.
+ */
+void gpu_mark_stage(struct kocl_service_request *sreq)
 {
     cl_command_queue Q = (cl_command_queue)gpu_get_cmdQueue(sreq);
-    return __check_cmdQueue_done(Q);
+
+    if (sreq->event || !Q)
+	return;
+    if (clEnqueueMarkerWithWaitList(Q, 0, NULL, &sreq->event) != CL_SUCCESS)
+	sreq->event = NULL;
+    else if (sreq->evfd >= 0)
+	clSetEventCallback(sreq->event, CL_COMPLETE, gpu_stage_notify,
+			   (void*)(long)sreq->evfd);
+    /* get the commands to the device, nobody waits on the queue now */
+    clFlush(Q);
+}
+
+/* 1 if the stage is done, without blocking when there is an event */
+static int __check_stage_done(struct kocl_service_request *sreq)
+{
+    cl_int st;
+    cl_int e;
+
+    if (!sreq->event)
+	return __check_cmdQueue_done(gpu_get_cmdQueue(sreq));
+
+    e = clGetEventInfo(sreq->event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+		       sizeof(cl_int), &st, NULL);
+    if (e == CL_SUCCESS && st > CL_COMPLETE)
+	return 0;
+    if (e != CL_SUCCESS || st < 0)
+	fprintf(stderr, "request %d: commands failed: %s\n", sreq->id,
+		getErrorString(e != CL_SUCCESS? e: st));
+
+    clReleaseEvent(sreq->event);
+    sreq->event = NULL;
+    return 1;
+}
+
+int gpu_execution_finished(struct kocl_service_request *sreq)
+{
+    return __check_stage_done(sreq);
 }
 
 int gpu_post_finished(struct kocl_service_request *sreq)
 {
-    cl_command_queue Q = (cl_command_queue)gpu_get_cmdQueue(sreq);
-    return __check_cmdQueue_done(Q);
+    return __check_stage_done(sreq);
+}
+
+static cl_mem gpu_get_view(int pool, void *p, unsigned long size)
+{
+    struct gpu_view *v, *slot = NULL;
+    cl_buffer_region r;
+    cl_mem m = NULL;
+    cl_int e;
+    char *b;
+    int i, s;
+
+    /* SVM pools need none */
+    if (!p || !size || poolSvm[pool])
+	return NULL;
+
+    s = (((unsigned long)p >> 12) ^ ((unsigned long)p >> 5) ^ size)
+	% GPU_VIEW_SLOTS;
+
+    pthread_mutex_lock(&viewLock);
+    for (i=0; i<GPU_VIEW_WAYS; i++) {
+	v = &views[pool][(s+i) % GPU_VIEW_SLOTS];
+	if (v->mem && v->p == p && v->size == size) {
+	    v->users++;
+	    m = v->mem;
+	    goto out;
+	}
+	/* an empty slot, or else the first one nobody uses */
+	if (!v->users && (!slot || (slot->mem && !v->mem)))
+	    slot = v;
+    }
+    if (!slot)
+	goto out;
+
+    for (i=0; i<nPinBufs[pool]; i++) {
+	b = (char*)pinPtrs[pool][i];
+	if ((char*)p >= b && (char*)p+size <= b+pinMapSizes[pool][i])
+	    break;
+    }
+    if (i == nPinBufs[pool])
+	goto out;
+    r.origin = (char*)p - b;
+    r.size = size;
+    if (viewAlign[pool] && r.origin % viewAlign[pool])
+	goto out;
+
+    m = clCreateSubBuffer(pinBufs[pool][i], CL_MEM_READ_WRITE,
+			  CL_BUFFER_CREATE_TYPE_REGION, &r, &e);
+    if (e != CL_SUCCESS) {
+	m = NULL;
+	goto out;
+    }
+    if (slot->mem)
+	clReleaseMemObject(slot->mem);
+    slot->mem = m;
+    slot->p = p;
+    slot->size = size;
+    slot->users = 1;
+out:
+    pthread_mutex_unlock(&viewLock);
+    return m;
+}
+
+static void gpu_put_view(int pool, cl_mem m)
+{
+    int i;
+
+    if (!m)
+	return;
+    pthread_mutex_lock(&viewLock);
+    for (i=0; i<GPU_VIEW_SLOTS; i++)
+	if (views[pool][i].mem == m) {
+	    views[pool][i].users--;
+	    break;
+	}
+    pthread_mutex_unlock(&viewLock);
+}
+
+/*
+ * The segment p is in, its buffer (NULL in an SVM pool), its start and
+ * p's offset there.
+ */
+int gpu_pool_locate(int channel, void *p, unsigned long size,
+		    cl_mem *buf, void **base, unsigned long *off)
+{
+    int i, r = -1, pool = gpu_channel_pool(channel);
+    char *b;
+
+    if (pool < 0)
+	return -1;
+    pthread_mutex_lock(&viewLock);
+    for (i=0; i<nPinBufs[pool]; i++) {
+	b = (char*)pinPtrs[pool][i];
+	if ((char*)p >= b && (char*)p+size <= b+pinMapSizes[pool][i]) {
+	    *buf = pinBufs[pool][i];
+	    *base = b;
+	    *off = (char*)p - b;
+	    r = 0;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&viewLock);
+    return r;
 }
 
-/*set platform context args */
+static int gpu_in_pool(struct kocl_service_request *sreq, void *p,
+		       unsigned long size)
+{
+    cl_mem buf;
+    void *base;
+    unsigned long off;
+
+    return !size || !gpu_pool_locate(sreq->channel, p, size, &buf, &base, &off);
+}
+
+/*set platform context args and the views of the request's buffers */
 int gpu_alloc_device_mem(struct kocl_service_request *sreq)
 {           
-     if(sreq->channel==2 || sreq->channel==3 ){
-             sreq->context=context2;
-        }else{
-            sreq->context=context;
-        }   
+    cl_device_id dev;
+    int pool = gpu_channel_pool(gpu_channel(sreq));
+
+    gpu_channel_device(gpu_channel(sreq), &sreq->context, &dev);
+    sreq->platform = gdevs[chanDev[gpu_channel(sreq)]].plat;
+    sreq->zerocopy = gdevs[chanDev[gpu_channel(sreq)]].zerocopy;
+    sreq->svm = poolSvm[pool] && (sreq->nbatch
+				  || (gpu_in_pool(sreq, sreq->hin, sreq->insize)
+				      && gpu_in_pool(sreq, sreq->hout, sreq->outsize)));
+    sreq->inview = gpu_get_view(pool, sreq->hin, sreq->insize);
+    sreq->outview = gpu_get_view(pool, sreq->hout, sreq->outsize);
     return 0;
 }
 
+void gpu_free_device_mem(struct kocl_service_request *sreq)
+{
+    int pool = gpu_channel_pool(gpu_channel(sreq));
+
+    gpu_put_view(pool, sreq->inview);
+    gpu_put_view(pool, sreq->outview);
+    sreq->inview = sreq->outview = NULL;
+}
+
 
 int gpu_alloc_cmdQueue(struct kocl_service_request *sreq)
 {
-    int i;
+    int i, q = 0, c = gpu_channel(sreq);
 
-     if(sreq->channel==2){
-            for (i=0; i<MAX_QUEUE_NR; i++) {
-	            if (!Queueuses2[i]) {
-	                Queueuses2[i] = 1;
-	                sreq->queue_id = i;
-	                sreq->queue = (cl_command_queue)(cmdQueue2[i]);             
-	                return 0;
-	            }         
-            }
-    }else if(sreq->channel==3){
-             for (i=0; i<MAX_QUEUE_NR; i++) {
-	            if (!Queueuses3[i]) {
-	                Queueuses3[i] = 1;
-	                sreq->queue_id = i;
-	                sreq->queue = (cl_command_queue)(cmdQueue3[i]);             
-	                return 0;
-	            }         
-            }
-    }else{//channel 0 or 1
-            for (i=0; i<MAX_QUEUE_NR; i++) {
-	            if (!Queueuses[i]) {
-	                Queueuses[i] = 1;
+    for (i=1; i<nQueues[c]; i++)
+	if (queueLoad[c][i] < queueLoad[c][q])
+	    q = i;
+    if (queueLoad[c][q] >= queueDepth[c])
+	return 1;
+
+            for (i=0; i<MAX_SLOTS; i++) {
+	            if (!Queueuses[c][i]) {
+	                Queueuses[c][i] = q+1;
+	                queueLoad[c][q]++;
 	                sreq->queue_id = i;
-	                sreq->queue = (cl_command_queue)(cmdQueue[i]);             
+	                sreq->queue = (cl_command_queue)(cmdQueue[c][q]);             
+	                sreq->prof = gpuProf;
 	                return 0;
 	            }         
             }
-    }    
     return 1;
 }
 
 void gpu_free_cmdQueue(struct kocl_service_request *sreq)
 {
-    if (sreq->queue_id >= 0 && sreq->queue_id < MAX_QUEUE_NR) {
-        if(sreq->channel==2){
-	        Queueuses2[sreq->queue_id] = 0;
-        }else if(sreq->channel==3){
-            Queueuses3[sreq->queue_id] = 0;
-        }else{
-            Queueuses[sreq->queue_id] = 0;
-        }    
+    /* a failed request may still have its stage marker */
+    if (sreq->event) {
+	clReleaseEvent(sreq->event);
+	sreq->event = NULL;
+    }
+    if (sreq->queue_id >= 0 && sreq->queue_id < MAX_SLOTS) {
+	int c = gpu_channel(sreq), q = Queueuses[c][sreq->queue_id]-1;
+
+	if (q >= 0)
+	    queueLoad[c][q]--;
+	Queueuses[c][sreq->queue_id] = 0;
+	sreq->queue_id = -1;
     }
 }
 
+static cl_ulong gpu_prof_info(cl_event e, cl_profiling_info what)
+{
+    cl_ulong t = 0;
+
+    if (clGetEventProfilingInfo(e, what, sizeof(t), &t, NULL) != CL_SUCCESS)
+	return 0;
+    return t;
+}
+
+/*
+ * Add up the profiled commands of a done request for its device and
+ * release their events. Commands without profiling info, failed or
+ * never run, are skipped.
+ */
+void gpu_prof_collect(struct kocl_service_request *sreq)
+{
+    struct gpu_prof *g;
+    struct kocl_prof_event *p;
+    cl_ulong q, sub, st, end;
+    int i;
+
+    if (!sreq->nprof && !sreq->lostprof)
+	return;
+    g = &profs[chanDev[gpu_channel(sreq)]];
+    pthread_mutex_lock(&profLock);
+    g->nreqs++;
+    g->lost += sreq->lostprof;
+    for (i=0; i<sreq->nprof; i++) {
+	p = &sreq->pev[i];
+	if (!p->e)
+	    continue;
+	q = gpu_prof_info(p->e, CL_PROFILING_COMMAND_QUEUED);
+	sub = gpu_prof_info(p->e, CL_PROFILING_COMMAND_SUBMIT);
+	st = gpu_prof_info(p->e, CL_PROFILING_COMMAND_START);
+	end = gpu_prof_info(p->e, CL_PROFILING_COMMAND_END);
+	clReleaseEvent(p->e);
+	p->e = NULL;
+	if (!st || end < st)
+	    continue;
 
+	switch (p->kind) {
+	case KOCL_PROF_WRITE:
+	    g->h2d_bytes += p->bytes;
+	    g->h2d_n++;
+	    g->h2d_ns += end-st;
+	    break;
+	case KOCL_PROF_READ:
+	    g->d2h_bytes += p->bytes;
+	    g->d2h_n++;
+	    g->d2h_ns += end-st;
+	    break;
+	default:
+	    g->kern_n++;
+	    g->kern_ns += end-st;
+	    break;
+	}
+	if (q && sub >= q)
+	    g->queued_ns += sub-q;
+	if (sub && st >= sub)
+	    g->submit_ns += st-sub;
+
+	/* busy: the union of the commands, as they come about in order */
+	if (!g->first) {
+	    g->first = st;
+	    g->last_end = st;
+	}
+	if (st > g->last_end) {
+	    g->idle_ns += st-g->last_end;
+	    g->busy_ns += end-st;
+	    g->last_end = end;
+	} else if (end > g->last_end) {
+	    g->busy_ns += end-g->last_end;
+	    g->last_end = end;
+	}
+    }
+    pthread_mutex_unlock(&profLock);
+    sreq->nprof = sreq->lostprof = 0;
+}
+
+/* a line per device that did something, key=value */
+static void gpu_prof_dump(void)
+{
+    struct gpu_prof *g;
+    unsigned long long span;
+    int i;
+
+    pthread_mutex_lock(&profLock);
+    for (i=0; i<nDevs; i++) {
+	g = &profs[i];
+	if (!g->nreqs)
+	    continue;
+	span = g->last_end-g->first;
+	printf("kocl_prof dev=%d reqs=%llu"
+	       " h2d_bytes=%llu h2d_n=%llu h2d_us=%llu h2d_MBps=%llu"
+	       " d2h_bytes=%llu d2h_n=%llu d2h_us=%llu d2h_MBps=%llu"
+	       " kern_n=%llu kern_us=%llu"
+	       " queued_us=%llu submit_us=%llu"
+	       " busy_us=%llu idle_us=%llu span_us=%llu busy_pct=%llu"
+	       " lost=%llu\n",
+	       i, g->nreqs,
+	       g->h2d_bytes, g->h2d_n, g->h2d_ns/1000,
+	       g->h2d_ns? g->h2d_bytes*1000/g->h2d_ns: 0,
+	       g->d2h_bytes, g->d2h_n, g->d2h_ns/1000,
+	       g->d2h_ns? g->d2h_bytes*1000/g->d2h_ns: 0,
+	       g->kern_n, g->kern_ns/1000,
+	       g->queued_ns/1000, g->submit_ns/1000,
+	       g->busy_ns/1000, g->idle_ns/1000, span/1000,
+	       span? g->busy_ns*100/span: 0, g->lost);
+    }
+    pthread_mutex_unlock(&profLock);
+    fflush(stdout);
+}
+
+static void *gpu_prof_thread(void *arg)
+{
+    struct timespec t;
+
+    pthread_mutex_lock(&profLock);
+    while (!profStop) {
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_sec += profInterval;
+	while (!profStop
+	       && pthread_cond_timedwait(&profCond, &profLock, &t) != ETIMEDOUT)
+	    ;
+	if (profStop)
+	    break;
+	pthread_mutex_unlock(&profLock);
+	gpu_prof_dump();
+	pthread_mutex_lock(&profLock);
+    }
+    pthread_mutex_unlock(&profLock);
+    return NULL;
+}
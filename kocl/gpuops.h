@@ -15,20 +15,39 @@
 #include <CL/cl.h>
 
  void gpu_init();
+ int gpu_set_queues(int channel, int queues, int depth);
+ void gpu_set_channels(unsigned long mask);
+ void gpu_set_chunk(unsigned long size);
+ void gpu_set_profiling(int secs);
  void gpu_finit();
 
  void service_CLset(int (*CLsetup)(struct plat_set *plat));
-
- void **gpu_alloc_pinned_mem(unsigned long size);
- void gpu_free_pinned_mem(struct kocl_gpu_mem_info *p);
+ void gpu_plat_set(struct plat_set *plat);
+ int gpu_channel_platform(int channel);
+
+ int gpu_nr_pools(void);
+ int gpu_channel_pool(int channel);
+ int gpu_channel_cpu(int channel);
+ int gpu_channel_slots(int channel);
+ int gpu_pool_node(int pool);
+ void *gpu_alloc_pinned_mem(int pool, unsigned long size,
+			    unsigned long *hugesz);
+ void gpu_free_pinned_mem(void);
+ int gpu_pool_locate(int channel, void *p, unsigned long size,
+		     cl_mem *buf, void **base, unsigned long *off);
  
  int gpu_alloc_device_mem(struct kocl_service_request *sreq);
  void gpu_free_device_mem(struct kocl_service_request *sreq);
  int gpu_alloc_cmdQueue(struct kocl_service_request *sreq);
  void gpu_free_cmdQueue(struct kocl_service_request *sreq);
 
+ unsigned long gpu_chunk_units(struct kocl_service_request *sreq);
+ int gpu_can_chunk(struct kocl_service_request *sreq);
+ int gpu_launch_chunked(struct kocl_service_request *sreq);
+ void gpu_mark_stage(struct kocl_service_request *sreq);
  int gpu_execution_finished(struct kocl_service_request *sreq);
  int gpu_post_finished(struct kocl_service_request *sreq);
+ void gpu_prof_collect(struct kocl_service_request *sreq);
 
  cl_command_queue gpu_get_cmdQueue(struct kocl_service_request *sreq);
 
@@ -23,6 +23,15 @@ static cl_int _opencl_safe_call(cl_int e, const char *file, int line) {
     return e;
 }
 
+/* cl_err() that tells and goes on, for errors the caller handles */
+#define cl_warn(...) _opencl_warn_call(__VA_ARGS__, __FILE__, __LINE__)
+static inline cl_int _opencl_warn_call(cl_int e, const char *file, int line) {
+    if (e!=CL_SUCCESS)
+	fprintf(stderr, "KOCL Warning: %s %d %s\n",
+		file, line, getErrorString(e));
+    return e;
+}
+
 static const char *getErrorString(cl_int error)
 {
 switch(error){
@@ -11,6 +11,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -22,33 +23,178 @@
 #include <errno.h>
 #include <string.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <time.h>
 #include "list.h"
 #include "helper.h"
 #include "gpuops.h"
 
+/*
+ * A pipeline moves the requests of channels first..last through their
+ * states. The helper runs one pipeline for all channels, or with -t a
+ * thread with its own pipeline per channel, so that a slow device
+ * doesn't hold up the others.
+ */
+struct kh_pipeline {
+    int first, last;
+    pthread_t thread;
+
+    /* lists of requests of different states */
+    struct list_head all_reqs;
+    struct list_head init_reqs;
+    struct list_head memdone_reqs;
+    struct list_head prepared_reqs;
+    struct list_head running_reqs;
+    struct list_head post_exec_reqs;
+    struct list_head done_reqs;
+
+    /* unused request items, see kh_alloc_service_request() */
+    struct list_head free_reqs;
+
+    /* finished by the native workers, see kh_native_run() */
+    pthread_mutex_t native_lock;
+    struct list_head native_done;
+
+    /* stage markers and native workers wake the pipeline, see kh_wait_ns() */
+    int evfd;
+};
+
 struct _kocl_sritem {
     struct kocl_service_request sr;
+    struct kh_pipeline *p;
     struct list_head glist;
     struct list_head list;
+    struct list_head members;  /* of a merged request, see kh_coalesce() */
+    int merged;                /* tried by kh_coalesce() */
+    /* a request of a native lane, see kh_native_submit() */
+    int npending;              /* pieces not done yet */
+    int nerr;                  /* KOCL_* error of a piece */
+    struct kh_piece *pieces;
 };
 
+/*
+ * Native lanes: requests of a service with a host implementation, on
+ * the channels of native_mask, are cut into pieces of at least
+ * KH_NATIVE_PIECE bytes, which the worker threads (-w) take from a
+ * common queue. With no workers the pipeline thread runs them itself.
+ */
+#define KH_NATIVE_PIECE (256UL<<10)
+#define KH_MAX_WORKERS 64
+
+struct kh_piece {
+    struct _kocl_sritem *sreq;
+    unsigned long first, n;
+    struct kh_piece *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct kh_piece *head, *tail;
+    int stop;
+} kh_work = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
+
+static int native_mask = -1;  /* -x, -1: the channels of a CPU device */
+static int nworkers = -1;      /* -w, -1: one per online CPU */
+static pthread_t workers[KH_MAX_WORKERS];
+static int nworkers_on;
+
+static void kh_init_native(void);
+static void kh_finit_native(void);
+
+static struct kh_pipeline pipes[KOCL_NR_CHANNELS];
+static int npipes = 1;
+static int threaded;
+static unsigned long coalesce_size;  /* -c, 0: don't merge requests */
+
+/*
+ * -S us: a busy pipeline spins for what comes next when one of its
+ * requests is expected to finish within this, and blocks otherwise,
+ * see kh_wait_ns(). -1 always spins.
+ */
+static long long spin_ns = 50000;
+#define KH_MAX_BLOCK_NS 10000000LL   /* in case no one wakes us */
+
 static int devfd;
 
+/* per-channel sq/cq rings mmap-ed from kocl, NULL when using read()/write() */
+static void *ringmem;
+static struct kocl_ring_info ringinfo;
+static struct kocl_sq_ring *sqs[KOCL_NR_CHANNELS];
+static struct kocl_cq_ring *cqs[KOCL_NR_CHANNELS];
+static int use_ring = 1;
+
+/* the scatter-gather window for kocl_map_sg(), -g MB, 0: none */
+static unsigned long sg_size = 64UL<<20;
+static void *sgmem;
+
+/* read()/write() batching when there are no rings */
+#define KH_IO_BATCH 64
+static struct kocl_ku_response resps[KH_IO_BATCH];
+static int nresps;
+
 struct kocl_gpu_mem_info hostbuf;
 
+static inline unsigned long long kh_now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+/* a request's KOCL_TS_* i, the first time it gets there */
+static inline void kh_stamp(struct kocl_service_request *sr, int i)
+{
+    if (sr->ts[i])
+	return;
+    sr->ts[i] = kh_now();
+}
+
+/* a service's recent time of a stage, a running average */
+static inline void kh_ewma(unsigned long long *avg, unsigned long long from,
+			   unsigned long long to)
+{
+    unsigned long long d = to > from? to - from: 0;
+
+    if (!from)
+	return;
+    *avg = *avg? *avg - *avg/8 + d/8: d;
+}
+
+/*
+ * Initial and maximum pool sizes, per device. The discrete GPU starts
+ * big, the others small, all of them grow on demand up to their max.
+ */
+static unsigned long pool_size[KOCL_MAX_POOLS] = {
+    KOCL_BUF_SIZE, KOCL_BUF_SIZE/4, KOCL_BUF_SIZE/8,
+};
+static unsigned long pool_max[KOCL_MAX_POOLS] = {
+    KOCL_BUF_SIZE*4, KOCL_BUF_SIZE, KOCL_BUF_SIZE,
+};
+/* 0, or the huge page size backing the pools */
+static unsigned long huge_size;
+/* -N pool:node, KH_NODE_AUTO for the device's node, see gpu_pool_node() */
+#define KH_NODE_AUTO (-2)
+#define KH_MAX_NODES 64
+static int pool_node[KOCL_MAX_POOLS] = {
+    [0 ... KOCL_MAX_POOLS-1] = KH_NODE_AUTO,
+};
+
+static pthread_t grow_thread;
+static int grow_thread_on;
+
 volatile int kh_loop_continue = 1;
 
 static char *service_lib_dir;
 static char *kocldev;
 
-/* lists of requests of different states */
-LIST_HEAD(all_reqs);
-LIST_HEAD(init_reqs);
-LIST_HEAD(memdone_reqs);
-LIST_HEAD(prepared_reqs);
-LIST_HEAD(running_reqs);
-LIST_HEAD(post_exec_reqs);
-LIST_HEAD(done_reqs);
 
 #define ssc(...) _safe_syscall(__VA_ARGS__, __FILE__, __LINE__)
 
@@ -63,10 +209,172 @@ int _safe_syscall(int r, const char *file, int line)
 }
 
 
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1<<1)
+#endif
+
+/*
+ * Keep size bytes at p on node, moving the pages already there: the
+ * driver's pinned memory and MAP_POPULATE-d huge pages are faulted in
+ * before we see them. Preferred, not bound, a full node still works.
+ */
+static void kh_bind_node(void *p, unsigned long size, int node)
+{
+    unsigned long mask[(KH_MAX_NODES+8*sizeof(long)-1)/(8*sizeof(long))] = {0};
+
+    if (node < 0 || node >= KH_MAX_NODES)
+	return;
+    mask[node/(8*sizeof(long))] = 1UL << (node % (8*sizeof(long)));
+    if (syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, KH_MAX_NODES+1,
+		MPOL_MF_MOVE) < 0)
+	kh_log(KOCL_LOG_ALERT, "can't place %lu bytes on node %d: %s\n",
+	       size, node, strerror(errno));
+}
+
+/* run the calling thread on the CPUs of node */
+static void kh_pin_node(int node)
+{
+    char path[64];
+    cpu_set_t set;
+    FILE *f;
+    int a, b, n;
+
+    if (node < 0)
+	return;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (!f)
+	return;
+    CPU_ZERO(&set);
+    /* like 0-7,16-23 */
+    while ((n = fscanf(f, "%d-%d", &a, &b)) >= 1) {
+	if (n == 1)
+	    b = a;
+	for (; a<=b && a<CPU_SETSIZE; a++)
+	    CPU_SET(a, &set);
+	if (fgetc(f) != ',')
+	    break;
+    }
+    fclose(f);
+    if (CPU_COUNT(&set) && sched_setaffinity(0, sizeof(set), &set) < 0)
+	kh_log(KOCL_LOG_ALERT, "can't run on node %d: %s\n", node, strerror(errno));
+}
+
+/*
+ * A pinned, locked segment of *size bytes for a pool. With huge pages
+ * *size is rounded to them: up for a new pool, down when growing so
+ * that max_size holds, and a too small growth just uses normal pages.
+ */
+static void *kh_alloc_pool_mem(int pool, unsigned long *size, int grow)
+{
+    unsigned long huge = huge_size;
+    void *p;
+
+    if (huge && grow && *size < huge)
+	huge = 0;
+    if (huge)
+	*size = grow? round_down(*size, huge): round_up(*size, huge);
+
+    /* huge pages come aligned, driver memory might need the spare page */
+    p = gpu_alloc_pinned_mem(pool, huge? *size: *size+PAGE_SIZE, &huge);
+    if (!p)
+	return NULL;
+    kh_log(KOCL_LOG_PRINT, "pool %d: %lu bytes at %p%s\n", pool, *size, p,
+	   huge? " on huge pages": "");
+    kh_bind_node(p, *size, hostbuf.pools[pool].node);
+
+    /* MAP_POPULATE has faulted in huge pages already */
+    if (!huge)
+	memset(p, 0, *size);//防止copy on write 所以每個page配給它一個值
+    ssc( mlock(p, *size));
+    return p;
+}
+
+/* add segments to the pools kocl asks to grow */
+static void *kh_grow_pools(void *arg)
+{
+    struct kocl_pool_grow g;
+
+    while (1) {
+	if (ioctl(devfd, KOCL_IOC_WAIT_GROW, (unsigned long)&g) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+
+	g.size = round_up(g.size, PAGE_SIZE);
+	g.uva = kh_alloc_pool_mem(g.pool, &g.size, 1);
+	if (!g.uva)
+	    continue;
+	if (ioctl(devfd, KOCL_IOC_GROW_POOL, (unsigned long)&g) < 0)
+	    perror("Grow pool");
+    }
+
+    return NULL;
+}
+
+static void kh_init_pipeline(struct kh_pipeline *p, int first, int last)
+{
+    p->first = first;
+    p->last = last;
+    INIT_LIST_HEAD(&p->all_reqs);
+    INIT_LIST_HEAD(&p->init_reqs);
+    INIT_LIST_HEAD(&p->memdone_reqs);
+    INIT_LIST_HEAD(&p->prepared_reqs);
+    INIT_LIST_HEAD(&p->running_reqs);
+    INIT_LIST_HEAD(&p->post_exec_reqs);
+    INIT_LIST_HEAD(&p->done_reqs);
+    INIT_LIST_HEAD(&p->free_reqs);
+    pthread_mutex_init(&p->native_lock, NULL);
+    INIT_LIST_HEAD(&p->native_done);
+    p->evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (p->evfd < 0)
+	kh_log(KOCL_LOG_ERROR, "no eventfd, channels %d..%d spin while busy\n",
+	       first, last);
+}
+
+static void kh_wake_pipeline(struct kh_pipeline *p)
+{
+    uint64_t one = 1;
+
+    if (p->evfd >= 0 && write(p->evfd, &one, sizeof(one)) < 0)
+	;   /* it's full, so it'll wake up anyway */
+}
+
+/* threads need a request source per channel, that is the rings */
+static void kh_init_pipelines(void)
+{
+    int i;
+
+    if (threaded && !ringmem) {
+	kh_log(KOCL_LOG_ERROR, "threads need the rings, run one thread\n");
+	threaded = 0;
+    }
+
+    if (!threaded) {
+	npipes = 1;
+	kh_init_pipeline(&pipes[0], 0, KOCL_NR_CHANNELS-1);
+	return;
+    }
+
+    npipes = 0;
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	if (hostbuf.chan_pool[i] >= 0)
+	    kh_init_pipeline(&pipes[npipes++], i, i);
+    if (!npipes) {
+	kh_log(KOCL_LOG_ERROR, "no channel has a pool, nothing to serve\n");
+	exit(1);
+    }
+    kh_log(KOCL_LOG_PRINT, "one pipeline thread per channel\n");
+}
+
 static int kh_init(void)
 {
     int  i, len, r;
-    void **p;
+    int grow = 0;
     
     devfd = ssc(open(kocldev, O_RDWR));
 
@@ -75,23 +383,27 @@ static int kh_init(void)
     kh_log(KOCL_LOG_PRINT,"gpu_init() ok\n");
 
     /* alloc GPU Pinned memory buffers */
-    p = (void**)gpu_alloc_pinned_mem(KOCL_BUF_SIZE+PAGE_SIZE); 
-
-    hostbuf.uva = p[0];
-    hostbuf.uva2 = p[1];
-    hostbuf.uva3 = p[2];
-    hostbuf.size = KOCL_BUF_SIZE;
-
-    kh_log(KOCL_LOG_PRINT,"hostbuf.uva1 :%p \n", hostbuf.uva);
-    kh_log(KOCL_LOG_PRINT,"hostbuf.uva2 :%p \n", hostbuf.uva2);
-    kh_log(KOCL_LOG_PRINT,"hostbuf.uva3 :%p \n", hostbuf.uva3);
-
-    memset(hostbuf.uva, 0, KOCL_BUF_SIZE);//防止copy on write 所以每個page配給它一個值
-    ssc( mlock(hostbuf.uva, KOCL_BUF_SIZE));
-    memset(hostbuf.uva2, 0, KOCL_BUF_SIZE);//防止copy on write 所以每個page配給它一個值
-    ssc( mlock(hostbuf.uva2, KOCL_BUF_SIZE));
-     memset(hostbuf.uva3, 0, KOCL_BUF_SIZE);//防止copy on write 所以每個page配給它一個值
-    ssc( mlock(hostbuf.uva3, KOCL_BUF_SIZE));
+    memset(&hostbuf, 0, sizeof(struct kocl_gpu_mem_info));
+    hostbuf.npools = gpu_nr_pools();
+    for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	hostbuf.chan_pool[i] = gpu_channel_pool(i);
+	hostbuf.chan_slots[i] = gpu_channel_slots(i);
+    }
+    for (i=0; i<hostbuf.npools; i++) {
+	hostbuf.pools[i].size = round_up(pool_size[i], PAGE_SIZE);
+	hostbuf.pools[i].max_size = pool_max[i];
+	hostbuf.pools[i].node = pool_node[i] == KH_NODE_AUTO?
+	    gpu_pool_node(i): pool_node[i];
+	if (hostbuf.pools[i].node >= 0)
+	    kh_log(KOCL_LOG_PRINT, "pool %d: node %d\n", i, hostbuf.pools[i].node);
+	hostbuf.pools[i].uva = kh_alloc_pool_mem(i, &hostbuf.pools[i].size, 0);
+	if (!hostbuf.pools[i].uva) {
+	    kh_log(KOCL_LOG_ERROR, "no pinned memory for pool %d\n", i);
+	    abort();
+	}
+	if (pool_max[i] > hostbuf.pools[i].size)
+	    grow = 1;
+    }
 
     /* tell kernel the buffers */
     r = ioctl(devfd, KOCL_IOC_SET_GPU_BUFS, (unsigned long)&hostbuf);
@@ -100,6 +412,52 @@ static int kh_init(void)
 	abort();
     }
 
+    if (grow) {
+	if (pthread_create(&grow_thread, NULL, kh_grow_pools, NULL))
+	    kh_log(KOCL_LOG_ERROR, "no pool growing thread, pools are fixed\n");
+	else
+	    grow_thread_on = 1;
+    }
+
+    /* map the request rings, fall back to read()/write() without them */
+    if (use_ring) {
+	if (ioctl(devfd, KOCL_IOC_SETUP_RING, (unsigned long)&ringinfo) < 0) {
+	    perror("Setup rings, use read/write instead");
+	} else {
+	    ringmem = mmap(NULL, ringinfo.size, PROT_READ|PROT_WRITE,
+			   MAP_SHARED, devfd, 0);
+	    if (ringmem == MAP_FAILED) {
+		perror("Map rings, use read/write instead");
+		ringmem = NULL;
+	    } else {
+		/* the area has the rings of other helpers' channels too */
+		for (i=0; i<KOCL_NR_CHANNELS && i<ringinfo.nchannels; i++) {
+		    char *base = (char*)ringmem + i*ringinfo.chan_size;
+
+		    if (hostbuf.chan_pool[i] < 0)
+			continue;
+		    sqs[i] = (struct kocl_sq_ring*)(base + ringinfo.sq_off);
+		    cqs[i] = (struct kocl_cq_ring*)(base + ringinfo.cq_off);
+		}
+		kh_log(KOCL_LOG_PRINT, "using %u-entry request rings\n",
+		       ringinfo.nentries);
+	    }
+	}
+    }
+
+    /* the services see the pages kocl puts there as any host memory */
+    if (sg_size) {
+	sgmem = mmap(NULL, sg_size, PROT_READ|PROT_WRITE, MAP_SHARED, devfd,
+		     KOCL_SG_OFFSET);
+	if (sgmem == MAP_FAILED) {
+	    perror("Map scatter-gather window");
+	    sgmem = NULL;
+	}
+    }
+
+    kh_init_pipelines();
+    kh_init_native();
+
     return 0;
 }
 
@@ -109,17 +467,80 @@ static int kh_finit(void)
     int i;
 
     ioctl(devfd, KOCL_IOC_SET_STOP);
+    kh_finit_native();
+    if (grow_thread_on)
+	pthread_join(grow_thread, NULL);
+    if (ringmem)
+	munmap(ringmem, ringinfo.size);
+    if (sgmem)
+	munmap(sgmem, sg_size);
     close(devfd);
     gpu_finit();
 
-    gpu_free_pinned_mem(&hostbuf);
+    gpu_free_pinned_mem();
+
+    return 0;
+}
+
+/*
+ * Enter kocl to hand over posted responses, and to sleep for
+ * requests with KOCL_RING_ENTER_WAIT.
+ */
+static int kh_ring_enter(int channel, unsigned int flags)
+{
+    struct kocl_ring_enter re;
+    int r;
+
+    re.channel = channel;
+    re.flags = flags;
+    r = ioctl(devfd, KOCL_IOC_RING_ENTER, (unsigned long)&re);
+    if (r < 0 && errno != EINTR) {
+	perror("Ring enter");
+	abort();
+    }
+    return r;
+}
+
+static int kh_cq_pending(struct kocl_cq_ring *cq)
+{
+    return cq->hdr.tail != __atomic_load_n(&cq->hdr.head, __ATOMIC_ACQUIRE);
+}
 
+/*
+ * Write all batched responses in one syscall.
+ */
+static int kh_flush_responses(void)
+{
+    if (nresps) {
+	ssc(write(devfd, resps, nresps*sizeof(struct kocl_ku_response)));
+	nresps = 0;
+    }
     return 0;
 }
 
-static int kh_send_response(struct kocl_ku_response *resp)
+static int kh_send_response(struct kocl_ku_response *resp, int channel)
 {
-    ssc(write(devfd, resp, sizeof(struct kocl_ku_response)));
+    struct kocl_cq_ring *cq;
+    unsigned int tail;
+
+    if (!ringmem) {
+	if (nresps == KH_IO_BATCH)
+	    kh_flush_responses();
+	resps[nresps++] = *resp;
+	return 0;
+    }
+
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS)
+	channel = 0;
+    cq = cqs[channel];
+
+    tail = cq->hdr.tail;
+    while (tail - __atomic_load_n(&cq->hdr.head, __ATOMIC_ACQUIRE)
+	   >= ringinfo.nentries)
+	kh_ring_enter(channel, 0);
+
+    cq->entries[tail & (ringinfo.nentries-1)] = *resp;
+    __atomic_store_n(&cq->hdr.tail, tail+1, __ATOMIC_RELEASE);
     return 0;
 }
 
@@ -128,32 +549,240 @@ static void kh_fail_request(struct _kocl_sritem *sreq, int serr)
     sreq->sr.state = KOCL_REQ_DONE;
     sreq->sr.errcode = serr;
     list_del(&sreq->list);
-    list_add_tail(&sreq->list, &done_reqs);
+    list_add_tail(&sreq->list, &sreq->p->done_reqs);
+}
+
+/*
+ * Request items come from the pipeline's free list, which grows by
+ * KH_SRITEM_CHUNK items and never shrinks, so taking a request doesn't
+ * go to malloc(). Only the pipeline's thread uses its list.
+ */
+#define KH_SRITEM_CHUNK 64
+
+/*
+ * Requests wait on the stage lists by priority, FIFO within one, so
+ * that the once per loop stages, prepare and launch, take the most
+ * urgent request first.
+ */
+static void kh_queue_request(struct _kocl_sritem *sreq, struct list_head *lst)
+{
+    struct list_head *pos;
+
+    for (pos = lst->prev; pos != lst; pos = pos->prev)
+	if (list_entry(pos, struct _kocl_sritem, list)->sr.prio >= sreq->sr.prio)
+	    break;
+    list_add(&sreq->list, pos);
 }
 
-static struct _kocl_sritem *kh_alloc_service_request()
+static struct _kocl_sritem *kh_alloc_service_request(struct kh_pipeline *p)
 {
-    struct _kocl_sritem *s = (struct _kocl_sritem *)
-	malloc(sizeof(struct _kocl_sritem));
-    if (s) {
-    	memset(s, 0, sizeof(struct _kocl_sritem));
-	INIT_LIST_HEAD(&s->list);
-	INIT_LIST_HEAD(&s->glist);
+    struct _kocl_sritem *s;
+    int i;
+
+    if (list_empty(&p->free_reqs)) {
+	s = (struct _kocl_sritem *)
+	    malloc(KH_SRITEM_CHUNK*sizeof(struct _kocl_sritem));
+	if (!s)
+	    return NULL;
+	for (i=0; i<KH_SRITEM_CHUNK; i++)
+	    list_add_tail(&s[i].list, &p->free_reqs);
     }
+
+    s = list_first_entry(&p->free_reqs, struct _kocl_sritem, list);
+    list_del(&s->list);
+    memset(&s->sr, 0, sizeof(struct kocl_service_request));
+    s->sr.evfd = p->evfd;
+    s->p = p;
+    s->merged = 0;
+    INIT_LIST_HEAD(&s->list);
+    INIT_LIST_HEAD(&s->glist);
+    INIT_LIST_HEAD(&s->members);
     return s;
 }
 
 static void kh_free_service_request(struct _kocl_sritem *s)
 {
-    free(s);
+    free(s->sr.batch);
+    free(s->sr.pev);
+    list_add(&s->list, &s->p->free_reqs);
+}
+
+/* 1 if the request goes to the service's host implementation */
+static int kh_native_lane(struct _kocl_sritem *sreq)
+{
+    int c = sreq->sr.channel;
+
+    return sreq->sr.s->native && !sreq->sr.nchain && c >= 0 && c < KOCL_NR_CHANNELS
+	&& (native_mask & (1<<c));
+}
+
+/* the last piece of a request hands it back to its pipeline */
+static void kh_native_run(struct kh_piece *pc)
+{
+    struct _kocl_sritem *sreq = pc->sreq;
+    struct kh_pipeline *p = sreq->p;
+    int r;
+
+    r = sreq->sr.s->native(&sreq->sr, pc->first, pc->n);
+    if (r)
+	__atomic_store_n(&sreq->nerr, r, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&sreq->npending, 1, __ATOMIC_ACQ_REL))
+	return;
+
+    pthread_mutex_lock(&p->native_lock);
+    list_add_tail(&sreq->list, &p->native_done);
+    pthread_mutex_unlock(&p->native_lock);
+    kh_wake_pipeline(p);
+}
+
+static void *kh_native_worker(void *arg)
+{
+    struct kh_piece *pc;
+
+    for (;;) {
+	pthread_mutex_lock(&kh_work.lock);
+	while (!kh_work.head && !kh_work.stop)
+	    pthread_cond_wait(&kh_work.cond, &kh_work.lock);
+	pc = kh_work.head;
+	if (pc) {
+	    kh_work.head = pc->next;
+	    if (!kh_work.head)
+		kh_work.tail = NULL;
+	}
+	pthread_mutex_unlock(&kh_work.lock);
+
+	if (!pc)
+	    break;
+	kh_native_run(pc);
+    }
+    return NULL;
+}
+
+static void kh_native_submit(struct _kocl_sritem *sreq)
+{
+    struct kh_piece one;
+    unsigned long nunits = gpu_chunk_units(&sreq->sr), per, size;
+    struct kh_piece *pcs;
+    int npieces = 1, i;
+
+    size = sreq->sr.insize > sreq->sr.outsize?
+	sreq->sr.insize: sreq->sr.outsize;
+    if (!nunits)
+	nunits = 1;
+    if (nworkers_on) {
+	npieces = (size + KH_NATIVE_PIECE-1)/KH_NATIVE_PIECE;
+	if (npieces > nworkers_on)
+	    npieces = nworkers_on;
+	if (npieces > nunits)
+	    npieces = nunits;
+	if (npieces < 1)
+	    npieces = 1;
+    }
+    per = (nunits + npieces-1)/npieces;
+    npieces = (nunits + per-1)/per;
+
+    pcs = malloc(npieces*sizeof(*pcs));
+    sreq->pieces = pcs;
+    sreq->nerr = 0;
+    sreq->npending = npieces;
+    sreq->sr.state = KOCL_REQ_RUNNING;
+    kh_stamp(&sreq->sr, KOCL_TS_LAUNCHED);
+    if (!pcs) {
+	/* all of it here, now */
+	pcs = &one;
+	npieces = 1;
+	sreq->npending = 1;
+	per = nunits;
+    }
+    for (i=0; i<npieces; i++) {
+	pcs[i].sreq = sreq;
+	pcs[i].first = i*per;
+	pcs[i].n = i == npieces-1? nunits - i*per: per;
+	pcs[i].next = i == npieces-1? NULL: &pcs[i+1];
+    }
+
+    if (!nworkers_on || pcs == &one) {
+	for (i=0; i<npieces; i++)
+	    kh_native_run(&pcs[i]);
+	return;
+    }
+
+    pthread_mutex_lock(&kh_work.lock);
+    if (kh_work.tail)
+	kh_work.tail->next = pcs;
+    else
+	kh_work.head = pcs;
+    kh_work.tail = &pcs[npieces-1];
+    pthread_cond_broadcast(&kh_work.cond);
+    pthread_mutex_unlock(&kh_work.lock);
+}
+
+/* requests the workers are done with go to done_reqs */
+static void kh_native_reap(struct kh_pipeline *p)
+{
+    struct _kocl_sritem *sreq;
+
+    pthread_mutex_lock(&p->native_lock);
+    while (!list_empty(&p->native_done)) {
+	sreq = list_entry(p->native_done.next, struct _kocl_sritem, list);
+	list_del(&sreq->list);
+	free(sreq->pieces);
+	sreq->pieces = NULL;
+	sreq->sr.state = KOCL_REQ_DONE;
+	sreq->sr.errcode = sreq->nerr;
+	kh_stamp(&sreq->sr, KOCL_TS_EXECUTED);
+	kh_stamp(&sreq->sr, KOCL_TS_POSTED);
+	list_add_tail(&sreq->list, &p->done_reqs);
+    }
+    pthread_mutex_unlock(&p->native_lock);
+}
+
+static void kh_init_native(void)
+{
+    int c;
+
+    if (native_mask < 0) {
+	native_mask = 0;
+	for (c=0; c<KOCL_NR_CHANNELS; c++)
+	    if (gpu_channel_cpu(c) && hostbuf.chan_pool[c] >= 0)
+		native_mask |= 1<<c;
+    }
+    if (!native_mask)
+	return;
+
+    if (nworkers < 0)
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers > KH_MAX_WORKERS)
+	nworkers = KH_MAX_WORKERS;
+    for (nworkers_on=0; nworkers_on<nworkers; nworkers_on++)
+	if (pthread_create(&workers[nworkers_on], NULL, kh_native_worker, NULL)) {
+	    perror("Create native worker");
+	    break;
+	}
+    kh_log(KOCL_LOG_PRINT, "native lanes 0x%x, %d workers\n",
+	   native_mask, nworkers_on);
 }
 
-static void kh_init_service_request(struct _kocl_sritem *item,
-			       struct kocl_ku_request *kureq)
+static void kh_finit_native(void)
 {
-    list_add_tail(&item->glist, &all_reqs);
+    int i;
+
+    pthread_mutex_lock(&kh_work.lock);
+    kh_work.stop = 1;
+    pthread_cond_broadcast(&kh_work.cond);
+    pthread_mutex_unlock(&kh_work.lock);
+    for (i=0; i<nworkers_on; i++)
+	pthread_join(workers[i], NULL);
+}
+
+static void kh_init_service_request(struct kh_pipeline *p,
+				    struct _kocl_sritem *item,
+				    struct kocl_ku_request *kureq)
+{
+    item->p = p;
+    list_add_tail(&item->glist, &p->all_reqs);
+    kh_stamp(&item->sr, KOCL_TS_RECV);
 
-    memset(&item->sr, 0, sizeof(struct kocl_service_request));
     item->sr.id = kureq->id;
     item->sr.hin = kureq->in;
     item->sr.hout = kureq->out;
@@ -163,7 +792,12 @@ static void kh_init_service_request(struct _kocl_sritem *item,
     item->sr.datasize = kureq->datasize;
     item->sr.queue_id = -1;
     item->sr.channel= kureq->channel;
-    item->sr.s = kh_lookup_service(kureq->service_name); 
+    item->sr.prio = kureq->prio;
+    item->sr.ctx = kureq->ctx;
+    item->sr.nchain = kureq->nchain < 0 || kureq->nchain > KOCL_CHAIN_MAX?
+	0: kureq->nchain;
+    item->sr.chain = kureq->chain;
+    item->sr.s = kh_lookup_service_id(kureq->sid, kureq->service_name);
     if (!item->sr.s) {
 	    dbg("can't find service\n");
 	    kh_fail_request(item, KOCL_NO_SERVICE);
@@ -171,65 +805,321 @@ static void kh_init_service_request(struct _kocl_sritem *item,
 	    item->sr.s->compute_size(&item->sr);
 	    item->sr.state = KOCL_REQ_INIT;
 	    item->sr.errcode = 0;
-	    list_add_tail(&item->list, &init_reqs);
+	    if (kh_native_lane(item))
+		kh_native_submit(item);
+	    else
+		kh_queue_request(item, &p->init_reqs);
+    }
+}
+
+/*
+ * Take all requests kocl has put into one channel's sq ring.
+ */
+static int kh_ring_reap_channel(struct kh_pipeline *p, struct kocl_sq_ring *sq)
+{
+    struct _kocl_sritem *sreq;
+    unsigned int head, tail;
+    int n = 0;
+
+    head = sq->hdr.head;
+    tail = __atomic_load_n(&sq->hdr.tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+	sreq = kh_alloc_service_request(p);
+	if (!sreq)
+	    break;
+	kh_init_service_request(p, sreq,
+				&sq->entries[head & (ringinfo.nentries-1)]);
+	head++;
+	n++;
+    }
+    __atomic_store_n(&sq->hdr.head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/*
+ * How long a pipeline may wait for new requests: for ever when it's
+ * idle, not at all when it has work to do now or a request is expected
+ * to finish within spin_ns: by the service's recent kernel time after
+ * its launch, or post time after the kernels. Otherwise until spin_ns
+ * before the first one is expected, up to KH_MAX_BLOCK_NS, stage
+ * markers and native workers wake it through p->evfd.
+ */
+static long long kh_wait_ns(struct kh_pipeline *p)
+{
+    struct list_head *pos;
+    struct _kocl_sritem *sreq;
+    unsigned long long due = ~0ULL, t, now;
+
+    if (list_empty(&p->all_reqs))
+	return -1;
+    if (spin_ns < 0 || p->evfd < 0 || !list_empty(&p->memdone_reqs)
+	|| !list_empty(&p->prepared_reqs) || !list_empty(&p->done_reqs))
+	return 0;
+    list_for_each(pos, &p->running_reqs) {
+	sreq = list_entry(pos, struct _kocl_sritem, list);
+	t = sreq->sr.ts[KOCL_TS_LAUNCHED] + sreq->sr.s->exec_ns;
+	if (t < due)
+	    due = t;
+    }
+    list_for_each(pos, &p->post_exec_reqs) {
+	sreq = list_entry(pos, struct _kocl_sritem, list);
+	t = sreq->sr.ts[KOCL_TS_EXECUTED] + sreq->sr.s->post_ns;
+	if (t < due)
+	    due = t;
+    }
+    if (due == ~0ULL)
+	return KH_MAX_BLOCK_NS;   /* native pieces, services being built */
+    now = kh_now();
+    if (due <= now + spin_ns)
+	return 0;
+    return due - now - spin_ns < KH_MAX_BLOCK_NS? due - now - spin_ns: KH_MAX_BLOCK_NS;
+}
+
+/*
+ * Wait up to ns (-1: for ever) for kocl to have requests or p->evfd to
+ * be woken, 1 if kocl has some.
+ */
+static int kh_block(struct kh_pipeline *p, long long ns)
+{
+    struct pollfd pfd[2];
+    struct timespec ts;
+    uint64_t v;
+    int n = 1, r;
+
+    pfd[0].fd = devfd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    if (ns && p->evfd >= 0) {
+	pfd[1].fd = p->evfd;
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+	n = 2;
     }
+    ts.tv_sec = ns/1000000000LL;
+    ts.tv_nsec = ns%1000000000LL;
+    r = ppoll(pfd, n, ns < 0? NULL: &ts, NULL);
+    if (r < 0) {
+	if (errno == EINTR)
+	    return 0;
+	perror("Poll request");
+	abort();
+    }
+    if (n == 2 && pfd[1].revents & POLLIN && read(p->evfd, &v, sizeof(v)) < 0)
+	;   /* raced with another reader, nothing to drain */
+    return (pfd[0].revents & POLLIN) != 0;
 }
 
-static int kh_get_next_service_request(void)
+/*
+ * Take all requests kocl has put into the pipeline's sq rings. The
+ * kernel is only entered when there is nothing new: to sleep if the
+ * pipeline is idle, or to flush completions and parked requests. A
+ * busy pipeline with nothing to do waits as kh_wait_ns() says.
+ */
+static int kh_ring_get_requests(struct kh_pipeline *p)
+{
+    int i, n = 0, flush = 0;
+    int channel = p->first == p->last? p->first: KOCL_RING_ALL_CHANNELS;
+    long long wait;
+
+    for (i=p->first; i<=p->last; i++)
+	if (sqs[i])
+	    n += kh_ring_reap_channel(p, sqs[i]);
+    if (n)
+	return 0;
+
+    for (i=p->first; i<=p->last; i++)
+	if (sqs[i] && (kh_cq_pending(cqs[i]) ||
+		       (__atomic_load_n(&sqs[i]->hdr.flags, __ATOMIC_RELAXED)
+			& KOCL_RING_SQ_OVERFLOW)))
+	    flush = 1;
+
+    if (list_empty(&p->all_reqs))
+	kh_ring_enter(channel, KOCL_RING_ENTER_WAIT);
+    else if (flush)
+	kh_ring_enter(channel, 0);
+    else if ((wait = kh_wait_ns(p)) > 0)
+	kh_block(p, wait);
+    return -1;
+}
+
+static int kh_get_next_service_request(struct kh_pipeline *p)
 {
     int err;
-    struct pollfd pfd;
 
     struct _kocl_sritem *sreq;
-    struct kocl_ku_request kureq;
+    static struct kocl_ku_request kureqs[KH_IO_BATCH];
+    int i, n;
 
-    pfd.fd = devfd;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
+    if (ringmem)
+	return kh_ring_get_requests(p);
 
-    err = poll(&pfd, 1, list_empty(&all_reqs)? -1:0);
-    if (err == 0 || (err && !(pfd.revents & POLLIN)) ) {
+    if (!kh_block(p, kh_wait_ns(p)))
 	return -1;
-    } else if (err == 1 && pfd.revents & POLLIN)
-    {
-	sreq = kh_alloc_service_request();
-    
-	if (!sreq)
-	    return -1;
 
-	err = read(devfd, (char*)(&kureq), sizeof(struct kocl_ku_request));
-	if (err <= 0) {
-	    if (errno == EAGAIN || err == 0) {
-		kh_free_service_request(sreq);
-		return -1;
-	    } else {
-		perror("Read request.");
-		abort();
-	    }
-	} else {
-	    kh_init_service_request(sreq, &kureq);	
-	    return 0;
-	}
-    } else {
-	if (err < 0) {
-	    perror("Poll request");
-	    abort();
+    err = read(devfd, (char*)kureqs, sizeof(kureqs));
+    if (err <= 0) {
+	if (errno == EAGAIN || err == 0) {
+	    return -1;
 	} else {
-	    fprintf(stderr, "Poll returns multiple fd's results\n");
+	    perror("Read request.");
 	    abort();
 	}
-    }    
+    }
+
+    n = err/sizeof(struct kocl_ku_request);
+    for (i=0; i<n; i++) {
+	sreq = kh_alloc_service_request(p);
+	if (!sreq) {
+	    /* already taken from kocl, fail them rather than lose them */
+	    struct kocl_ku_response resp;
+	    memset(&resp, 0, sizeof(resp));
+	    resp.id = kureqs[i].id;
+	    resp.errcode = KOCL_NO_RESPONSE;
+	    kh_send_response(&resp, kureqs[i].channel);
+	    continue;
+	}
+	kh_init_service_request(p, sreq, &kureqs[i]);
+    }
+    return 0;
+}
+
+/* small enough and in a pool segment, *buf and *base are that segment */
+static int kh_mergeable(struct _kocl_sritem *sreq, cl_mem *buf, void **base)
+{
+    struct kocl_service_request *sr = &sreq->sr;
+    cl_mem ob;
+    void *obase;
+
+    if (!sr->s->can_merge || sr->nchain || sr->insize > coalesce_size
+	|| sr->outsize > coalesce_size)
+	return 0;
+    if (gpu_pool_locate(sr->channel, sr->hin, sr->insize, buf, base, &sr->inoff)
+	|| gpu_pool_locate(sr->channel, sr->hout, sr->outsize, &ob, &obase, &sr->outoff)
+	|| obase != *base)
+	return 0;
+    return 1;
+}
+
+/*
+ * A request of its own for the n merged ones in m. It goes through the
+ * stages in their place, they wait on its members list until it is
+ * done.
+ */
+static struct _kocl_sritem *kh_merge_requests(struct kh_pipeline *p,
+					      struct _kocl_sritem **m, int n,
+					      cl_mem buf, void *base)
+{
+    struct _kocl_sritem *l = kh_alloc_service_request(p);
+    struct kocl_service_request *sr;
+    int i;
+
+    if (!l)
+	return NULL;
+    sr = &l->sr;
+    sr->batch = (struct kocl_service_request **)
+	malloc(n*sizeof(struct kocl_service_request *));
+    if (!sr->batch) {
+	kh_free_service_request(l);
+	return NULL;
+    }
+
+    sr->id = -1;
+    sr->channel = m[0]->sr.channel;
+    sr->s = m[0]->sr.s;
+    /* what makes them mergeable, like the key, is the same for all */
+    sr->hdata = m[0]->sr.hdata;
+    sr->datasize = m[0]->sr.datasize;
+    sr->queue_id = -1;
+    sr->local_x = m[0]->sr.local_x;
+    sr->global_y = m[0]->sr.global_y;
+    sr->local_y = m[0]->sr.local_y;
+    sr->nbatch = n;
+    sr->batchbuf = buf;
+    sr->batchbase = base;
+    sr->prio = m[0]->sr.prio;
+    for (i=0; i<n; i++) {
+	sr->batch[i] = &m[i]->sr;
+	sr->insize += m[i]->sr.insize;
+	sr->outsize += m[i]->sr.outsize;
+	sr->global_x += m[i]->sr.global_x;
+	if (m[i]->sr.prio > sr->prio)
+	    sr->prio = m[i]->sr.prio;
+	list_del(&m[i]->list);
+	list_add_tail(&m[i]->list, &l->members);
+    }
+    sr->state = KOCL_REQ_INIT;
+
+    l->p = p;
+    l->merged = 1;
+    list_add_tail(&l->glist, &p->all_reqs);
+    kh_queue_request(l, &p->init_reqs);
+    return l;
+}
+
+/*
+ * Merge the small requests that arrived together for one service and
+ * channel, as the service allows, into launches over an offset table.
+ */
+static void kh_coalesce(struct kh_pipeline *p)
+{
+    struct _kocl_sritem *m[KOCL_BATCH_MAX], *a, *b;
+    struct list_head *pos, *n, *q;
+    cl_mem buf, bbuf;
+    void *base, *bbase;
+    int nr;
+
+    if (!coalesce_size)
+	return;
+
+    list_for_each_safe(pos, n, &p->init_reqs) {
+	a = list_entry(pos, struct _kocl_sritem, list);
+	if (a->merged)
+	    continue;
+	a->merged = 1;
+	if (!kh_mergeable(a, &buf, &base))
+	    continue;
+
+	m[0] = a;
+	nr = 1;
+	for (q = pos->next; q != &p->init_reqs && nr < KOCL_BATCH_MAX;
+	     q = q->next) {
+	    b = list_entry(q, struct _kocl_sritem, list);
+	    if (b->merged || b->sr.s != a->sr.s
+		|| b->sr.channel != a->sr.channel
+		|| !kh_mergeable(b, &bbuf, &bbase) || bbase != base
+		|| !a->sr.s->can_merge(&a->sr, &b->sr))
+		continue;
+	    b->merged = 1;
+	    m[nr++] = b;
+	}
+	if (nr < 2 || !kh_merge_requests(p, m, nr, buf, base))
+	    continue;
+	dbg("merged %d requests of %s\n", nr, a->sr.s->name);
+	/* the members are off the list now */
+	n = p->init_reqs.next;
+    }
 }
 
 static int kh_request_alloc_mem(struct _kocl_sritem *sreq)
 {
-    int r = gpu_alloc_device_mem(&sreq->sr);
+    /* the service's programs for the device may still be building */
+    int r = kh_service_ready(sreq->sr.s, gpu_channel_platform(sreq->sr.channel));
+
+    if (r <= 0) {
+	if (r < 0)
+	    kh_fail_request(sreq, KOCL_NO_SERVICE);
+	return -1;
+    }
+    r = gpu_alloc_device_mem(&sreq->sr);
     if (r) {
 	return -1;
     } else {
 	sreq->sr.state = KOCL_REQ_MEM_DONE;
+	kh_stamp(&sreq->sr, KOCL_TS_MEM);
 	list_del(&sreq->list);
-	list_add_tail(&sreq->list, &memdone_reqs);
+	kh_queue_request(sreq, &sreq->p->memdone_reqs);
 	return 0;
     }
 }
@@ -237,9 +1127,11 @@ static int kh_request_alloc_mem(struct _kocl_sritem *sreq)
 static int kh_prepare_exec(struct _kocl_sritem *sreq)
 {
     int r;
-    if (gpu_alloc_cmdQueue(&sreq->sr)) {
+    /* a chain's later stages keep the queue and slot of the first */
+    if (sreq->sr.queue_id < 0 && gpu_alloc_cmdQueue(&sreq->sr)) {
 	r = -1;
     } else {
+	  sreq->sr.chunked = gpu_can_chunk(&sreq->sr);
 	  r = sreq->sr.s->prepare(&sreq->sr);  
 	
 	if (r) {
@@ -247,8 +1139,9 @@ static int kh_prepare_exec(struct _kocl_sritem *sreq)
 	    kh_fail_request(sreq, r);
 	} else {
 	    sreq->sr.state = KOCL_REQ_PREPARED;
+	    kh_stamp(&sreq->sr, KOCL_TS_PREPARED);
 	    list_del(&sreq->list);
-	    list_add_tail(&sreq->list, &prepared_reqs);
+	    kh_queue_request(sreq, &sreq->p->prepared_reqs);
 	  }
     }
 
@@ -257,26 +1150,78 @@ static int kh_prepare_exec(struct _kocl_sritem *sreq)
 	
 static int kh_launch_exec(struct _kocl_sritem *sreq)
 {
-   int r = sreq->sr.s->launch(&sreq->sr); 
+   int r = sreq->sr.chunked? gpu_launch_chunked(&sreq->sr):
+       sreq->sr.s->launch(&sreq->sr); 
     if (r) {
 	dbg("%d fails launch\n", sreq->sr.id);
 	kh_fail_request(sreq, r);	
     } else {
 	sreq->sr.state = KOCL_REQ_RUNNING;
+	kh_stamp(&sreq->sr, KOCL_TS_LAUNCHED);
+	gpu_mark_stage(&sreq->sr);
 	list_del(&sreq->list);
-	list_add_tail(&sreq->list, &running_reqs);
+	list_add_tail(&sreq->list, &sreq->p->running_reqs);
     }
     return 0;
 }
 
+/*
+ * The next service of a chained request, right behind the post of the
+ * one before on the same in-order queue, without waiting for it. The
+ * stage's buffers only go back to the host as the services need them,
+ * see kocl_keep().
+ */
+static void kh_next_stage(struct _kocl_sritem *sreq)
+{
+    struct kocl_service_request *sr = &sreq->sr;
+    struct kocl_chain_stage *cs = &sr->chain[sr->stage++];
+
+    gpu_free_device_mem(sr);
+    sr->s = kh_lookup_service_id(cs->sid, cs->service_name);
+    if (!sr->s) {
+	dbg("%d: can't find service of stage %d\n", sr->id, sr->stage);
+	kh_fail_request(sreq, KOCL_NO_SERVICE);
+	return;
+    }
+    sr->hin = cs->in;
+    sr->hout = cs->out;
+    sr->hdata = cs->data;
+    sr->insize = cs->insize;
+    sr->outsize = cs->outsize;
+    sr->datasize = cs->datasize;
+    /* the request's context is its first service's */
+    sr->ctx = 0;
+    sr->InputBuf = sr->OutputBuf = NULL;
+    sr->key_dec_buf = sr->key_enc_buf = NULL;
+    sr->s->compute_size(sr);
+    sr->state = KOCL_REQ_INIT;
+    list_del(&sreq->list);
+    kh_queue_request(sreq, &sreq->p->init_reqs);
+}
+
 static int kh_post_exec(struct _kocl_sritem *sreq)
 {
     int r = 1;
     if (gpu_execution_finished(&sreq->sr)){
+	  /* of the last stage of a chain */
+	  if (sreq->sr.stage >= sreq->sr.nchain) {
+	      kh_stamp(&sreq->sr, KOCL_TS_EXECUTED);
+	      if (!sreq->sr.nchain)
+		  kh_ewma(&sreq->sr.s->exec_ns, sreq->sr.ts[KOCL_TS_LAUNCHED],
+			  sreq->sr.ts[KOCL_TS_EXECUTED]);
+	  }
 	  if (!(r=sreq->sr.s->post(&sreq->sr))){  
+	      if (sreq->sr.stage < sreq->sr.nchain) {
+		  kh_next_stage(sreq);
+		  return 0;
+	      }
+	      /* what the last stage left on the device */
+	      if (sreq->sr.nchain)
+		  kocl_flush_kept(&sreq->sr, 1);
 	      sreq->sr.state = KOCL_REQ_POST_EXEC;
+	      gpu_mark_stage(&sreq->sr);
 	      list_del(&sreq->list);
-	      list_add_tail(&sreq->list, &post_exec_reqs);
+	      list_add_tail(&sreq->list, &sreq->p->post_exec_reqs);
 	   }
 	  else {
 	    dbg("%d fails post\n", sreq->sr.id);
@@ -290,8 +1235,11 @@ static int kh_finish_post(struct _kocl_sritem *sreq)
 {
     if (gpu_post_finished(&sreq->sr)) {
 	  sreq->sr.state = KOCL_REQ_DONE;
+	  kh_stamp(&sreq->sr, KOCL_TS_POSTED);
+	  kh_ewma(&sreq->sr.s->post_ns, sreq->sr.ts[KOCL_TS_EXECUTED],
+		  sreq->sr.ts[KOCL_TS_POSTED]);
 	  list_del(&sreq->list);
-	  list_add_tail(&sreq->list, &done_reqs);
+	  list_add_tail(&sreq->list, &sreq->p->done_reqs);
 	
 	  return 0;
     }
@@ -302,15 +1250,33 @@ static int kh_finish_post(struct _kocl_sritem *sreq)
 static int kh_service_done(struct _kocl_sritem *sreq)
 {
     struct kocl_ku_response resp;
+    struct _kocl_sritem *m;
 
-    resp.id = sreq->sr.id;
-    resp.errcode = sreq->sr.errcode;
+    if (sreq->sr.nbatch) {
+	/* a merged request answers for its members */
+	while (!list_empty(&sreq->members)) {
+	    m = list_first_entry(&sreq->members, struct _kocl_sritem, list);
+	    m->sr.errcode = sreq->sr.errcode;
+	    memcpy(&m->sr.ts[KOCL_TS_MEM], &sreq->sr.ts[KOCL_TS_MEM],
+		   (KOCL_TS_POSTED-KOCL_TS_MEM+1)*sizeof(m->sr.ts[0]));
+	    m->sr.state = KOCL_REQ_DONE;
+	    kh_service_done(m);
+	}
+    } else {
+	resp.id = sreq->sr.id;
+	resp.errcode = sreq->sr.errcode;
+	memcpy(resp.ts, sreq->sr.ts, sizeof(resp.ts));
     
-    kh_send_response(&resp);
+	kh_send_response(&resp, sreq->sr.channel);
+    }
     
     list_del(&sreq->list);
     list_del(&sreq->glist);
+    /* a failed chain's buffers, its queue may still be using them */
+    kocl_flush_kept(&sreq->sr, 0);
+    gpu_prof_collect(&sreq->sr);
     gpu_free_cmdQueue(&sreq->sr);   
+    gpu_free_device_mem(&sreq->sr);
     kh_free_service_request(sreq);
     return 0;
 }
@@ -330,29 +1296,136 @@ static int __kh_process_request(int (*op)(struct _kocl_sritem *),
     return r;	
 }
 
-static int kh_main_loop()
+/* the node of the pipeline's devices, if they are all on one */
+static int kh_pipeline_node(struct kh_pipeline *p)
+{
+    int c, node = -2;
+
+    for (c=p->first; c<=p->last; c++) {
+	if (hostbuf.chan_pool[c] < 0)
+	    continue;
+	if (node == -2)
+	    node = hostbuf.pools[hostbuf.chan_pool[c]].node;
+	else if (hostbuf.pools[hostbuf.chan_pool[c]].node != node)
+	    return -1;
+    }
+    return node == -2? -1: node;
+}
+
+static int kh_main_loop(struct kh_pipeline *p)
 {    
+    /* next to the pool and the device, see kh_bind_node() */
+    kh_pin_node(kh_pipeline_node(p));
+
     while (kh_loop_continue)
     {
-	__kh_process_request(kh_service_done, &done_reqs, 0);
-	__kh_process_request(kh_finish_post, &post_exec_reqs, 0);
-	__kh_process_request(kh_post_exec, &running_reqs, 1);
-	__kh_process_request(kh_launch_exec, &prepared_reqs, 1);
-	__kh_process_request(kh_prepare_exec, &memdone_reqs, 1);
-	__kh_process_request(kh_request_alloc_mem, &init_reqs, 0);
-	kh_get_next_service_request();	
+	kh_native_reap(p);
+	__kh_process_request(kh_service_done, &p->done_reqs, 0);
+	kh_flush_responses();
+	__kh_process_request(kh_finish_post, &p->post_exec_reqs, 0);
+	__kh_process_request(kh_post_exec, &p->running_reqs, 0);
+	__kh_process_request(kh_launch_exec, &p->prepared_reqs, 1);
+	__kh_process_request(kh_prepare_exec, &p->memdone_reqs, 1);
+	kh_coalesce(p);
+	__kh_process_request(kh_request_alloc_mem, &p->init_reqs, 0);
+	kh_get_next_service_request(p);	
     }
 
     return 0;
 }
 
+static void *kh_pipeline_thread(void *arg)
+{
+    kh_main_loop((struct kh_pipeline*)arg);
+    return NULL;
+}
+
+/* run pipeline 0 here and the others on their own threads */
+static int kh_run_pipelines(void)
+{
+    int i;
+
+    for (i=1; i<npipes; i++)
+	if (pthread_create(&pipes[i].thread, NULL, kh_pipeline_thread,
+			   &pipes[i])) {
+	    perror("Create pipeline thread");
+	    abort();
+	}
+
+    kh_main_loop(&pipes[0]);
+
+    for (i=1; i<npipes; i++)
+	pthread_join(pipes[i].thread, NULL);
+    return 0;
+}
+
+/* pool:node, -1 for none */
+static int kh_parse_node(const char *arg)
+{
+    int pool, node;
+
+    if (sscanf(arg, "%d:%d", &pool, &node) != 2
+	|| pool < 0 || pool >= KOCL_MAX_POOLS || node < -1 || node >= KH_MAX_NODES)
+	return -1;
+    pool_node[pool] = node;
+    return 0;
+}
+
+/* pool:size[:max], sizes in MB */
+static int kh_parse_pool(const char *arg)
+{
+    int pool;
+    unsigned long size, max = 0;
+
+    if (sscanf(arg, "%d:%lu:%lu", &pool, &size, &max) < 2
+	|| pool < 0 || pool >= KOCL_MAX_POOLS || !size)
+	return -1;
+    pool_size[pool] = size<<20;
+    pool_max[pool] = max? max<<20: size<<20;
+    return 0;
+}
+
+/* the channels to serve, as 0,1 */
+static int kh_parse_channels(const char *arg)
+{
+    unsigned long mask = 0;
+    char *end;
+    long c;
+
+    do {
+	c = strtol(arg, &end, 0);
+	if (end == arg || c < 0 || c >= KOCL_NR_CHANNELS)
+	    return -1;
+	mask |= 1UL << c;
+	arg = end + 1;
+    } while (*end == ',');
+    if (*end)
+	return -1;
+    gpu_set_channels(mask);
+    return 0;
+}
+
+/* channel:queues[:depth], -1 for all channels */
+static int kh_parse_queues(const char *arg)
+{
+    int ch, queues, depth = 0, i;
+
+    if (sscanf(arg, "%d:%d:%d", &ch, &queues, &depth) < 2
+	|| ch < -1 || ch >= KOCL_NR_CHANNELS || queues < 1)
+	return -1;
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	if ((ch < 0 || i == ch) && gpu_set_queues(i, queues, depth))
+	    return -1;
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int c;
     kocldev = "/dev/kocl";
     service_lib_dir = "./";
 
-    while ((c = getopt(argc, argv, "d:l:v:")) != -1)
+    while ((c = getopt(argc, argv, "d:l:v:np:H:tc:q:s:N:g:w:x:P:S:C:")) != -1)
     {
 	switch (c)
     {
@@ -365,12 +1438,86 @@ int main(int argc, char *argv[])
 	case 'v':
 	    kocl_log_level = atoi(optarg);
 	    break;
+	case 'n':
+	    use_ring = 0;
+	    break;
+	case 't':
+	    threaded = 1;
+	    break;
+	case 'c':
+	    coalesce_size = strtoul(optarg, NULL, 0)<<10;
+	    break;
+	case 'q':
+	    if (kh_parse_queues(optarg) < 0) {
+		fprintf(stderr, "bad queues %s\n", optarg);
+		return 0;
+	    }
+	    break;
+	case 'g':
+	    sg_size = strtoul(optarg, NULL, 0)<<20;
+	    break;
+	case 'N':
+	    if (kh_parse_node(optarg) < 0) {
+		fprintf(stderr, "bad node %s\n", optarg);
+		return 0;
+	    }
+	    break;
+	case 's':
+	    gpu_set_chunk(strtoul(optarg, NULL, 0)<<10);
+	    break;
+	case 'w':
+	    nworkers = atoi(optarg);
+	    break;
+	case 'x':
+	    native_mask = strtol(optarg, NULL, 0);
+	    break;
+	case 'P':
+	    gpu_set_profiling(atoi(optarg));
+	    break;
+	case 'C':
+	    if (kh_parse_channels(optarg) < 0) {
+		fprintf(stderr, "bad channels %s\n", optarg);
+		return 0;
+	    }
+	    break;
+	case 'S':
+	    spin_ns = atoll(optarg);
+	    if (spin_ns > 0)
+		spin_ns *= 1000;
+	    break;
+	case 'H':
+	    huge_size = strtoul(optarg, NULL, 0)<<20;
+	    if (huge_size != (2UL<<20) && huge_size != (1UL<<30)) {
+		fprintf(stderr, "huge pages are 2 or 1024 MB\n");
+		return 0;
+	    }
+	    break;
+	case 'p':
+	    if (kh_parse_pool(optarg) < 0) {
+		fprintf(stderr, "bad pool size %s\n", optarg);
+		return 0;
+	    }
+	    break;
 	default:
 	    fprintf(stderr,
 		    "Usage %s"
 		    " [-d device]"
 		    " [-l service_lib_dir]"
-		    " [-v log_level"
+		    " [-v log_level]"
+		    " [-n (no rings, use read/write)]"
+		    " [-p pool:size_MB[:max_MB]]"
+		    " [-H huge_page_MB (2 or 1024)]"
+		    " [-t (a thread per channel)]"
+		    " [-c KB (merge requests up to this size)]"
+		    " [-q channel:queues[:depth]]"
+		    " [-s KB (streamed chunks, 0: off)]"
+		    " [-N pool:node (-1: any)]"
+		    " [-g MB (scatter-gather window, 0: none)]"
+		    " [-w native workers (0: on the pipeline threads)]"
+		    " [-x channel mask of native lanes (0: none)]"
+		    " [-P s (profile the devices, dump every s, 0: at exit)]"
+		    " [-S us (spin for requests due within, -1: always)]"
+		    " [-C channel,... (serve only these, other helpers the rest)]"
 		    "\n",
 		    argv[0]);
 	    return 0;
@@ -379,7 +1526,7 @@ int main(int argc, char *argv[])
     
     kh_init();
     kh_load_all_services(service_lib_dir);
-    kh_main_loop();
+    kh_run_pipelines();
     kh_finit();
     return 0;
 }
@@ -15,16 +15,121 @@
 
 #include "kocl.h"
 #include <linux/types.h>
+#include <linux/list.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
 
 #define kocl_log(level, ...) kocl_do_log(level, "kocl", ##__VA_ARGS__)
 #define dbg(...) kocl_log(KOCL_LOG_DEBUG, ##__VA_ARGS__)
 
 /*
- * Buffer management stuff, put them here in case we may
- * create a kocl_buf.c for buffer related functions.
+ * Buffer management stuff, the functions are in kocl_buf.c.
+ *
+ * A pool is cut into page sized units. Buffers bigger than the largest
+ * slab class take a run of units from the bitmap, smaller ones are
+ * carved out of slab units of power-of-two sized objects.
  */
-#define KOCL_BUF_UNIT_SIZE (1024*1024)
+#define KOCL_BUF_UNIT_SIZE PAGE_SIZE
 #define KOCL_BUF_NR_FRAMES_PER_UNIT (KOCL_BUF_UNIT_SIZE/PAGE_SIZE)
 
+#define KOCL_SLAB_MIN_SHIFT 5   /* 32 bytes */
+#define KOCL_SLAB_MAX_SHIFT 11  /* 2 KB */
+#define KOCL_SLAB_NR_CLASSES (KOCL_SLAB_MAX_SHIFT-KOCL_SLAB_MIN_SHIFT+1)
+#define KOCL_SLAB_MAX_OBJS (KOCL_BUF_UNIT_SIZE>>KOCL_SLAB_MIN_SHIFT)
+
+struct _kocl_slab {
+    struct list_head list;      /* on its class's partial list */
+    u32 unit;
+    u16 nfree;
+    u8  cls;
+    unsigned long map[BITS_TO_LONGS(KOCL_SLAB_MAX_OBJS)]; /* used objects */
+    unsigned long cached[BITS_TO_LONGS(KOCL_SLAB_MAX_OBJS)]; /* in a CPU cache */
+};
+
+/*
+ * Small classes: the slab classes, then runs of 1..KOCL_PCP_MAX_UNITS
+ * units. Each CPU caches up to KOCL_PCP_HIGH freed buffers per class
+ * and fills or drains its cache KOCL_PCP_BATCH buffers at a time, so
+ * the common kocl_malloc/kocl_free pair doesn't touch the bitmap.
+ */
+#define KOCL_PCP_MAX_UNITS 8
+#define KOCL_PCP_NR_CLASSES (KOCL_SLAB_NR_CLASSES+KOCL_PCP_MAX_UNITS)
+#define KOCL_PCP_HIGH 16
+#define KOCL_PCP_BATCH 8
+
+struct _kocl_pcp_cache {
+    u16 count[KOCL_PCP_NR_CLASSES];
+    void *objs[KOCL_PCP_NR_CLASSES][KOCL_PCP_HIGH];
+};
+
+struct _kocl_mempool {
+    spinlock_t lock;
+    unsigned long uva;    
+    unsigned long kva;    
+    struct page **pages;    
+    u32 npages;
+    u32 nunits;
+    int direct;           /* kva is in the linear mapping, not vmap-ed */
+    unsigned long *bitmap;
+    u32           *alloc_sz;
+    struct _kocl_slab **slabs;  /* per unit, NULL if not a slab unit */
+    struct list_head partial[KOCL_SLAB_NR_CLASSES];
+    struct _kocl_pcp_cache __percpu *pcp;
+    unsigned long *pcp_cached;  /* first units of runs in a CPU cache */
+};
+
+extern int kocl_mempool_init(struct _kocl_mempool *gmp);
+extern void kocl_mempool_finit(struct _kocl_mempool *gmp);
+extern void kocl_mempool_swap(struct _kocl_mempool *gmp,
+			      struct _kocl_mempool *ngmp);
+extern void *kocl_mempool_alloc(struct _kocl_mempool *gmp,
+				unsigned long nbytes);
+extern void kocl_mempool_free(struct _kocl_mempool *gmp, void *p);
+extern unsigned long kocl_mempool_bufsize(struct _kocl_mempool *gmp, void *p);
+
+/*
+ * A device's pool: segments of pinned memory, the first one registered
+ * with KOCL_IOC_SET_GPU_BUFS and the others added when it grows.
+ * Segments are only appended, nsegs is published after the segment.
+ */
+struct _kocl_pool {
+    int nsegs;
+    unsigned long size;         /* of all segments */
+    unsigned long max_size;
+    int node;                   /* of the device, NUMA_NO_NODE if not known */
+    u32 gen;                    /* bumped whenever the helper sets it anew */
+    struct _kocl_mempool segs[KOCL_POOL_MAX_SEGS];
+    /* telemetry, see kocl_pool_note_alloc() */
+    atomic_long_t used, peak;   /* bytes */
+    atomic_long_t nalloc, nfail, nquota;
+    atomic_long_t sizes[KOCL_POOL_NR_SIZES];
+};
+
+extern void kocl_pool_init(struct _kocl_pool *pool);
+extern void *kocl_pool_alloc(struct _kocl_pool *pool, unsigned long nbytes);
+extern void kocl_pool_free(struct _kocl_pool *pool, void *p);
+extern struct _kocl_mempool *kocl_pool_seg(struct _kocl_pool *pool, void *p);
+extern unsigned long kocl_pool_bufsize(struct _kocl_pool *pool, void *p);
+extern void kocl_pool_note_alloc(struct _kocl_pool *pool, unsigned long nbytes,
+				 unsigned long sz);
+extern void kocl_pool_note_free(struct _kocl_pool *pool, unsigned long sz);
+extern void kocl_pool_scan(struct _kocl_pool *pool, struct kocl_pool_info *pi);
+/* the pools as KOCL_IOC_GET_GPU_BUFS tells them, in main.c */
+extern void kocl_pools_info(struct kocl_gpu_mem_info *gb);
+
+/*
+ * Statistics, in kocl_stat.c, under kocl_debugfs (NULL without one).
+ * kocl_lat_account() takes a request's KOCL_TS_* stamps.
+ */
+struct dentry;
+extern struct dentry *kocl_debugfs;
+extern int kocl_lat_stats;
+extern int kocl_stat_init(void);
+extern void kocl_stat_exit(void);
+extern void kocl_lat_account(int sid, int channel, const u64 *ts);
+/* the name of a kocl_service_id(), NULL if there is none */
+extern const char *kocl_service_name(int sid);
+
 
 #endif
@@ -23,21 +23,108 @@
     (TO_UL(dst_base) + (						\
 	TO_UL(pointer)-TO_UL(src_base)))
 
-struct kocl_gpu_mem_info {
-    void * uva;
-    void * uva2;
-    void * uva3;
+#define KOCL_SERVICE_NAME_SIZE 32
+
+/*
+ * Request priorities. Higher ones are handed to the helper and launched
+ * before lower ones of the channel, kocl_offload_sync() makes a normal
+ * request high, its caller waits for it.
+ */
+#define KOCL_PRIO_BULK (-1)
+#define KOCL_PRIO_NORMAL 0
+#define KOCL_PRIO_HIGH 1
+
+/* service ids handed out by kocl_service_id(), 1..KOCL_MAX_SERVICES */
+#define KOCL_MAX_SERVICES 64
+
+/*
+ * Channel numbers select the device: 0 and 1 the NVIDIA GPU,
+ * 2 the Intel GPU and 3 the Intel CPU.
+ */
+#define KOCL_NR_CHANNELS 4
+
+/*
+ * Helper processes, each serving some of the channels, see
+ * KOCL_IOC_SET_GPU_BUFS.
+ */
+#define KOCL_MAX_HELPERS 4
+
+/*
+ * Pinned memory pools, one per device the helper registers, each with
+ * its own size. chan_pool[] tells the pool of every channel.
+ *
+ * A pool registered with max_size > size grows lazily: when it runs
+ * out, kocl asks for more at KOCL_IOC_WAIT_GROW and the helper adds a
+ * segment of pinned memory with KOCL_IOC_GROW_POOL.
+ */
+#define KOCL_MAX_POOLS 8
+#define KOCL_POOL_MAX_SEGS 8
+
+/* allocations by size, from up to 32 bytes doubling, the last one all above */
+#define KOCL_POOL_NR_SIZES 24
+
+struct kocl_pool_info {
+    void *uva;
     unsigned long size;
+    unsigned long max_size;   /* 0: same as size, never grows */
+    int node;                 /* NUMA node of the device and pool, -1: any */
+    /* the rest from KOCL_IOC_GET_GPU_BUFS only, units are pages */
+    unsigned long units, free_units;
+    unsigned long max_free_run;    /* longest run of free units in a segment */
+    unsigned long slab_units;      /* cut into buffers of up to 2KB */
+    unsigned long cached;          /* freed small buffers the CPUs keep */
+    unsigned long used_bytes, peak_bytes;  /* in clients' buffers */
+    unsigned long nalloc;
+    unsigned long nfail;           /* the pool had no room */
+    unsigned long nquota;          /* over a channel's or client's quota */
+    unsigned long sizes[KOCL_POOL_NR_SIZES];
 };
 
-#define KOCL_SERVICE_NAME_SIZE 32
+/*
+ * A helper's pools, and the channels it serves: those it gives a pool,
+ * -1 in chan_pool for the channels of other helpers. KOCL_IOC_GET_GPU_BUFS
+ * tells all of kocl's pools instead.
+ */
+struct kocl_gpu_mem_info {
+    int npools;
+    int chan_pool[KOCL_NR_CHANNELS];
+    int chan_slots[KOCL_NR_CHANNELS];  /* requests the helper runs at once, 0: don't know */
+    struct kocl_pool_info pools[KOCL_MAX_POOLS];
+};
+
+struct kocl_pool_grow {
+    int pool;
+    void *uva;                /* unused by KOCL_IOC_WAIT_GROW */
+    unsigned long size;       /* wanted size from KOCL_IOC_WAIT_GROW */
+};
+
+/*
+ * Chains: services run one after another on one request, in the
+ * helper, and the request completes once, after the last. A request's
+ * chain are the stages after its own service, with their own buffers
+ * in its pool, see kocl_chain_add(). kocl_ku_request.chain points to
+ * the helper's copy, in the pool too.
+ */
+#define KOCL_CHAIN_MAX 4
+
+struct kocl_chain_stage {
+    int sid;
+    char service_name[KOCL_SERVICE_NAME_SIZE];
+    void *in, *out, *data;
+    unsigned long insize, outsize, datasize;
+};
 
 struct kocl_ku_request {
     int id;
     int channel;
+    int sid;                  /* id of service_name, 0 if not known */
+    int prio;                 /* KOCL_PRIO_* */
+    int ctx;                  /* kocl_ctx_register() handle of data, 0: none */
     char service_name[KOCL_SERVICE_NAME_SIZE];
     void *in, *out, *data;
     unsigned long insize, outsize, datasize;
+    int nchain;               /* stages in chain, 0 if not a chain */
+    struct kocl_chain_stage *chain;
 };
 
 /* kocl's errno */
@@ -46,9 +133,89 @@ struct kocl_ku_request {
 #define KOCL_NO_SERVICE 2
 #define KOCL_TERMINATED 3
 
+/*
+ * A request's timestamps, ns of CLOCK_MONOTONIC (ktime_get_ns() in the
+ * kernel). kocl takes the SUBMIT, HANDED, RESP and CALLBACK ones, the
+ * helper those between and sends them back with the response. 0: not
+ * taken, a native lane has no MEM or PREPARED.
+ */
+#define KOCL_TS_SUBMIT 0      /* queued in kocl */
+#define KOCL_TS_HANDED 1      /* to the helper, ring or read() */
+#define KOCL_TS_RECV 2        /* the helper has it */
+#define KOCL_TS_MEM 3         /* KOCL_REQ_MEM_DONE, its programs are built */
+#define KOCL_TS_PREPARED 4    /* a queue and the uploads enqueued */
+#define KOCL_TS_LAUNCHED 5    /* the kernels enqueued */
+#define KOCL_TS_EXECUTED 6    /* uploads and kernels done */
+#define KOCL_TS_POSTED 7      /* downloads done */
+#define KOCL_TS_RESP 8        /* kocl has the response */
+#define KOCL_TS_CALLBACK 9    /* the callback returned */
+#define KOCL_NR_TS 10
+
 struct kocl_ku_response {
     int id;
     int errcode;
+    unsigned long long ts[KOCL_NR_TS]; /* the helper's, RECV..POSTED */
+};
+
+/*
+ * Submission/completion rings shared by kocl and the helper through
+ * mmap() on /dev/kocl, in the style of io_uring. There is one sq/cq
+ * pair per channel, chan_size bytes apart in the mmap area.
+ *
+ * The kernel produces kocl_ku_requests into the sq ring and the helper
+ * consumes them; the helper produces kocl_ku_responses into the cq ring
+ * and the kernel reaps them at KOCL_IOC_RING_ENTER. Indexes are free
+ * running, an entry lives at entries[index & mask].
+ */
+#define KOCL_RING_NR_ENTRIES 1024
+
+/* sq ring flags */
+#define KOCL_RING_SQ_OVERFLOW 1 /* requests are parked because sq was full */
+
+struct kocl_ring_hdr {
+    unsigned int head;     /* consumer index */
+    unsigned int tail;     /* producer index */
+    unsigned int mask;
+    unsigned int nentries;
+    unsigned int flags;
+};
+
+struct kocl_sq_ring {
+    struct kocl_ring_hdr hdr;
+    struct kocl_ku_request entries[KOCL_RING_NR_ENTRIES];
+};
+
+struct kocl_cq_ring {
+    struct kocl_ring_hdr hdr;
+    struct kocl_ku_response entries[KOCL_RING_NR_ENTRIES];
+};
+
+struct kocl_ring_info {
+    unsigned int nentries;
+    unsigned int nchannels;
+    unsigned long sq_off;     /* offsets of channel 0's rings */
+    unsigned long cq_off;
+    unsigned long chan_size;  /* distance between two channels' rings */
+    unsigned long size;       /* size of the mmap area */
+};
+
+/*
+ * The scatter-gather window: the helper mmaps /dev/kocl at this offset,
+ * up to KOCL_SG_SPAN, and kocl_map_sg() puts the pages of clients'
+ * requests there for it. kocl moves each helper's to a file range of
+ * its own past the offset, so zapping one window leaves the others be.
+ */
+#define KOCL_SG_OFFSET (1UL<<32)
+#define KOCL_SG_SPAN (1UL<<32)
+
+/* KOCL_IOC_RING_ENTER flags */
+#define KOCL_RING_ENTER_WAIT 1 /* sleep until the sq ring has requests */
+
+#define KOCL_RING_ALL_CHANNELS (-1)
+
+struct kocl_ring_enter {
+    int channel;              /* or KOCL_RING_ALL_CHANNELS */
+    unsigned int flags;
 };
 
 /*
@@ -56,12 +223,9 @@ struct kocl_ku_response {
  */
 #if defined __KERNEL__ || defined __KOCL__
 
-/* the NR will not be used */
-#define KOCL_BUF_NR 1
+/* default pool size of a device */
 #define KOCL_BUF_SIZE (1024*1024*128)
 
-#define KOCL_MMAP_SIZE KOCL_BUF_SIZE
-
 #define KOCL_DEV_NAME "kocl"
 
 /* ioctl */
@@ -70,13 +234,21 @@ struct kocl_ku_response {
 #define KOCL_IOC_MAGIC 'g'
 
 #define KOCL_IOC_SET_GPU_BUFS \
-    _IOW(KOCL_IOC_MAGIC, 1, struct kocl_gpu_mem_info[KOCL_BUF_NR])
+    _IOW(KOCL_IOC_MAGIC, 1, struct kocl_gpu_mem_info)
 #define KOCL_IOC_GET_GPU_BUFS \
-    _IOR(KOCL_IOC_MAGIC, 2, struct kocl_gpu_mem_info[KOCL_BUF_NR])
+    _IOR(KOCL_IOC_MAGIC, 2, struct kocl_gpu_mem_info)
 #define KOCL_IOC_SET_STOP     _IO(KOCL_IOC_MAGIC, 3)
 #define KOCL_IOC_GET_REQS     _IOR(KOCL_IOC_MAGIC, 4, 
+#define KOCL_IOC_SETUP_RING \
+    _IOR(KOCL_IOC_MAGIC, 5, struct kocl_ring_info)
+#define KOCL_IOC_RING_ENTER \
+    _IOW(KOCL_IOC_MAGIC, 6, struct kocl_ring_enter)
+#define KOCL_IOC_GROW_POOL \
+    _IOW(KOCL_IOC_MAGIC, 7, struct kocl_pool_grow)
+#define KOCL_IOC_WAIT_GROW \
+    _IOR(KOCL_IOC_MAGIC, 8, struct kocl_pool_grow)
 
-#define KOCL_IOC_MAXNR 4
+#define KOCL_IOC_MAXNR 8
 
 #include "kocl_log.h"
 
@@ -91,6 +263,28 @@ struct kocl_ku_response {
 #include <CL/cl.h>
 struct kocl_service;
 
+/* a device buffer a chain keeps for its next stages, see kocl_get_buffer() */
+#define KOCL_KEPT_MAX 4
+
+struct kocl_kept {
+    void *hp;
+    size_t size;
+    cl_mem b;
+    int dirty;                /* newer than hp, read back before it's dropped */
+};
+
+/* a profiled command of a request, see kocl_prof_event() */
+#define KOCL_PROF_WRITE 0
+#define KOCL_PROF_READ 1
+#define KOCL_PROF_KERNEL 2
+#define KOCL_PROF_MAX 16       /* a request's events at first, they grow */
+
+struct kocl_prof_event {
+    cl_event e;
+    int kind;                 /* KOCL_PROF_* */
+    size_t bytes;             /* of a transfer */
+};
+
 struct kocl_service_request {
     int id;
     int channel;
@@ -102,14 +296,40 @@ struct kocl_service_request {
     int global_x, global_y;
     int local_x, local_y;
     int state;
-    int queue_id;
+    int prio;                 /* KOCL_PRIO_* */
+    int ctx;                  /* handle of a client context in hdata, 0: none */
+    int queue_id;             /* slot on the channel, see gpuops.c */
     cl_command_queue queue;   
+    cl_event event;           /* end of the running stage, see gpuops.c */
     cl_context context;
+    int platform;             /* of the channel's device, see struct plat_set */
+    int zerocopy;             /* the device works on host memory in place */
+    int chunked;              /* streamed, see kocl_service.launch_chunk */
+    int svm;                  /* hin/hout are SVM, see kocl_set_arg_buffer() */
     cl_uint numDevices;
     cl_device_id *devices;
+    cl_mem  inview, outview;  /* pinned pool views of hin/hout, or NULL */
     cl_mem  InputBuf,OutputBuf ;
     cl_mem  key_dec_buf, key_enc_buf; 
+    cl_mem  ScratchBuf;       /* a service's own, from prepare to post */
     cl_kernel kernel ;  
+    /* merged requests, see kh_coalesce() in helper.c */
+    int nbatch;
+    struct kocl_service_request **batch;
+    cl_mem batchbuf;          /* the pool segment all of batch[] is in */
+    void *batchbase;          /* its host address, the pointer if svm */
+    unsigned long inoff, outoff;  /* of a batch member's hin/hout */
+    /* a chain, see kh_next_stage() in helper.c */
+    int nchain;
+    int stage;                /* of chain[] that runs now, its index+1 */
+    struct kocl_chain_stage *chain;
+    struct kocl_kept kept[KOCL_KEPT_MAX];
+    unsigned long long ts[KOCL_NR_TS];  /* see KOCL_TS_*, in helper.c */
+    int evfd;                 /* the helper's wake up eventfd, -1: none */
+    int prof;                 /* the helper profiles the request's commands */
+    int nprof, maxprof;
+    int lostprof;             /* events kocl_prof_event() had no room for */
+    struct kocl_prof_event *pev;
 };
 
 /* service request states: */
@@ -131,6 +351,8 @@ struct kocl_service_request {
 
 #include <linux/list.h>
 #include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/scatterlist.h>
 
 
 struct kocl_request;
@@ -143,21 +365,130 @@ struct kocl_request {
     void *in, *out, *udata, *kdata;
     unsigned long insize, outsize, udatasize, kdatasize;
     char service_name[KOCL_SERVICE_NAME_SIZE];
+    int sid;                  /* kocl_service_id(service_name), or 0 */
+    int prio;                 /* KOCL_PRIO_*, KOCL_PRIO_NORMAL by default */
+    unsigned int timeout_ms;  /* then KOCL_NO_RESPONSE, 0: kocl.ko's req_timeout_ms */
+    int ctx;                  /* kocl_ctx_register() handle in place of udata */
+    void *ctxref;             /* kocl's, see kocl_ctx_attach() */
+    /* kocl_map_sg()-ed in and out, for the helper, 0 if not */
+    unsigned long sg_uva[2];
+    unsigned long sg_first[2], sg_npages[2];
+    int sg_win;               /* the helper whose window has them */
+    u32 sg_gen;               /* and its open, see kocl_unmap_sg() */
+    /* later stages, kocl_chain_add()-ed, and the helper's copy */
+    int nchain;
+    struct kocl_chain_stage *chain;
     kocl_callback callback;
     int errcode;
     struct completion *c;/* async-call completion */
+    u64 ts[KOCL_NR_TS];       /* see KOCL_TS_*, the last request handed out */
 };
 
 extern int kocl_offload_sync(struct kocl_request*);
 extern int kocl_offload_async(struct kocl_request*);
+/* one request over all devices, see main.c */
+extern int kocl_offload_split(struct kocl_request *req,
+			      unsigned long in_unit, unsigned long out_unit);
+extern int kocl_offload_split_sync(struct kocl_request *req,
+				   unsigned long in_unit, unsigned long out_unit);
+/*
+ * take a queued request back, its callback runs with KOCL_TERMINATED,
+ * -EINPROGRESS if the helper has it: then once it answers or goes
+ */
+extern int kocl_cancel_request(struct kocl_request *req);
 
 extern int kocl_next_request_id(void);
+extern int kocl_service_id(const char *name);
 extern struct kocl_request* kocl_alloc_request(void);
 extern void kocl_free_request(struct kocl_request*);
 
+/* let kocl_pick_channel() choose, see there */
+#define KOCL_CHANNEL_AUTO (-1)
+extern int kocl_pick_channel(unsigned long nbytes);
+
+/*
+ * NUMA node of a channel's device, NUMA_NO_NODE if the helper doesn't
+ * know, and the channel of a device on node (NUMA_NO_NODE: the caller's
+ * node), or -1 if there is none.
+ */
+extern int kocl_channel_node(int channel);
+extern int kocl_near_channel(int node);
+
+/*
+ * For clients cutting their own requests: the slots of a channel the
+ * helper has free right now, and the unit its pool allocates in.
+ */
+extern int kocl_channel_free_slots(int channel);
+extern unsigned long kocl_pool_unit(int channel);
+
+/*
+ * Scatter-gather: the helper works on the pages of sg in place, rather
+ * than on a copy in the pool, see main.c.
+ */
+#define KOCL_SG_IN 1
+#define KOCL_SG_OUT 2
+#define KOCL_SG_INOUT (KOCL_SG_IN|KOCL_SG_OUT)
+extern int kocl_map_sg(struct kocl_request *req, struct scatterlist *sg,
+		       unsigned long skip, unsigned long nbytes, int how);
+
+/*
+ * Chains: run service_name on in/out/udata, in the request's pool,
+ * after req's own service and the stages added before, on the device
+ * and without a trip back to kocl in between. KOCL_CHAIN_IN and
+ * KOCL_CHAIN_OUT stand for req's own in and out, kocl_map_sg()-ed or
+ * not. req->channel must be set first. May sleep.
+ */
+#define KOCL_CHAIN_IN ((void*)1)
+#define KOCL_CHAIN_OUT ((void*)2)
+extern int kocl_chain_add(struct kocl_request *req, const char *service_name,
+			  void *in, unsigned long insize,
+			  void *out, unsigned long outsize,
+			  void *udata, unsigned long udatasize);
+
+/*
+ * Client contexts: data many requests share, a key schedule, a hash
+ * seed, registered once. A request with req->ctx set has it as its
+ * udata, kocl keeps a copy resident in each pool it is used on and the
+ * helper's services see the handle in sr->ctx to cache it by. A
+ * context doesn't change, register a new one instead. Handles are > 0,
+ * register returns 0 if it can't.
+ */
+extern int kocl_ctx_register(const void *data, unsigned long size);
+extern void kocl_ctx_unregister(int handle);
+
+/*
+ * For KSM: calc_checksum() of each of n pages into sums, on the GPU, see
+ * main.c. Also in the fordedup table, dedup.h.
+ */
+extern int kocl_page_checksums(struct page **pages, unsigned int n, u32 *sums);
+/* group[i]: the first of the n pages with pages[i]'s fingerprint, or i */
+extern int kocl_page_dups(struct page **pages, unsigned int n, u32 *group);
+
 extern void *kocl_malloc(unsigned long nbytes,int channel);
 extern void kocl_free(void* p,int channel);
 
+/*
+ * Pool memory a client may have in flight, 0 for no limit. Buffers
+ * from kocl_malloc_wait() with a quota must be freed with the same
+ * quota by kocl_free_quota().
+ */
+struct kocl_quota {
+    atomic_long_t used;
+    unsigned long limit;
+};
+
+#define KOCL_QUOTA_INIT(lim) { .used = ATOMIC_LONG_INIT(0), .limit = (lim) }
+
+/*
+ * Sleep until the pool and the quotas allow the allocation, NULL on a
+ * fatal signal, or at once if the channel has no helper up or nbytes
+ * is more than its pool can ever give. q may be NULL for just the
+ * channel's quota.
+ */
+extern void *kocl_malloc_wait(unsigned long nbytes, int channel,
+			      struct kocl_quota *q);
+extern void kocl_free_quota(void *p, int channel, struct kocl_quota *q);
+
 
 #endif /* __KERNEL__ */
 
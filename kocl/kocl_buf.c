@@ -0,0 +1,574 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * Pinned memory pool allocator.
+ *
+ * Units are pages. Big buffers get a first-fit run of units from the
+ * bitmap, alloc_sz[] remembers the run length at its first unit. Small
+ * buffers, up to 2KB, come from per-class slabs: a slab is one unit cut
+ * into equal objects, tracked by a bitmap kept outside the pool since
+ * the pool memory is shared with the helper.
+ *
+ * In front of both sit per-CPU caches of freed buffers of the small
+ * classes, filled and drained in batches under the pool lock. A bit
+ * per buffer tells it is in one, so a double free is caught there.
+ *
+ * Each pool counts the bytes its clients hold, their peak, allocations
+ * by size and those that failed, and kocl_pool_scan() walks the
+ * bitmaps for how much is free and in what runs, for
+ * KOCL_IOC_GET_GPU_BUFS and kocl/pools in debugfs.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/bitmap.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/numa.h>
+#include "kkocl.h"
+
+int kocl_mempool_init(struct _kocl_mempool *gmp)
+{
+    int i;
+
+    gmp->nunits = gmp->npages/KOCL_BUF_NR_FRAMES_PER_UNIT;
+
+    gmp->bitmap = vzalloc(BITS_TO_LONGS(gmp->nunits)*sizeof(long));
+    gmp->alloc_sz = vzalloc(gmp->nunits*sizeof(u32));
+    gmp->slabs = vzalloc(gmp->nunits*sizeof(struct _kocl_slab*));
+    gmp->pcp = alloc_percpu(struct _kocl_pcp_cache);
+    gmp->pcp_cached = vzalloc(BITS_TO_LONGS(gmp->nunits)*sizeof(long));
+    if (!gmp->bitmap || !gmp->alloc_sz || !gmp->slabs || !gmp->pcp
+	|| !gmp->pcp_cached) {
+	kocl_log(KOCL_LOG_ERROR, "run out of memory for gmp metadata\n");
+	kocl_mempool_finit(gmp);
+	return -ENOMEM;
+    }
+
+    for (i=0; i<KOCL_SLAB_NR_CLASSES; i++)
+	INIT_LIST_HEAD(&gmp->partial[i]);
+
+    return 0;
+}
+
+void kocl_mempool_finit(struct _kocl_mempool *gmp)
+{
+    u32 i;
+
+    /* cached buffers are just dropped, they're still marked used */
+    if (gmp->pcp) {
+	free_percpu(gmp->pcp);
+	gmp->pcp = NULL;
+    }
+    if (gmp->pcp_cached) {
+	vfree(gmp->pcp_cached);
+	gmp->pcp_cached = NULL;
+    }
+    if (gmp->slabs) {
+	for (i=0; i<gmp->nunits; i++)
+	    kfree(gmp->slabs[i]);
+	vfree(gmp->slabs);
+	gmp->slabs = NULL;
+    }
+    if (gmp->bitmap) {
+	vfree(gmp->bitmap);
+	gmp->bitmap = NULL;
+    }
+    if (gmp->alloc_sz) {
+	vfree(gmp->alloc_sz);
+	gmp->alloc_sz = NULL;
+    }
+}
+
+/*
+ * Exchange the allocator state of two pools, gmp's lock must be held.
+ * ngmp is private to the caller, so its lock is left alone.
+ */
+void kocl_mempool_swap(struct _kocl_mempool *gmp, struct _kocl_mempool *ngmp)
+{
+    LIST_HEAD(tmp);
+    int i;
+
+    swap(gmp->uva, ngmp->uva);
+    swap(gmp->kva, ngmp->kva);
+    swap(gmp->pages, ngmp->pages);
+    swap(gmp->npages, ngmp->npages);
+    swap(gmp->nunits, ngmp->nunits);
+    swap(gmp->direct, ngmp->direct);
+    swap(gmp->bitmap, ngmp->bitmap);
+    swap(gmp->alloc_sz, ngmp->alloc_sz);
+    swap(gmp->slabs, ngmp->slabs);
+    swap(gmp->pcp, ngmp->pcp);
+    swap(gmp->pcp_cached, ngmp->pcp_cached);
+    for (i=0; i<KOCL_SLAB_NR_CLASSES; i++) {
+	list_splice_init(&gmp->partial[i], &tmp);
+	list_splice_init(&ngmp->partial[i], &gmp->partial[i]);
+	list_splice_init(&tmp, &ngmp->partial[i]);
+    }
+}
+
+static inline void *unit_addr(struct _kocl_mempool *gmp, unsigned long idx)
+{
+    return (void*)(gmp->kva + idx*KOCL_BUF_UNIT_SIZE);
+}
+
+static unsigned long units_alloc(struct _kocl_mempool *gmp, u32 n)
+{
+    unsigned long idx;
+
+    idx = bitmap_find_next_zero_area(gmp->bitmap, gmp->nunits, 0, n, 0);
+    if (idx < gmp->nunits) {
+	bitmap_set(gmp->bitmap, idx, n);
+	gmp->alloc_sz[idx] = n;
+    }
+    return idx;
+}
+
+static void units_free(struct _kocl_mempool *gmp, unsigned long idx)
+{
+    bitmap_clear(gmp->bitmap, idx, gmp->alloc_sz[idx]);
+    gmp->alloc_sz[idx] = 0;
+}
+
+static inline unsigned int slab_nobjs(int cls)
+{
+    return KOCL_BUF_UNIT_SIZE >> (cls+KOCL_SLAB_MIN_SHIFT);
+}
+
+static void *slab_alloc(struct _kocl_mempool *gmp, int cls)
+{
+    struct _kocl_slab *sl;
+    unsigned long idx;
+    unsigned int obj;
+
+    if (list_empty(&gmp->partial[cls])) {
+	idx = units_alloc(gmp, 1);
+	if (idx >= gmp->nunits)
+	    return NULL;
+
+	/* pools are used under spinlocks */
+	sl = kzalloc(sizeof(struct _kocl_slab), GFP_ATOMIC);
+	if (!sl) {
+	    units_free(gmp, idx);
+	    return NULL;
+	}
+	sl->unit = idx;
+	sl->cls = cls;
+	sl->nfree = slab_nobjs(cls);
+	gmp->slabs[idx] = sl;
+	list_add(&sl->list, &gmp->partial[cls]);
+    }
+
+    sl = list_first_entry(&gmp->partial[cls], struct _kocl_slab, list);
+    obj = find_first_zero_bit(sl->map, slab_nobjs(cls));
+    __set_bit(obj, sl->map);
+    if (--sl->nfree == 0)
+	list_del_init(&sl->list);
+
+    return (char*)unit_addr(gmp, sl->unit)
+	+ (obj << (cls+KOCL_SLAB_MIN_SHIFT));
+}
+
+static void slab_free(struct _kocl_mempool *gmp, struct _kocl_slab *sl,
+		      unsigned long offset)
+{
+    int shift = sl->cls+KOCL_SLAB_MIN_SHIFT;
+    unsigned int obj = offset >> shift;
+
+    /* same tolerance as for units: ignore pointers inside objects */
+    if (offset & ((1UL<<shift)-1) || !test_bit(obj, sl->map))
+	return;
+
+    __clear_bit(obj, sl->map);
+    if (sl->nfree++ == 0)
+	list_add(&sl->list, &gmp->partial[sl->cls]);
+
+    /* give the unit back, but keep the last partial slab of the class */
+    if (sl->nfree == slab_nobjs(sl->cls)
+	&& !list_is_singular(&gmp->partial[sl->cls])) {
+	list_del(&sl->list);
+	gmp->slabs[sl->unit] = NULL;
+	units_free(gmp, sl->unit);
+	kfree(sl);
+    }
+}
+
+static inline int slab_class(unsigned long nbytes)
+{
+    return nbytes <= (1UL<<KOCL_SLAB_MIN_SHIFT)? 0:
+	fls_long(nbytes-1) - KOCL_SLAB_MIN_SHIFT;
+}
+
+/* per-CPU cache class of a request size, -1 if it isn't cached */
+static inline int pcp_class(unsigned long nbytes)
+{
+    unsigned long n;
+
+    if (nbytes <= (1UL<<KOCL_SLAB_MAX_SHIFT))
+	return slab_class(nbytes);
+    n = DIV_ROUND_UP(nbytes, KOCL_BUF_UNIT_SIZE);
+    return n <= KOCL_PCP_MAX_UNITS? KOCL_SLAB_NR_CLASSES+n-1: -1;
+}
+
+static inline u32 pcp_class_units(int cls)
+{
+    return cls-KOCL_SLAB_NR_CLASSES+1;
+}
+
+/* the two below need gmp->lock */
+static void *class_alloc(struct _kocl_mempool *gmp, int cls)
+{
+    unsigned long idx;
+
+    if (cls < KOCL_SLAB_NR_CLASSES)
+	return slab_alloc(gmp, cls);
+
+    idx = units_alloc(gmp, pcp_class_units(cls));
+    if (idx >= gmp->nunits)
+	return NULL;
+    return unit_addr(gmp, idx);
+}
+
+static void class_free(struct _kocl_mempool *gmp, void *p)
+{
+    unsigned long off = (unsigned long)(p) - gmp->kva;
+    unsigned long idx = off/KOCL_BUF_UNIT_SIZE;
+
+    if (gmp->slabs[idx])
+	slab_free(gmp, gmp->slabs[idx], off % KOCL_BUF_UNIT_SIZE);
+    else
+	units_free(gmp, idx);
+}
+
+/*
+ * Class of a buffer being freed, -1 if it must take the slow path.
+ * The metadata of an allocated buffer doesn't change until it is
+ * freed, so this is safe without the lock.
+ */
+static int pcp_free_class(struct _kocl_mempool *gmp, unsigned long off)
+{
+    unsigned long idx = off/KOCL_BUF_UNIT_SIZE;
+    struct _kocl_slab *sl = gmp->slabs[idx];
+    u32 n;
+    int shift;
+
+    off %= KOCL_BUF_UNIT_SIZE;
+    if (sl) {
+	shift = sl->cls+KOCL_SLAB_MIN_SHIFT;
+	if (off & ((1UL<<shift)-1) || !test_bit(off >> shift, sl->map))
+	    return -1;
+	return sl->cls;
+    }
+
+    n = gmp->alloc_sz[idx];
+    if (off || n == 0 || n > KOCL_PCP_MAX_UNITS)
+	return -1;
+    return KOCL_SLAB_NR_CLASSES+n-1;
+}
+
+/*
+ * The bit telling an allocated buffer at p is in a CPU cache, stable
+ * without the lock as pcp_free_class() is.
+ */
+static unsigned long *pcp_cached_bit(struct _kocl_mempool *gmp, void *p,
+				     unsigned long *bit)
+{
+    unsigned long off = (unsigned long)(p) - gmp->kva;
+    unsigned long idx = off/KOCL_BUF_UNIT_SIZE;
+    struct _kocl_slab *sl = gmp->slabs[idx];
+
+    if (sl) {
+	*bit = (off % KOCL_BUF_UNIT_SIZE) >> (sl->cls+KOCL_SLAB_MIN_SHIFT);
+	return sl->cached;
+    }
+    *bit = idx;
+    return gmp->pcp_cached;
+}
+
+static inline void pcp_mark(struct _kocl_mempool *gmp, void *p)
+{
+    unsigned long bit, *map = pcp_cached_bit(gmp, p, &bit);
+
+    set_bit(bit, map);
+}
+
+static inline void pcp_unmark(struct _kocl_mempool *gmp, void *p)
+{
+    unsigned long bit, *map = pcp_cached_bit(gmp, p, &bit);
+
+    clear_bit(bit, map);
+}
+
+static void *pcp_alloc(struct _kocl_mempool *gmp, int cls)
+{
+    struct _kocl_pcp_cache *pc;
+    void *p = NULL;
+
+    pc = get_cpu_ptr(gmp->pcp);
+    if (!pc->count[cls]) {
+	spin_lock(&gmp->lock);
+	while (pc->count[cls] < KOCL_PCP_BATCH) {
+	    p = class_alloc(gmp, cls);
+	    if (!p)
+		break;
+	    pcp_mark(gmp, p);
+	    pc->objs[cls][pc->count[cls]++] = p;
+	}
+	spin_unlock(&gmp->lock);
+    }
+    if (pc->count[cls]) {
+	p = pc->objs[cls][--pc->count[cls]];
+	pcp_unmark(gmp, p);
+    }
+    put_cpu_ptr(gmp->pcp);
+
+    return p;
+}
+
+static void pcp_free(struct _kocl_mempool *gmp, int cls, void *p)
+{
+    struct _kocl_pcp_cache *pc;
+    unsigned long bit, *map = pcp_cached_bit(gmp, p, &bit);
+    int i;
+
+    /* freed twice, it is in a cache already */
+    if (WARN_ONCE(test_and_set_bit(bit, map),
+		  "kocl: pool buffer %p freed twice\n", p))
+	return;
+
+    pc = get_cpu_ptr(gmp->pcp);
+    if (pc->count[cls] == KOCL_PCP_HIGH) {
+	spin_lock(&gmp->lock);
+	for (i=0; i<KOCL_PCP_BATCH; i++) {
+	    pcp_unmark(gmp, pc->objs[cls][i]);
+	    class_free(gmp, pc->objs[cls][i]);
+	}
+	spin_unlock(&gmp->lock);
+	memmove(pc->objs[cls], pc->objs[cls]+KOCL_PCP_BATCH,
+		(KOCL_PCP_HIGH-KOCL_PCP_BATCH)*sizeof(void*));
+	pc->count[cls] -= KOCL_PCP_BATCH;
+    }
+    pc->objs[cls][pc->count[cls]++] = p;
+    put_cpu_ptr(gmp->pcp);
+}
+
+void *kocl_mempool_alloc(struct _kocl_mempool *gmp, unsigned long nbytes)
+{
+    unsigned long idx;
+    u32 req_nunits;
+    int cls;
+
+    if (!gmp->bitmap || !nbytes)
+	return NULL;
+
+    cls = pcp_class(nbytes);
+    if (cls >= 0)
+	return pcp_alloc(gmp, cls);
+
+    req_nunits = DIV_ROUND_UP(nbytes, KOCL_BUF_UNIT_SIZE);
+    spin_lock(&gmp->lock);
+    idx = units_alloc(gmp, req_nunits);
+    spin_unlock(&gmp->lock);
+    if (idx >= gmp->nunits)
+	return NULL;
+    return unit_addr(gmp, idx);
+}
+
+void kocl_mempool_free(struct _kocl_mempool *gmp, void *p)
+{
+    unsigned long off = (unsigned long)(p) - gmp->kva;
+    unsigned long idx = off/KOCL_BUF_UNIT_SIZE;
+    u32 alloc_nunits;
+    int cls;
+
+    if (!gmp->bitmap || (unsigned long)(p) < gmp->kva || idx >= gmp->nunits) {
+	kocl_log(KOCL_LOG_ERROR, "incorrect GPU memory pointer 0x%lX to free\n",
+		 (unsigned long)p);
+	return;
+    }
+
+    cls = pcp_free_class(gmp, off);
+    if (cls >= 0) {
+	pcp_free(gmp, cls, p);
+	return;
+    }
+
+    spin_lock(&gmp->lock);
+    if (gmp->slabs[idx]) {
+	slab_free(gmp, gmp->slabs[idx], off % KOCL_BUF_UNIT_SIZE);
+	goto out;
+    }
+
+    alloc_nunits = gmp->alloc_sz[idx];
+    if (alloc_nunits == 0 || off % KOCL_BUF_UNIT_SIZE) {
+	/*
+	 * We allow such case because this allows users free memory
+	 * from any field among in, out and data in request.
+	 */
+	goto out;
+    }
+    if (alloc_nunits > (gmp->nunits - idx)) {
+	kocl_log(KOCL_LOG_ERROR, "incorrect GPU memory allocation info: "
+		 "allocated %u units at unit index %lu\n", alloc_nunits, idx);
+	goto out;
+    }
+
+    units_free(gmp, idx);
+out:
+    spin_unlock(&gmp->lock);
+}
+
+void kocl_pool_init(struct _kocl_pool *pool)
+{
+    int i, j;
+
+    memset(pool, 0, sizeof(struct _kocl_pool));
+    pool->node = NUMA_NO_NODE;
+    for (i=0; i<KOCL_POOL_MAX_SEGS; i++) {
+	spin_lock_init(&pool->segs[i].lock);
+	for (j=0; j<KOCL_SLAB_NR_CLASSES; j++)
+	    INIT_LIST_HEAD(&pool->segs[i].partial[j]);
+    }
+}
+
+/* segment holding the kernel address p, NULL if it isn't in the pool */
+struct _kocl_mempool *kocl_pool_seg(struct _kocl_pool *pool, void *p)
+{
+    int i, n = smp_load_acquire(&pool->nsegs);
+    struct _kocl_mempool *gmp;
+
+    for (i=0; i<n; i++) {
+	gmp = &pool->segs[i];
+	if (ADDR_WITHIN(p, gmp->kva, (unsigned long)gmp->npages<<PAGE_SHIFT))
+	    return gmp;
+    }
+    return NULL;
+}
+
+void *kocl_pool_alloc(struct _kocl_pool *pool, unsigned long nbytes)
+{
+    int i, n = smp_load_acquire(&pool->nsegs);
+    void *p;
+
+    for (i=0; i<n; i++) {
+	p = kocl_mempool_alloc(&pool->segs[i], nbytes);
+	if (p)
+	    return p;
+    }
+    return NULL;
+}
+
+void kocl_pool_free(struct _kocl_pool *pool, void *p)
+{
+    struct _kocl_mempool *gmp = kocl_pool_seg(pool, p);
+
+    if (!gmp) {
+	kocl_log(KOCL_LOG_ERROR, "incorrect GPU memory pointer 0x%lX to free\n",
+		 (unsigned long)p);
+	return;
+    }
+    kocl_mempool_free(gmp, p);
+}
+
+/*
+ * Size of the buffer allocated at p, 0 if p isn't the start of one.
+ * p must stay allocated, its metadata is read without the lock.
+ */
+unsigned long kocl_mempool_bufsize(struct _kocl_mempool *gmp, void *p)
+{
+    unsigned long off = (unsigned long)(p) - gmp->kva;
+    unsigned long idx = off/KOCL_BUF_UNIT_SIZE;
+    struct _kocl_slab *sl = gmp->slabs[idx];
+    int shift;
+
+    off %= KOCL_BUF_UNIT_SIZE;
+    if (sl) {
+	shift = sl->cls+KOCL_SLAB_MIN_SHIFT;
+	if (off & ((1UL<<shift)-1) || !test_bit(off >> shift, sl->map))
+	    return 0;
+	return 1UL<<shift;
+    }
+    return off? 0: (unsigned long)gmp->alloc_sz[idx]*KOCL_BUF_UNIT_SIZE;
+}
+
+unsigned long kocl_pool_bufsize(struct _kocl_pool *pool, void *p)
+{
+    struct _kocl_mempool *gmp = kocl_pool_seg(pool, p);
+
+    return gmp? kocl_mempool_bufsize(gmp, p): 0;
+}
+
+/* a kocl_malloc() of nbytes got a buffer of sz bytes, 0 if none */
+void kocl_pool_note_alloc(struct _kocl_pool *pool, unsigned long nbytes,
+			  unsigned long sz)
+{
+    long u, pk;
+    int b;
+
+    if (!sz) {
+	atomic_long_inc(&pool->nfail);
+	return;
+    }
+    b = slab_class(nbytes);
+    atomic_long_inc(&pool->sizes[min(b, KOCL_POOL_NR_SIZES-1)]);
+    atomic_long_inc(&pool->nalloc);
+    u = atomic_long_add_return(sz, &pool->used);
+    while ((pk = atomic_long_read(&pool->peak)) < u
+	   && atomic_long_cmpxchg(&pool->peak, pk, u) != pk)
+	;
+}
+
+void kocl_pool_note_free(struct _kocl_pool *pool, unsigned long sz)
+{
+    atomic_long_sub(sz, &pool->used);
+}
+
+static void kocl_mempool_scan(struct _kocl_mempool *gmp, struct kocl_pool_info *pi)
+{
+    unsigned long i, end, run = 0;
+    int cpu, c;
+
+    spin_lock(&gmp->lock);
+    if (!gmp->bitmap)
+	goto out;
+    pi->units += gmp->nunits;
+    for (i = find_first_zero_bit(gmp->bitmap, gmp->nunits); i < gmp->nunits;
+	 i = find_next_zero_bit(gmp->bitmap, gmp->nunits, end)) {
+	end = find_next_bit(gmp->bitmap, gmp->nunits, i);
+	pi->free_units += end-i;
+	if (end-i > run)
+	    run = end-i;
+    }
+    if (run > pi->max_free_run)
+	pi->max_free_run = run;
+    for (i=0; i<gmp->nunits; i++)
+	if (gmp->slabs[i])
+	    pi->slab_units++;
+    /* racy, the CPUs change them without the lock */
+    for_each_possible_cpu(cpu)
+	for (c=0; c<KOCL_PCP_NR_CLASSES; c++)
+	    pi->cached += per_cpu_ptr(gmp->pcp, cpu)->count[c];
+out:
+    spin_unlock(&gmp->lock);
+}
+
+/* fill in pi's occupancy and counters */
+void kocl_pool_scan(struct _kocl_pool *pool, struct kocl_pool_info *pi)
+{
+    int i, n = smp_load_acquire(&pool->nsegs);
+
+    for (i=0; i<n; i++)
+	kocl_mempool_scan(&pool->segs[i], pi);
+    pi->used_bytes = max(atomic_long_read(&pool->used), 0L);
+    pi->peak_bytes = atomic_long_read(&pool->peak);
+    pi->nalloc = atomic_long_read(&pool->nalloc);
+    pi->nfail = atomic_long_read(&pool->nfail);
+    pi->nquota = atomic_long_read(&pool->nquota);
+    for (i=0; i<KOCL_POOL_NR_SIZES; i++)
+	pi->sizes[i] = atomic_long_read(&pool->sizes[i]);
+}
@@ -0,0 +1,236 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * Request latency histograms, in debugfs as kocl/latency.
+ *
+ * When a request's callback has returned, the time between each two of
+ * its KOCL_TS_* stamps goes to a log2 histogram of the phase for the
+ * request's service and one for its channel. Writing to the file
+ * clears them.
+ *
+ * kocl/pools shows how full and fragmented each pool is, a line per
+ * pool, see kocl_pool_scan().
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include "kkocl.h"
+
+int kocl_lat_stats = 1;
+module_param_named(lat_stats, kocl_lat_stats, int, 0644);
+MODULE_PARM_DESC(lat_stats, "keep request latency histograms, default 1 (yes)");
+
+struct dentry *kocl_debugfs;
+
+static const struct {
+    const char *name;
+    int from, to;
+} kocl_phases[] = {
+    { "kqueue",   KOCL_TS_SUBMIT,   KOCL_TS_HANDED },   /* in kocl's queue */
+    { "pickup",   KOCL_TS_HANDED,   KOCL_TS_RECV },     /* until the helper takes it */
+    { "wait",     KOCL_TS_RECV,     KOCL_TS_MEM },      /* for its programs, merging */
+    { "prepare",  KOCL_TS_MEM,      KOCL_TS_PREPARED }, /* for a queue, enqueueing uploads */
+    { "launch",   KOCL_TS_PREPARED, KOCL_TS_LAUNCHED }, /* behind other launches */
+    { "exec",     KOCL_TS_LAUNCHED, KOCL_TS_EXECUTED }, /* uploads and kernels */
+    { "post",     KOCL_TS_EXECUTED, KOCL_TS_POSTED },   /* downloads */
+    { "reply",    KOCL_TS_POSTED,   KOCL_TS_RESP },     /* until kocl has the response */
+    { "callback", KOCL_TS_RESP,     KOCL_TS_CALLBACK },
+    { "total",    KOCL_TS_SUBMIT,   KOCL_TS_CALLBACK },
+};
+
+#define KOCL_LAT_NR_PHASES ARRAY_SIZE(kocl_phases)
+
+/* bucket b: [2^(b-1), 2^b) us, 0 below 1us, the last one all above */
+#define KOCL_LAT_BUCKETS 24
+
+struct kocl_lat_hist {
+    atomic_t n[KOCL_LAT_NR_PHASES][KOCL_LAT_BUCKETS];
+    atomic64_t sum[KOCL_LAT_NR_PHASES];   /* ns */
+};
+
+/* by sid, 0 for requests without one */
+static struct kocl_lat_hist lat_srv[KOCL_MAX_SERVICES+1];
+static struct kocl_lat_hist lat_chan[KOCL_NR_CHANNELS];
+
+static inline int kocl_lat_bucket(u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+
+    if (!us)
+	return 0;
+    return min_t(int, ilog2(us)+1, KOCL_LAT_BUCKETS-1);
+}
+
+void kocl_lat_account(int sid, int channel, const u64 *ts)
+{
+    struct kocl_lat_hist *hs[2];
+    int i, j, b;
+    u64 d;
+
+    hs[0] = &lat_srv[sid > 0 && sid <= KOCL_MAX_SERVICES? sid: 0];
+    hs[1] = channel >= 0 && channel < KOCL_NR_CHANNELS? &lat_chan[channel]: NULL;
+
+    for (i=0; i<KOCL_LAT_NR_PHASES; i++) {
+	if (!ts[kocl_phases[i].from] || ts[kocl_phases[i].to] < ts[kocl_phases[i].from])
+	    continue;
+	d = ts[kocl_phases[i].to] - ts[kocl_phases[i].from];
+	b = kocl_lat_bucket(d);
+	for (j=0; j<2; j++)
+	    if (hs[j]) {
+		atomic_inc(&hs[j]->n[i][b]);
+		atomic64_add(d, &hs[j]->sum[i]);
+	    }
+    }
+}
+
+/* upper bound of the bucket the p-th percentile falls in, in us */
+static unsigned long kocl_lat_pct(const unsigned int *n, unsigned long cnt, int p)
+{
+    unsigned long want = DIV_ROUND_UP(cnt*p, 100), s = 0;
+    int b;
+
+    for (b=0; b<KOCL_LAT_BUCKETS; b++) {
+	s += n[b];
+	if (s >= want)
+	    break;
+    }
+    return 1UL << min(b, KOCL_LAT_BUCKETS-1);
+}
+
+static void kocl_lat_show_hist(struct seq_file *m, const char *what, int id,
+			       struct kocl_lat_hist *h)
+{
+    unsigned int n[KOCL_LAT_BUCKETS];
+    unsigned long cnt;
+    int i, b, j;
+
+    for (i=0; i<KOCL_LAT_NR_PHASES; i++) {
+	for (b=0, cnt=0; b<KOCL_LAT_BUCKETS; b++)
+	    cnt += n[b] = atomic_read(&h->n[i][b]);
+	if (!cnt)
+	    continue;
+	seq_printf(m, "%s %d %s n=%lu mean_us=%llu p50_us=%lu p99_us=%lu",
+		   what, id, kocl_phases[i].name, cnt,
+		   div64_u64(atomic64_read(&h->sum[i]), (u64)cnt*NSEC_PER_USEC),
+		   kocl_lat_pct(n, cnt, 50), kocl_lat_pct(n, cnt, 99));
+	/* the buckets up to the last one used */
+	for (b=KOCL_LAT_BUCKETS-1; b>0 && !n[b]; b--)
+	    ;
+	seq_puts(m, " log2_us:");
+	for (j=0; j<=b; j++)
+	    seq_printf(m, " %u", n[j]);
+	seq_putc(m, '\n');
+    }
+}
+
+static int kocl_lat_show(struct seq_file *m, void *v)
+{
+    int i;
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	kocl_lat_show_hist(m, "channel", i, &lat_chan[i]);
+    for (i=0; i<=KOCL_MAX_SERVICES; i++) {
+	const char *name = kocl_service_name(i);
+
+	if (i && !name)
+	    break;
+	seq_printf(m, "# service %d: %s\n", i, i? name: "(no sid)");
+	kocl_lat_show_hist(m, "service", i, &lat_srv[i]);
+    }
+    return 0;
+}
+
+static int kocl_lat_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, kocl_lat_show, NULL);
+}
+
+static ssize_t kocl_lat_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+    memset(lat_srv, 0, sizeof(lat_srv));
+    memset(lat_chan, 0, sizeof(lat_chan));
+    return count;
+}
+
+static const struct file_operations kocl_lat_fops = {
+    .owner = THIS_MODULE,
+    .open = kocl_lat_open,
+    .read = seq_read,
+    .write = kocl_lat_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int kocl_pools_show(struct seq_file *m, void *v)
+{
+    struct kocl_gpu_mem_info *gb;
+    struct kocl_pool_info *pi;
+    int i, b, j;
+
+    gb = kmalloc(sizeof(*gb), GFP_KERNEL);
+    if (!gb)
+	return -ENOMEM;
+    kocl_pools_info(gb);
+    for (i=0; i<gb->npools; i++) {
+	pi = &gb->pools[i];
+	seq_printf(m, "pool %d size=%lu max_size=%lu node=%d units=%lu used_units=%lu"
+		   " free_units=%lu max_free_run=%lu slab_units=%lu cached=%lu"
+		   " used_bytes=%lu peak_bytes=%lu allocs=%lu fails=%lu over_quota=%lu",
+		   i, pi->size, pi->max_size, pi->node, pi->units,
+		   pi->units-pi->free_units, pi->free_units, pi->max_free_run,
+		   pi->slab_units, pi->cached, pi->used_bytes, pi->peak_bytes,
+		   pi->nalloc, pi->nfail, pi->nquota);
+	/* by size, from 32 bytes, up to the last one used */
+	for (b=KOCL_POOL_NR_SIZES-1; b>0 && !pi->sizes[b]; b--)
+	    ;
+	seq_puts(m, " log2_sizes:");
+	for (j=0; j<=b; j++)
+	    seq_printf(m, " %lu", pi->sizes[j]);
+	seq_putc(m, '\n');
+    }
+    kfree(gb);
+    return 0;
+}
+
+static int kocl_pools_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, kocl_pools_show, NULL);
+}
+
+static const struct file_operations kocl_pools_fops = {
+    .owner = THIS_MODULE,
+    .open = kocl_pools_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int kocl_stat_init(void)
+{
+    kocl_debugfs = debugfs_create_dir("kocl", NULL);
+    if (IS_ERR_OR_NULL(kocl_debugfs)) {
+	/* no debugfs, the counters are still kept */
+	kocl_debugfs = NULL;
+	return 0;
+    }
+    debugfs_create_file("latency", 0644, kocl_debugfs, NULL, &kocl_lat_fops);
+    debugfs_create_file("pools", 0444, kocl_debugfs, NULL, &kocl_pools_fops);
+    return 0;
+}
+
+void kocl_stat_exit(void)
+{
+    debugfs_remove_recursive(kocl_debugfs);
+    kocl_debugfs = NULL;
+}
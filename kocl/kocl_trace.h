@@ -0,0 +1,197 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * Tracepoints of a request's way through kocl, in
+ * /sys/kernel/debug/tracing/events/kocl/ for ftrace and perf:
+ * submitted, handed to the helper, its response written back, the
+ * callback's entry and exit, and pool buffers.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kocl
+
+#if !defined(_KOCL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KOCL_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "kocl.h"
+
+DECLARE_EVENT_CLASS(kocl_request_class,
+
+    TP_PROTO(struct kocl_request *req),
+
+    TP_ARGS(req),
+
+    TP_STRUCT__entry(
+	__field(int, id)
+	__field(int, channel)
+	__field(int, sid)
+	__array(char, service, KOCL_SERVICE_NAME_SIZE)
+	__field(unsigned long, insize)
+	__field(unsigned long, outsize)
+	__field(unsigned long, datasize)
+	__field(int, nchain)
+	__field(int, errcode)
+    ),
+
+    TP_fast_assign(
+	__entry->id = req->id;
+	__entry->channel = req->channel;
+	__entry->sid = req->sid;
+	memcpy(__entry->service, req->service_name, KOCL_SERVICE_NAME_SIZE);
+	__entry->service[KOCL_SERVICE_NAME_SIZE-1] = 0;
+	__entry->insize = req->insize;
+	__entry->outsize = req->outsize;
+	__entry->datasize = req->udatasize;
+	__entry->nchain = req->nchain;
+	__entry->errcode = req->errcode;
+    ),
+
+    TP_printk("id=%d channel=%d sid=%d service=%s insize=%lu outsize=%lu"
+	      " datasize=%lu nchain=%d errcode=%d",
+	      __entry->id, __entry->channel, __entry->sid, __entry->service,
+	      __entry->insize, __entry->outsize, __entry->datasize,
+	      __entry->nchain, __entry->errcode)
+);
+
+/* kocl_offload_async() and kocl_offload_sync(), before the request is queued */
+TRACE_EVENT(kocl_submit,
+
+    TP_PROTO(struct kocl_request *req, int sync),
+
+    TP_ARGS(req, sync),
+
+    TP_STRUCT__entry(
+	__field(int, id)
+	__field(int, channel)
+	__field(int, sid)
+	__array(char, service, KOCL_SERVICE_NAME_SIZE)
+	__field(unsigned long, insize)
+	__field(unsigned long, outsize)
+	__field(unsigned long, datasize)
+	__field(int, prio)
+	__field(int, sync)
+    ),
+
+    TP_fast_assign(
+	__entry->id = req->id;
+	__entry->channel = req->channel;
+	__entry->sid = req->sid;
+	memcpy(__entry->service, req->service_name, KOCL_SERVICE_NAME_SIZE);
+	__entry->service[KOCL_SERVICE_NAME_SIZE-1] = 0;
+	__entry->insize = req->insize;
+	__entry->outsize = req->outsize;
+	__entry->datasize = req->udatasize;
+	__entry->prio = req->prio;
+	__entry->sync = sync;
+    ),
+
+    TP_printk("id=%d channel=%d sid=%d service=%s insize=%lu outsize=%lu"
+	      " datasize=%lu prio=%d %s",
+	      __entry->id, __entry->channel, __entry->sid, __entry->service,
+	      __entry->insize, __entry->outsize, __entry->datasize,
+	      __entry->prio, __entry->sync? "sync": "async")
+);
+
+/* copied out to the helper, by kocl_read() or into the sq ring */
+DEFINE_EVENT(kocl_request_class, kocl_handoff,
+    TP_PROTO(struct kocl_request *req),
+    TP_ARGS(req)
+);
+
+/* the helper's response came, by kocl_write() or the cq ring */
+DEFINE_EVENT(kocl_request_class, kocl_complete,
+    TP_PROTO(struct kocl_request *req),
+    TP_ARGS(req)
+);
+
+DEFINE_EVENT(kocl_request_class, kocl_callback_entry,
+    TP_PROTO(struct kocl_request *req),
+    TP_ARGS(req)
+);
+
+/* the request may be gone by now, this is what it was at the entry */
+TRACE_EVENT(kocl_callback_exit,
+
+    TP_PROTO(int id, int channel, int sid, int errcode, u64 ns),
+
+    TP_ARGS(id, channel, sid, errcode, ns),
+
+    TP_STRUCT__entry(
+	__field(int, id)
+	__field(int, channel)
+	__field(int, sid)
+	__field(int, errcode)
+	__field(u64, ns)
+    ),
+
+    TP_fast_assign(
+	__entry->id = id;
+	__entry->channel = channel;
+	__entry->sid = sid;
+	__entry->errcode = errcode;
+	__entry->ns = ns;
+    ),
+
+    TP_printk("id=%d channel=%d sid=%d errcode=%d callback_ns=%llu",
+	      __entry->id, __entry->channel, __entry->sid, __entry->errcode,
+	      (unsigned long long)__entry->ns)
+);
+
+/* p NULL if it failed, size is what the pool gave */
+TRACE_EVENT(kocl_malloc,
+
+    TP_PROTO(int channel, unsigned long nbytes, void *p, unsigned long size),
+
+    TP_ARGS(channel, nbytes, p, size),
+
+    TP_STRUCT__entry(
+	__field(int, channel)
+	__field(unsigned long, nbytes)
+	__field(void *, p)
+	__field(unsigned long, size)
+    ),
+
+    TP_fast_assign(
+	__entry->channel = channel;
+	__entry->nbytes = nbytes;
+	__entry->p = p;
+	__entry->size = size;
+    ),
+
+    TP_printk("channel=%d nbytes=%lu p=%p size=%lu",
+	      __entry->channel, __entry->nbytes, __entry->p, __entry->size)
+);
+
+TRACE_EVENT(kocl_free,
+
+    TP_PROTO(int channel, void *p, unsigned long size),
+
+    TP_ARGS(channel, p, size),
+
+    TP_STRUCT__entry(
+	__field(int, channel)
+	__field(void *, p)
+	__field(unsigned long, size)
+    ),
+
+    TP_fast_assign(
+	__entry->channel = channel;
+	__entry->p = p;
+	__entry->size = size;
+    ),
+
+    TP_printk("channel=%d p=%p size=%lu",
+	      __entry->channel, __entry->p, __entry->size)
+);
+
+#endif /* _KOCL_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE kocl_trace
+#include <trace/define_trace.h>
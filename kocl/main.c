@@ -35,17 +35,97 @@
 #include <asm/page.h>
 #include <linux/highmem.h>
 #include <linux/pagemap.h>
+#include <linux/mutex.h>
+#include <linux/hash.h>
+#include <linux/workqueue.h>
+#include <linux/smp.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/moduleparam.h>
 #include "kkocl.h"
 #include "dedup.h"
+#define CREATE_TRACE_POINTS
+#include "kocl_trace.h"
+#include "../jhash/jhash_common.h"
+
+struct _kocl_ring {
+    void *mem;                  /* vmalloc_user area mmap-ed by the helper */
+    unsigned long size;
+    unsigned long chan_size;
+    unsigned int mask;          /* private copy, the shared one is untrusted */
+    unsigned int nentries;
+};
+
+/*
+ * Pending requests of one channel. Channels don't share locks or
+ * wait queues, so each device's traffic only contends with itself.
+ */
+struct _kocl_chan {
+    struct list_head reqs;
+    spinlock_t reqlock;
+    wait_queue_head_t reqq;
+
+    struct kocl_sq_ring *sq;
+    struct kocl_cq_ring *cq;
+    struct mutex cqlock;        /* serializes cq reaping */
+    int ring;                   /* its helper serves it through the rings */
+
+    int helper;                 /* index of the helper serving it, -1: none */
+    int state;                  /* KOCL_TERMINATED once that one stopped */
+
+    atomic_long_t inuse;        /* pool bytes allocated for the channel */
+
+    /* for kocl_pick_channel() */
+    atomic_long_t inflight;     /* bytes of requests not done yet */
+    atomic_t nreqs;             /* requests not done yet */
+    int slots;                  /* the helper runs that many at once */
+    atomic_long_t rate;         /* bytes done per ms while busy, 0 unknown */
+    atomic64_t last_done;       /* ns */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Requests handed to the helper, hashed by id so that a response
+ * finds its request in O(1) and only locks one bucket.
+ */
+#define KOCL_RTD_HASH_BITS 8
+#define KOCL_RTD_HASH_SIZE (1<<KOCL_RTD_HASH_BITS)
+
+struct _kocl_rtd_bucket {
+    struct list_head reqs;
+    spinlock_t lock;
+} ____cacheline_aligned_in_smp;
 
-struct _kocl_mempool {
-    unsigned long uva;    
-    unsigned long kva;    
-    struct page **pages;    
-    u32 npages;
-    u32 nunits;
-    unsigned long *bitmap;
-    u32           *alloc_sz;
+/*
+ * The helper's scatter-gather window, a VM_MIXEDMAP area that
+ * kocl_map_sg() inserts the pages of requests into, a bit per page.
+ */
+struct _kocl_sg_window {
+    struct vm_area_struct *vma;
+    struct mm_struct *mm;
+    unsigned long npages;
+    unsigned long *map;
+    spinlock_t lock;
+};
+
+/*
+ * A helper process, an open of /dev/kocl. It serves the channels it
+ * registers pools for and gets only their requests, so helpers, e.g.
+ * one per OpenCL vendor, run side by side and come and go on their own.
+ */
+struct _kocl_helper {
+    int used;
+    unsigned long chans;        /* the channels it serves, a bit each */
+    unsigned long pools;        /* kocl's pools it has, a bit each */
+    int pool[KOCL_MAX_POOLS];   /* kocl's pool of its pool i */
+    int npools;
+    int ring;                   /* it set up the rings */
+    int stopped;                /* by KOCL_IOC_SET_STOP */
+    u32 gen;                    /* bumped per open, the slot is reused */
+    struct _kocl_sg_window sg;
 };
 
 struct _kocl_dev {
@@ -56,23 +136,34 @@ struct _kocl_dev {
     int rid_sequence;
     spinlock_t ridlock;
 
-    struct list_head reqs;
-    spinlock_t reqlock;
-    wait_queue_head_t reqq;
+    struct _kocl_chan chans[KOCL_NR_CHANNELS];
+    wait_queue_head_t reqq;     /* for consumers of all channels */
+
+    struct _kocl_rtd_bucket rtdreqs[KOCL_RTD_HASH_SIZE];
 
-    struct list_head rtdreqs;
-    spinlock_t rtdreqlock;
+    struct _kocl_ring ring;
+    struct _kocl_helper helpers[KOCL_MAX_HELPERS];
 
-    struct _kocl_mempool gmpool;
-    struct _kocl_mempool gmpool2;
-    struct _kocl_mempool gmpool3;    
-    spinlock_t gmpool_lock;    
+    struct _kocl_pool pools[KOCL_MAX_POOLS];
+    int npools;                 /* pools [0, npools) were ever used */
+    int chan_pool[KOCL_NR_CHANNELS];
+    struct mutex pool_mutex;    /* serializes registering and growing, and helpers */
+    unsigned long grow_pending; /* pools that ran out and may grow */
+    wait_queue_head_t growq;
+    wait_queue_head_t memq;     /* kocl_malloc_wait() sleepers */
     int state;
 };
 
 struct _kocl_request_item {
     struct list_head list;
     struct kocl_request *r;
+    int cpu;                    /* submitting CPU */
+    struct work_struct work;    /* deferred callback */
+    int channel;
+    unsigned long bytes;        /* in and out */
+    u64 t0;                     /* ns when queued */
+    u64 deadline;               /* ns it times out at, 0: never */
+    int cancel;                 /* the helper has it: errcode it gets then */
 };
 
 struct _kocl_sync_call_data {
@@ -82,13 +173,239 @@ struct _kocl_sync_call_data {
 	int done;
 };
 
-static atomic_t kocldev_av = ATOMIC_INIT(1);
 static struct _kocl_dev kocldev;
 
 static struct kmem_cache *kocl_request_cache;
 static struct kmem_cache *kocl_request_item_cache;
 static struct kmem_cache *kocl_sync_call_data_cache;
 
+/*
+ * Completion callbacks run in the helper's syscall by default. With
+ * deferred_callback they run on a per-CPU worker of the CPU that
+ * submitted the request, so heavy callbacks don't hold up the helper.
+ */
+static int deferred_callback = 0;
+module_param(deferred_callback, int, 0444);
+MODULE_PARM_DESC(deferred_callback,
+		 "run callbacks on per-CPU workers, default 0 (No)");
+
+/*
+ * A sync call of a service whose sync calls have been taking up to
+ * sync_spin_us spins for its response, up to twice that long, before
+ * it sleeps: a wake up costs about as much as a small request.
+ */
+static int sync_spin_us = 50;
+module_param(sync_spin_us, int, 0644);
+MODULE_PARM_DESC(sync_spin_us,
+		 "spin for sync calls expected within this many us, default 50, 0: never");
+
+/* by sid, 0 for requests without one: recent sync call time, ns */
+static atomic64_t kocl_sync_ns[KOCL_MAX_SERVICES+1];
+
+static struct workqueue_struct *kocl_callback_wq;
+
+/* pool memory a channel may have in flight, in MB, 0 for no limit */
+static int chan_quota = 0;
+module_param(chan_quota, int, 0644);
+MODULE_PARM_DESC(chan_quota,
+		 "per-channel limit of allocated pool memory (MB), default 0 (none)");
+
+/*
+ * Requests the helper hasn't answered in req_timeout_ms, or in their
+ * own timeout_ms, complete with KOCL_NO_RESPONSE. The helper may still
+ * be working on one that it had taken, and a late answer is dropped.
+ */
+static unsigned int req_timeout_ms = 0;
+module_param(req_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(req_timeout_ms,
+		 "time requests out after this many ms, default 0 (never)");
+
+/* looks for expired requests while there are any with a deadline */
+#define KOCL_WATCHDOG_PERIOD (HZ/10)
+static struct delayed_work kocl_watchdog;
+static atomic_t kocl_ntimed = ATOMIC_INIT(0);
+
+/* pick_channel's guess of a channel it hasn't seen done anything, bytes/ms */
+#define KOCL_AUTO_DEF_RATE (1024*1024)
+
+static void fill_ku_request(struct kocl_ku_request *kureq,
+			    struct kocl_request *req);
+
+static inline struct _kocl_rtd_bucket *kocl_rtd_bucket(int id)
+{
+    return &kocldev.rtdreqs[hash_32((u32)id, KOCL_RTD_HASH_BITS)];
+}
+
+/*
+ * Track a request handed to the helper until its response comes.
+ */
+static void kocl_rtd_add(struct _kocl_request_item *item)
+{
+    struct _kocl_rtd_bucket *b = kocl_rtd_bucket(item->r->id);
+
+    spin_lock(&b->lock);
+    list_add_tail(&item->list, &b->reqs);
+    spin_unlock(&b->lock);
+}
+
+static inline struct _kocl_chan *kocl_chan(int channel)
+{
+    if (unlikely(channel < 0 || channel >= KOCL_NR_CHANNELS))
+	channel = 0;
+    return &kocldev.chans[channel];
+}
+
+/* no requests for the channel, see kocl_helper_stop() */
+static inline int kocl_terminated(int channel)
+{
+    return kocldev.state == KOCL_TERMINATED
+	|| kocl_chan(channel)->state == KOCL_TERMINATED;
+}
+
+/*
+ * Put one request into its channel's sq ring, and make it visible to
+ * kocl_write()/ring reaping through rtdreqs before publishing it.
+ * Must be called with the channel's reqlock held.
+ * Returns 1 if the request was consumed, 0 if the ring is off or full.
+ */
+static int kocl_ring_produce(struct _kocl_chan *ch,
+			     struct _kocl_request_item *item)
+{
+    struct kocl_sq_ring *sq = ch->sq;
+    unsigned int tail;
+
+    if (!ch->ring)
+	return 0;
+
+    tail = sq->hdr.tail;
+    if (tail - smp_load_acquire(&sq->hdr.head) >= kocldev.ring.nentries)
+	return 0;
+
+    fill_ku_request(&sq->entries[tail & kocldev.ring.mask], item->r);
+    kocl_rtd_add(item);
+
+    smp_store_release(&sq->hdr.tail, tail+1);
+    return 1;
+}
+
+/*
+ * Move parked requests into the sq ring as long as it has room.
+ * Must be called with the channel's reqlock held.
+ */
+static void kocl_ring_refill(struct _kocl_chan *ch)
+{
+    struct _kocl_request_item *item;
+
+    if (!ch->ring)
+	return;
+
+    while (!list_empty(&ch->reqs)) {
+	item = list_first_entry(&ch->reqs, struct _kocl_request_item, list);
+	list_del(&item->list);
+	if (!kocl_ring_produce(ch, item)) {
+	    list_add(&item->list, &ch->reqs);
+	    return;
+	}
+    }
+    ch->sq->hdr.flags &= ~KOCL_RING_SQ_OVERFLOW;
+}
+
+/*
+ * Park a request on the channel's reqs, behind those of its priority
+ * and ahead of lower ones. Must be called with the channel's reqlock.
+ */
+static void kocl_park_item(struct _kocl_chan *ch,
+			   struct _kocl_request_item *item)
+{
+    struct _kocl_request_item *i;
+
+    list_for_each_entry_reverse(i, &ch->reqs, list)
+	if (i->r->prio >= item->r->prio) {
+	    list_add(&item->list, &i->list);
+	    return;
+	}
+    list_add(&item->list, &ch->reqs);
+}
+
+/*
+ * Queue a request for the helper: straight into the channel's sq ring
+ * if the helper uses it, otherwise (or when the ring is full) on the
+ * channel's reqs.
+ */
+static void kocl_queue_item(struct _kocl_request_item *item)
+{
+    struct _kocl_chan *ch = kocl_chan(item->r->channel);
+    unsigned int ms = item->r->timeout_ms? item->r->timeout_ms:
+	READ_ONCE(req_timeout_ms);
+
+    spin_lock(&ch->reqlock);
+
+    INIT_LIST_HEAD(&item->list);
+    item->cpu = raw_smp_processor_id();
+    item->channel = ch - kocldev.chans;
+    item->bytes = item->r->insize + item->r->outsize;
+    item->t0 = ktime_get_ns();
+    item->deadline = ms? item->t0 + (u64)ms*NSEC_PER_MSEC: 0;
+    item->cancel = 0;
+    if (ms)
+	atomic_inc(&kocl_ntimed);
+    memset(item->r->ts, 0, sizeof(item->r->ts));
+    item->r->ts[KOCL_TS_SUBMIT] = item->t0;
+    atomic_long_add(item->bytes, &ch->inflight);
+    atomic_inc(&ch->nreqs);
+    if (!list_empty(&ch->reqs) || !kocl_ring_produce(ch, item)) {
+	kocl_park_item(ch, item);
+	if (ch->ring)
+	    ch->sq->hdr.flags |= KOCL_RING_SQ_OVERFLOW;
+    }
+
+    wake_up_interruptible(&ch->reqq);
+
+    spin_unlock(&ch->reqlock);
+
+    /* the item may be done already, it's not touched any more */
+    if (ms)
+	queue_delayed_work(system_wq, &kocl_watchdog, KOCL_WATCHDOG_PERIOD);
+
+    /* only touch the shared wait queue when someone sleeps on it */
+    smp_mb();
+    if (waitqueue_active(&(kocldev.reqq)))
+	wake_up_interruptible(&(kocldev.reqq));
+}
+
+/* has any of the channels in chans requests queued */
+static int kocl_reqs_pending(unsigned long chans)
+{
+    int i;
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	if (test_bit(i, &chans) && !list_empty(&kocldev.chans[i].reqs))
+	    return 1;
+    return 0;
+}
+
+/*
+ * A request of the channel is done. Its rate sample is the time since
+ * the later of its queueing and the channel's previous completion, which
+ * leaves out the time it waited behind others.
+ */
+static void kocl_chan_done(struct _kocl_request_item *item)
+{
+    struct _kocl_chan *ch = &kocldev.chans[item->channel];
+    u64 now = ktime_get_ns();
+    u64 from = max_t(u64, item->t0, atomic64_xchg(&ch->last_done, now));
+    long r, sample;
+
+    atomic_long_sub(item->bytes, &ch->inflight);
+    atomic_dec(&ch->nreqs);
+    if (!item->bytes || now <= from)
+	return;
+
+    sample = div64_u64((u64)item->bytes * NSEC_PER_MSEC, now - from);
+    r = atomic_long_read(&ch->rate);
+    atomic_long_set(&ch->rate, r? r - r/8 + sample/8: sample);
+}
+
 /*
  * Async GPU call.
  */
@@ -96,11 +413,13 @@ int kocl_offload_async(struct kocl_request *req)
 {
     struct _kocl_request_item *item;
     
-    if (unlikely(kocldev.state == KOCL_TERMINATED)) {
+    if (unlikely(kocl_terminated(req->channel))) {
 	kocl_log(KOCL_LOG_ALERT,
 		 "kocl is terminated, no request accepted any more\n");
 	return KOCL_TERMINATED;
     }
+    if (kocl_ctx_attach(req))
+	return -EINVAL;
     
     item = kmem_cache_alloc(kocl_request_item_cache, GFP_KERNEL);
 
@@ -110,16 +429,8 @@ int kocl_offload_async(struct kocl_request *req)
     }
     item->r = req;
     
-    spin_lock(&(kocldev.reqlock));
-
-    INIT_LIST_HEAD(&item->list);
-    list_add_tail(&item->list, &(kocldev.reqs));
-    
-    wake_up_interruptible(&(kocldev.reqq));
-    
-    spin_unlock(&(kocldev.reqlock));
-
-   
+    trace_kocl_submit(req, 0);
+    kocl_queue_item(item);
     
     return 0;
 }
@@ -133,7 +444,8 @@ static int sync_callback(struct kocl_request *req)
     struct _kocl_sync_call_data *data = (struct _kocl_sync_call_data*)
 	req->kdata;
     
-    data->done = 1;
+    /* the spinning waiter doesn't take the wait queue's lock */
+    smp_store_release(&data->done, 1);
     
     wake_up_interruptible(&data->queue);
     
@@ -141,14 +453,49 @@ static int sync_callback(struct kocl_request *req)
 }
 
 /*
- * Sync GPU call
+ * Wait for a sync call, spinning first if its service's recent calls
+ * were short, see sync_spin_us. t0 is when it was submitted. A signal
+ * cancels the request, or waits on if the helper has it: the callback
+ * still has data and req, and the helper the buffers.
  */
-int kocl_offload_sync(struct kocl_request *req)
+static void kocl_sync_wait(struct kocl_request *req,
+			   struct _kocl_sync_call_data *data, int sid, u64 t0)
+{
+    atomic64_t *e = &kocl_sync_ns[sid > 0 && sid <= KOCL_MAX_SERVICES? sid: 0];
+    u64 exp = atomic64_read(e), spin = (u64)max(sync_spin_us, 0)*NSEC_PER_USEC;
+    u64 now, d;
+
+    if (exp && exp <= spin) {
+	u64 until = t0 + 2*exp;
+
+	while (!smp_load_acquire(&data->done) && !need_resched()
+	       && ktime_get_ns() < until)
+	    cpu_relax();
+    }
+    if (!smp_load_acquire(&data->done)
+	&& wait_event_interruptible(data->queue, (data->done==1))) {
+	if (kocl_cancel_request(req))
+	    wait_event(data->queue, (data->done==1));
+	return;
+    }
+
+    now = ktime_get_ns();
+    d = now > t0? now - t0: 0;
+    atomic64_set(e, exp? exp - (exp >> 3) + (d >> 3): d);
+}
+
+/*
+ * Sync GPU call, through kocl_offload_split() if in_unit isn't 0.
+ */
+static int __kocl_offload_sync(struct kocl_request *req,
+			       unsigned long in_unit, unsigned long out_unit)
 {
     struct _kocl_sync_call_data *data;
-    struct _kocl_request_item *item;
+    struct _kocl_request_item *item = NULL;
+    u64 t0 = ktime_get_ns();
+    int err, prio = req->prio;
 
-    if (unlikely(kocldev.state == KOCL_TERMINATED)) {
+    if (unlikely(kocl_terminated(req->channel))) {
 	kocl_log(KOCL_LOG_ALERT,
 		 "kocl is terminated, no request accepted any more\n");
 	return KOCL_TERMINATED;
@@ -159,13 +506,20 @@ int kocl_offload_sync(struct kocl_request *req)
 	kocl_log(KOCL_LOG_ERROR, "kocl_call_sync alloc mem failed\n");
 	return -ENOMEM;
     }
-    item = kmem_cache_alloc(kocl_request_item_cache, GFP_KERNEL);
-    if (!item) {
-	kocl_log(KOCL_LOG_ERROR, "out of memory for kocl request\n");
-	return -ENOMEM;
+    if (!in_unit) {
+	if (kocl_ctx_attach(req)) {
+	    kmem_cache_free(kocl_sync_call_data_cache, data);
+	    return -EINVAL;
+	}
+	item = kmem_cache_alloc(kocl_request_item_cache, GFP_KERNEL);
+	if (!item) {
+	    kocl_log(KOCL_LOG_ERROR, "out of memory for kocl request\n");
+	    kmem_cache_free(kocl_sync_call_data_cache, data);
+	    return -ENOMEM;
+	}
+	item->r = req;
     }
-    item->r = req;
-    
+
     data->oldkdata = req->kdata;
     data->oldcallback = req->callback;
     data->done = 0;
@@ -173,27 +527,41 @@ int kocl_offload_sync(struct kocl_request *req)
     
     req->kdata = data;
     req->callback = sync_callback;
+    if (req->prio == KOCL_PRIO_NORMAL)
+	req->prio = KOCL_PRIO_HIGH;
     
-    spin_lock(&(kocldev.reqlock));
-
-    INIT_LIST_HEAD(&item->list);//初始化list node, prev,next 都指向自己 
-    list_add_tail(&item->list, &(kocldev.reqs));//把item->list node 加入到 reqs list 裡面（先進先出）
+    if (item) {
+	trace_kocl_submit(req, 1);
+	kocl_queue_item(item);//把item加入reqs list或sq ring, 並把在kocl_read() reqq queue的process 叫醒
+	err = 0;
+    } else
+	err = kocl_offload_split(req, in_unit, out_unit);
 
-    wake_up_interruptible(&(kocldev.reqq));//有收到reqs 把在kocl_read() reqq queue的process 叫醒
-    
-    spin_unlock(&(kocldev.reqlock));
+    //process先在data queue等,如果kocl_wrte()收到reqs回來則會呼叫sync_callback
+    if (!err)
+	kocl_sync_wait(req, data, req->sid, t0);
 
-    //process先在data queue等,如果kocl_wrte()收到reqs回來則會呼叫sync_callback 
-    wait_event_interruptible(data->queue, (data->done==1));
-        
     req->kdata = data->oldkdata;
     req->callback = data->oldcallback;
- 
+    req->prio = prio;
+
     kmem_cache_free(kocl_sync_call_data_cache, data);
-    return 0;
+    return err;
+}
+
+int kocl_offload_sync(struct kocl_request *req)
+{
+    return __kocl_offload_sync(req, 0, 0);
 }
 EXPORT_SYMBOL_GPL(kocl_offload_sync);
 
+int kocl_offload_split_sync(struct kocl_request *req,
+			    unsigned long in_unit, unsigned long out_unit)
+{
+    return __kocl_offload_sync(req, in_unit, out_unit);
+}
+EXPORT_SYMBOL_GPL(kocl_offload_split_sync);
+
 
 int kocl_next_request_id(void)
 {
@@ -212,6 +580,46 @@ int kocl_next_request_id(void)
 }
 EXPORT_SYMBOL_GPL(kocl_next_request_id);
 
+/*
+ * Service names get small ids, so that the helper finds a request's
+ * service by indexing rather than comparing names. A client looks its
+ * services up once and sets kocl_request.sid along with the name.
+ */
+static char kocl_snames[KOCL_MAX_SERVICES][KOCL_SERVICE_NAME_SIZE];
+static int kocl_nsnames;
+static DEFINE_SPINLOCK(kocl_snames_lock);
+
+int kocl_service_id(const char *name)
+{
+    int i, sid = 0;
+
+    spin_lock(&kocl_snames_lock);
+    for (i=0; i<kocl_nsnames; i++)
+	if (!strncmp(kocl_snames[i], name, KOCL_SERVICE_NAME_SIZE)) {
+	    sid = i+1;
+	    goto out;
+	}
+    if (kocl_nsnames < KOCL_MAX_SERVICES) {
+	strncpy(kocl_snames[kocl_nsnames], name, KOCL_SERVICE_NAME_SIZE-1);
+	sid = ++kocl_nsnames;
+    }
+out:
+    spin_unlock(&kocl_snames_lock);
+    return sid;
+}
+EXPORT_SYMBOL_GPL(kocl_service_id);
+
+const char *kocl_service_name(int sid)
+{
+    const char *name = NULL;
+
+    spin_lock(&kocl_snames_lock);
+    if (sid > 0 && sid <= kocl_nsnames)
+	name = kocl_snames[sid-1];
+    spin_unlock(&kocl_snames_lock);
+    return name;
+}
+
 static void kocl_request_item_constructor(void *data)
 {
     struct _kocl_request_item *item =
@@ -252,425 +660,1763 @@ struct kocl_request* kocl_alloc_request(void)
 EXPORT_SYMBOL_GPL(kocl_alloc_request);
 
 
+static void kocl_unmap_sg(struct kocl_request *req);
+static void kocl_ctx_detach(struct kocl_request *req);
+
 void kocl_free_request(struct kocl_request* req)
 {
+    /* a request that never completed may still have its pages there */
+    kocl_unmap_sg(req);
+    kocl_ctx_detach(req);
+    if (req->chain)
+	kocl_free(req->chain, req->channel);
+    /* the constructor doesn't run again for a reused object */
+    req->sid = 0;
+    req->prio = KOCL_PRIO_NORMAL;
+    req->ctx = 0;
+    req->timeout_ms = 0;
+    req->nchain = 0;
+    req->chain = NULL;
     kmem_cache_free(kocl_request_cache, req);
 }
 EXPORT_SYMBOL_GPL(kocl_free_request);
 
+/*
+ * The stages live in the request's pool, KOCL_CHAIN_MAX of them as the
+ * client gave them and as many more as fill_ku_request() makes of them
+ * for the helper.
+ */
+int kocl_chain_add(struct kocl_request *req, const char *service_name,
+		   void *in, unsigned long insize,
+		   void *out, unsigned long outsize,
+		   void *udata, unsigned long udatasize)
+{
+    struct kocl_chain_stage *cs;
+
+    if (req->channel < 0 || req->channel >= KOCL_NR_CHANNELS
+	|| req->nchain >= KOCL_CHAIN_MAX)
+	return -EINVAL;
+    if (!req->chain) {
+	req->chain = kocl_malloc_wait(2*KOCL_CHAIN_MAX*sizeof(*cs),
+				      req->channel, NULL);
+	if (!req->chain)
+	    return -ENOMEM;
+    }
 
-void* kocl_malloc(unsigned long nbytes, int channel)
+    cs = &req->chain[req->nchain++];
+    cs->sid = kocl_service_id(service_name);
+    strncpy(cs->service_name, service_name, KOCL_SERVICE_NAME_SIZE-1);
+    cs->service_name[KOCL_SERVICE_NAME_SIZE-1] = 0;
+    cs->in = in;
+    cs->out = out;
+    cs->data = udata;
+    cs->insize = insize;
+    cs->outsize = outsize;
+    cs->datasize = udatasize;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(kocl_chain_add);
+
+
+/* the pool of a channel, as registered by the helper */
+static inline int kocl_pool_id(int channel)
 {
-    unsigned int req_nunits = DIV_ROUND_UP(nbytes, KOCL_BUF_UNIT_SIZE);
-    void *p = NULL;
-    unsigned long idx=0UL;
-    unsigned long *bitmap=NULL;
-    u32 nunits=0;
-    unsigned long kva=0UL;
-    u32 *alloc_sz=NULL;
-
-    spin_lock(&kocldev.gmpool_lock);
-         if(channel==2){      
-             bitmap = kocldev.gmpool2.bitmap;
-             nunits = kocldev.gmpool2.nunits;
-                kva = kocldev.gmpool2.kva;
-           alloc_sz = kocldev.gmpool2.alloc_sz;
-        }else if(channel==3){
-             bitmap = kocldev.gmpool3.bitmap;
-             nunits = kocldev.gmpool3.nunits;
-                kva = kocldev.gmpool3.kva;
-           alloc_sz = kocldev.gmpool3.alloc_sz;
-        }else{
-            //channel 0 or 1 
-             bitmap = kocldev.gmpool.bitmap;
-             nunits = kocldev.gmpool.nunits;
-                kva = kocldev.gmpool.kva;
-           alloc_sz = kocldev.gmpool.alloc_sz;
-        }
-
-    idx = bitmap_find_next_zero_area(bitmap, nunits, 0, req_nunits, 0);
-    if (idx < nunits) {
-	    bitmap_set(bitmap, idx, req_nunits);
-	    p = (void*)((unsigned long)(kva) + idx*KOCL_BUF_UNIT_SIZE);
-	    alloc_sz[idx] = req_nunits;
-    // kocl_log(KOCL_LOG_PRINT, "idx:%lu gmpool.nunits:%d req_nunits:%d p:%p \n",idx, kocldev.gmpool.nunits, req_nunits, p);
-    
-    } else {
-	    kocl_log(KOCL_LOG_ERROR, "idx:%lu 20:%d\n", idx, nunits);
-	    kocl_log(KOCL_LOG_ERROR, "out of GPU memory for malloc %lu\n",  nbytes);
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS)
+	channel = 0;
+    return kocldev.chan_pool[channel];
+}
+
+static inline struct _kocl_pool *kocl_pool(int channel)
+{
+    return &kocldev.pools[kocl_pool_id(channel)];
+}
+
+/* the channel has a helper, with its pool */
+static inline int kocl_chan_served(int channel)
+{
+    return kocldev.chans[channel].helper >= 0 && kocl_pool(channel)->size;
+}
+
+/* ask the helper for more memory if the pool may still grow */
+static void kocl_pool_want_grow(int id)
+{
+    struct _kocl_pool *pool = &kocldev.pools[id];
+
+    if (pool->size < pool->max_size
+	&& !test_and_set_bit(id, &kocldev.grow_pending))
+	wake_up_interruptible(&kocldev.growq);
+}
+
+/* over a limit, but always let one buffer through to avoid deadlocks */
+static inline int kocl_over_quota(atomic_long_t *used, unsigned long limit,
+				  unsigned long nbytes)
+{
+    long u = atomic_long_read(used);
+
+    return limit && u && u + nbytes > limit;
+}
+
+/*
+ * The channel a new request of nbytes should go to, for clients that
+ * leave placement to kocl (KOCL_CHANNEL_AUTO). That is the one expected
+ * to be done first with what it has in flight and the new request, at
+ * the rate it has been doing requests. Channels without a pool, over
+ * chan_quota or whose pool is nearly full are only taken if there is
+ * nothing else. Allocate the request's buffers on the returned channel.
+ */
+int kocl_pick_channel(unsigned long nbytes)
+{
+    unsigned long quota = (unsigned long)chan_quota<<20;
+    unsigned long used[KOCL_MAX_POOLS] = {0};
+    u64 cost, best_cost = 0;
+    int i, best = -1, best_busy = 1, busy;
+    struct _kocl_pool *pool;
+    struct _kocl_chan *ch;
+    long rate;
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	used[kocl_pool_id(i)] += atomic_long_read(&kocldev.chans[i].inuse);
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	ch = &kocldev.chans[i];
+	pool = kocl_pool(i);
+	if (!kocl_chan_served(i))
+	    continue;
+
+	busy = used[kocl_pool_id(i)] + nbytes > pool->size - pool->size/8
+	    || kocl_over_quota(&ch->inuse, quota, nbytes);
+	rate = atomic_long_read(&ch->rate);
+	if (rate <= 0)
+	    rate = KOCL_AUTO_DEF_RATE;
+	cost = div64_u64(((u64)atomic_long_read(&ch->inflight) + nbytes)
+			 * USEC_PER_MSEC, rate);
+	/* the copies to a device on another node cross the interconnect */
+	if (pool->node != NUMA_NO_NODE && pool->node != numa_node_id())
+	    cost += cost/4;
+
+	if (best < 0 || busy < best_busy
+	    || (busy == best_busy && cost < best_cost)) {
+	    best = i;
+	    best_cost = cost;
+	    best_busy = busy;
+	}
+    }
+
+    return best < 0? 0: best;
+}
+EXPORT_SYMBOL_GPL(kocl_pick_channel);
+
+int kocl_channel_node(int channel)
+{
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS || !kocl_chan_served(channel))
+	return NUMA_NO_NODE;
+    return kocl_pool(channel)->node;
+}
+EXPORT_SYMBOL_GPL(kocl_channel_node);
+
+int kocl_near_channel(int node)
+{
+    int i;
+
+    if (node == NUMA_NO_NODE)
+	node = numa_node_id();
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	if (kocl_channel_node(i) == node)
+	    return i;
+    return -1;
+}
+EXPORT_SYMBOL_GPL(kocl_near_channel);
+
+/* as many as the helper has queue slots, KOCL_DEF_SLOTS if it didn't say */
+#define KOCL_DEF_SLOTS 16
+
+int kocl_channel_free_slots(int channel)
+{
+    struct _kocl_chan *ch;
+    int n;
+
+    if (channel < 0 || channel >= KOCL_NR_CHANNELS || !kocl_chan_served(channel))
+	return 0;
+    ch = &kocldev.chans[channel];
+    n = (ch->slots? ch->slots: KOCL_DEF_SLOTS) - atomic_read(&ch->nreqs);
+    return n > 0? n: 0;
+}
+EXPORT_SYMBOL_GPL(kocl_channel_free_slots);
+
+unsigned long kocl_pool_unit(int channel)
+{
+    return KOCL_BUF_UNIT_SIZE;
+}
+EXPORT_SYMBOL_GPL(kocl_pool_unit);
+
+static void *kocl_try_malloc(unsigned long nbytes, int channel,
+			     struct kocl_quota *q)
+{
+    struct _kocl_chan *ch = kocl_chan(channel);
+    int id = kocl_pool_id(channel);
+    unsigned long sz;
+    void *p;
+
+    /* its pool may be another helper's by now, or not set up yet */
+    if (unlikely(ch->helper < 0 || ch->state != KOCL_OK))
+	return NULL;
+    if (kocl_over_quota(&ch->inuse, (unsigned long)chan_quota<<20, nbytes)
+	|| (q && kocl_over_quota(&q->used, q->limit, nbytes))) {
+	atomic_long_inc(&kocldev.pools[id].nquota);
+	trace_kocl_malloc(channel, nbytes, NULL, 0);
+	return NULL;
+    }
+
+    p = kocl_pool_alloc(&kocldev.pools[id], nbytes);
+    if (!p) {
+	kocl_pool_note_alloc(&kocldev.pools[id], nbytes, 0);
+	trace_kocl_malloc(channel, nbytes, NULL, 0);
+	kocl_pool_want_grow(id);
+	return NULL;
     }
-    spin_unlock(&kocldev.gmpool_lock);
+
+    sz = kocl_pool_bufsize(&kocldev.pools[id], p);
+    kocl_pool_note_alloc(&kocldev.pools[id], nbytes, sz);
+    trace_kocl_malloc(channel, nbytes, p, sz);
+    atomic_long_add(sz, &ch->inuse);
+    if (q)
+	atomic_long_add(sz, &q->used);
+    return p;
+}
+
+void* kocl_malloc(unsigned long nbytes, int channel)
+{
+    void *p;
+
+    p = kocl_try_malloc(nbytes, channel, NULL);
+
+    if (!p)
+	kocl_log(KOCL_LOG_ERROR, "out of GPU memory for malloc %lu\n",  nbytes);
     return p;	
 }
 EXPORT_SYMBOL_GPL(kocl_malloc);
 
+/*
+ * No helper will give it: the channel has none that is up, or nbytes
+ * is more than any segment of its pool has, or can have once it grows.
+ */
+static int kocl_malloc_never(unsigned long nbytes, int channel)
+{
+    struct _kocl_chan *ch = kocl_chan(channel);
+    struct _kocl_pool *pool = kocl_pool(channel);
+    unsigned long big = 0, size = READ_ONCE(pool->size);
+    int i, n;
+
+    if (ch->helper < 0 || ch->state != KOCL_OK)
+	return 1;
+    n = smp_load_acquire(&pool->nsegs);
+    for (i=0; i<n; i++)
+	big = max(big, (unsigned long)pool->segs[i].nunits*KOCL_BUF_UNIT_SIZE);
+    if (nbytes <= big)
+	return 0;
+    /* a segment it grows never takes it past max_size */
+    return n >= KOCL_POOL_MAX_SEGS || size >= pool->max_size
+	|| nbytes > pool->max_size - size;
+}
+
+void *kocl_malloc_wait(unsigned long nbytes, int channel,
+		       struct kocl_quota *q)
+{
+    void *p = NULL;
+
+    might_sleep();
+    if (wait_event_killable(kocldev.memq,
+			    (p = kocl_try_malloc(nbytes, channel, q)) != NULL
+			    || kocl_malloc_never(nbytes, channel)))
+	return NULL;
+    if (!p)
+	kocl_log(KOCL_LOG_ERROR, "no GPU memory to wait for, malloc %lu\n", nbytes);
+    return p;
+}
+EXPORT_SYMBOL_GPL(kocl_malloc_wait);
+
+static inline void kocl_wake_mem_waiters(void)
+{
+    if (wq_has_sleeper(&kocldev.memq))
+	wake_up(&kocldev.memq);
+}
+
+void kocl_free_quota(void *p, int channel, struct kocl_quota *q)
+{
+    struct _kocl_pool *pool = kocl_pool(channel);
+    unsigned long sz = kocl_pool_bufsize(pool, p);
+
+    trace_kocl_free(channel, p, sz);
+    kocl_pool_free(pool, p);
+    if (sz) {
+	kocl_pool_note_free(pool, sz);
+	atomic_long_sub(sz, &kocl_chan(channel)->inuse);
+	if (q)
+	    atomic_long_sub(sz, &q->used);
+    }
+    kocl_wake_mem_waiters();
+}
+EXPORT_SYMBOL_GPL(kocl_free_quota);
+
 void kocl_free(void *p, int channel)
 {  
-    unsigned long idx=0UL;
-    unsigned int alloc_nunits=0;
-    unsigned long *bitmap=NULL;
-    u32 nunits=0;
-    unsigned long kva=0UL;
-    u32 *alloc_sz=NULL;
-
-        if(channel==2){      
-             bitmap = kocldev.gmpool2.bitmap;
-             nunits = kocldev.gmpool2.nunits;
-                kva = kocldev.gmpool2.kva;
-           alloc_sz = kocldev.gmpool2.alloc_sz;
-
-        }else if(channel==3){
-             bitmap = kocldev.gmpool3.bitmap;
-             nunits = kocldev.gmpool3.nunits;
-                kva = kocldev.gmpool3.kva;
-           alloc_sz = kocldev.gmpool3.alloc_sz;
-        }else{
-            //channel 0 or 1 
-             bitmap = kocldev.gmpool.bitmap;
-             nunits = kocldev.gmpool.nunits;
-                kva = kocldev.gmpool.kva;
-           alloc_sz = kocldev.gmpool.alloc_sz;
-        }
-
-     idx =	((unsigned long)(p)-(unsigned long)(kva))/KOCL_BUF_UNIT_SIZE;
-  
-    if (idx < 0 || idx >= nunits) {
-	     kocl_log(KOCL_LOG_ERROR, "incorrect GPU memory pointer 0x%lX to free\n",  p);
-	    return;
+    kocl_free_quota(p, channel, NULL);
+}
+EXPORT_SYMBOL_GPL(kocl_free);
+
+/*
+ * Client contexts, see kocl_ctx_register(). A handle is the slot + 1
+ * and the slot's generation above KOCL_CTX_SHIFT bits, so the helper
+ * never sees a reused handle stand for another context. Each context
+ * lives until its registration and the requests using it are gone.
+ */
+#define KOCL_MAX_CTXS 1024
+#define KOCL_CTX_SHIFT 12
+
+struct _kocl_ctx {
+    void *data;                 /* the client's, copied */
+    unsigned long size;
+    atomic_t ref;
+    void *copy[KOCL_MAX_POOLS]; /* resident in the pools */
+    u32 copy_gen[KOCL_MAX_POOLS];
+    int copy_chan[KOCL_MAX_POOLS];
+};
+
+static struct _kocl_ctx *kocl_ctxs[KOCL_MAX_CTXS];
+static u32 kocl_ctx_gens[KOCL_MAX_CTXS];
+static DEFINE_SPINLOCK(kocl_ctx_lock);
+
+int kocl_ctx_register(const void *data, unsigned long size)
+{
+    struct _kocl_ctx *c;
+    int i, h = 0;
+
+    c = kzalloc(sizeof(*c), GFP_KERNEL);
+    if (!c)
+	return 0;
+    c->data = kmemdup(data, size, GFP_KERNEL);
+    if (!c->data) {
+	kfree(c);
+	return 0;
     }
-    alloc_nunits = alloc_sz[idx];
-    if (alloc_nunits == 0) {
-	/*
-	 * We allow such case because this allows users free memory
-	 * from any field among in, out and data in request.
-	 */
-	    return;
+    c->size = size;
+    atomic_set(&c->ref, 1);
+
+    spin_lock(&kocl_ctx_lock);
+    for (i=0; i<KOCL_MAX_CTXS && kocl_ctxs[i]; i++)
+	;
+    if (i < KOCL_MAX_CTXS) {
+	kocl_ctxs[i] = c;
+	kocl_ctx_gens[i] = (kocl_ctx_gens[i]+1) & ((1U<<(30-KOCL_CTX_SHIFT))-1);
+	h = (kocl_ctx_gens[i]<<KOCL_CTX_SHIFT) | (i+1);
     }
-    if (alloc_nunits > (nunits - idx)) {
-	    kocl_log(KOCL_LOG_ERROR, "incorrect GPU memory allocation info: "
-		        "allocated %u units at unit index %u\n", alloc_nunits, idx);
-	    return;
+    spin_unlock(&kocl_ctx_lock);
+
+    if (!h) {
+	kocl_log(KOCL_LOG_ERROR, "out of client contexts\n");
+	kfree(c->data);
+	kfree(c);
+    }
+    return h;
+}
+EXPORT_SYMBOL_GPL(kocl_ctx_register);
+
+/* the copies of a pool the helper has set anew since are gone with it */
+static void kocl_ctx_put(struct _kocl_ctx *c)
+{
+    int i;
+
+    if (!atomic_dec_and_test(&c->ref))
+	return;
+    for (i=0; i<KOCL_MAX_POOLS; i++)
+	if (c->copy[i] && c->copy_gen[i] == kocldev.pools[i].gen)
+	    kocl_free(c->copy[i], c->copy_chan[i]);
+    kfree(c->data);
+    kfree(c);
+}
+
+static struct _kocl_ctx *kocl_ctx_get(int handle)
+{
+    int i = (handle & ((1<<KOCL_CTX_SHIFT)-1)) - 1;
+    struct _kocl_ctx *c = NULL;
+
+    if (i < 0 || i >= KOCL_MAX_CTXS)
+	return NULL;
+    spin_lock(&kocl_ctx_lock);
+    if (kocl_ctxs[i] && kocl_ctx_gens[i] == (u32)handle>>KOCL_CTX_SHIFT) {
+	c = kocl_ctxs[i];
+	atomic_inc(&c->ref);
+    }
+    spin_unlock(&kocl_ctx_lock);
+    return c;
+}
+
+void kocl_ctx_unregister(int handle)
+{
+    int i = (handle & ((1<<KOCL_CTX_SHIFT)-1)) - 1;
+    struct _kocl_ctx *c = NULL;
+
+    if (i < 0 || i >= KOCL_MAX_CTXS)
+	return;
+    spin_lock(&kocl_ctx_lock);
+    if (kocl_ctxs[i] && kocl_ctx_gens[i] == (u32)handle>>KOCL_CTX_SHIFT) {
+	c = kocl_ctxs[i];
+	kocl_ctxs[i] = NULL;
+    }
+    spin_unlock(&kocl_ctx_lock);
+    if (c)
+	kocl_ctx_put(c);
+}
+EXPORT_SYMBOL_GPL(kocl_ctx_unregister);
+
+/* a copy of c in pool id of the current generation, under kocl_ctx_lock */
+static inline void *kocl_ctx_copy(struct _kocl_ctx *c, int id)
+{
+    if (c->copy[id] && c->copy_gen[id] == kocldev.pools[id].gen)
+	return c->copy[id];
+    return NULL;
+}
+
+/*
+ * The context's copy in the request's pool becomes its udata. It is
+ * made outside kocl_ctx_lock and published under it, the first one in
+ * wins.
+ */
+static int kocl_ctx_attach(struct kocl_request *req)
+{
+    struct _kocl_ctx *c;
+    int id = kocl_pool_id(req->channel);
+    u32 gen;
+    void *p, *n;
+
+    if (!req->ctx || req->ctxref)
+	return 0;
+    c = kocl_ctx_get(req->ctx);
+    if (!c)
+	return -EINVAL;
+
+    spin_lock(&kocl_ctx_lock);
+    p = kocl_ctx_copy(c, id);
+    spin_unlock(&kocl_ctx_lock);
+
+    if (!p) {
+	gen = READ_ONCE(kocldev.pools[id].gen);
+	n = kocl_try_malloc(c->size, req->channel, NULL);
+	if (n)
+	    memcpy(n, c->data, c->size);
+
+	spin_lock(&kocl_ctx_lock);
+	p = kocl_ctx_copy(c, id);
+	if (!p && n && gen == kocldev.pools[id].gen) {
+	    c->copy[id] = p = n;
+	    c->copy_gen[id] = gen;
+	    c->copy_chan[id] = req->channel;
+	    n = NULL;
+	}
+	spin_unlock(&kocl_ctx_lock);
+	if (n)
+	    kocl_free(n, req->channel);
+    }
+
+    if (!p) {
+	kocl_ctx_put(c);
+	return -ENOMEM;
+    }
+    req->ctxref = c;
+    req->udata = p;
+    req->udatasize = c->size;
+    return 0;
+}
+
+static void kocl_ctx_detach(struct kocl_request *req)
+{
+    if (req->ctxref) {
+	kocl_ctx_put(req->ctxref);
+	req->ctxref = NULL;
+    }
+}
+
+/*
+ * Splitting one request over the devices. Each pool is a device, so a
+ * request is cut into one part per pool, sized by the rate of the
+ * channel that takes it. The part on the request's own pool works on
+ * the request's buffers in place, the others get buffers in their pool
+ * and are copied in here and out when they are done.
+ */
+static int split_min = 1024;
+module_param(split_min, int, 0644);
+MODULE_PARM_DESC(split_min,
+		 "smallest part of a split request (KB), default 1024");
+
+struct _kocl_split;
+
+struct _kocl_split_part {
+    struct _kocl_split *split;
+    struct kocl_request *r;
+    unsigned long first, units;
+    void *buf;                  /* its own buffers, NULL if in place */
+};
+
+struct _kocl_split {
+    struct kocl_request *parent;
+    unsigned long in_unit, out_unit;
+    atomic_t left;
+    int errcode;
+    struct _kocl_split_part parts[KOCL_MAX_POOLS];
+};
+
+static int kocl_split_part_done(struct kocl_request *r)
+{
+    struct _kocl_split_part *part = (struct _kocl_split_part *)r->kdata;
+    struct _kocl_split *split = part->split;
+    struct kocl_request *parent = split->parent;
+
+    if (r->errcode)
+	split->errcode = r->errcode;
+    else if (part->buf)
+	memcpy(parent->out + part->first*split->out_unit, r->out,
+	       part->units*split->out_unit);
+    if (part->buf)
+	kocl_free(part->buf, r->channel);
+    kocl_free_request(r);
+
+    if (atomic_dec_and_test(&split->left)) {
+	parent->errcode = split->errcode;
+	kfree(split);
+	parent->callback(parent);
+    }
+    return 0;
+}
+
+/* the request of part on channel, with buffers of its own off the parent's pool */
+static int kocl_split_setup_part(struct _kocl_split *split,
+				 struct _kocl_split_part *part, int channel)
+{
+    struct kocl_request *parent = split->parent;
+    struct kocl_request *r;
+    unsigned long insz = part->units*split->in_unit;
+    unsigned long outsz = part->units*split->out_unit;
+    int inplace = parent->in == parent->out;
+    char *b;
+
+    r = part->r = kocl_alloc_request();
+    if (!r)
+	return -ENOMEM;
+    r->channel = channel;
+    memcpy(r->service_name, parent->service_name, KOCL_SERVICE_NAME_SIZE);
+    r->sid = parent->sid;
+    r->prio = parent->prio;
+    r->timeout_ms = parent->timeout_ms;
+    r->callback = kocl_split_part_done;
+    r->kdata = part;
+    r->insize = insz;
+    r->outsize = outsz;
+    r->udatasize = parent->udatasize;
+    /* each pool has its own copy of a context */
+    r->ctx = parent->ctx;
+    if (r->ctx)
+	r->udatasize = 0;
+
+    if (kocl_pool_id(channel) == kocl_pool_id(parent->channel)) {
+	part->buf = NULL;
+	r->in = parent->in + part->first*split->in_unit;
+	r->out = parent->out + part->first*split->out_unit;
+	r->udata = r->ctx? NULL: parent->udata;
+	return 0;
+    }
+
+    b = part->buf = kocl_try_malloc(insz + (inplace? 0: outsz)
+				    + r->udatasize, channel, NULL);
+    if (!b) {
+	kocl_free_request(r);
+	return -ENOMEM;
+    }
+    r->in = b;
+    memcpy(b, parent->in + part->first*split->in_unit, insz);
+    b += insz;
+    if (inplace)
+	r->out = r->in;
+    else {
+	r->out = b;
+	b += outsz;
+    }
+    if (r->udatasize) {
+	r->udata = b;
+	memcpy(b, parent->udata, parent->udatasize);
+    }
+    return 0;
+}
+
+/*
+ * Run a request on all devices, as parts of whole in_unit and out_unit
+ * sized pieces of its in and out: the service must take any number of
+ * them, with the same udata. An in place request (in == out) needs
+ * in_unit == out_unit. The request's callback runs when all parts are
+ * done, with an error of one of them. Requests too small for two parts
+ * of split_min just go to their channel.
+ */
+int kocl_offload_split(struct kocl_request *req,
+		       unsigned long in_unit, unsigned long out_unit)
+{
+    struct _kocl_split *split;
+    struct _kocl_split_part *part;
+    int chan[KOCL_MAX_POOLS];
+    unsigned long rate[KOCL_MAX_POOLS], sum = 0;
+    unsigned long nunits, gran, left, r;
+    unsigned long min = (unsigned long)split_min<<10;
+    int i, c, id, own = kocl_pool_id(req->channel), n = 0;
+
+    if (unlikely(kocl_terminated(req->channel)))
+	return KOCL_TERMINATED;
+
+    nunits = out_unit? req->outsize/out_unit: 0;
+    if (req->sg_uva[0] || req->sg_uva[1] || req->nchain
+	|| !in_unit || !out_unit || req->insize < nunits*in_unit
+	|| (req->in == req->out && in_unit != out_unit)
+	|| nunits*out_unit < 2*min)
+	return kocl_offload_async(req);
+
+    /* one channel per pool, the request's own one for its pool */
+    for (i=0; i<KOCL_MAX_POOLS; i++)
+	chan[i] = -1;
+    chan[own] = req->channel;
+    for (c=0; c<KOCL_NR_CHANNELS; c++) {
+	id = kocl_pool_id(c);
+	if (chan[id] < 0 && kocl_chan_served(c))
+	    chan[id] = c;
+    }
+    for (i=0; i<KOCL_MAX_POOLS; i++) {
+	rate[i] = 0;
+	if (chan[i] < 0)
+	    continue;
+	rate[i] = atomic_long_read(&kocldev.chans[chan[i]].rate);
+	if (!rate[i])
+	    rate[i] = KOCL_AUTO_DEF_RATE;
+	sum += rate[i];
+    }
+
+    split = kmalloc(sizeof(struct _kocl_split), GFP_KERNEL);
+    if (!split)
+	return kocl_offload_async(req);
+    split->parent = req;
+    split->in_unit = in_unit;
+    split->out_unit = out_unit;
+    split->errcode = 0;
+
+    /* parts of whole pages if the units allow, for the helper's views */
+    gran = (in_unit < PAGE_SIZE && !(PAGE_SIZE % in_unit))?
+	PAGE_SIZE/in_unit: 1;
+    left = nunits;
+    for (i=0; i<KOCL_MAX_POOLS; i++) {
+	if (chan[i] < 0 || i == own)
+	    continue;
+	r = div64_u64((u64)nunits*rate[i], sum);
+	r -= r % gran;
+	if (r*out_unit < min || r >= left)
+	    continue;
+	part = &split->parts[n];
+	part->split = split;
+	part->first = nunits - left;
+	part->units = r;
+	if (kocl_split_setup_part(split, part, chan[i]))
+	    continue;
+	left -= r;
+	n++;
+    }
+
+    /* the request's own pool takes the rest */
+    part = &split->parts[n];
+    part->split = split;
+    part->first = nunits - left;
+    part->units = left;
+    if (!n || kocl_split_setup_part(split, part, req->channel)) {
+	/* nothing is queued yet */
+	for (i=0; i<n; i++) {
+	    if (split->parts[i].buf)
+		kocl_free(split->parts[i].buf, split->parts[i].r->channel);
+	    kocl_free_request(split->parts[i].r);
+	}
+	kfree(split);
+	return kocl_offload_async(req);
+    }
+    atomic_set(&split->left, ++n);
+
+    for (i=0; i<n; i++) {
+	struct kocl_request *pr = split->parts[i].r;
+
+	if (kocl_offload_async(pr)) {
+	    pr->errcode = KOCL_NO_RESPONSE;
+	    kocl_split_part_done(pr);
+	}
+    }
+    return 0;
+}
+EXPORT_SYMBOL_GPL(kocl_offload_split);
+
+/*
+ * find request by id in the rtdreqs
+ * offlist = 1: remove the request from the list
+ * offlist = 0: keep the request in the list
+ */
+static struct _kocl_request_item* find_request(int id, int offlist)
+{
+    struct _kocl_rtd_bucket *b = kocl_rtd_bucket(id);
+    struct _kocl_request_item *pos;
+
+    spin_lock(&b->lock);
+    
+    list_for_each_entry(pos, &b->reqs, list) {
+	if (pos->r->id == id) {
+	    if (offlist)
+		list_del(&pos->list);
+	    spin_unlock(&b->lock);
+	    return pos;
+	}
+    }
+
+    spin_unlock(&b->lock);
+
+    return NULL;
+}
+
+
+static int kocl_expire_requests(u64 now, int errcode, unsigned long chans);
+
+/* each open is a helper, up to KOCL_MAX_HELPERS of them */
+int kocl_open(struct inode *inode, struct file *filp)
+{
+    struct _kocl_helper *h = NULL;
+    int i;
+
+    mutex_lock(&kocldev.pool_mutex);
+    for (i=0; i<KOCL_MAX_HELPERS; i++) {
+	if (!kocldev.helpers[i].used) {
+	    h = &kocldev.helpers[i];
+	    h->used = 1;
+	    WRITE_ONCE(h->gen, h->gen + 1);
+	    h->chans = h->pools = 0;
+	    h->npools = 0;
+	    h->ring = h->stopped = 0;
+	    break;
+	}
+    }
+    mutex_unlock(&kocldev.pool_mutex);
+    if (!h)
+	return -EBUSY;
+
+    filp->private_data = h;
+    return 0;
+}
+
+/*
+ * A helper stops: its channels take no requests until another one
+ * registers pools for them, and what they have completes with
+ * KOCL_TERMINATED, nobody would answer it. Other helpers go on.
+ * Returns how many requests that was.
+ */
+static int kocl_helper_stop(struct _kocl_helper *h)
+{
+    struct _kocl_chan *ch;
+    int i;
+
+    h->stopped = 1;
+    wake_up_interruptible(&kocldev.growq);
+    for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	if (!test_bit(i, &h->chans))
+	    continue;
+	ch = &kocldev.chans[i];
+	/* no producer is still filling the ring afterwards */
+	spin_lock(&ch->reqlock);
+	ch->state = KOCL_TERMINATED;
+	ch->ring = 0;
+	spin_unlock(&ch->reqlock);
+    }
+    /* kocl_malloc_wait()ers of its channels fail now */
+    kocl_wake_mem_waiters();
+    return kocl_expire_requests(0, KOCL_TERMINATED, h->chans);
+}
+
+int kocl_release(struct inode *inode, struct file *filp)
+{
+    struct _kocl_helper *h = filp->private_data;
+    int i;
+
+    /* the callbacks free their buffers, a new helper gets clean pools */
+    i = kocl_helper_stop(h);
+    if (i)
+	kocl_log(KOCL_LOG_ALERT, "helper gone, %d requests terminated\n", i);
+
+    /* its pools went with it, the pages stay pinned until they're reused */
+    mutex_lock(&kocldev.pool_mutex);
+    for (i=0; i<KOCL_MAX_POOLS; i++) {
+	if (!test_bit(i, &h->pools))
+	    continue;
+	smp_store_release(&kocldev.pools[i].nsegs, 0);
+	kocldev.pools[i].size = 0;
+	clear_bit(i, &kocldev.grow_pending);
+    }
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	if (test_bit(i, &h->chans))
+	    kocldev.chans[i].helper = -1;
+    h->used = 0;
+    mutex_unlock(&kocldev.pool_mutex);
+    return 0;
+}
+
+/* helper's address of a pool buffer, other pointers are kept as is */
+static inline void *kocl_pool_uva(struct _kocl_pool *pool, void *p)
+{
+    struct _kocl_mempool *gmp = kocl_pool_seg(pool, p);
+
+    //ADDR_REBASE(dst_base,src_base,src_pointer),//= dst_base+(src_pointer-src_base)
+    return gmp? (void*)ADDR_REBASE(gmp->uva, gmp->kva, p): p;
+}
+
+/* the helper's address of a chain stage's buffer, see KOCL_CHAIN_IN */
+static void *kocl_chain_uva(struct _kocl_pool *pool, struct kocl_request *req,
+			    void *p)
+{
+    if (p == KOCL_CHAIN_IN)
+	return req->sg_uva[0]? (void*)req->sg_uva[0]: kocl_pool_uva(pool, req->in);
+    if (p == KOCL_CHAIN_OUT)
+	return req->sg_uva[1]? (void*)req->sg_uva[1]: kocl_pool_uva(pool, req->out);
+    return kocl_pool_uva(pool, p);
+}
+
+static void fill_ku_request(struct kocl_ku_request *kureq,
+			   struct kocl_request *req)
+{
+    struct _kocl_pool *pool = kocl_pool(req->channel);
+
+    req->ts[KOCL_TS_HANDED] = ktime_get_ns();
+    kureq->id = req->id;
+    kureq->sid = req->sid;
+    kureq->prio = req->prio;
+    kureq->ctx = req->ctx;
+    memcpy(kureq->service_name, req->service_name, KOCL_SERVICE_NAME_SIZE);
+
+    kureq->in = req->sg_uva[0]? (void*)req->sg_uva[0]: kocl_pool_uva(pool, req->in);
+    kureq->out = req->sg_uva[1]? (void*)req->sg_uva[1]: kocl_pool_uva(pool, req->out);
+    kureq->data = kocl_pool_uva(pool, req->udata);
+
+    kureq->channel= req->channel;
+    kureq->insize = req->insize;
+    kureq->outsize = req->outsize;
+    kureq->datasize = req->udatasize;
+
+    /* the helper's copy, made anew as a request may be handed out again */
+    kureq->nchain = req->nchain;
+    kureq->chain = NULL;
+    if (req->nchain) {
+	struct kocl_chain_stage *hs = req->chain + KOCL_CHAIN_MAX;
+	int i;
+
+	for (i=0; i<req->nchain; i++) {
+	    hs[i] = req->chain[i];
+	    hs[i].in = kocl_chain_uva(pool, req, req->chain[i].in);
+	    hs[i].out = kocl_chain_uva(pool, req, req->chain[i].out);
+	    hs[i].data = kocl_chain_uva(pool, req, req->chain[i].data);
+	}
+	kureq->chain = kocl_pool_uva(pool, hs);
+    }
+    trace_kocl_handoff(req);
+}
+
+/*
+ * Hand out as many queued requests as fit in buf.
+ */
+ssize_t kocl_read(
+    struct file *filp, char __user *buf, size_t c, loff_t *fpos)
+{
+    struct _kocl_helper *h = filp->private_data;
+    ssize_t ret = 0;
+    size_t n, nmax = c/sizeof(struct kocl_ku_request);
+    struct _kocl_request_item *item;
+    struct kocl_ku_request kureq;
+    struct _kocl_chan *ch;
+    LIST_HEAD(batch);
+    int i;
+
+    if (!nmax)
+	return -EINVAL; /* Too small. */
+
+    while (!kocl_reqs_pending(h->chans)) {//這邊會去看reqs list 是否為空
+	if (filp->f_flags & O_NONBLOCK)
+	    return -EAGAIN;
+
+	if (wait_event_interruptible(
+		kocldev.reqq, kocl_reqs_pending(h->chans)))//如果kocl_call_sync()沒有收到reqs,process 在reqq queue等 
+	    return -ERESTARTSYS;
+    }
+
+    /* take a batch off reqs, copy_to_user can't run under the spinlock */
+    for (i=0, n=0; i<KOCL_NR_CHANNELS && n<nmax; i++) {
+	if (!test_bit(i, &h->chans))
+	    continue;
+	ch = &kocldev.chans[i];
+	spin_lock(&ch->reqlock);
+	for (; n<nmax && !list_empty(&ch->reqs); n++)
+	    list_move_tail(ch->reqs.next, &batch);
+	spin_unlock(&ch->reqlock);
+    }
+    if (!n)
+	return -EAGAIN; /* raced with another reader */
+
+    while (!list_empty(&batch)) {
+	item = list_first_entry(&batch, struct _kocl_request_item, list);
+	fill_ku_request(&kureq, item->r);//算出位址得到item後把在kocl收到request的資訊(kocl_request *)給kureq
+
+	if (copy_to_user(buf+ret, &kureq, sizeof(struct kocl_ku_request)))
+	    break;
+	ret += sizeof(struct kocl_ku_request);
+
+	list_del(&item->list);
+	kocl_rtd_add(item);//這時候把item加入到rtdreqs 給kocl_wrte()查此item
+    }
+
+    if (!list_empty(&batch)) {
+	/* give back what we failed to hand out */
+	while (!list_empty(&batch)) {
+	    item = list_first_entry(&batch, struct _kocl_request_item, list);
+	    ch = kocl_chan(item->r->channel);
+	    spin_lock(&ch->reqlock);
+	    list_move(&item->list, &ch->reqs);
+	    spin_unlock(&ch->reqlock);
+	}
+	if (!ret)
+	    return -EFAULT;
+    }
+    
+    *fpos += ret;
+
+    return ret;    
+}
+
+/*
+ * The callback, and the request's latencies once it has returned: the
+ * callback may free or reuse the request, so they are copied first.
+ */
+static void kocl_run_callback(struct _kocl_request_item *item)
+{
+    struct kocl_request *r = item->r;
+    u64 ts[KOCL_NR_TS], t;
+    int sid = r->sid, id = r->id, err = r->errcode;
+
+    trace_kocl_callback_entry(r);
+    t = trace_kocl_callback_exit_enabled()? ktime_get_ns(): 0;
+    if (!kocl_lat_stats) {
+	r->callback(r);
+	trace_kocl_callback_exit(id, item->channel, sid, err,
+				 t? ktime_get_ns() - t: 0);
+	return;
+    }
+    memcpy(ts, r->ts, sizeof(ts));
+    r->callback(r);
+    ts[KOCL_TS_CALLBACK] = ktime_get_ns();
+    trace_kocl_callback_exit(id, item->channel, sid, err,
+			     t? ts[KOCL_TS_CALLBACK] - t: 0);
+    kocl_lat_account(sid, item->channel, ts);
+}
+
+static void kocl_callback_work(struct work_struct *work)
+{
+    struct _kocl_request_item *item =
+	container_of(work, struct _kocl_request_item, work);
+
+    kocl_run_callback(item);
+    kmem_cache_free(kocl_request_item_cache, item);
+}
+
+/*
+ * A request off all lists is done, with the helper's answer or without
+ * one, its errcode set: account it and run its callback.
+ */
+static void kocl_finish_item(struct _kocl_request_item *item)
+{
+    kocl_chan_done(item);
+    if (item->deadline)
+	atomic_dec(&kocl_ntimed);
+    /* the helper is done with them, the callback may reuse the pages */
+    kocl_unmap_sg(item->r);
+
+    item->r->ts[KOCL_TS_RESP] = ktime_get_ns();
+    trace_kocl_complete(item->r);
+
+    /*
+     * Different strategy should be applied here:
+     * #1 invoke the callback in the write syscall, like here.
+     * #2 add the resp into the resp-list in the write syscall
+     *    and return, a kernel thread will process the list
+     *    and invoke the callback.
+     *
+     * The first one is the default because this can ensure
+     * the fast response. A kthread may have to sleep so that
+     * the response can't be processed ASAP. deferred_callback
+     * selects #2 with a worker on the submitting CPU, sync calls
+     * only do a wake up and always stay inline.
+     */
+    if (deferred_callback && item->r->callback != sync_callback) {
+	INIT_WORK(&item->work, kocl_callback_work);
+	if (cpu_online(item->cpu))
+	    queue_work_on(item->cpu, kocl_callback_wq, &item->work);
+	else
+	    queue_work(kocl_callback_wq, &item->work);
+	return;
+    }
+
+    kocl_run_callback(item);
+    kmem_cache_free(kocl_request_item_cache, item);
+}
+
+/*
+ * Take a request back from its channel's reqs. NULL if it isn't there
+ * any more, on its way to the helper, with it or being completed.
+ */
+static struct _kocl_request_item *kocl_take_request(struct kocl_request *req)
+{
+    struct _kocl_chan *ch = kocl_chan(req->channel);
+    struct _kocl_request_item *pos;
+
+    spin_lock(&ch->reqlock);
+    list_for_each_entry(pos, &ch->reqs, list) {
+	if (pos->r == req) {
+	    list_del(&pos->list);
+	    spin_unlock(&ch->reqlock);
+	    return pos;
+	}
+    }
+    spin_unlock(&ch->reqlock);
+
+    return NULL;
+}
+
+/*
+ * Mark a request the helper has, in rtdreqs, to complete with errcode
+ * whatever it answers: it still works on the request's in and out, so
+ * the callback can't free them before. 0 if it isn't there.
+ */
+static int kocl_mark_request(int id, int errcode)
+{
+    struct _kocl_rtd_bucket *b = kocl_rtd_bucket(id);
+    struct _kocl_request_item *pos;
+    int found = 0;
+
+    spin_lock(&b->lock);
+    list_for_each_entry(pos, &b->reqs, list) {
+	if (pos->r->id == id) {
+	    if (!pos->cancel)
+		pos->cancel = errcode;
+	    found = 1;
+	    break;
+	}
+    }
+    spin_unlock(&b->lock);
+    return found;
+}
+
+/*
+ * Complete a queued request with KOCL_TERMINATED, its callback has run
+ * when this returns 0. If the helper has it already, -EINPROGRESS: it
+ * completes with KOCL_TERMINATED when the helper answers or goes, its
+ * answer dropped. -ENOENT if it's neither, then it completes as usual.
+ */
+int kocl_cancel_request(struct kocl_request *req)
+{
+    struct _kocl_request_item *item = kocl_take_request(req);
+
+    if (!item)
+	return kocl_mark_request(req->id, KOCL_TERMINATED)?
+	    -EINPROGRESS: -ENOENT;
+    req->errcode = KOCL_TERMINATED;
+    kocl_finish_item(item);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(kocl_cancel_request);
+
+/*
+ * Complete requests of the channels in chans with errcode: all of
+ * them, the helper is gone, or those due by now if now isn't 0. Due
+ * ones the helper has are only marked, they complete with errcode when
+ * it answers or goes. Callbacks free their buffers, so none are left
+ * in the pools of a helper that has gone. Returns how many there were.
+ */
+static int kocl_expire_requests(u64 now, int errcode, unsigned long chans)
+{
+    struct _kocl_request_item *item, *tmp;
+    struct _kocl_rtd_bucket *b;
+    struct _kocl_chan *ch;
+    LIST_HEAD(expired);
+    int i, n = 0;
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	if (!test_bit(i, &chans))
+	    continue;
+	ch = &kocldev.chans[i];
+	spin_lock(&ch->reqlock);
+	list_for_each_entry_safe(item, tmp, &ch->reqs, list)
+	    if (!now || (item->deadline && item->deadline <= now))
+		list_move_tail(&item->list, &expired);
+	spin_unlock(&ch->reqlock);
+    }
+    for (i=0; i<KOCL_RTD_HASH_SIZE; i++) {
+	b = &kocldev.rtdreqs[i];
+	spin_lock(&b->lock);
+	list_for_each_entry_safe(item, tmp, &b->reqs, list) {
+	    if (!test_bit(item->channel, &chans))
+		continue;
+	    if (!now) {
+		list_move_tail(&item->list, &expired);
+	    } else if (item->deadline && item->deadline <= now
+		       && !item->cancel) {
+		item->cancel = errcode;
+		kocl_log(KOCL_LOG_ALERT, "request %d of %s timed out,"
+			 " waiting for the helper to let it go\n",
+			 item->r->id, item->r->service_name);
+	    }
+	}
+	spin_unlock(&b->lock);
+    }
+
+    /* callbacks may queue new requests, those aren't on expired */
+    list_for_each_entry_safe(item, tmp, &expired, list) {
+	list_del(&item->list);
+	if (now)
+	    kocl_log(KOCL_LOG_ALERT, "request %d of %s timed out\n",
+		     item->r->id, item->r->service_name);
+	item->r->errcode = errcode;
+	kocl_finish_item(item);
+	n++;
+    }
+    return n;
+}
+
+static void kocl_watchdog_fn(struct work_struct *work)
+{
+    kocl_expire_requests(ktime_get_ns(), KOCL_NO_RESPONSE, ~0UL);
+    if (atomic_read(&kocl_ntimed) > 0)
+	queue_delayed_work(system_wq, &kocl_watchdog, KOCL_WATCHDOG_PERIOD);
+}
+
+/*
+ * Complete the in-flight request a helper response refers to.
+ */
+static int kocl_complete_response(struct kocl_ku_response *kuresp)
+{
+    struct _kocl_request_item *item;
+
+    item = find_request(kuresp->id, 1);//用原本送出去的reqs id 從rtdreqs list去找 
+    if (!item)
+	return -ENOENT; /* no request found */
+
+    /* timed out or cancelled meanwhile, the answer is dropped */
+    item->r->errcode = item->cancel? item->cancel: kuresp->errcode;
+    memcpy(&item->r->ts[KOCL_TS_RECV], &kuresp->ts[KOCL_TS_RECV],
+	   (KOCL_TS_POSTED-KOCL_TS_RECV+1)*sizeof(u64));
+    if (unlikely(kuresp->errcode != 0)) {
+	switch(kuresp->errcode) {
+	case KOCL_NO_RESPONSE:
+	    kocl_log(KOCL_LOG_ALERT,
+		"userspace helper doesn't give any response\n");
+	    break;
+	case KOCL_NO_SERVICE:
+	    kocl_log(KOCL_LOG_ALERT,
+		     "no such service %s\n",
+		     item->r->service_name);
+	    break;
+	case KOCL_TERMINATED:
+	    kocl_log(KOCL_LOG_ALERT,
+		     "request is terminated\n"
+		);
+	    break;
+	default:
+	    kocl_log(KOCL_LOG_ALERT,
+		     "unknown error with code %d\n",
+		     kuresp->id);
+	    break;		    
+	}
+    }
+
+    kocl_finish_item(item);
+    return 0;
+}
+
+/*
+ * Take an array of responses from the helper.
+ */
+ssize_t kocl_write(struct file *filp, const char __user *buf,
+		   size_t count, loff_t *fpos)
+{
+    struct kocl_ku_response kuresp;
+    ssize_t ret = 0;
+    size_t i, n = count/sizeof(struct kocl_ku_response);
+    
+    if (!n)
+	return -EINVAL; /* Too small. */
+
+    for (i=0; i<n; i++) {
+	/*memcpy*/if (copy_from_user(&kuresp,
+				    buf+i*sizeof(struct kocl_ku_response),
+				    sizeof(struct kocl_ku_response)))//把userspace helper傳來的response buf給kuresp
+	    break;
+
+	/* not an error, the request may have timed out meanwhile */
+	if (kocl_complete_response(&kuresp))
+	    dbg("no request %d for response\n", kuresp.id);
+    }
+
+    if (!i)
+	return -EFAULT;
+
+    ret = i*sizeof(struct kocl_ku_response);
+    *fpos += ret;
+    return ret;
+}
+
+/*
+ * Reap all responses the helper has posted in a channel's cq ring.
+ */
+static int kocl_ring_reap(struct _kocl_chan *ch)
+{
+    struct kocl_cq_ring *cq = ch->cq;
+    struct kocl_ku_response kuresp;
+    unsigned int head, tail;
+    int n = 0;
+
+    mutex_lock(&ch->cqlock);
+
+    head = cq->hdr.head;
+    tail = smp_load_acquire(&cq->hdr.tail);
+    if (tail - head > kocldev.ring.nentries) {
+	kocl_log(KOCL_LOG_ERROR, "corrupted cq ring %u %u\n", head, tail);
+	mutex_unlock(&ch->cqlock);
+	return -EINVAL;
+    }
+
+    while (head != tail) {
+	kuresp = cq->entries[head & kocldev.ring.mask];
+	if (kocl_complete_response(&kuresp))
+	    dbg("no request %d for cq entry\n", kuresp.id);
+	head++;
+	n++;
+    }
+    smp_store_release(&cq->hdr.head, head);
+
+    mutex_unlock(&ch->cqlock);
+    return n;
+}
+
+static inline int kocl_ring_sq_nonempty(struct _kocl_chan *ch)
+{
+    return smp_load_acquire(&ch->sq->hdr.tail) != ch->sq->hdr.head;
+}
+
+/* does any of the channels in chans, with rings, have something to serve */
+static int kocl_ring_sq_ready(unsigned long chans)
+{
+    int i;
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	if (test_bit(i, &chans)
+	    && (kocl_ring_sq_nonempty(&kocldev.chans[i])
+		|| !list_empty(&kocldev.chans[i].reqs)))
+	    return 1;
+    return 0;
+}
+
+/*
+ * The only syscall of a ring-mode helper: reap completions, move
+ * parked requests into the sq rings and optionally sleep until there
+ * is something to serve, on one channel or on all of them.
+ */
+static int kocl_ring_enter(struct _kocl_helper *h, char __user *buf)
+{
+    struct kocl_ring_enter re;
+    struct _kocl_chan *ch;
+    wait_queue_head_t *wq;
+    unsigned long chans;
+    int i, r, ready;
+
+    if (!h->ring)
+	return -EINVAL;
+    if (copy_from_user(&re, buf, sizeof(struct kocl_ring_enter)))
+	return -EFAULT;
+
+    /* only the helper's own channels */
+    if (re.channel == KOCL_RING_ALL_CHANNELS) {
+	chans = h->chans;
+	wq = &kocldev.reqq;
+    } else if (re.channel >= 0 && re.channel < KOCL_NR_CHANNELS
+	       && test_bit(re.channel, &h->chans)) {
+	chans = 1UL << re.channel;
+	wq = &kocldev.chans[re.channel].reqq;
+    } else
+	return -EINVAL;
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	if (!test_bit(i, &chans))
+	    continue;
+	r = kocl_ring_reap(&kocldev.chans[i]);
+	if (r < 0)
+	    return r;
     }
 
-    spin_lock(&kocldev.gmpool_lock);    
-  // kocl_log(KOCL_LOG_PRINT, "pool2:idx:%lu nunits:%d  p:%p \n", idx, nunits, p);
-    bitmap_clear(bitmap, idx, alloc_nunits);
-    alloc_sz[idx] = 0;
-    spin_unlock(&kocldev.gmpool_lock);
+    for (;;) {
+	ready = 0;
+	for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	    if (!test_bit(i, &chans))
+		continue;
+	    ch = &kocldev.chans[i];
+	    spin_lock(&ch->reqlock);
+	    kocl_ring_refill(ch);
+	    spin_unlock(&ch->reqlock);
+	    ready |= kocl_ring_sq_nonempty(ch);
+	}
+
+	if (!(re.flags & KOCL_RING_ENTER_WAIT) || ready)
+	    break;
+
+	if (wait_event_interruptible(*wq, kocl_ring_sq_ready(chans)))
+	    return -ERESTARTSYS;
+    }
 
+    return 0;
 }
-EXPORT_SYMBOL_GPL(kocl_free);
 
 /*
- * find request by id in the rtdreqs
- * offlist = 1: remove the request from the list
- * offlist = 0: keep the request in the list
+ * The rings of the helper's channels, the area has those of all: each
+ * helper only touches its own.
  */
-static struct _kocl_request_item* find_request(int id, int offlist)
+static int setup_ring(struct _kocl_helper *h, char __user *buf)
 {
-    struct _kocl_request_item *pos, *n;
+    struct kocl_ring_info info;
+    struct _kocl_ring *ring = &kocldev.ring;
+    struct _kocl_chan *ch;
+    unsigned long sqsz = PAGE_ALIGN(sizeof(struct kocl_sq_ring));
+    unsigned long cqsz = PAGE_ALIGN(sizeof(struct kocl_cq_ring));
+    int i;
 
-    spin_lock(&(kocldev.rtdreqlock));
-    
-    list_for_each_entry_safe(pos, n, &(kocldev.rtdreqs), list) {
-	if (pos->r->id == id) {
-	    if (offlist)
-		list_del(&pos->list);
-	    spin_unlock(&(kocldev.rtdreqlock));
-	    return pos;
+    if (!h->chans)
+	return -EINVAL;
+
+    /* keep the area for the life of the module, an old mapping may live on */
+    mutex_lock(&kocldev.pool_mutex);
+    if (!ring->mem) {
+	ring->mem = vmalloc_user((sqsz + cqsz)*KOCL_NR_CHANNELS);
+	if (!ring->mem) {
+	    mutex_unlock(&kocldev.pool_mutex);
+	    kocl_log(KOCL_LOG_ERROR, "run out of memory for rings\n");
+	    return -ENOMEM;
+	}
+	ring->chan_size = sqsz + cqsz;
+	ring->size = ring->chan_size*KOCL_NR_CHANNELS;
+	ring->nentries = KOCL_RING_NR_ENTRIES;
+	ring->mask = KOCL_RING_NR_ENTRIES-1;
+	for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	    ch = &kocldev.chans[i];
+	    ch->sq = (struct kocl_sq_ring*)
+		((char*)ring->mem + i*ring->chan_size);
+	    ch->cq = (struct kocl_cq_ring*)
+		((char*)ring->mem + i*ring->chan_size + sqsz);
 	}
     }
+    mutex_unlock(&kocldev.pool_mutex);
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	if (!test_bit(i, &h->chans))
+	    continue;
+	ch = &kocldev.chans[i];
+	spin_lock(&ch->reqlock);
+	memset(&ch->sq->hdr, 0, sizeof(struct kocl_ring_hdr));
+	memset(&ch->cq->hdr, 0, sizeof(struct kocl_ring_hdr));
+	ch->sq->hdr.nentries = ch->cq->hdr.nentries = ring->nentries;
+	ch->sq->hdr.mask = ch->cq->hdr.mask = ring->mask;
+	ch->ring = 1;
+	kocl_ring_refill(ch);
+	spin_unlock(&ch->reqlock);
+    }
+    h->ring = 1;
+
+    info.nentries = ring->nentries;
+    info.nchannels = KOCL_NR_CHANNELS;
+    info.sq_off = 0;
+    info.cq_off = sqsz;
+    info.chan_size = ring->chan_size;
+    info.size = ring->size;
+    if (copy_to_user(buf, &info, sizeof(struct kocl_ring_info)))
+	return -EFAULT;
+    
+    return 0;
+}
 
-    spin_unlock(&(kocldev.rtdreqlock));
-
-    return NULL;
+/*
+ * Scatter-gather requests. The helper mmaps a window at KOCL_SG_OFFSET
+ * and kocl_map_sg() inserts the pages of a request's scatterlist into
+ * it, so the helper, and a device that works on host memory, read and
+ * write them in place: the client copies nothing into the pool and
+ * nothing back. The pages are zapped from the window when the response
+ * comes, before the callback. Each helper has its own window, requests
+ * go into the one of their channel's helper.
+ */
+static void kocl_sg_close(struct vm_area_struct *vma)
+{
+    struct _kocl_sg_window *w = vma->vm_private_data;
+    unsigned long *map = NULL;
+
+    spin_lock(&w->lock);
+    if (w->vma == vma) {
+	w->vma = NULL;
+	w->mm = NULL;
+	map = w->map;
+	w->map = NULL;
+	w->npages = 0;
+    }
+    spin_unlock(&w->lock);
+    kfree(map);
 }
 
+static const struct vm_operations_struct kocl_sg_vm_ops = {
+    .close = kocl_sg_close,
+};
 
-int kocl_open(struct inode *inode, struct file *filp)
+static int kocl_sg_mmap(struct _kocl_helper *h, struct vm_area_struct *vma)
 {
-    if (!atomic_dec_and_test(&kocldev_av)) { //atomic_dec_and_test(atomic_t *v) 為遞減v的值並且測試運算結果
-	atomic_inc(&kocldev_av);//atomic_inc(* v) 遞減v的值
+    struct _kocl_sg_window *w = &h->sg;
+    unsigned long npages = vma_pages(vma);
+    unsigned long *map;
+
+    if (!(vma->vm_flags & VM_SHARED) || !npages ||
+	npages > KOCL_SG_SPAN >> PAGE_SHIFT)
+	return -EINVAL;
+    map = kcalloc(BITS_TO_LONGS(npages), sizeof(long), GFP_KERNEL);
+    if (!map)
+	return -ENOMEM;
+
+    spin_lock(&w->lock);
+    if (w->vma) {
+	spin_unlock(&w->lock);
+	kfree(map);
 	return -EBUSY;
     }
-
-    filp->private_data = &kocldev;
+    w->vma = vma;
+    w->mm = vma->vm_mm;
+    w->map = map;
+    w->npages = npages;
+    spin_unlock(&w->lock);
+
+    /* not linked into the file's mappings yet, so it may still move */
+    vma->vm_pgoff = (KOCL_SG_OFFSET +
+		     (h - kocldev.helpers)*KOCL_SG_SPAN) >> PAGE_SHIFT;
+    vma->vm_flags |= VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTCOPY;
+    vma->vm_ops = &kocl_sg_vm_ops;
+    vma->vm_private_data = w;
+    kocl_log(KOCL_LOG_PRINT, "scatter-gather window of %lu pages\n", npages);
     return 0;
 }
 
-int kocl_release(struct inode *inode, struct file *file)
+/*
+ * The window with its mm held and read locked, NULL if there is none.
+ * Undo with kocl_sg_put().
+ */
+static struct vm_area_struct *kocl_sg_get(struct _kocl_sg_window *w)
 {
-    atomic_set(&kocldev_av, 1);
-    return 0;
+    struct vm_area_struct *vma;
+    struct mm_struct *mm;
+
+    spin_lock(&w->lock);
+    vma = w->vma;
+    mm = w->mm;
+    /* mmget_not_zero(), which 4.7 doesn't have yet */
+    if (vma && !atomic_inc_not_zero(&mm->mm_users))
+	vma = NULL;
+    spin_unlock(&w->lock);
+    if (!vma)
+	return NULL;
+
+    down_read(&mm->mmap_sem);
+    /* munmap() takes mmap_sem for writing, so it is there or gone now */
+    if (READ_ONCE(w->vma) != vma) {
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+	return NULL;
+    }
+    return vma;
 }
 
-static void fill_ku_request(struct kocl_ku_request *kureq,
-			   struct kocl_request *req)
+static void kocl_sg_put(struct vm_area_struct *vma)
 {
-    unsigned long uva=0UL;    
-    unsigned long kva=0UL;
-    u32 npages=0; 
+    struct mm_struct *mm = vma->vm_mm;
 
-    kureq->id = req->id;
-    memcpy(kureq->service_name, req->service_name, KOCL_SERVICE_NAME_SIZE);
-
-        if(req->channel==2){
-                kva = kocldev.gmpool2.kva ;
-                uva = kocldev.gmpool2.uva ;
-             npages = kocldev.gmpool2.npages ;
-   
-        }else if(req->channel==3){
-                kva = kocldev.gmpool3.kva ;
-                uva = kocldev.gmpool3.uva ;
-             npages = kocldev.gmpool3.npages ;
-        }else{
-            //channel 0 or 1
-                kva = kocldev.gmpool.kva ;
-                uva = kocldev.gmpool.uva ;
-             npages = kocldev.gmpool.npages ;
-        }
-
-    //ADDR_REBASE(dst_base,src_base,src_pointer),//= dst_base+(src_pointer-src_base)
-    if (ADDR_WITHIN(req->in, kva, npages<<PAGE_SHIFT)) {
-	    kureq->in = (void*)ADDR_REBASE( uva, kva, req->in);
-    } else {
-	    kureq->in = req->in;
-    }
+    up_read(&mm->mmap_sem);
+    mmput(mm);
+}
 
-    if (ADDR_WITHIN(req->out, kva, npages<<PAGE_SHIFT)) {
-	    kureq->out = (void*)ADDR_REBASE( uva, kva, req->out);
-    } else {
-	    kureq->out = req->out;
-    }
+static void kocl_sg_release(struct _kocl_sg_window *w, unsigned long first,
+			    unsigned long npages)
+{
 
-    if (ADDR_WITHIN(req->udata, kva, npages<<PAGE_SHIFT)) {
-	    kureq->data = (void*)ADDR_REBASE( uva, kva, req->udata);
-    } else {
-	    kureq->data = req->udata;
-    } 
+    spin_lock(&w->lock);
+    if (w->map && first + npages <= w->npages)
+	bitmap_clear(w->map, first, npages);
+    spin_unlock(&w->lock);
+}
 
-    kureq->channel= req->channel;
-    kureq->insize = req->insize;
-    kureq->outsize = req->outsize;
-    kureq->datasize = req->udatasize;
+/*
+ * Drop npages of the window from first. The window is a mapping of
+ * /dev/kocl at its helper's own range, see kocl_sg_mmap(), so they are
+ * that file range and no other helper's: unlike zap_vma_ptes(), this
+ * works for a VM_MIXEDMAP area.
+ */
+static void kocl_sg_zap(struct vm_area_struct *vma, unsigned long first,
+			unsigned long npages)
+{
+    unmap_mapping_range(vma->vm_file->f_mapping,
+			(loff_t)(vma->vm_pgoff + first) << PAGE_SHIFT,
+			(loff_t)npages << PAGE_SHIFT, 1);
 }
 
-ssize_t kocl_read(
-    struct file *filp, char __user *buf, size_t c, loff_t *fpos)
+/*
+ * The pages of nbytes of sg after the first skip ones into pages, if
+ * not NULL, and the offset into the first: their number, -EINVAL if
+ * they don't make one run of pages, see kocl_map_sg().
+ */
+static long kocl_sg_pages(struct scatterlist *sg, unsigned long skip,
+			  unsigned long nbytes, struct page **pages,
+			  unsigned long *off)
 {
-    ssize_t ret = 0;
-    struct list_head *r;
-    struct _kocl_request_item *item;
+    struct scatterlist *s;
+    unsigned long npages = 0, left = nbytes, len, o, n, i;
 
-    spin_lock(&(kocldev.reqlock));
-    while (list_empty(&(kocldev.reqs))) {//這邊會去看reqs list 是否為空,如果為空傳回一個非0值表示沒有
-	spin_unlock(&(kocldev.reqlock));
+    for (s = sg; s && left; s = sg_next(s)) {
+	if (skip >= s->length) {
+	    skip -= s->length;
+	    continue;
+	}
+	o = s->offset + skip;
+	len = min(left, (unsigned long)s->length - skip);
+	if ((npages && o % PAGE_SIZE)
+	    || (left > len && (o + len) % PAGE_SIZE))
+	    return -EINVAL;
+	if (!npages)
+	    *off = o % PAGE_SIZE;
+	n = DIV_ROUND_UP(o % PAGE_SIZE + len, PAGE_SIZE);
+	if (pages)
+	    for (i=0; i<n; i++)
+		pages[npages+i] = nth_page(sg_page(s), o/PAGE_SIZE + i);
+	npages += n;
+	left -= len;
+	skip = 0;
+    }
+    return left? -EINVAL: npages;
+}
 
-	if (filp->f_flags & O_NONBLOCK)
-	    return -EAGAIN;
+/*
+ * Map nbytes of sg, after the first skip ones, into the helper's window
+ * as the request's in (KOCL_SG_IN), out (KOCL_SG_OUT) or both, for in
+ * place requests. The bytes must make one run of pages: every entry but
+ * the first starts on a page and every one but the last ends on one.
+ * -EINVAL if they don't, or one is anonymous, it would be in another
+ * process's mapping, or slab, the helper would see and write others'
+ * objects on it, -ENOSPC if the window is full and -ENODEV if
+ * the helper has none: the client copies into the pool then, as
+ * without. kocl unmaps the pages when the request is done. May sleep.
+ */
+int kocl_map_sg(struct kocl_request *req, struct scatterlist *sg,
+		unsigned long skip, unsigned long nbytes, int how)
+{
+    struct _kocl_sg_window *w;
+    struct vm_area_struct *vma;
+    struct page **pages;
+    unsigned long first, off = 0, addr, i;
+    long npages;
+    int slot = (how & KOCL_SG_IN)? 0: 1, err = 0;
+    int hid = kocl_chan(req->channel)->helper;
+
+    if (!nbytes || !(how & KOCL_SG_INOUT) || req->sg_uva[slot])
+	return -EINVAL;
+    /* both of a request's in the same window */
+    if (hid < 0 || (req->sg_npages[!slot] && req->sg_win != hid))
+	return -ENODEV;
+    w = &kocldev.helpers[hid].sg;
+    npages = kocl_sg_pages(sg, skip, nbytes, NULL, &off);
+    if (npages < 0)
+	return npages;
+    pages = kmalloc_array(npages, sizeof(struct page *), GFP_KERNEL);
+    if (!pages)
+	return -ENOMEM;
+    kocl_sg_pages(sg, skip, nbytes, pages, &off);
+    for (i=0; i<npages; i++)
+	if (PageAnon(pages[i]) || PageSlab(pages[i])) {
+	    err = -EINVAL;
+	    goto out;
+	}
 
-	if (wait_event_interruptible(
-		kocldev.reqq, (!list_empty(&(kocldev.reqs)))))//如果kocl_call_sync()沒有收到reqs,process 在reqq queue等 
-	    return -ERESTARTSYS;
-	spin_lock(&(kocldev.reqlock));
+    vma = kocl_sg_get(w);
+    if (!vma) {
+	err = -ENODEV;
+	goto out;
     }
- 
-    r = kocldev.reqs.next;//找reqs list head 下一個node
-    list_del(r);//取出node
-    item = list_entry(r, struct _kocl_request_item, list);//藉由 r 算出kocl_request_item 結構的初始位置,有點複雜QQ 看圖
-    if (item) {
-	struct kocl_ku_request kureq;
-	fill_ku_request(&kureq, item->r);//算出位址得到item後把在kocl收到request的資訊(kocl_request *)給kureq
-	
-	/*memcpy*/copy_to_user(buf, &kureq, sizeof(struct kocl_ku_request));//再把kureq 的資訊給userspace helper的buf
-	ret = c;
+    spin_lock(&w->lock);
+    first = bitmap_find_next_zero_area(w->map, w->npages, 0, npages, 0);
+    if (first + npages > w->npages)
+	err = -ENOSPC;
+    else
+	bitmap_set(w->map, first, npages);
+    spin_unlock(&w->lock);
+    if (err)
+	goto put;
+
+    addr = vma->vm_start + first*PAGE_SIZE;
+    for (i=0; i<npages; i++) {
+	err = vm_insert_page(vma, addr + i*PAGE_SIZE, pages[i]);
+	if (err)
+	    break;
     }
-
-    spin_unlock(&(kocldev.reqlock));
-
-    if (ret > 0 && item) {
-	spin_lock(&(kocldev.rtdreqlock));
-
-	INIT_LIST_HEAD(&item->list);
-	list_add_tail(&item->list, &(kocldev.rtdreqs));//這時候把item加入到rtdreqs list 給kocl_wrte()查此item
-
-	spin_unlock(&(kocldev.rtdreqlock));
+    if (err) {
+	kocl_sg_zap(vma, first, i);
+	kocl_sg_release(w, first, npages);
+	goto put;
     }
-    
-    *fpos += ret;
 
-    return ret;    
+    req->sg_win = hid;
+    req->sg_gen = READ_ONCE(kocldev.helpers[hid].gen);
+    req->sg_uva[slot] = addr + off;
+    req->sg_first[slot] = first;
+    req->sg_npages[slot] = npages;
+    if (how == KOCL_SG_INOUT)
+	req->sg_uva[1] = addr + off;
+put:
+    kocl_sg_put(vma);
+out:
+    kfree(pages);
+    return err;
 }
+EXPORT_SYMBOL_GPL(kocl_map_sg);
 
-ssize_t kocl_write(struct file *filp, const char __user *buf,
-		   size_t count, loff_t *fpos)
+static void kocl_unmap_sg(struct kocl_request *req)
 {
-    struct kocl_ku_response kuresp;
-    struct _kocl_request_item *item;
-    ssize_t ret = 0;
-    size_t  realcount;
-    
-    if (count < sizeof(struct kocl_ku_response))
-	ret = -EINVAL; /* Too small. */
-    else
-    {
-	realcount = sizeof(struct kocl_ku_response);
-
-	/*memcpy*/copy_from_user(&kuresp, buf, realcount);//把userspace helper傳來的response buf給kuresp
-
-	item = find_request(kuresp.id, 1);//用原本送出去的reqs id 從rtdreqs list去找 
-	if (!item)
-	{	    
-	    ret = -EFAULT; /* no request found */
-	} else {
-	    item->r->errcode = kuresp.errcode;
-	    if (unlikely(kuresp.errcode != 0)) {
-		switch(kuresp.errcode) {
-		case KOCL_NO_RESPONSE:
-		    kocl_log(KOCL_LOG_ALERT,
-			"userspace helper doesn't give any response\n");
-		    break;
-		case KOCL_NO_SERVICE:
-		    kocl_log(KOCL_LOG_ALERT,
-			     "no such service %s\n",
-			     item->r->service_name);
-		    break;
-		case KOCL_TERMINATED:
-		    kocl_log(KOCL_LOG_ALERT,
-			     "request is terminated\n"
-			);
-		    break;
-		default:
-		    kocl_log(KOCL_LOG_ALERT,
-			     "unknown error with code %d\n",
-			     kuresp.id);
-		    break;		    
-		}
-	    }
+    struct _kocl_sg_window *w;
+    struct vm_area_struct *vma;
+    int i;
 
-	    /*
-	     * Different strategy should be applied here:
-	     * #1 invoke the callback in the write syscall, like here.
-	     * #2 add the resp into the resp-list in the write syscall
-	     *    and return, a kernel thread will process the list
-	     *    and invoke the callback.
-	     *
-	     * Currently, the first one is used because this can ensure
-	     * the fast response. A kthread may have to sleep so that
-	     * the response can't be processed ASAP.
-	     */
-	    item->r->callback(item->r);
-	    ret = count;/*realcount;*/
-	    *fpos += ret;
-	    kmem_cache_free(kocl_request_item_cache, item);
-	}
+    if (!req->sg_npages[0] && !req->sg_npages[1])
+	return;
+    /*
+     * without the window its pages went with it, and a helper that
+     * took the slot since has a window of its own, not ours to clear
+     */
+    if (READ_ONCE(kocldev.helpers[req->sg_win].gen) != req->sg_gen)
+	goto out;
+    w = &kocldev.helpers[req->sg_win].sg;
+    vma = kocl_sg_get(w);
+    for (i=0; i<2; i++) {
+	if (!req->sg_npages[i])
+	    continue;
+	if (vma)
+	    kocl_sg_zap(vma, req->sg_first[i], req->sg_npages[i]);
+	kocl_sg_release(w, req->sg_first[i], req->sg_npages[i]);
     }
+    if (vma)
+	kocl_sg_put(vma);
+out:
+    req->sg_npages[0] = req->sg_npages[1] = 0;
+    req->sg_uva[0] = req->sg_uva[1] = 0;
+}
 
-    return ret;
+static int kocl_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct _kocl_helper *h = filp->private_data;
+
+    if (vma->vm_pgoff == KOCL_SG_OFFSET >> PAGE_SHIFT)
+	return kocl_sg_mmap(h, vma);
+    if (!kocldev.ring.mem)
+	return -ENODEV;
+    return remap_vmalloc_range(vma, kocldev.ring.mem, vma->vm_pgoff);
 }
 
-static int clear_gpu_mempool(void)
+static void clear_one_mempool(struct _kocl_mempool *gmp)
 {
-    struct _kocl_mempool *gmp = &kocldev.gmpool;
-    struct _kocl_mempool *gmp2 = &kocldev.gmpool2;
-    struct _kocl_mempool *gmp3 = &kocldev.gmpool3;
     int i;
 
-    spin_lock(&kocldev.gmpool_lock);
-
-    for (i=0; i<gmp->npages; i++){
+    for (i=0; i<gmp->npages && gmp->pages; i++){
         if (!PageReserved(gmp->pages[i]))
              SetPageDirty(gmp->pages[i]);
 	      put_page(gmp->pages[i]);
 	};	
     if (gmp->pages)
 	kfree(gmp->pages);
-    if (gmp->bitmap)
-	kfree(gmp->bitmap);
-    if (gmp->alloc_sz)
-	kfree(gmp->alloc_sz);
-    vunmap((void*)gmp->kva);
-
-    for (i=0; i<gmp2->npages; i++){
-        if (!PageReserved(gmp2->pages[i]))
-             SetPageDirty(gmp2->pages[i]);
-	      put_page(gmp2->pages[i]);
-	};
-    if (gmp2->pages)
-	kfree(gmp2->pages);
-    if (gmp2->bitmap)
-	kfree(gmp2->bitmap);
-    if (gmp2->alloc_sz)
-	kfree(gmp2->alloc_sz);
-    vunmap((void*)gmp2->kva);
-    
-    for (i=0; i<gmp3->npages; i++){
-        if (!PageReserved(gmp3->pages[i]))
-             SetPageDirty(gmp3->pages[i]);
-	      put_page(gmp3->pages[i]);
-	};
-    if (gmp3->pages)
-	kfree(gmp3->pages);
-    if (gmp3->bitmap)
-	kfree(gmp3->bitmap);
-    if (gmp3->alloc_sz)
-	kfree(gmp3->alloc_sz);
-    vunmap((void*)gmp3->kva);
-
-
-    spin_unlock(&kocldev.gmpool_lock);
+    gmp->pages = NULL;
+    kocl_mempool_finit(gmp);
+    if (gmp->kva && !gmp->direct)
+	vunmap((void*)gmp->kva);
+    gmp->kva = 0;
+}
+
+/*
+ * Helper buffers on huge pages are mostly physically contiguous, use
+ * the kernel's linear mapping for them, which is itself made of huge
+ * pages, rather than vmap()-ing them with 4KB ptes.
+ */
+static int pages_contiguous(struct page **pages, u32 npages)
+{
+    unsigned long pfn = page_to_pfn(pages[0]);
+    u32 i;
+
+    if (PageHighMem(pages[0]))
+	return 0;
+    for (i=1; i<npages; i++)
+	if (page_to_pfn(pages[i]) != pfn+i)
+	    return 0;
+    return 1;
+}
+
+/* only at module unload, nobody allocates any more and vunmap may sleep */
+static int clear_gpu_mempool(void)
+{
+    int i, j;
+
+    for (i=0; i<KOCL_MAX_POOLS; i++)
+	for (j=0; j<KOCL_POOL_MAX_SEGS; j++)
+	    clear_one_mempool(&kocldev.pools[i].segs[j]);
     return 0;
 }
 
-static int set_gpu_mempool(char __user *buf)
+/*
+ * Drop a previous helper's segment: swapped out under the pool lock
+ * like set_one_mempool() does, then unpinned and unmapped. May sleep.
+ */
+static void release_one_mempool(struct _kocl_mempool *gmp)
 {
-    struct kocl_gpu_mem_info gb;
-    struct _kocl_mempool *gmp = &kocldev.gmpool;
-    struct _kocl_mempool *gmp2 = &kocldev.gmpool2;
-    struct _kocl_mempool *gmp3 = &kocldev.gmpool3;
-    int rt;
-    int err=0;
-   
-    spin_lock(&(kocldev.gmpool_lock));    
-     
-    copy_from_user(&gb, buf, sizeof(struct kocl_gpu_mem_info));//把helper的pinned memory(hostbuf.uva)給gb
-
-kocl_log(KOCL_LOG_PRINT, "gmp->uva1: %p \n",gb.uva);
-kocl_log(KOCL_LOG_PRINT, "gmp->uva2: %p \n",gb.uva2);
-kocl_log(KOCL_LOG_PRINT, "gmp->uva3: %p \n",gb.uva3);
-
-    /* set up pages mem */
-    gmp->uva = (unsigned long)(gb.uva);
-    gmp2->uva = (unsigned long)(gb.uva2);
-    gmp3->uva = (unsigned long)(gb.uva3);
-
-    gmp->npages = gb.size/PAGE_SIZE;// 1G/4K = 262144,共有 2^18個pages
-    gmp2->npages = gb.size/PAGE_SIZE;// 1G/4K = 262144,共有 2^18個pages
-    gmp3->npages = gb.size/PAGE_SIZE;
-
-    if (!gmp->pages) {
-	gmp->pages = kmalloc(sizeof(struct page*)*gmp->npages, GFP_KERNEL);//配置262144(1024*256)個page pointer array space 
-	if (!gmp->pages) {
-	    kocl_log(KOCL_LOG_ERROR, "run out of memory for gmp pages\n");
-	    err = -ENOMEM;
-	    goto unlock_and_out;
-	  }
-    }
-    if (!gmp2->pages) {
-	gmp2->pages = kmalloc(sizeof(struct page*)*gmp2->npages, GFP_KERNEL);//配置262144(1024*256)個page pointer array space 
-	if (!gmp2->pages) {
-	    kocl_log(KOCL_LOG_ERROR, "run out of memory for gmp pages\n");
-	    err = -ENOMEM;
-	    goto unlock_and_out;
-	  }
-    }
-     if (!gmp3->pages) {
-	gmp3->pages = kmalloc(sizeof(struct page*)*gmp3->npages, GFP_KERNEL);//配置262144(1024*256)個page pointer array space 
-	if (!gmp3->pages) {
-	    kocl_log(KOCL_LOG_ERROR, "run out of memory for gmp pages\n");
-	    err = -ENOMEM;
-	    goto unlock_and_out;
-	  }
+    struct _kocl_mempool old;
+
+    if (!gmp->kva)
+	return;
+    memset(&old, 0, sizeof(struct _kocl_mempool));
+    spin_lock(&gmp->lock);
+    kocl_mempool_swap(gmp, &old);
+    spin_unlock(&gmp->lock);
+    clear_one_mempool(&old);
+}
+
+/*
+ * Pin the helper's buffer at uva and map it into the kernel. The new
+ * pool is built aside and only swapped in under the pool lock, pinning
+ * and mapping may sleep. What gmp had before, a previous helper's, is
+ * unpinned and unmapped after.
+ */
+static int set_one_mempool(struct _kocl_mempool *gmp, void *uva,
+			   unsigned long size)
+{
+    struct _kocl_mempool ngmp;
+    int i, rt, err;
+
+    memset(&ngmp, 0, sizeof(struct _kocl_mempool));
+    ngmp.uva = (unsigned long)(uva);
+    ngmp.npages = size/PAGE_SIZE;// 128M/4K = 32768個pages
+
+    ngmp.pages = kmalloc(sizeof(struct page*)*ngmp.npages, GFP_KERNEL);//配置page pointer array space 
+    if (!ngmp.pages) {
+	kocl_log(KOCL_LOG_ERROR, "run out of memory for gmp pages\n");
+	return -ENOMEM;
     }
 
     /* for Linux kernel 4.4.0 version below works
@@ -680,161 +2426,312 @@ kocl_log(KOCL_LOG_PRINT, "gmp->uva3: %p \n",gb.uva3);
    
    /* for Linux Kernel 4.8.0/4.7.0 */
     down_read(&current->mm->mmap_sem);
-        rt = get_user_pages( gmp->uva, gmp->npages , 0 , 0 , gmp->pages, NULL);
+        rt = get_user_pages( ngmp.uva, ngmp.npages , 0 , 0 , ngmp.pages, NULL);
     up_read(&current->mm->mmap_sem);      
     if (rt<=0) {
-	      kocl_log(KOCL_LOG_PRINT,"[kocl] DEBUG: no page pinned at pages2 %d\n", rt);
-	    goto unlock_and_out;
+	kocl_log(KOCL_LOG_PRINT,"[kocl] DEBUG: no page pinned %d\n", rt);
+	err = -EFAULT;
+	goto out_free;
     }
-    
-    down_read(&current->mm->mmap_sem);
-        rt = get_user_pages( gmp2->uva, gmp2->npages , 0 , 0 , gmp2->pages, NULL);
-    up_read(&current->mm->mmap_sem);        
-    if (rt<=0) {
-	      kocl_log(KOCL_LOG_PRINT,"[kocl] DEBUG: no page pinned at pages2 %d\n", rt);
-	    goto unlock_and_out;
+    if (rt < ngmp.npages) {
+	kocl_log(KOCL_LOG_ERROR, "only %d of %u pages pinned\n",
+		 rt, ngmp.npages);
+	err = -EFAULT;
+	goto out_put;
     }
 
-    down_read(&current->mm->mmap_sem);
-        rt = get_user_pages( gmp3->uva, gmp3->npages , 0 , 0 , gmp3->pages, NULL);
-    up_read(&current->mm->mmap_sem);        
-    if (rt<=0) {
-	      kocl_log(KOCL_LOG_PRINT,"[kocl] DEBUG: no page pinned at pages2 %d\n", rt);
-	    goto unlock_and_out;
-    }
-
-    /* set up bitmap */
-    gmp->nunits = gmp->npages/KOCL_BUF_NR_FRAMES_PER_UNIT;// 262144(1024*256)/256 = 1024 個nunits
-    gmp2->nunits = gmp2->npages/KOCL_BUF_NR_FRAMES_PER_UNIT;// 262144(1024*256)/256 = 1024 個nunits
-    gmp3->nunits = gmp3->npages/KOCL_BUF_NR_FRAMES_PER_UNIT;
-
-kocl_log(KOCL_LOG_PRINT, "pool1: nunits=%d npage=%d KOCL_BUF=%d\n",
-             gmp->nunits,gmp->npages,KOCL_BUF_NR_FRAMES_PER_UNIT);
-kocl_log(KOCL_LOG_PRINT, "pool2: nunits=%d npage=%d KOCL_BUF=%d\n",
-             gmp2->nunits,gmp2->npages,KOCL_BUF_NR_FRAMES_PER_UNIT);
-kocl_log(KOCL_LOG_PRINT, "pool3: nunits=%d npage=%d KOCL_BUF=%d\n",
-             gmp3->nunits,gmp3->npages,KOCL_BUF_NR_FRAMES_PER_UNIT);               
-
-    if (!gmp->bitmap) {
-	gmp->bitmap = kmalloc(
-	    BITS_TO_LONGS(gmp->nunits)*sizeof(long), GFP_KERNEL);//配置bitmap 所需要的空間long 長度8, 1024有16個 
-	    if (!gmp->bitmap) {
-	        kocl_log(KOCL_LOG_PRINT , "run out of memory for gmp bitmap\n");
-	        err = -ENOMEM;
-	        goto unlock_and_out;
-	    }
-    }    
-    bitmap_zero(gmp->bitmap, gmp->nunits);//把bitmap array 初始化清成 0
-
-    if (!gmp2->bitmap) {
-	gmp2->bitmap = kmalloc(
-	    BITS_TO_LONGS(gmp2->nunits)*sizeof(long), GFP_KERNEL);//配置bitmap 所需要的空間long 長度8, 1024有16個 
-	    if (!gmp2->bitmap) {
-	        kocl_log(KOCL_LOG_PRINT , "run out of memory for gmp bitmap\n");
-	        err = -ENOMEM;
-	        goto unlock_and_out;
-	    }
-    }    
-    bitmap_zero(gmp2->bitmap, gmp2->nunits);//把bitmap array 初始化清成 0
-
-    if (!gmp3->bitmap) {
-	gmp3->bitmap = kmalloc(
-	    BITS_TO_LONGS(gmp3->nunits)*sizeof(long), GFP_KERNEL);//配置bitmap 所需要的空間long 長度8, 1024有16個 
-	    if (!gmp3->bitmap) {
-	        kocl_log(KOCL_LOG_PRINT , "run out of memory for gmp bitmap\n");
-	        err = -ENOMEM;
-	        goto unlock_and_out;
-	    }
-    }    
-    bitmap_zero(gmp3->bitmap, gmp3->nunits);//把bitmap array 初始化清成 0
-
-
-    /* set up allocated memory sizes */ //alloc_sz 主要是看已經分配多少req_nunits空間
-    if (!gmp->alloc_sz) {
-	gmp->alloc_sz = kmalloc(
-	    gmp->nunits*sizeof(u32), GFP_KERNEL);
-	    if (!gmp->alloc_sz) {
-	        kocl_log(KOCL_LOG_ERROR,
-		        "run out of memory for gmp alloc_sz\n");
-	        err = -ENOMEM;
-	        goto unlock_and_out;
-	    }
-    }
-    memset(gmp->alloc_sz, 0, gmp->nunits);//把alloc_sz array 初始化清成 0
+    err = kocl_mempool_init(&ngmp);
+    if (err)
+	goto out_put;
 
-    if (!gmp2->alloc_sz) {
-	gmp2->alloc_sz = kmalloc(
-	    gmp2->nunits*sizeof(u32), GFP_KERNEL);
-	    if (!gmp2->alloc_sz) {
-	        kocl_log(KOCL_LOG_ERROR,
-		        "run out of memory for gmp alloc_sz\n");
-	        err = -ENOMEM;
-	        goto unlock_and_out;
-	    }
+    /* set up kernel remapping *///把helper的meomory page map 到kernel 
+    if (pages_contiguous(ngmp.pages, ngmp.npages)) {
+	ngmp.kva = (unsigned long)page_address(ngmp.pages[0]);
+	ngmp.direct = 1;
+    } else
+	ngmp.kva = (unsigned long)vmap(ngmp.pages, ngmp.npages, GFP_KERNEL, PAGE_KERNEL);
+    if (!ngmp.kva) {
+	kocl_log(KOCL_LOG_ERROR, "map pages into kernel failed\n");
+	kocl_mempool_finit(&ngmp);
+	err = -EFAULT;
+	goto out_put;
     }
-    memset(gmp2->alloc_sz, 0, gmp2->nunits);//把alloc_sz array 初始化清成 0
 
-    if (!gmp3->alloc_sz) {
-	gmp3->alloc_sz = kmalloc(
-	    gmp3->nunits*sizeof(u32), GFP_KERNEL);
-	    if (!gmp3->alloc_sz) {
-	        kocl_log(KOCL_LOG_ERROR,
-		        "run out of memory for gmp alloc_sz\n");
-	        err = -ENOMEM;
-	        goto unlock_and_out;
-	    }
-    }
-    memset(gmp3->alloc_sz, 0, gmp3->nunits);//把alloc_sz array 初始化清成 0
+    kocl_log(KOCL_LOG_PRINT, "pool: uva=%p kva=%p nunits=%u npages=%u%s\n",
+	     (void*)ngmp.uva, (void*)ngmp.kva, ngmp.nunits, ngmp.npages,
+	     ngmp.direct? " (direct)": "");
 
-    /* set up kernel remapping *///把helper的meomory page map 到kernel 
-    gmp->kva = (unsigned long)vmap(gmp->pages, gmp->npages, GFP_KERNEL, PAGE_KERNEL);
-    gmp2->kva = (unsigned long)vmap(gmp2->pages, gmp2->npages, GFP_KERNEL, PAGE_KERNEL);
-    gmp3->kva = (unsigned long)vmap(gmp3->pages, gmp3->npages, GFP_KERNEL, PAGE_KERNEL);
+    spin_lock(&gmp->lock);
+    kocl_mempool_swap(gmp, &ngmp);
+    spin_unlock(&gmp->lock);
+
+    /* ngmp now holds the old pool, its pages and mapping */
+    clear_one_mempool(&ngmp);
+    return 0;
+
+out_put:
+    for (i=0; i<rt; i++)
+	put_page(ngmp.pages[i]);
+out_free:
+    kfree(ngmp.pages);
+    return err;
+}
+
+/* kocl's pools some helper has, a bit each, under pool_mutex */
+static unsigned long kocl_pools_taken(void)
+{
+    unsigned long taken = 0;
+    int i;
+
+    for (i=0; i<KOCL_MAX_HELPERS; i++)
+	if (kocldev.helpers[i].used)
+	    taken |= kocldev.helpers[i].pools;
+    return taken;
+}
+
+/*
+ * Register a helper's pools, once per helper: it serves the channels
+ * it gives a pool (chan_pool[c] is -1 for those of other helpers), and
+ * gets as many free pools of kocl's, its pool i is h->pool[i]. A pool
+ * starts over with the one segment given here, segments it had for a
+ * previous helper are unpinned and unmapped, with what is still
+ * allocated in them: frees of those are no-ops, and the pool's and its
+ * channels' counts start at 0. Requests a previous helper of the
+ * channels left, in its buffers, are terminated first.
+ */
+static int set_gpu_mempool(struct _kocl_helper *h, char __user *buf)
+{
+    struct kocl_gpu_mem_info gb;
+    struct _kocl_pool *pool;
+    unsigned long chans = 0, taken;
+    int i, j, c, n, err = 0;
+   
+    if (copy_from_user(&gb, buf, sizeof(struct kocl_gpu_mem_info)))//把helper的pinned memory(hostbuf.uva)給gb
+	return -EFAULT;
+
+    if (gb.npools <= 0 || gb.npools > KOCL_MAX_POOLS)
+	return -EINVAL;
+    for (c=0; c<KOCL_NR_CHANNELS; c++) {
+	if (gb.chan_pool[c] < -1 || gb.chan_pool[c] >= gb.npools)
+	    return -EINVAL;
+	if (gb.chan_pool[c] >= 0)
+	    chans |= 1UL << c;
+    }
+    if (!chans)
+	return -EINVAL;
 
-    if (!gmp->kva) {
-	    kocl_log(KOCL_LOG_ERROR, "map pages into kernel failed\n");
-	    err = -EFAULT;
-	    goto unlock_and_out;
+    /* claim the channels and the pools */
+    mutex_lock(&kocldev.pool_mutex);
+    if (h->chans) {
+	mutex_unlock(&kocldev.pool_mutex);
+	return -EBUSY;
+    }
+    for (c=0; c<KOCL_NR_CHANNELS; c++) {
+	if (test_bit(c, &chans) && kocldev.chans[c].helper >= 0) {
+	    mutex_unlock(&kocldev.pool_mutex);
+	    kocl_log(KOCL_LOG_ERROR, "channel %d has a helper\n", c);
+	    return -EBUSY;
+	}
     }
-    if (!gmp2->kva) {
-	    kocl_log(KOCL_LOG_ERROR, "map pages into kernel failed\n");
-	    err = -EFAULT;
-	    goto unlock_and_out;
+    taken = kocl_pools_taken();
+    for (i=0, n=0; i<KOCL_MAX_POOLS && n<gb.npools; i++)
+	if (!test_bit(i, &taken))
+	    h->pool[n++] = i;
+    if (n < gb.npools) {
+	mutex_unlock(&kocldev.pool_mutex);
+	kocl_log(KOCL_LOG_ERROR, "no %d free pools\n", gb.npools);
+	return -ENOSPC;
     }
-    if (!gmp3->kva) {
-	    kocl_log(KOCL_LOG_ERROR, "map pages into kernel failed\n");
-	    err = -EFAULT;
-	    goto unlock_and_out;
+    for (i=0; i<n; i++)
+	h->pools |= 1UL << h->pool[i];
+    h->npools = n;
+    h->chans = chans;
+    for (c=0; c<KOCL_NR_CHANNELS; c++) {
+	if (!test_bit(c, &chans))
+	    continue;
+	/* until its pool is there */
+	kocldev.chans[c].state = KOCL_TERMINATED;
+	kocldev.chans[c].helper = h - kocldev.helpers;
     }
+    mutex_unlock(&kocldev.pool_mutex);
+
+    n = kocl_expire_requests(0, KOCL_TERMINATED, chans);
+    if (n)
+	kocl_log(KOCL_LOG_ALERT, "%d requests of a previous helper terminated\n", n);
+
+    mutex_lock(&kocldev.pool_mutex);
+    for (i=0; i<h->npools; i++) {
+	pool = &kocldev.pools[h->pool[i]];
+
+	smp_store_release(&pool->nsegs, 0);
+	atomic_long_set(&pool->used, 0);
+	clear_bit(h->pool[i], &kocldev.grow_pending);
+	/* segments the pool grew for a previous helper, segs[0] below */
+	for (j=1; j<KOCL_POOL_MAX_SEGS; j++)
+	    release_one_mempool(&pool->segs[j]);
+	err = set_one_mempool(&pool->segs[0], gb.pools[i].uva,
+			      gb.pools[i].size);
+	if (err)
+	    break;
+	pool->size = gb.pools[i].size;
+	pool->gen++;
+	pool->max_size = max(gb.pools[i].size, gb.pools[i].max_size);
+	pool->node = (gb.pools[i].node >= 0 && gb.pools[i].node < nr_node_ids
+		      && node_online(gb.pools[i].node))? gb.pools[i].node: NUMA_NO_NODE;
+	smp_store_release(&pool->nsegs, 1);
+    }
+    if (err) {
+	/* give it all back, the helper may try again */
+	for (i=0; i<h->npools; i++) {
+	    smp_store_release(&kocldev.pools[h->pool[i]].nsegs, 0);
+	    kocldev.pools[h->pool[i]].size = 0;
+	}
+	for (c=0; c<KOCL_NR_CHANNELS; c++)
+	    if (test_bit(c, &chans))
+		kocldev.chans[c].helper = -1;
+	h->chans = h->pools = 0;
+	h->npools = 0;
+    } else {
+	for (c=0; c<KOCL_NR_CHANNELS; c++) {
+	    if (!test_bit(c, &chans))
+		continue;
+	    kocldev.chan_pool[c] = h->pool[gb.chan_pool[c]];
+	    atomic_long_set(&kocldev.chans[c].inuse, 0);
+	    kocldev.chans[c].slots = max(gb.chan_slots[c], 0);
+	    kocldev.chans[c].state = KOCL_OK;
+	}
+	kocldev.npools = max(kocldev.npools, h->pool[h->npools-1]+1);
+	kocl_log(KOCL_LOG_PRINT, "helper %d: channels 0x%lx, pools 0x%lx\n",
+		 (int)(h - kocldev.helpers), chans, h->pools);
+    }
+    mutex_unlock(&kocldev.pool_mutex);
+    /* sleepers on the fresh pools, or to give up on them */
+    kocl_wake_mem_waiters();
 
-    kocl_log(KOCL_LOG_PRINT, "gmp->kva: %p \n",gmp->kva);
-    kocl_log(KOCL_LOG_PRINT, "gmp2->kva: %p \n",gmp2->kva);
-    kocl_log(KOCL_LOG_PRINT, "gmp3->kva: %p \n",gmp3->kva);
+    return err;
+}
 
+/* add a segment to one of the helper's pools, in answer to KOCL_IOC_WAIT_GROW */
+static int grow_gpu_mempool(struct _kocl_helper *h, char __user *buf)
+{
+    struct kocl_pool_grow g;
+    struct _kocl_pool *pool;
+    int n, id, err;
 
-unlock_and_out:
-    spin_unlock(&(kocldev.gmpool_lock));    
+    if (copy_from_user(&g, buf, sizeof(struct kocl_pool_grow)))
+	return -EFAULT;
+    if (g.pool < 0 || g.pool >= h->npools || !g.size)
+	return -EINVAL;
+
+    mutex_lock(&kocldev.pool_mutex);
+    id = h->pool[g.pool];
+    pool = &kocldev.pools[id];
+    n = pool->nsegs;
+    if (n >= KOCL_POOL_MAX_SEGS || pool->size + g.size > pool->max_size) {
+	err = -ENOSPC;
+	goto out;
+    }
 
+    err = set_one_mempool(&pool->segs[n], g.uva, g.size);
+    if (err)
+	goto out;
+    pool->size += g.size;
+    smp_store_release(&pool->nsegs, n+1);
+    kocl_wake_mem_waiters();
+    kocl_log(KOCL_LOG_PRINT, "pool %d grew to %lu bytes in %d segments\n",
+	     id, pool->size, n+1);
+out:
+    mutex_unlock(&kocldev.pool_mutex);
     return err;
 }
 
-static int dump_gpu_bufs(char __user *buf)
+/*
+ * Sleep until one of the helper's pools wants to grow, return it, as
+ * the helper's pool, with its wanted size: double the pool, but not
+ * beyond max_size.
+ */
+static int wait_gpu_mempool_grow(struct _kocl_helper *h, char __user *buf)
 {
-    /* TODO: dump gmpool's info to buf */
+    struct kocl_pool_grow g;
+    struct _kocl_pool *pool;
+    unsigned long pending;
+    int i, id, err;
+
+    do {
+	err = wait_event_interruptible(kocldev.growq,
+				       (kocldev.grow_pending & h->pools)
+				       || h->stopped
+				       || kocldev.state == KOCL_TERMINATED);
+	if (err)
+	    return err;
+	if (h->stopped || kocldev.state == KOCL_TERMINATED)
+	    return -ESHUTDOWN;
+	pending = READ_ONCE(kocldev.grow_pending) & h->pools;
+	id = pending? __ffs(pending): 0;
+    } while (!pending || !test_and_clear_bit(id, &kocldev.grow_pending));
+
+    memset(&g, 0, sizeof(struct kocl_pool_grow));
+    for (i=0; i<h->npools; i++)
+	if (h->pool[i] == id)
+	    g.pool = i;
+
+    pool = &kocldev.pools[id];
+    g.size = min(pool->size, pool->max_size - pool->size);
+
+    if (copy_to_user(buf, &g, sizeof(struct kocl_pool_grow)))
+	return -EFAULT;
     return 0;
 }
 
-static int terminate_all_requests(void)
+void kocl_pools_info(struct kocl_gpu_mem_info *gb)
 {
-    /* TODO: stop receiving requests, set all reqeusts code to
-     kocl_TERMINATED and call their callbacks */
-    kocldev.state = KOCL_TERMINATED;
+    int i;
+
+    memset(gb, 0, sizeof(struct kocl_gpu_mem_info));
+    mutex_lock(&kocldev.pool_mutex);
+    gb->npools = kocldev.npools;
+    memcpy(gb->chan_pool, kocldev.chan_pool, sizeof(gb->chan_pool));
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	gb->chan_slots[i] = kocldev.chans[i].slots;
+    for (i=0; i<kocldev.npools; i++) {
+	gb->pools[i].uva = (void*)kocldev.pools[i].segs[0].uva;
+	gb->pools[i].size = kocldev.pools[i].size;
+	gb->pools[i].max_size = kocldev.pools[i].max_size;
+	gb->pools[i].node = kocldev.pools[i].node;
+	kocl_pool_scan(&kocldev.pools[i], &gb->pools[i]);
+    }
+    mutex_unlock(&kocldev.pool_mutex);
+}
+
+static int dump_gpu_bufs(char __user *buf)
+{
+    struct kocl_gpu_mem_info *gb;
+    int err = 0;
+
+    gb = kmalloc(sizeof(*gb), GFP_KERNEL);
+    if (!gb)
+	return -ENOMEM;
+    kocl_pools_info(gb);
+    if (copy_to_user(buf, gb, sizeof(struct kocl_gpu_mem_info)))
+	err = -EFAULT;
+    kfree(gb);
+    return err;
+}
+
+/* a helper stops, see kocl_helper_stop() */
+static int terminate_all_requests(struct _kocl_helper *h)
+{
+    int n = kocl_helper_stop(h);
+
+    if (n)
+	kocl_log(KOCL_LOG_ALERT, "%d requests terminated\n", n);
     return 0;
 }
 
 static long kocl_ioctl(struct file *filp,
 	       unsigned int cmd, unsigned long arg)
 {
+    struct _kocl_helper *h = filp->private_data;
     int err = 0;
     
     if (_IOC_TYPE(cmd) != KOCL_IOC_MAGIC)
@@ -850,7 +2747,7 @@ static long kocl_ioctl(struct file *filp,
     switch (cmd) {
 	
     case KOCL_IOC_SET_GPU_BUFS:
-	err = set_gpu_mempool((char*)arg);
+	err = set_gpu_mempool(h, (char*)arg);
 	break;
 	
     case KOCL_IOC_GET_GPU_BUFS:
@@ -858,7 +2755,23 @@ static long kocl_ioctl(struct file *filp,
 	break;
 
     case KOCL_IOC_SET_STOP:
-	err = terminate_all_requests();
+	err = terminate_all_requests(h);
+	break;
+
+    case KOCL_IOC_SETUP_RING:
+	err = setup_ring(h, (char*)arg);
+	break;
+
+    case KOCL_IOC_RING_ENTER:
+	err = kocl_ring_enter(h, (char*)arg);
+	break;
+
+    case KOCL_IOC_GROW_POOL:
+	err = grow_gpu_mempool(h, (char*)arg);
+	break;
+
+    case KOCL_IOC_WAIT_GROW:
+	err = wait_gpu_mempool_grow(h, (char*)arg);
 	break;
 
     default:
@@ -871,19 +2784,18 @@ static long kocl_ioctl(struct file *filp,
 
 static unsigned int kocl_poll(struct file *filp, poll_table *wait)
 {
+    struct _kocl_helper *h = filp->private_data;
     unsigned int mask = 0;
     
-    spin_lock(&(kocldev.reqlock));
-    
     poll_wait(filp, &(kocldev.reqq), wait);//先在reqq sleep
 
-    if (!list_empty(&(kocldev.reqs))) 
+    /* with rings, so that a helper can wait here for other things too */
+    if (kocl_reqs_pending(h->chans)
+	|| (h->ring && kocl_ring_sq_ready(h->chans)))
 	mask |= POLLIN | POLLRDNORM;//可讀取
 
     mask |= POLLOUT | POLLWRNORM;//可寫入
 
-    spin_unlock(&(kocldev.reqlock));
-
     return mask;
 }
 
@@ -894,10 +2806,128 @@ static struct file_operations kocl_ops =  {
     .write          = kocl_write,
     .poll           = kocl_poll,
     .unlocked_ioctl = kocl_ioctl,
+    .mmap           = kocl_mmap,
     .open           = kocl_open,
     .release        = kocl_release,   
 };
 
+/*
+ * For KSM, on the jhash services: a u32 per page of n pages from one
+ * request to service, whose udata is a jhash2_info. The helper reads
+ * the pages where they are, mapped with kocl_map_sg(), or copies of
+ * them in the pool if they can't be or are anonymous: KSM's are, and
+ * those mustn't go into the helper's mapping. May sleep. 0 or a negative errno,
+ * KOCL_* from the helper.
+ */
+static int dedup_channel = KOCL_CHANNEL_AUTO;
+module_param(dedup_channel, int, 0644);
+MODULE_PARM_DESC(dedup_channel, "channel of kocl_page_checksums() and "
+		 "kocl_page_dups(), -1: kocl picks");
+
+static int kocl_pages_offload(const char *service, int *sid, u32 seed,
+			      struct page **pages, unsigned int n, u32 *res)
+{
+    struct kocl_request *req;
+    struct scatterlist *sg;
+    struct jhash2_info *info;
+    unsigned long osz = round_up(n*sizeof(u32), sizeof(long));
+    char *buf, *in = NULL;
+    unsigned int i;
+    int err, anon = 0;
+
+    if (!n)
+	return 0;
+    if (!*sid)
+	*sid = kocl_service_id(service);
+    for (i=0; i<n && !anon; i++)
+	anon = PageAnon(pages[i]);
+    req = kocl_alloc_request();
+    if (!req)
+	return -ENOMEM;
+    req->channel = dedup_channel == KOCL_CHANNEL_AUTO?
+	kocl_pick_channel((unsigned long)n*PAGE_SIZE): dedup_channel;
+
+    sg = kmalloc_array(n, sizeof(*sg), GFP_KERNEL);
+    if (!sg) {
+	err = -ENOMEM;
+	goto free_req;
+    }
+    sg_init_table(sg, n);
+    for (i=0; i<n; i++)
+	sg_set_page(sg+i, pages[i], PAGE_SIZE, 0);
+
+    buf = kocl_malloc_wait(osz + sizeof(*info), req->channel, NULL);
+    if (!buf) {
+	err = -ENOMEM;
+	goto free_sg;
+    }
+    if (anon || kocl_map_sg(req, sg, 0, (unsigned long)n*PAGE_SIZE, KOCL_SG_IN)) {
+	in = kocl_malloc_wait((unsigned long)n*PAGE_SIZE, req->channel, NULL);
+	if (!in) {
+	    err = -ENOMEM;
+	    goto free_buf;
+	}
+	for (i=0; i<n; i++) {
+	    void *p = kmap_atomic(pages[i]);
+
+	    memcpy(in + (unsigned long)i*PAGE_SIZE, p, PAGE_SIZE);
+	    kunmap_atomic(p);
+	}
+    }
+
+    info = (struct jhash2_info*)(buf + osz);
+    info->seed = seed;
+    info->nkeys = n;
+    info->length = PAGE_SIZE/sizeof(u32);
+
+    req->in = in;
+    req->insize = (unsigned long)n*PAGE_SIZE;
+    req->out = buf;
+    req->outsize = n*sizeof(u32);
+    req->udata = info;
+    req->udatasize = sizeof(*info);
+    strcpy(req->service_name, service);
+    req->sid = *sid;
+
+    err = kocl_offload_sync(req);
+    if (!err)
+	err = req->errcode;
+    if (!err)
+	memcpy(res, buf, n*sizeof(u32));
+
+    if (in)
+	kocl_free(in, req->channel);
+free_buf:
+    kocl_free(buf, req->channel);
+free_sg:
+    kfree(sg);
+free_req:
+    kocl_free_request(req);
+    return err;
+}
+
+/* KSM's calc_checksum(), jhash2(page, PAGE_SIZE/4, 17), of each page */
+int kocl_page_checksums(struct page **pages, unsigned int n, u32 *sums)
+{
+    static int sid;
+
+    return kocl_pages_offload("jhash2_service", &sid, 17, pages, n, sums);
+}
+EXPORT_SYMBOL_GPL(kocl_page_checksums);
+
+/*
+ * Candidate duplicates: group[i] is the first page whose 64-bit
+ * fingerprint pages[i] shares, i if none, from a sort on the device.
+ * Only those pairs need a memcmp() to be sure.
+ */
+int kocl_page_dups(struct page **pages, unsigned int n, u32 *group)
+{
+    static int sid;
+
+    return kocl_pages_offload("dedup_service", &sid, 0, pages, n, group);
+}
+EXPORT_SYMBOL_GPL(kocl_page_dups);
+
 /* for ksm  */
 struct fordedup dedup = {
          .kkocl_alloc_request    = kocl_alloc_request,
@@ -907,6 +2937,8 @@ struct fordedup dedup = {
          .kkocl_next_request_id  = kocl_next_request_id,
 	     .kkocl_free_request     = kocl_free_request,
 	     .kkocl_free            = kocl_free,
+	     .kkocl_page_checksums  = kocl_page_checksums,
+	     .kkocl_page_dups       = kocl_page_dups,
 };
 
 
@@ -915,21 +2947,42 @@ static int kocl_init(void)
     
     int result = 0;
     int devno;
+    int i;
   
     printk("dedup:%p",&dedup); 
   
     kocldev.state = KOCL_OK;
+    INIT_DELAYED_WORK(&kocl_watchdog, kocl_watchdog_fn);
     
-    INIT_LIST_HEAD(&(kocldev.reqs));
-    INIT_LIST_HEAD(&(kocldev.rtdreqs));
-    
-    spin_lock_init(&(kocldev.reqlock));
-    spin_lock_init(&(kocldev.rtdreqlock));
+    for (i=0; i<KOCL_NR_CHANNELS; i++) {
+	INIT_LIST_HEAD(&kocldev.chans[i].reqs);
+	spin_lock_init(&kocldev.chans[i].reqlock);
+	init_waitqueue_head(&kocldev.chans[i].reqq);
+	mutex_init(&kocldev.chans[i].cqlock);
+	atomic_long_set(&kocldev.chans[i].inuse, 0);
+	atomic_long_set(&kocldev.chans[i].inflight, 0);
+	atomic_set(&kocldev.chans[i].nreqs, 0);
+	atomic_long_set(&kocldev.chans[i].rate, 0);
+	atomic64_set(&kocldev.chans[i].last_done, 0);
+	kocldev.chans[i].sq = NULL;
+	kocldev.chans[i].cq = NULL;
+	kocldev.chans[i].ring = 0;
+	kocldev.chans[i].helper = -1;
+	kocldev.chans[i].state = KOCL_OK;
+    }
+    for (i=0; i<KOCL_RTD_HASH_SIZE; i++) {
+	INIT_LIST_HEAD(&kocldev.rtdreqs[i].reqs);
+	spin_lock_init(&kocldev.rtdreqs[i].lock);
+    }
 
     init_waitqueue_head(&(kocldev.reqq));
 
     spin_lock_init(&(kocldev.ridlock));
-    spin_lock_init(&(kocldev.gmpool_lock));
+
+    memset(&kocldev.ring, 0, sizeof(struct _kocl_ring));
+    memset(kocldev.helpers, 0, sizeof(kocldev.helpers));
+    for (i=0; i<KOCL_MAX_HELPERS; i++)
+	spin_lock_init(&kocldev.helpers[i].sg.lock);
     
 
        
@@ -961,9 +3014,28 @@ static int kocl_init(void)
 	kmem_cache_destroy(kocl_request_item_cache);
 	return -EFAULT;
     }
+
+    /* per-CPU (bound) workers for deferred callbacks */
+    kocl_callback_wq = alloc_workqueue("kocl_callback", WQ_HIGHPRI, 0);
+    if (!kocl_callback_wq) {
+	kocl_log(KOCL_LOG_ERROR, "can't create callback workqueue\n");
+	kmem_cache_destroy(kocl_request_cache);
+	kmem_cache_destroy(kocl_request_item_cache);
+	kmem_cache_destroy(kocl_sync_call_data_cache);
+	return -EFAULT;
+    }
     
     /* initialize buffer info */
-    memset(&kocldev.gmpool, 0, sizeof(struct _kocl_mempool));   
+    for (i=0; i<KOCL_MAX_POOLS; i++)
+	kocl_pool_init(&kocldev.pools[i]);
+    memset(kocldev.chan_pool, 0, sizeof(kocldev.chan_pool));
+    kocldev.npools = 0;
+    kocldev.grow_pending = 0;
+    mutex_init(&kocldev.pool_mutex);
+    init_waitqueue_head(&kocldev.growq);
+    init_waitqueue_head(&kocldev.memq);
+
+    kocl_stat_init();
 
     /* alloc dev */	
     result = alloc_chrdev_region(&kocldev.devno, 0, 1 , KOCL_DEV_NAME);//動態取得 major number
@@ -1006,12 +3078,16 @@ static int kocl_init(void)
 static void kocl_cleanup(void)
 {
     kocldev.state = KOCL_TERMINATED;
+    cancel_delayed_work_sync(&kocl_watchdog);
 
+    kocl_stat_exit();
     device_destroy(kocldev.cls, kocldev.devno);
     cdev_del(&kocldev.cdev);
     class_destroy(kocldev.cls);
 
     unregister_chrdev_region(kocldev.devno, 1);
+    if (kocl_callback_wq)
+	destroy_workqueue(kocl_callback_wq);
     if (kocl_request_cache)
 	kmem_cache_destroy(kocl_request_cache);
     if (kocl_request_item_cache)
@@ -1020,6 +3096,9 @@ static void kocl_cleanup(void)
 	kmem_cache_destroy(kocl_sync_call_data_cache);
 
     clear_gpu_mempool();
+
+    if (kocldev.ring.mem)
+	vfree(kocldev.ring.mem);
    
 }
 
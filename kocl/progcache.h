@@ -0,0 +1,195 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * On-disk cache of built OpenCL programs for services.
+ */
+
+#ifndef __PROGCACHE_H__
+#define __PROGCACHE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * A program binary per device, in $KOCL_CL_CACHE or ./clcache, named by
+ * a hash of the source, the device name, its OpenCL version and the
+ * driver version, so that an upgrade or a changed .cl file just misses.
+ * Anything wrong with the cache falls back to building the source.
+ */
+#define KOCL_CL_CACHE_DIR "clcache"
+
+static unsigned long long __kocl_fnv(unsigned long long h,
+				     const void *p, size_t n)
+{
+    const unsigned char *c = (const unsigned char *)p;
+
+    while (n--) {
+	h ^= *c++;
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static const char *__kocl_cache_dir(void)
+{
+    const char *d = getenv("KOCL_CL_CACHE");
+    return (d && *d)? d: KOCL_CL_CACHE_DIR;
+}
+
+static void __kocl_cache_path(char *path, size_t len, cl_device_id dev,
+			      const char *src, size_t size)
+{
+    static const cl_device_info infos[] = {
+	CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION
+    };
+    unsigned long long h = 14695981039346656037ULL;
+    char buf[256];
+    size_t n;
+    int i;
+
+    h = __kocl_fnv(h, src, size);
+    for (i=0; i<sizeof(infos)/sizeof(infos[0]); i++) {
+	if (clGetDeviceInfo(dev, infos[i], sizeof(buf), buf, &n) != CL_SUCCESS)
+	    n = 0;
+	h = __kocl_fnv(h, buf, n < sizeof(buf)? n: sizeof(buf));
+    }
+    snprintf(path, len, "%s/%016llx.bin", __kocl_cache_dir(), h);
+}
+
+static cl_program __kocl_load_program(cl_context ctx, cl_uint ndev,
+				      const cl_device_id *devs,
+				      const char *src, size_t size)
+{
+    unsigned char **bins;
+    size_t *lens;
+    cl_program prog = NULL;
+    char path[1024];
+    FILE *fp;
+    cl_int e;
+    int i, ok = 1;
+
+    bins = (unsigned char **)calloc(ndev, sizeof(*bins));
+    lens = (size_t *)calloc(ndev, sizeof(*lens));
+    if (!bins || !lens)
+	goto out;
+
+    for (i=0; ok && i<ndev; i++) {
+	__kocl_cache_path(path, sizeof(path), devs[i], src, size);
+	fp = fopen(path, "rb");
+	if (!fp) {
+	    ok = 0;
+	    break;
+	}
+	fseek(fp, 0, SEEK_END);
+	lens[i] = ftell(fp);
+	rewind(fp);
+	bins[i] = (unsigned char *)malloc(lens[i] ? lens[i] : 1);
+	if (!bins[i] || !lens[i] || fread(bins[i], 1, lens[i], fp) != lens[i])
+	    ok = 0;
+	fclose(fp);
+    }
+
+    if (ok) {
+	prog = clCreateProgramWithBinary(ctx, ndev, devs, lens,
+					 (const unsigned char **)bins, NULL, &e);
+	if (e != CL_SUCCESS)
+	    prog = NULL;
+	else if (clBuildProgram(prog, ndev, devs, NULL, NULL, NULL)
+		 != CL_SUCCESS) {
+	    clReleaseProgram(prog);
+	    prog = NULL;
+	}
+    }
+
+out:
+    if (bins)
+	for (i=0; i<ndev; i++)
+	    free(bins[i]);
+    free(bins);
+    free(lens);
+    return prog;
+}
+
+static void __kocl_save_program(cl_program prog, cl_uint ndev,
+				const cl_device_id *devs,
+				const char *src, size_t size)
+{
+    unsigned char **bins;
+    size_t *lens;
+    char path[1024], tmp[1040];
+    FILE *fp;
+    int i, ok;
+
+    bins = (unsigned char **)calloc(ndev, sizeof(*bins));
+    lens = (size_t *)calloc(ndev, sizeof(*lens));
+    if (!bins || !lens)
+	goto out;
+
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES,
+			 ndev*sizeof(*lens), lens, NULL) != CL_SUCCESS)
+	goto out;
+    for (i=0; i<ndev; i++)
+	if (!(bins[i] = (unsigned char *)malloc(lens[i] ? lens[i] : 1)))
+	    goto out;
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES,
+			 ndev*sizeof(*bins), bins, NULL) != CL_SUCCESS)
+	goto out;
+
+    mkdir(__kocl_cache_dir(), 0755);
+    for (i=0; i<ndev; i++) {
+	if (!lens[i])
+	    continue;
+	__kocl_cache_path(path, sizeof(path), devs[i], src, size);
+	/* a helper killed while writing leaves no truncated binary */
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fp = fopen(tmp, "wb");
+	if (!fp)
+	    continue;
+	ok = fwrite(bins[i], 1, lens[i], fp) == lens[i];
+	ok = !fclose(fp) && ok;
+	if (!ok || rename(tmp, path))
+	    unlink(tmp);
+    }
+
+out:
+    if (bins)
+	for (i=0; i<ndev; i++)
+	    free(bins[i]);
+    free(bins);
+    free(lens);
+}
+
+/*
+ * clCreateProgramWithSource() and clBuildProgram() for the devices, or
+ * the cached binaries of an earlier build. Returns the build's error
+ * in *ret as clBuildProgram() does.
+ */
+static cl_program kocl_build_program(cl_context ctx, cl_uint ndev,
+				     const cl_device_id *devs,
+				     const char *src, size_t size,
+				     cl_int *ret)
+{
+    cl_program prog;
+
+    prog = __kocl_load_program(ctx, ndev, devs, src, size);
+    if (prog) {
+	*ret = CL_SUCCESS;
+	return prog;
+    }
+
+    prog = clCreateProgramWithSource(ctx, 1, &src, &size, ret);
+    if (*ret != CL_SUCCESS)
+	return prog;
+    *ret = clBuildProgram(prog, ndev, devs, NULL, NULL, NULL);
+    if (*ret == CL_SUCCESS)
+	__kocl_save_program(prog, ndev, devs, src, size);
+    return prog;
+}
+
+#endif
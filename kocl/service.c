@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <glob.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "list.h"
 #include "helper.h"
 #include "gpuops.h"
@@ -27,6 +28,112 @@ struct _kocl_sitem {
 
 LIST_HEAD(services);//初始化services list的head 讓prev,next指向自己
 
+/*
+ * A service library and its programs on each platform. Those with
+ * service_CLsetup_plat() build a platform on the first request there,
+ * the others every platform with service_CLsetup() once loaded, or all
+ * of them at load with KOCL_CL_EAGER=1. Builds run on a thread of the
+ * library, one at a time, the libraries' in parallel, while the
+ * pipelines serve what is ready and keep the other requests waiting.
+ */
+#define KH_CL_NONE 0
+#define KH_CL_WANTED 1
+#define KH_CL_BUILDING 2
+#define KH_CL_READY 3
+#define KH_CL_FAILED 4
+
+struct _kocl_lib {
+    void *lh;
+    CLsetup setup;
+    CLsetup_plat setup_plat;
+    int state[KOCL_MAX_PLATFORMS];
+    int busy;                 /* a thread is building */
+    pthread_mutex_t lock;
+};
+
+static void *kh_build_thread(void *arg)
+{
+    struct _kocl_lib *lib = (struct _kocl_lib *)arg;
+    struct plat_set plat;
+    int i, r;
+
+    gpu_plat_set(&plat);
+    pthread_mutex_lock(&lib->lock);
+    for (;;) {
+	for (i=0; i<plat.nplatforms && lib->state[i] != KH_CL_WANTED; i++)
+	    ;
+	if (i == plat.nplatforms)
+	    break;
+	__atomic_store_n(&lib->state[i], KH_CL_BUILDING, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&lib->lock);
+
+	/* all of them at once without setup_plat, failed if one did */
+	if (lib->setup_plat)
+	    r = lib->setup_plat(&plat, i);
+	else
+	    r = lib->setup(&plat);
+
+	pthread_mutex_lock(&lib->lock);
+	if (lib->setup_plat)
+	    __atomic_store_n(&lib->state[i], r? KH_CL_FAILED: KH_CL_READY,
+			     __ATOMIC_RELEASE);
+	else
+	    for (i=0; i<plat.nplatforms; i++)
+		__atomic_store_n(&lib->state[i], r? KH_CL_FAILED: KH_CL_READY,
+				 __ATOMIC_RELEASE);
+	if (r && lib->setup_plat)
+	    fprintf(stderr, "Warning: failed to build services for platform %d\n", i);
+	else if (r)
+	    fprintf(stderr, "Warning: failed to build services\n");
+    }
+    lib->busy = 0;
+    pthread_mutex_unlock(&lib->lock);
+    return NULL;
+}
+
+/* with lib->lock held */
+static void kh_build(struct _kocl_lib *lib)
+{
+    pthread_t t;
+
+    if (lib->busy)
+	return;
+    lib->busy = 1;
+    if (pthread_create(&t, NULL, kh_build_thread, lib)) {
+	/* build it here then */
+	pthread_mutex_unlock(&lib->lock);
+	kh_build_thread(lib);
+	pthread_mutex_lock(&lib->lock);
+    } else
+	pthread_detach(t);
+}
+
+int kh_service_ready(struct kocl_service *s, int platform)
+{
+    struct _kocl_lib *lib = (struct _kocl_lib *)s->lib;
+    int st;
+
+    if (!lib || platform < 0 || platform >= KOCL_MAX_PLATFORMS)
+	return 1;
+    st = __atomic_load_n(&lib->state[platform], __ATOMIC_ACQUIRE);
+    if (st == KH_CL_READY)
+	return 1;
+    if (st == KH_CL_FAILED)
+	return -1;
+    if (st == KH_CL_NONE) {
+	pthread_mutex_lock(&lib->lock);
+	if (lib->state[platform] == KH_CL_NONE) {
+	    lib->state[platform] = KH_CL_WANTED;
+	    kh_build(lib);
+	}
+	pthread_mutex_unlock(&lib->lock);
+    }
+    return 0;
+}
+
+/* the library being loaded, for kh_register_service() */
+static struct _kocl_lib *loading_lib;
+
 static struct _kocl_sitem *lookup_kocl_sitem(const char *name)
 {
     struct _kocl_sitem *i;
@@ -52,6 +159,28 @@ struct kocl_service *kh_lookup_service(const char *name)
     return i->s;
 }
 
+/*
+ * Services by the ids kocl gives their names, filled in on the first
+ * request of each id. Pipeline threads may race to fill an entry, with
+ * the same service.
+ */
+static struct kocl_service *sid_services[KOCL_MAX_SERVICES+1];
+
+struct kocl_service *kh_lookup_service_id(int sid, const char *name)
+{
+    struct kocl_service *s;
+
+    if (sid <= 0 || sid > KOCL_MAX_SERVICES)
+	return kh_lookup_service(name);
+    s = __atomic_load_n(&sid_services[sid], __ATOMIC_ACQUIRE);
+    if (!s) {
+	s = kh_lookup_service(name);
+	if (s)
+	    __atomic_store_n(&sid_services[sid], s, __ATOMIC_RELEASE);
+    }
+    return s;
+}
+
 int kh_register_service(struct kocl_service *s, void *libhandle)
 {
     struct _kocl_sitem *i;
@@ -64,6 +193,8 @@ int kh_register_service(struct kocl_service *s, void *libhandle)
 
     i->s = s;
     i->libhandle = libhandle;
+    if (loading_lib && loading_lib->lh == libhandle)
+	s->lib = loading_lib;
     INIT_LIST_HEAD(&i->list);
 
     list_add_tail(&i->list, &services);//把i->list head 加入services FIFO Queue list
@@ -73,9 +204,15 @@ int kh_register_service(struct kocl_service *s, void *libhandle)
 
 static int __unregister_service(struct _kocl_sitem *i)
 {
+    int sid;
+
     if (!i)
 	return 1;
 
+    for (sid=1; sid<=KOCL_MAX_SERVICES; sid++)
+	if (sid_services[sid] == i->s)
+	    __atomic_store_n(&sid_services[sid], NULL, __ATOMIC_RELEASE);
+
     list_del(&i->list);
     free(i);
 
@@ -91,9 +228,10 @@ int kh_load_service(const char *libpath)
 {
     void *lh;
     fn_init_service init;//宣告一個fn_init_service的function pointer
-    CLsetup clsetup;
+    struct _kocl_lib *lib;
+    const char *eager = getenv("KOCL_CL_EAGER");
     char *err;
-    int r=1;
+    int i, r=1;
        
 
     lh = dlopen(libpath, RTLD_LAZY);//dlopen(filename,flag)載入動態函式庫的檔名
@@ -102,39 +240,58 @@ int kh_load_service(const char *libpath)
 	fprintf(stderr,
 		"Warning: open %s error, %s\n",
 		libpath, dlerror());
-    } else {
-	init = (fn_init_service)dlsym(lh, SERVICE_INIT);//找到init_service的funcion assign 給init
-    
-    clsetup = (CLsetup)dlsym(lh, SERVICE_CL);//找到service_CLsetup的funcion assign 給clsetup
-    if(!clsetup){
-        fprintf(stderr,
-		    "Warning: %s has no service %s\n",
-		    libpath, ((err=dlerror()) == NULL?"": err));
-	    dlclose(lh);
-    }else{
-       // printf("service_CLset start  ~\n"); 
-        service_CLset(clsetup);
+	return r;
+    }
+    init = (fn_init_service)dlsym(lh, SERVICE_INIT);//找到init_service的funcion assign 給init
+    lib = (struct _kocl_lib *)calloc(1, sizeof(*lib));
+    if (!init || !lib) {
+	fprintf(stderr,
+		"Warning: %s has no service %s\n",
+		libpath, ((err=dlerror()) == NULL?"": err));
+	free(lib);
+	dlclose(lh);
+	return r;
     }
+    lib->lh = lh;
+    lib->setup = (CLsetup)dlsym(lh, SERVICE_CL);//找到service_CLsetup的funcion assign 給clsetup
+    lib->setup_plat = (CLsetup_plat)dlsym(lh, SERVICE_CL_PLAT);
+    pthread_mutex_init(&lib->lock, NULL);
+    if (!lib->setup && !lib->setup_plat)
+	fprintf(stderr,
+		"Warning: %s has no service %s\n", libpath, SERVICE_CL);
 
-    if (!init){
-	    fprintf(stderr,
-		    "Warning: %s has no service %s\n",
-		    libpath, ((err=dlerror()) == NULL?"": err));
-	    dlclose(lh);
-	} else {
-	    if (init(lh, kh_register_service))//註冊kocl service
-	    {
-		fprintf(stderr,
-			"Warning: %s failed to register service\n",
-			libpath);
-		dlclose(lh);
-	    } else
-		r = 0;
-	 }     	    
+    loading_lib = lib;
+    if (init(lh, kh_register_service))//註冊kocl service
+    {
+	struct list_head *e, *n;
+
+	fprintf(stderr,
+		"Warning: %s failed to register service\n",
+		libpath);
+	loading_lib = NULL;
+	/* what it did register goes with it */
+	list_for_each_safe(e, n, &services)
+	    if (list_entry(e, struct _kocl_sitem, list)->libhandle == lh)
+		__unregister_service(list_entry(e, struct _kocl_sitem, list));
+	pthread_mutex_destroy(&lib->lock);
+	free(lib);
+	dlclose(lh);
+	return r;
     }
-    
+    loading_lib = NULL;
 
-    return r;
+    if (!lib->setup && !lib->setup_plat) {
+	/* nothing to build */
+	for (i=0; i<KOCL_MAX_PLATFORMS; i++)
+	    lib->state[i] = KH_CL_READY;
+    } else if (!lib->setup_plat || (eager && atoi(eager))) {
+	pthread_mutex_lock(&lib->lock);
+	for (i=0; i<KOCL_MAX_PLATFORMS; i++)
+	    lib->state[i] = KH_CL_WANTED;
+	kh_build(lib);
+	pthread_mutex_unlock(&lib->lock);
+    }
+    return 0;
 }
 
 int kh_load_all_services(const char *dir)
@@ -17,6 +17,38 @@ struct kocl_service {
     int (*launch)(struct kocl_service_request *sreq);
     int (*prepare)(struct kocl_service_request *sreq);
     int (*post)(struct kocl_service_request *sreq);
+    /*
+     * Optional: 1 if b can run in one launch with a, same service and
+     * channel. Such launches go to prepare with sreq->nbatch set.
+     */
+    int (*can_merge)(struct kocl_service_request *a,
+		     struct kocl_service_request *b);
+    /*
+     * Optional: streaming. A request of independent units, chunk_in
+     * bytes of hin and chunk_out of hout each (chunk_in 0: in place, in
+     * hout), on a device that works on copies, is run by the helper in
+     * chunks whose upload, kernel and download overlap, see
+     * gpu_launch_chunked(). It comes to prepare with sreq->chunked set,
+     * then prepare makes the device buffers without copying in and post
+     * releases them without copying out. launch_chunk enqueues the work
+     * of units first..first+n-1 on sreq->queue.
+     */
+    unsigned long chunk_in, chunk_out;
+    int (*launch_chunk)(struct kocl_service_request *sreq,
+			unsigned long first, unsigned long n);
+    /*
+     * Optional: a host implementation, for the channels of the helper's
+     * native lanes (those of a CPU device by default). The helper runs
+     * such requests without OpenCL, units first..first+n-1 (as above, a
+     * request without units is the one unit 0) on hin/hout/hdata, the
+     * pieces of one request on several worker threads at once. Returns
+     * 0 or a KOCL_* error.
+     */
+    int (*native)(struct kocl_service_request *sreq,
+		  unsigned long first, unsigned long n);
+    void *lib;                /* the helper's, see service.c */
+    /* the helper's, recent kernel and post times of a request, ns, see kh_wait_ns() */
+    unsigned long long exec_ns, post_ns;
 };
 
 struct plat_arg{
@@ -25,17 +57,34 @@ struct plat_arg{
        cl_context context ;
 }; 
 
+/*
+ * The OpenCL platforms the helper found, a service builds its program
+ * for each of them and runs a request with that of sr->platform.
+ * platform1 and platform2 are the first two, for older services.
+ */
+#define KOCL_MAX_PLATFORMS 4
+
 struct plat_set{
     struct plat_arg platform1;
     struct plat_arg platform2;
+    int nplatforms;
+    struct plat_arg platforms[KOCL_MAX_PLATFORMS];
 };
 
 #define SERVICE_INIT "init_service"
 #define SERVICE_FINIT "finit_service"
 #define SERVICE_LIB_PREFIX "libsrv_"
 #define SERVICE_CL "service_CLsetup"
+/*
+ * Optional: build the programs of platform i only. The helper calls it
+ * on the first request for one of the library's services there, on a
+ * thread of its own, rather than service_CLsetup() at load. 0 if the
+ * platform is ready.
+ */
+#define SERVICE_CL_PLAT "service_CLsetup_plat"
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS //Should define before #include <CL/cl.h>
 #include <CL/cl.h>
+#include <stdlib.h>
 
 typedef int (*fn_init_service)(
     void* libhandle, int (*reg_srv)(struct kocl_service *, void*));
@@ -43,11 +92,320 @@ typedef int (*fn_finit_service)(
     void* libhandle, int (*unreg_srv)(const char*));
 
 typedef int (*CLsetup)(struct plat_set *plat);
+typedef int (*CLsetup_plat)(struct plat_set *plat, int i);
+
+/*
+ * Kernel objects per request slot. A request has its slot, queue_id,
+ * to itself from prepare until it is done, so the kernel of that slot
+ * is its own to set arguments on, even when it shares the command
+ * queue with others. Kernels are created on first use.
+ */
+#define KOCL_MAX_SLOTS 64
+
+struct kocl_kernel_pool {
+    const char *name;
+    cl_kernel k[KOCL_NR_CHANNELS][KOCL_MAX_SLOTS];
+};
+
+#define KOCL_KERNEL_POOL(kname) { .name = (kname) }
+
+static inline cl_kernel kocl_get_kernel(struct kocl_kernel_pool *kp,
+					cl_program prog,
+					struct kocl_service_request *sr)
+{
+    cl_kernel *k;
+    cl_int ret;
+
+    if (sr->channel < 0 || sr->channel >= KOCL_NR_CHANNELS
+	|| sr->queue_id < 0 || sr->queue_id >= KOCL_MAX_SLOTS)
+	return NULL;
+
+    k = &kp->k[sr->channel][sr->queue_id];
+    if (!*k) {
+	*k = clCreateKernel(prog, kp->name, &ret);
+	if (ret != CL_SUCCESS)
+	    *k = NULL;
+    }
+    return *k;
+}
+
+/* in finit_service, for each pool and then the programs */
+static inline void kocl_release_kernels(struct kocl_kernel_pool *kp)
+{
+    int i, j;
+
+    for (i=0; i<KOCL_NR_CHANNELS; i++)
+	for (j=0; j<KOCL_MAX_SLOTS; j++)
+	    if (kp->k[i][j]) {
+		clReleaseKernel(kp->k[i][j]);
+		kp->k[i][j] = NULL;
+	    }
+}
+
+static inline void kocl_release_programs(cl_program *progs, int n)
+{
+    int i;
+
+    for (i=0; i<n; i++)
+	if (progs[i]) {
+	    clReleaseProgram(progs[i]);
+	    progs[i] = NULL;
+	}
+}
+
+/*
+ * The offset table of a merged request: {first work-item, inoff,
+ * outoff} per member, the members' global_x add up to sr->global_x.
+ */
+#define KOCL_BATCH_MAX 32
+
+static inline cl_mem kocl_batch_table(struct kocl_service_request *sr,
+				      cl_int *ret)
+{
+    cl_uint tbl[3*KOCL_BATCH_MAX];
+    cl_uint first = 0;
+    int i;
+
+    for (i=0; i<sr->nbatch && i<KOCL_BATCH_MAX; i++) {
+	tbl[3*i] = first;
+	tbl[3*i+1] = sr->batch[i]->inoff;
+	tbl[3*i+2] = sr->batch[i]->outoff;
+	first += sr->batch[i]->global_x;
+    }
+    return clCreateBuffer(sr->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			  3*i*sizeof(cl_uint), tbl, ret);
+}
+
+/*
+ * Profiling, helper -P: the request queues profile their commands, and
+ * services enqueue their transfers and kernels with kocl_prof_event()
+ * as the event (NULL if not profiling), or kocl_enqueue_kernel(). The
+ * helper reads them when the request is done and adds them up per
+ * device, see gpu_prof_collect(). The events grow with the request, a
+ * streamed one has three per chunk.
+ */
+static inline cl_event *kocl_prof_event(struct kocl_service_request *sr,
+					int kind, size_t bytes)
+{
+    struct kocl_prof_event *p;
+    int n;
+
+    if (!sr->prof)
+	return NULL;
+    if (sr->nprof >= sr->maxprof) {
+	n = sr->maxprof? 2*sr->maxprof: KOCL_PROF_MAX;
+	p = (struct kocl_prof_event*)realloc(sr->pev, n*sizeof(*p));
+	if (!p) {
+	    sr->lostprof++;
+	    return NULL;
+	}
+	sr->pev = p;
+	sr->maxprof = n;
+    }
+    p = &sr->pev[sr->nprof++];
+    p->e = NULL;
+    p->kind = kind;
+    p->bytes = bytes;
+    return &p->e;
+}
+
+static inline cl_int kocl_enqueue_kernel(struct kocl_service_request *sr,
+					 cl_kernel k, cl_uint dim,
+					 const size_t *offset, const size_t *global,
+					 const size_t *local)
+{
+    return clEnqueueNDRangeKernel(sr->queue, k, dim, offset, global, local,
+				  0, NULL, kocl_prof_event(sr, KOCL_PROF_KERNEL, 0));
+}
+
+/*
+ * Device buffers of a chain's stages on a device that works on copies:
+ * kocl_put_buffer() keeps them, unread, while stages are left, and
+ * kocl_get_buffer() of the same host memory in a later stage takes one
+ * as it is. Queues are in order, so all of it is just enqueued, the
+ * host copies are only read back when something else wants them.
+ * An entry holds a reference of its buffer and each take one more,
+ * which the take's put drops: a stage may take one as in and out.
+ */
+static inline int kocl_kept_overlaps(struct kocl_kept *e, void *hp, size_t size)
+{
+    return (char*)hp < (char*)e->hp + e->size && (char*)e->hp < (char*)hp + size;
+}
+
+static inline cl_int kocl_drop_kept(struct kocl_service_request *sr,
+				    struct kocl_kept *e, int copyout)
+{
+    cl_int ret = CL_SUCCESS;
+
+    if (copyout && e->dirty)
+	ret = clEnqueueReadBuffer(sr->queue, e->b, CL_FALSE, 0, e->size, e->hp,
+				  0, NULL, kocl_prof_event(sr, KOCL_PROF_READ, e->size));
+    clReleaseMemObject(e->b);
+    e->b = NULL;
+    return ret;
+}
+
+/* size bytes of hp for a stage, NULL if it must get a buffer of its own */
+static inline cl_mem kocl_take_kept(struct kocl_service_request *sr,
+				    void *hp, size_t size)
+{
+    struct kocl_kept *e;
+    int i;
+
+    for (i=0; i<KOCL_KEPT_MAX; i++) {
+	e = &sr->kept[i];
+	if (e->b && e->hp == hp && size <= e->size) {
+	    clRetainMemObject(e->b);
+	    return e->b;
+	}
+    }
+    /* hp is read from the host, with what the device has of it */
+    for (i=0; i<KOCL_KEPT_MAX; i++) {
+	e = &sr->kept[i];
+	if (e->b && e->dirty && kocl_kept_overlaps(e, hp, size)) {
+	    clEnqueueReadBuffer(sr->queue, e->b, CL_FALSE, 0, e->size, e->hp,
+				0, NULL, kocl_prof_event(sr, KOCL_PROF_READ, e->size));
+	    e->dirty = 0;
+	}
+    }
+    return NULL;
+}
+
+/* 1 if b is kept, or read back as need be and dropped as the last stage's */
+static inline int kocl_keep(struct kocl_service_request *sr, cl_mem b,
+			    void *hp, size_t size, int copyout)
+{
+    struct kocl_kept *e = NULL, *f = NULL;
+    int i;
+
+    for (i=0; i<KOCL_KEPT_MAX; i++) {
+	if (sr->kept[i].b == b)
+	    e = &sr->kept[i];
+	else if (!sr->kept[i].b && !f)
+	    f = &sr->kept[i];
+    }
+    /* what others keep of hp is old now */
+    if (copyout)
+	for (i=0; i<KOCL_KEPT_MAX; i++)
+	    if (sr->kept[i].b && &sr->kept[i] != e
+		&& kocl_kept_overlaps(&sr->kept[i], hp, size))
+		kocl_drop_kept(sr, &sr->kept[i], 0);
+    if (!e && (sr->stage >= sr->nchain || !f))
+	return 0;
+    if (e) {
+	/* the take's reference, the entry has its own */
+	clReleaseMemObject(b);
+    } else {
+	e = f;
+	e->b = b;
+	e->hp = hp;
+	e->size = size;
+	e->dirty = 0;
+    }
+    e->dirty |= copyout;
+    if (sr->stage >= sr->nchain)
+	kocl_drop_kept(sr, e, 1);
+    return 1;
+}
+
+/* after a chain's last stage, or its failure (copyout 0) */
+static inline void kocl_flush_kept(struct kocl_service_request *sr, int copyout)
+{
+    int i;
+
+    for (i=0; i<KOCL_KEPT_MAX; i++)
+	if (sr->kept[i].b)
+	    kocl_drop_kept(sr, &sr->kept[i], copyout);
+}
+
+/*
+ * A buffer for size bytes of a request's host memory hp, in the way
+ * that is fastest on the request's device: on one that works on host
+ * memory (sr->zerocopy) hp itself, through the helper's pool view if
+ * there is one, else a buffer of the device's own, written from hp if
+ * copyin. kocl_put_buffer() reads it back to hp if copyout, and drops it.
+ * Chains keep the latter for their next stages, see kocl_keep().
+ */
+static inline cl_mem kocl_get_buffer(struct kocl_service_request *sr,
+				     cl_mem view, void *hp, size_t size,
+				     int copyin, cl_int *ret)
+{
+    cl_mem b;
+
+    /* SVM needs no buffer, see kocl_set_arg_buffer() */
+    if (sr->svm) {
+	*ret = CL_SUCCESS;
+	return NULL;
+    }
+
+    if (sr->zerocopy) {
+	*ret = CL_SUCCESS;
+	if (view)
+	    return view;
+	return clCreateBuffer(sr->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+			      size, hp, ret);
+    }
+
+    if (sr->nchain && (b = kocl_take_kept(sr, hp, size))) {
+	*ret = CL_SUCCESS;
+	return b;
+    }
+    b = clCreateBuffer(sr->context, CL_MEM_READ_WRITE, size, NULL, ret);
+    if (*ret == CL_SUCCESS && copyin)
+	*ret = clEnqueueWriteBuffer(sr->queue, b, CL_FALSE, 0, size, hp,
+				    0, NULL, kocl_prof_event(sr, KOCL_PROF_WRITE, size));
+    return b;
+}
+
+static inline cl_int kocl_put_buffer(struct kocl_service_request *sr,
+				     cl_mem b, cl_mem view, void *hp,
+				     size_t size, int copyout)
+{
+    cl_int ret = CL_SUCCESS;
+    void *h;
+
+    if (!b)
+	return ret;
+    if (sr->nchain && !sr->zerocopy && kocl_keep(sr, b, hp, size, copyout))
+	return ret;
+    if (copyout && sr->zerocopy) {
+	/* make the device's writes visible in hp, queued like a read */
+	h = clEnqueueMapBuffer(sr->queue, b, CL_FALSE, CL_MAP_READ, 0, size,
+			       0, NULL, NULL, &ret);
+	if (h)
+	    ret = clEnqueueUnmapMemObject(sr->queue, b, h, 0, NULL, NULL);
+    } else if (copyout)
+	ret = clEnqueueReadBuffer(sr->queue, b, CL_FALSE, 0, size, hp,
+				  0, NULL, kocl_prof_event(sr, KOCL_PROF_READ, size));
+    if (b != view)
+	clReleaseMemObject(b);
+    return ret;
+}
+
+/*
+ * Kernel argument idx for the buffer *b of kocl_get_buffer() of host
+ * memory hp, or for a merged request's batchbuf at batchbase: with
+ * sr->svm the helper's pool is SVM and hp is passed as it is.
+ */
+static inline cl_int kocl_set_arg_buffer(struct kocl_service_request *sr,
+					 cl_kernel k, cl_uint idx,
+					 cl_mem *b, void *hp)
+{
+#ifdef CL_VERSION_2_0
+    if (sr->svm)
+	return clSetKernelArgSVMPointer(k, idx, hp);
+#endif
+    return clSetKernelArg(k, idx, sizeof(cl_mem), b);
+}
 
 #ifdef __KOCL__
 
 struct kocl_service * kh_lookup_service(const char *name);
+/* by kocl_ku_request.sid, name is used the first time or if sid is 0 */
+struct kocl_service * kh_lookup_service_id(int sid, const char *name);
 int kh_register_service(struct kocl_service *s, void *libhandle);
+/* 1 if s can run on platform now, 0 if it is being built, -1 if it failed */
+int kh_service_ready(struct kocl_service *s, int platform);
 int kh_unregister_service(const char *name);
 int kh_load_service(const char *libpath);
 int kh_load_all_services(const char *libdir);
@@ -0,0 +1,301 @@
+/*
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the GPL-COPYING file in the top-level directory.
+ *
+ * Copyright (c) 2017-2018 NCKU of Taiwan and the ASRLab.
+ *
+ * Work-group size tuning for services.
+ */
+
+#ifndef __WGTUNE_H__
+#define __WGTUNE_H__
+
+#include <time.h>
+#include "progcache.h"
+
+/*
+ * The local size of a kernel per channel, probed on a scratch buffer
+ * the first time a channel runs it: multiples of the kernel's
+ * CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE up to its
+ * CL_KERNEL_WORK_GROUP_SIZE, and the driver's own choice (0). The best
+ * one is kept next to the program binaries, see progcache.h, per
+ * device and driver; KOCL_WG_RETUNE=1 probes again.
+ *
+ * setargs points the kernel's arguments at scratch, which holds work
+ * items of item_size bytes.
+ */
+#define KOCL_WG_PROBE_RUNS 3
+
+struct kocl_wg_tuner {
+    const char *kernel;
+    size_t work;
+    size_t item_size;
+    int (*setargs)(cl_kernel k, cl_mem scratch, size_t size);
+    size_t local[KOCL_NR_CHANNELS];
+    int tuned[KOCL_NR_CHANNELS];
+};
+
+#define KOCL_WG_TUNER(kname, nwork, isize, fn) \
+    { .kernel = (kname), .work = (nwork), .item_size = (isize), .setargs = (fn) }
+
+static void __kocl_wg_path(char *path, size_t len, const char *kernel,
+			   cl_device_id dev)
+{
+    __kocl_cache_path(path, len, dev, kernel, strlen(kernel));
+    /* .bin -> .wg */
+    if (strlen(path) > 4)
+	strcpy(path+strlen(path)-4, ".wg");
+}
+
+static double __kocl_wg_time(cl_command_queue q, cl_kernel k,
+			     size_t global, size_t local)
+{
+    struct timespec a, b;
+    double best = -1, t;
+    int i;
+
+    for (i=0; i<KOCL_WG_PROBE_RUNS; i++) {
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	if (clEnqueueNDRangeKernel(q, k, 1, NULL, &global,
+				   local? &local: NULL, 0, NULL, NULL)
+	    != CL_SUCCESS || clFinish(q) != CL_SUCCESS)
+	    return -1;
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	t = (b.tv_sec-a.tv_sec)*1e9 + (b.tv_nsec-a.tv_nsec);
+	if (best < 0 || t < best)
+	    best = t;
+    }
+    return best;
+}
+
+/*
+ * The best local size of kernel over nitems work-items on a scratch
+ * buffer of size bytes, and its time in *time, -1 if it didn't run.
+ * It runs on a queue of its own, the channel's have other requests
+ * in flight that its clFinish() would wait for.
+ */
+static size_t __kocl_wg_probe_kernel(const char *kernel, size_t nitems, size_t size,
+				     int (*setargs)(cl_kernel, cl_mem, size_t),
+				     cl_program prog, struct kocl_service_request *sr,
+				     cl_device_id dev, double *time)
+{
+    size_t mult = 1, max = 1, l, global, best_l = 0;
+    double best = -1, tm;
+    cl_command_queue q;
+    cl_mem scratch;
+    cl_kernel k;
+    cl_int e;
+
+    *time = -1;
+    if (!nitems)
+	return 0;
+    q = clCreateCommandQueue(sr->context, dev, 0, &e);
+    if (e != CL_SUCCESS)
+	return 0;
+    k = clCreateKernel(prog, kernel, &e);
+    if (e != CL_SUCCESS) {
+	clReleaseCommandQueue(q);
+	return 0;
+    }
+    scratch = clCreateBuffer(sr->context, CL_MEM_READ_WRITE, size, NULL, &e);
+    if (e != CL_SUCCESS) {
+	clReleaseKernel(k);
+	clReleaseCommandQueue(q);
+	return 0;
+    }
+    if (setargs(k, scratch, size))
+	goto out;
+
+    clGetKernelWorkGroupInfo(k, dev, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+			     sizeof(mult), &mult, NULL);
+    clGetKernelWorkGroupInfo(k, dev, CL_KERNEL_WORK_GROUP_SIZE,
+			     sizeof(max), &max, NULL);
+    if (!mult)
+	mult = 1;
+
+    /* a warm-up run, then the driver's choice to beat */
+    __kocl_wg_time(q, k, nitems, 0);
+    best = __kocl_wg_time(q, k, nitems, 0);
+    for (l = mult; l <= max; l *= 2) {
+	global = (nitems/l)*l;
+	if (!global)
+	    break;
+	tm = __kocl_wg_time(q, k, global, l) * nitems / global;
+	if (tm >= 0 && (best < 0 || tm < best)) {
+	    best = tm;
+	    best_l = l;
+	}
+    }
+    *time = best;
+out:
+    clReleaseMemObject(scratch);
+    clReleaseKernel(k);
+    clReleaseCommandQueue(q);
+    return best_l;
+}
+
+static size_t __kocl_wg_probe(struct kocl_wg_tuner *t, cl_program prog,
+			      struct kocl_service_request *sr,
+			      cl_device_id dev)
+{
+    double tm;
+
+    return __kocl_wg_probe_kernel(t->kernel, t->work, t->work*t->item_size,
+				  t->setargs, prog, sr, dev, &tm);
+}
+
+/*
+ * The local size for sr's channel, 0 to let the driver choose. May
+ * probe, on a queue of its own, so call it from prepare.
+ */
+static size_t kocl_wg_local(struct kocl_wg_tuner *t, cl_program prog,
+			    struct kocl_service_request *sr)
+{
+    const char *retune = getenv("KOCL_WG_RETUNE");
+    cl_device_id dev;
+    char path[1024];
+    unsigned long l;
+    FILE *fp;
+    int c = sr->channel;
+
+    if (c < 0 || c >= KOCL_NR_CHANNELS)
+	return 0;
+    if (t->tuned[c])
+	return t->local[c];
+
+    t->tuned[c] = 1;
+    t->local[c] = 0;
+    if (clGetCommandQueueInfo(sr->queue, CL_QUEUE_DEVICE, sizeof(dev),
+			      &dev, NULL) != CL_SUCCESS)
+	return 0;
+    __kocl_wg_path(path, sizeof(path), t->kernel, dev);
+
+    if (!(retune && atoi(retune))) {
+	fp = fopen(path, "r");
+	if (fp) {
+	    if (fscanf(fp, "%lu", &l) == 1) {
+		fclose(fp);
+		return t->local[c] = l;
+	    }
+	    fclose(fp);
+	}
+    }
+
+    t->local[c] = __kocl_wg_probe(t, prog, sr, dev);
+    printf("%s on channel %d: local size %lu\n", t->kernel, c,
+	   (unsigned long)t->local[c]);
+    mkdir(__kocl_cache_dir(), 0755);
+    fp = fopen(path, "w");
+    if (fp) {
+	fprintf(fp, "%lu\n", (unsigned long)t->local[c]);
+	fclose(fp);
+    }
+    return t->local[c];
+}
+
+/*
+ * Variants of a kernel: the same work in different shapes, the
+ * work-items of v[i] take v[i].per_item of the tuner's items each.
+ * The fastest variant per channel, at its best local size, is probed
+ * as above and kept as "<name>.var" next to the .wg files. All
+ * variants take the same arguments, setargs is called for each.
+ */
+#define KOCL_MAX_VARIANTS 4
+
+struct kocl_variant {
+    const char *kernel;
+    size_t per_item;
+};
+
+struct kocl_variant_tuner {
+    const char *name;
+    size_t work;
+    size_t item_size;
+    int (*setargs)(cl_kernel k, cl_mem scratch, size_t size);
+    struct kocl_variant v[KOCL_MAX_VARIANTS];
+    int best[KOCL_NR_CHANNELS];
+    size_t local[KOCL_NR_CHANNELS];
+    int tuned[KOCL_NR_CHANNELS];
+};
+
+#define KOCL_VARIANT(kname, n) { .kernel = (kname), .per_item = (n) }
+
+static int __kocl_variant_probe(struct kocl_variant_tuner *t, cl_program prog,
+				struct kocl_service_request *sr,
+				cl_device_id dev, size_t *local)
+{
+    double best = -1, tm;
+    size_t l;
+    int i, b = 0;
+
+    *local = 0;
+    for (i=0; i<KOCL_MAX_VARIANTS && t->v[i].kernel; i++) {
+	l = __kocl_wg_probe_kernel(t->v[i].kernel, t->work/t->v[i].per_item,
+				   t->work*t->item_size, t->setargs,
+				   prog, sr, dev, &tm);
+	if (tm >= 0 && (best < 0 || tm < best)) {
+	    best = tm;
+	    b = i;
+	    *local = l;
+	}
+    }
+    return b;
+}
+
+/*
+ * The variant for sr's channel, its local size in t->local[]. May
+ * probe, call it from prepare as kocl_wg_local().
+ */
+static struct kocl_variant *kocl_variant_pick(struct kocl_variant_tuner *t,
+					      cl_program prog,
+					      struct kocl_service_request *sr)
+{
+    const char *retune = getenv("KOCL_WG_RETUNE");
+    cl_device_id dev;
+    char path[1024];
+    unsigned long l;
+    FILE *fp;
+    int c = sr->channel, b;
+
+    if (c < 0 || c >= KOCL_NR_CHANNELS)
+	return &t->v[0];
+    if (t->tuned[c])
+	return &t->v[t->best[c]];
+
+    t->tuned[c] = 1;
+    t->best[c] = 0;
+    t->local[c] = 0;
+    if (clGetCommandQueueInfo(sr->queue, CL_QUEUE_DEVICE, sizeof(dev),
+			      &dev, NULL) != CL_SUCCESS)
+	return &t->v[0];
+    __kocl_wg_path(path, sizeof(path), t->name, dev);
+    /* .wg -> .var */
+    strcpy(path+strlen(path)-3, ".var");
+
+    if (!(retune && atoi(retune))) {
+	fp = fopen(path, "r");
+	if (fp) {
+	    if (fscanf(fp, "%d %lu", &b, &l) == 2 && b >= 0
+		&& b < KOCL_MAX_VARIANTS && t->v[b].kernel) {
+		fclose(fp);
+		t->best[c] = b;
+		t->local[c] = l;
+		return &t->v[b];
+	    }
+	    fclose(fp);
+	}
+    }
+
+    t->best[c] = __kocl_variant_probe(t, prog, sr, dev, &t->local[c]);
+    printf("%s on channel %d: %s, local size %lu\n", t->name, c,
+	   t->v[t->best[c]].kernel, (unsigned long)t->local[c]);
+    mkdir(__kocl_cache_dir(), 0755);
+    fp = fopen(path, "w");
+    if (fp) {
+	fprintf(fp, "%d %lu\n", t->best[c], (unsigned long)t->local[c]);
+	fclose(fp);
+    }
+    return &t->v[t->best[c]];
+}
+
+#endif